@@ -38,6 +38,9 @@ void daemon_client_kill(struct daemon_client *dc)
 
 	dc->freed = TRUE;
 
+	if (dc->user != NULL)
+		daemon_user_cancel_wait(dc->user, daemon_client_user_ready, dc);
+
 	if (dc->backend != NULL) {
 		daemon_backend_kill(dc->backend);
 	}
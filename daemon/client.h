@@ -27,6 +27,7 @@ struct daemon_client {
 	struct daemon_backend *backend;
 	struct ctrlproxyd_config *config;
 	gboolean (*socks_accept_fn) (struct pending_client *, gboolean);
+	void (*backend_ready) (struct daemon_client *);
 	struct pending_client *pending_client;
 	struct irc_login_details *login_details;
 	char *servername;
@@ -39,5 +40,6 @@ struct daemon_client {
 void daemon_client_kill(struct daemon_client *dc);
 void daemon_client_forward_credentials(struct daemon_client *dc);
 void daemon_clients_exit(void);
+void daemon_client_user_ready(struct daemon_user *user, gboolean ready, gpointer userdata);
 
 #endif
@@ -27,6 +27,9 @@ struct ctrlproxyd_config {
 	char *configdir;
 	gboolean ssl;
 	gpointer ssl_credentials;
+	gboolean prewarm;
+	int prewarm_max_age; /* in days, 0 for no limit */
+	int prewarm_parallel;
 };
 
 #endif
@@ -60,7 +60,8 @@ static struct ctrlproxyd_config *global_daemon_config;
 
 /* there are no hup signals here */
 void register_hup_handler(hup_handler_fn fn, void *userdata) {}
-static gboolean daemon_client_connect_backend(struct daemon_client *cd, struct pending_client *cl, const char *username);
+static gboolean daemon_client_connect_backend(struct daemon_client *cd, struct pending_client *cl, const char *username,
+											  void (*backend_ready) (struct daemon_client *cd));
 
 void listener_syslog(enum log_level l, const struct irc_listener *listener, const char *ret)
 {
@@ -117,9 +118,34 @@ struct ctrlproxyd_config *read_config_file(const char *name)
 	if (g_key_file_has_key(kf, "settings", "ssl", NULL))
 		config->ssl = g_key_file_get_boolean(kf, "settings", "ssl", NULL);
 
+	if (g_key_file_has_key(kf, "settings", "prewarm", NULL))
+		config->prewarm = g_key_file_get_boolean(kf, "settings", "prewarm", NULL);
+	else
+		config->prewarm = TRUE;
+
+	if (g_key_file_has_key(kf, "settings", "prewarm-max-age", NULL))
+		config->prewarm_max_age = g_key_file_get_integer(kf, "settings", "prewarm-max-age", NULL);
+
+	if (g_key_file_has_key(kf, "settings", "prewarm-parallel", NULL))
+		config->prewarm_parallel = g_key_file_get_integer(kf, "settings", "prewarm-parallel", NULL);
+	else
+		config->prewarm_parallel = 4;
+
+	if (g_key_file_has_key(kf, "settings", "transport-backend", NULL)) {
+		char *backend;
+		backend = g_key_file_get_string(kf, "settings", "transport-backend", NULL);
+		if (!irc_transport_set_backend(backend))
+			fprintf(stderr, "Transport backend '%s' not available, using '%s'\n",
+					backend, irc_transport_get_backend());
+		g_free(backend);
+	}
+
 #ifdef HAVE_GNUTLS
 	if (config->ssl)
 		config->ssl_credentials = ssl_create_server_credentials(SSL_CREDENTIALS_DIR, kf, "ssl");
+
+	if (g_key_file_has_key(kf, "settings", "kernel-tls", NULL))
+		ssl_set_kernel_tls(g_key_file_get_boolean(kf, "settings", "kernel-tls", NULL));
 #endif
 
 	g_key_file_free(kf);
@@ -175,7 +201,7 @@ static gboolean daemon_client_recv(struct irc_transport *transport, const struct
 {
 	struct daemon_client *cd = transport->userdata;
 
-	if (cd->backend->authenticated)
+	if (cd->backend != NULL && cd->backend->authenticated)
 		return daemon_backend_send_line(cd->backend, line);
 	else
 		return TRUE;
@@ -207,6 +233,14 @@ static const struct irc_transport_callbacks daemon_client_callbacks = {
 };
 
 #ifdef HAVE_GSSAPI
+static void gssapi_backend_ready(struct daemon_client *cd)
+{
+	/* The client may already have asked for a network while we were
+	 * waiting for the backend to come up */
+	if (cd->servername != NULL)
+		transport_send_args(cd->backend->transport, NULL, "CONNECT", cd->servername, cd->servicename, NULL);
+}
+
 static gboolean daemon_socks_gssapi (struct pending_client *pc, gss_name_t username)
 {
 	struct daemon_client *cd = pc->private_data;
@@ -223,7 +257,7 @@ static gboolean daemon_socks_gssapi (struct pending_client *pc, gss_name_t usern
 		return FALSE;
 	}
 
-	if (!daemon_client_connect_backend(cd, pc, namebuf.value))
+	if (!daemon_client_connect_backend(cd, pc, namebuf.value, gssapi_backend_ready))
 		return FALSE;
 	major_status = gss_release_buffer(&minor_status, &namebuf);
 
@@ -269,27 +303,89 @@ const static struct daemon_backend_callbacks backend_callbacks = {
 	.recv = backend_recv,
 };
 
-static gboolean daemon_client_connect_backend(struct daemon_client *cd, struct pending_client *cl, const char *username)
+static void daemon_client_backend_failed(struct daemon_client *cd, const char *msg)
+{
+	listener_log(LOG_WARNING, cd->listener, "%s", msg);
+
+	if (cd->client_transport != NULL) {
+		transport_send_args(cd->client_transport, NULL, "ERROR", msg, NULL);
+		daemon_client_kill(cd);
+	} else if (cd->socks_accept_fn != NULL) {
+		cd->socks_accept_fn(cd->pending_client, FALSE);
+	}
+}
+
+void daemon_client_user_ready(struct daemon_user *user, gboolean ready, gpointer userdata)
+{
+	struct daemon_client *cd = userdata;
+	char *msg;
+
+	if (!ready) {
+		msg = g_strdup_printf("Unable to start ctrlproxy for %s", user->username);
+		daemon_client_backend_failed(cd, msg);
+		g_free(msg);
+		return;
+	}
+
+	cd->backend = daemon_backend_open(user->socketpath, &backend_callbacks, cd, cd->listener);
+	if (cd->backend == NULL) {
+		msg = g_strdup_printf("Unable to connect to ctrlproxy for %s", user->username);
+		daemon_client_backend_failed(cd, msg);
+		g_free(msg);
+		return;
+	}
+
+	if (cd->backend_ready != NULL)
+		cd->backend_ready(cd);
+}
+
+/* Send an ERROR through the client transport, or straight to the
+ * connection if there is none yet */
+static void daemon_client_send_error(struct daemon_client *cd, struct pending_client *cl,
+									 const char *fmt, ...)
+{
+	va_list ap;
+	char *msg;
+
+	va_start(ap, fmt);
+	msg = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	if (cd->client_transport != NULL)
+		transport_send_args(cd->client_transport, NULL, "ERROR", msg, NULL);
+	else
+		irc_sendf(cl->connection, cl->listener->iconv, NULL, "ERROR :%s", msg);
+
+	g_free(msg);
+}
+
+/**
+ * Find the ctrlproxy instance for a user, starting it if necessary.
+ *
+ * The backend is opened asynchronously once the instance has signalled
+ * that it is listening, after which backend_ready is called.
+ */
+static gboolean daemon_client_connect_backend(struct daemon_client *cd, struct pending_client *cl, const char *username,
+											  void (*backend_ready) (struct daemon_client *cd))
 {
 	daemon_user_free(cd->user);
 	cd->user = get_daemon_user(cd->config, username);
 	if (cd->user == NULL) {
 		listener_log(LOG_INFO, cd->listener, "Unable to find user %s", username);
-		irc_sendf(cl->connection, cl->listener->iconv, NULL, "ERROR :Unknown user %s", username);
+		daemon_client_send_error(cd, cl, "Unknown user %s", username);
 		return FALSE;
 	}
 
-	if (!daemon_user_running(cd->user)) {
+	if (cd->user->state != DAEMON_USER_STARTING && !daemon_user_running(cd->user)) {
 		if (!daemon_user_start(cd->user, cd->config->ctrlproxy_path, cd->listener)) {
-			irc_sendf(cl->connection, cl->listener->iconv, NULL, "ERROR :Unable to start ctrlproxy for %s",
-					  cd->user->username);
+			daemon_client_send_error(cd, cl, "Unable to start ctrlproxy for %s",
+									 cd->user->username);
 			return FALSE;
 		}
 	}
 
-	cd->backend = daemon_backend_open(cd->user->socketpath, &backend_callbacks, cd, cl->listener);
-	if (cd->backend == NULL)
-		return FALSE;
+	cd->backend_ready = backend_ready;
+	daemon_user_wait_ready(cd->user, daemon_client_user_ready, cd);
 
 	return TRUE;
 }
@@ -298,21 +394,28 @@ static void daemon_backend_pass_checked(struct daemon_backend *backend, gboolean
 {
 	struct daemon_client *cd = backend->userdata;
 
+	if (accepted)
+		daemon_user_touch(cd->user);
+
 	cd->socks_accept_fn(cd->pending_client, accepted);
 }
 
 
+static void socks_backend_ready(struct daemon_client *cd)
+{
+	daemon_backend_authenticate(cd->backend, cd->login_details->password, daemon_backend_pass_checked);
+}
+
 static gboolean daemon_socks_auth_simple(struct pending_client *cl, const char *username, const char *password,
 										 gboolean (*on_finished) (struct pending_client *, gboolean))
 {
 	struct daemon_client *cd = cl->private_data;
-	
-	if (!daemon_client_connect_backend(cd, cl, username))
-		return FALSE;
 
 	cd->socks_accept_fn = on_finished;
+	g_free(cd->login_details->password);
+	cd->login_details->password = g_strdup(password);
 
-	return daemon_backend_authenticate(cd->backend, password, daemon_backend_pass_checked);
+	return daemon_client_connect_backend(cd, cl, username, socks_backend_ready);
 }
 
 static gboolean daemon_socks_connect_fqdn (struct pending_client *cl, const char *hostname, uint16_t port)
@@ -330,7 +433,12 @@ static gboolean daemon_socks_connect_fqdn (struct pending_client *cl, const char
 	irc_transport_set_callbacks(cd->client_transport, &daemon_client_callbacks, cd);
 
 	snprintf(portstr, sizeof(portstr), "%d", port);
-	transport_send_args(cd->backend->transport, NULL, "CONNECT", hostname, portstr, NULL);
+	if (cd->backend != NULL) {
+		transport_send_args(cd->backend->transport, NULL, "CONNECT", hostname, portstr, NULL);
+	} else {
+		cd->servername = g_strdup(hostname);
+		cd->servicename = g_strdup(portstr);
+	}
 
 	g_assert(strlen(hostname) < 0x100);
 
@@ -350,10 +458,16 @@ static void plain_handle_auth_finish(struct daemon_backend *backend, gboolean ac
 								ERR_PASSWDMISMATCH, "Password invalid", NULL);
 		daemon_client_kill(dc);
 	} else {
+		daemon_user_touch(dc->user);
 		daemon_client_forward_credentials(dc);
 	}
 }
 
+static void plain_backend_ready(struct daemon_client *cd)
+{
+	daemon_backend_authenticate(cd->backend, cd->login_details->password, plain_handle_auth_finish);
+}
+
 static gboolean handle_client_line(struct pending_client *pc, const struct irc_line *l)
 {
 	struct daemon_client *cd = pc->private_data;
@@ -383,18 +497,22 @@ static gboolean handle_client_line(struct pending_client *pc, const struct irc_l
 	}
 
 	if (cd->login_details->username != NULL && cd->login_details->password != NULL && cd->login_details->nick != NULL) {
-		if (!daemon_client_connect_backend(cd, pc, cd->login_details->username))
-			return FALSE;
-
 		cd->description = g_io_channel_ip_get_description(pc->connection);
-		listener_log(LOG_INFO, pc->listener, "Accepted new client %s for user %s", cd->description, cd->user->username);
-
-		cd->client_transport = irc_transport_new_iochannel(pc->connection);
 
-		daemon_backend_authenticate(cd->backend, cd->login_details->password, plain_handle_auth_finish);
+		listener_log(LOG_INFO, pc->listener, "Accepted new client %s for user %s", cd->description, cd->login_details->username);
 
+		/* If the instance is already running, the backend is opened (and
+		 * authentication started or an error reported) before
+		 * daemon_client_connect_backend() returns, so the client
+		 * transport has to exist first. */
+		cd->client_transport = irc_transport_new_iochannel(pc->connection);
 		irc_transport_set_callbacks(cd->client_transport, &daemon_client_callbacks, cd);
 
+		/* Even if this succeeds, cd may already have been freed because
+		 * the backend failed straight away, so don't touch it after */
+		if (!daemon_client_connect_backend(cd, pc, cd->login_details->username, plain_backend_ready))
+			daemon_client_kill(cd);
+
 		return FALSE;
 	}
 
@@ -422,14 +540,6 @@ struct irc_listener_ops daemon_ops = {
 	.handle_client_line = handle_client_line,
 };
 
-static void daemon_user_start_if_exists(struct daemon_user *user, const char *ctrlproxy_path,
-										struct irc_listener *listener)
-{
-	if (daemon_user_exists(user) && !daemon_user_running(user)) {
-		daemon_user_start(user, ctrlproxy_path, listener);
-	}
-}
-
 int main(int argc, char **argv)
 {
 	struct ctrlproxyd_config *config;
@@ -542,7 +652,8 @@ int main(int argc, char **argv)
 			return 1;
 	}
 
-	foreach_daemon_user(config, daemon_listener, daemon_user_start_if_exists);
+	if (config->prewarm)
+		daemon_users_prewarm(config, daemon_listener);
 
 	g_main_loop_run(main_loop);
 
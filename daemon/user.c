@@ -23,8 +23,25 @@
 #include "internals.h"
 #include "daemon/user.h"
 #include <pwd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include <glib-unix.h>
 #include "daemon/daemon.h"
 
+/* Users known to the daemon, indexed by user name. Entries are shared
+ * between all clients of the same user, so that they all see the same
+ * instance state. */
+static GHashTable *daemon_users = NULL;
+
+struct daemon_user_waiter {
+	daemon_user_ready_fn fn;
+	gpointer userdata;
+};
+
 gboolean daemon_user_exists(struct daemon_user *user)
 {
 	return g_file_test(user->configdir, G_FILE_TEST_IS_DIR);
@@ -37,11 +54,24 @@ gboolean daemon_user_running(struct daemon_user *user)
 	return (user->pid != -1);
 }
 
+struct daemon_user *daemon_user_ref(struct daemon_user *user)
+{
+	user->refcount++;
+	return user;
+}
+
 void daemon_user_free(struct daemon_user *user)
 {
 	if (user == NULL)
 		return;
+	user->refcount--;
+	if (user->refcount > 0)
+		return;
+	g_assert(user->ready_waiters == NULL);
+	if (daemon_users != NULL)
+		g_hash_table_remove(daemon_users, user->username);
 	g_free(user->pidpath);
+	g_free(user->lastloginpath);
 	g_free(user->socketpath);
 	g_free(user->configdir);
 	g_free(user->username);
@@ -50,11 +80,22 @@ void daemon_user_free(struct daemon_user *user)
 
 struct daemon_user *get_daemon_user(struct ctrlproxyd_config *config, const char *username)
 {
-	struct daemon_user *user = g_new0(struct daemon_user, 1);
+	struct daemon_user *user;
 	struct passwd *pwd;
 
+	if (daemon_users == NULL)
+		daemon_users = g_hash_table_new(g_str_hash, g_str_equal);
+
+	user = g_hash_table_lookup(daemon_users, username);
+	if (user != NULL)
+		return daemon_user_ref(user);
+
+	user = g_new0(struct daemon_user, 1);
 	user->username = g_strdup(username);
 	user->child_watch = -1;
+	user->ready_watch = -1;
+	user->ready_timeout = -1;
+	user->refcount = 1;
 
 	if (config->configdir != NULL) {
 		user->configdir = g_build_filename(config->configdir, username, NULL);
@@ -74,17 +115,30 @@ struct daemon_user *get_daemon_user(struct ctrlproxyd_config *config, const char
 
 	user->socketpath = g_build_filename(user->configdir, "socket", NULL);
 	user->pidpath = g_build_filename(user->configdir, "pid", NULL);
+	user->lastloginpath = g_build_filename(user->configdir, "last-login", NULL);
+
+	g_hash_table_insert(daemon_users, user->username, user);
 	return user;
 }
 
 struct spawn_data {
 	struct daemon_user *user;
 	struct irc_listener *listener;
+	int ready_fd;
 };
 
 static void user_setup(gpointer user_data)
 {
 	struct spawn_data *data = user_data;
+
+	/* GLib marks all inherited descriptors close-on-exec, so explicitly
+	 * keep the readiness pipe open for the child. */
+	if (fcntl(data->ready_fd, F_SETFD, 0) < 0) {
+		listener_log(LOG_WARNING, data->listener, "Unable to pass readiness pipe to ctrlproxy: %s",
+					 strerror(errno));
+		exit(1);
+	}
+
 	if (setuid(data->user->uid) < 0) {
 		listener_log(LOG_WARNING, data->listener, "Unable to change effective user id to %s (%d): %s",
 					 data->user->username, data->user->uid,
@@ -93,6 +147,87 @@ static void user_setup(gpointer user_data)
 	}	
 }
 
+/**
+ * Finish waiting for an instance to come up and notify everybody
+ * that was waiting for it.
+ */
+static void daemon_user_ready_finish(struct daemon_user *user, gboolean ready)
+{
+	GList *waiters, *gl;
+
+	if (user->ready_timeout != -1) {
+		g_source_remove(user->ready_timeout);
+		user->ready_timeout = -1;
+	}
+
+	if (user->ready_watch != -1) {
+		g_source_remove(user->ready_watch);
+		user->ready_watch = -1;
+	}
+
+	if (user->ready_channel != NULL) {
+		g_io_channel_unref(user->ready_channel);
+		user->ready_channel = NULL;
+	}
+
+	user->state = ready?DAEMON_USER_READY:DAEMON_USER_STOPPED;
+
+	/* Waiters may drop the last reference to the user */
+	daemon_user_ref(user);
+
+	waiters = user->ready_waiters;
+	user->ready_waiters = NULL;
+	for (gl = waiters; gl; gl = gl->next) {
+		struct daemon_user_waiter *waiter = gl->data;
+		waiter->fn(user, ready, waiter->userdata);
+		g_free(waiter);
+	}
+	g_list_free(waiters);
+
+	daemon_user_free(user);
+}
+
+static gboolean daemon_user_ready_read(GIOChannel *ch, GIOCondition condition, gpointer data)
+{
+	struct daemon_user *user = data;
+	gchar buf[16];
+	gsize nread = 0;
+	GIOStatus status;
+
+	status = g_io_channel_read_chars(ch, buf, sizeof(buf), &nread, NULL);
+
+	/* Returning FALSE removes the watch */
+	user->ready_watch = -1;
+
+	if (status == G_IO_STATUS_NORMAL && nread > 0) {
+		listener_log(LOG_INFO, user->listener, "ctrlproxy instance for %s is ready",
+					 user->username);
+		daemon_user_ready_finish(user, TRUE);
+	} else {
+		listener_log(LOG_WARNING, user->listener,
+					 "ctrlproxy instance for %s went away before becoming ready",
+					 user->username);
+		daemon_user_ready_finish(user, FALSE);
+	}
+
+	return FALSE;
+}
+
+static gboolean daemon_user_ready_timed_out(gpointer data)
+{
+	struct daemon_user *user = data;
+
+	user->ready_timeout = -1;
+
+	listener_log(LOG_WARNING, user->listener,
+				 "ctrlproxy instance for %s did not become ready within %d seconds",
+				 user->username, DAEMON_USER_READY_TIMEOUT);
+
+	daemon_user_ready_finish(user, FALSE);
+
+	return FALSE;
+}
+
 static void daemon_user_exits(GPid pid, gint status, gpointer data)
 {
 	struct daemon_user *user = (struct daemon_user *)data;
@@ -106,6 +241,13 @@ static void daemon_user_exits(GPid pid, gint status, gpointer data)
 	g_spawn_close_pid(pid);
 	user->pid = -1;
 	user->child_watch = -1;
+
+	if (user->state == DAEMON_USER_STARTING)
+		daemon_user_ready_finish(user, FALSE);
+	user->state = DAEMON_USER_STOPPED;
+
+	/* Drop the reference held by the child watch */
+	daemon_user_free(user);
 }
 
 
@@ -115,20 +257,34 @@ gboolean daemon_user_start(struct daemon_user *user, const char *ctrlproxy_path,
 	struct spawn_data spawn_data;
 	char **command;
 	int child_stdin, child_stdout, child_stderr;
-	spawn_data.listener = l;
-	spawn_data.user = user;
+	int ready_fds[2];
+
+	g_assert(user->state != DAEMON_USER_STARTING);
 
 	user->listener = l;
 
-	command = g_new0(char *, 6);
+	if (!g_unix_open_pipe(ready_fds, FD_CLOEXEC, &error)) {
+		listener_log(LOG_WARNING, l, "Unable to create readiness pipe for %s: %s",
+					 user->username, error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	spawn_data.listener = l;
+	spawn_data.user = user;
+	spawn_data.ready_fd = ready_fds[1];
+
+	command = g_new0(char *, 8);
 	command[0] = g_strdup(ctrlproxy_path);
 	command[1] = g_strdup("--config-dir");
 	command[2] = g_strdup(user->configdir);
+	command[3] = g_strdup("--ready-fd");
+	command[4] = g_strdup_printf("%d", ready_fds[1]);
 	if (user->uid == (uid_t)-1) {
-		command[3] = g_strdup("--restricted");
-		command[4] = NULL;
+		command[5] = g_strdup("--restricted");
+		command[6] = NULL;
 	} else {
-		command[3] = NULL;
+		command[5] = NULL;
 	}
 
 	if (!g_spawn_async_with_pipes(NULL, command, NULL, G_SPAWN_SEARCH_PATH|G_SPAWN_DO_NOT_REAP_CHILD, user_setup, &spawn_data,
@@ -136,22 +292,233 @@ gboolean daemon_user_start(struct daemon_user *user, const char *ctrlproxy_path,
 		listener_log(LOG_WARNING, l, "Unable to start ctrlproxy for %s (%s): %s", user->username,
 					 user->configdir, error->message);
 		g_error_free(error);
+		g_strfreev(command);
+		close(ready_fds[0]);
+		close(ready_fds[1]);
 		return FALSE;
 	}
 	g_strfreev(command);
 
+	/* Only the child should hold the write end, so that we see EOF if
+	 * it dies before becoming ready. */
+	close(ready_fds[1]);
+
 	listener_log(LOG_INFO, l, "Launched new ctrlproxy instance for %s at %s",
 				 user->username, user->configdir);
-	user->child_watch = g_child_watch_add(user->pid, daemon_user_exits, user);
+	user->child_watch = g_child_watch_add(user->pid, daemon_user_exits, daemon_user_ref(user));
 
-	/* FIXME: What if the process hasn't started up completely while we try to
-	 * connect to the socket? */
+	user->state = DAEMON_USER_STARTING;
+	user->ready_channel = g_io_channel_unix_new(ready_fds[0]);
+	g_io_channel_set_close_on_unref(user->ready_channel, TRUE);
+	g_io_channel_set_encoding(user->ready_channel, NULL, NULL);
+	user->ready_watch = g_io_add_watch(user->ready_channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+									   daemon_user_ready_read, user);
+	user->ready_timeout = g_timeout_add_seconds(DAEMON_USER_READY_TIMEOUT,
+												daemon_user_ready_timed_out, user);
 
 	return TRUE;
 }
 
+/**
+ * Wait until the ctrlproxy instance for a user is accepting connections.
+ *
+ * The callback is run immediately if the instance is not in the process
+ * of starting up.
+ */
+void daemon_user_wait_ready(struct daemon_user *user, daemon_user_ready_fn fn, gpointer userdata)
+{
+	struct daemon_user_waiter *waiter;
+
+	if (user->state != DAEMON_USER_STARTING) {
+		fn(user, TRUE, userdata);
+		return;
+	}
+
+	waiter = g_new0(struct daemon_user_waiter, 1);
+	waiter->fn = fn;
+	waiter->userdata = userdata;
+	user->ready_waiters = g_list_append(user->ready_waiters, waiter);
+}
+
+void daemon_user_cancel_wait(struct daemon_user *user, daemon_user_ready_fn fn, gpointer userdata)
+{
+	GList *gl;
+
+	for (gl = user->ready_waiters; gl; gl = gl->next) {
+		struct daemon_user_waiter *waiter = gl->data;
+
+		if (waiter->fn == fn && waiter->userdata == userdata) {
+			user->ready_waiters = g_list_delete_link(user->ready_waiters, gl);
+			g_free(waiter);
+			return;
+		}
+	}
+}
+
+/**
+ * Check whether a user has logged in within the last max_age days.
+ *
+ * Logins are tracked by the modification time of the last-login file,
+ * which is only updated once a client has authenticated; failed logins
+ * and instances started by prewarm don't count. Users that haven't
+ * logged in since it was introduced are not considered active.
+ */
+gboolean daemon_user_recently_active(struct daemon_user *user, int max_age)
+{
+	struct stat st;
+
+	if (max_age <= 0)
+		return TRUE;
+
+	if (g_stat(user->lastloginpath, &st) < 0)
+		return FALSE;
+
+	return (time(NULL) - st.st_mtime) <= (time_t)max_age * 24 * 60 * 60;
+}
+
+/**
+ * Record that a user has logged in.
+ *
+ * ctrlproxyd usually runs as root while the configuration directory
+ * belongs to the user, so neither the directory nor the file is allowed
+ * to be a symlink, and the file is only changed through its descriptor.
+ */
+void daemon_user_touch(struct daemon_user *user)
+{
+	struct stat st;
+	int dirfd, fd;
+
+	dirfd = open(user->configdir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dirfd < 0) {
+		syslog(LOG_WARNING, "Unable to open %s: %s",
+			   user->configdir, g_strerror(errno));
+		return;
+	}
+
+	if (user->uid != (uid_t)-1 &&
+		(fstat(dirfd, &st) < 0 || st.st_uid != user->uid)) {
+		syslog(LOG_WARNING, "Not recording login: %s is not owned by %s",
+			   user->configdir, user->username);
+		close(dirfd);
+		return;
+	}
+
+	fd = openat(dirfd, "last-login",
+				O_WRONLY | O_CREAT | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0600);
+	close(dirfd);
+	if (fd < 0) {
+		syslog(LOG_WARNING, "Unable to create %s: %s",
+			   user->lastloginpath, g_strerror(errno));
+		return;
+	}
+
+	/* Refuse anything but a file of our own, e.g. a hard link */
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1) {
+		syslog(LOG_WARNING, "Not recording login: %s is not a regular file",
+			   user->lastloginpath);
+		close(fd);
+		return;
+	}
+
+	if (user->uid != (uid_t)-1 && st.st_uid != user->uid &&
+		fchown(fd, user->uid, -1) < 0)
+		syslog(LOG_WARNING, "Unable to change owner of %s: %s",
+			   user->lastloginpath, g_strerror(errno));
+
+	if (futimens(fd, NULL) < 0)
+		syslog(LOG_WARNING, "Unable to update %s: %s",
+			   user->lastloginpath, g_strerror(errno));
+
+	close(fd);
+}
+
+struct prewarm_state {
+	GQueue *queue;
+	int active;
+	int started;
+	int max_parallel;
+	int max_age;
+	const char *ctrlproxy_path;
+	struct irc_listener *listener;
+};
+
+static void prewarm_next(struct prewarm_state *state);
+
+static void prewarm_user_ready(struct daemon_user *user, gboolean ready, gpointer userdata)
+{
+	struct prewarm_state *state = userdata;
+
+	state->active--;
+	if (ready)
+		state->started++;
+	daemon_user_free(user);
+	prewarm_next(state);
+}
+
+static void prewarm_next(struct prewarm_state *state)
+{
+	while (state->active < state->max_parallel && !g_queue_is_empty(state->queue)) {
+		struct daemon_user *user = g_queue_pop_head(state->queue);
+
+		if (user->state != DAEMON_USER_STOPPED || daemon_user_running(user) ||
+			!daemon_user_start(user, state->ctrlproxy_path, state->listener)) {
+			daemon_user_free(user);
+			continue;
+		}
+
+		state->active++;
+		daemon_user_wait_ready(user, prewarm_user_ready, state);
+	}
+
+	if (state->active == 0 && g_queue_is_empty(state->queue)) {
+		listener_log(LOG_INFO, state->listener, "Pre-warmed %d ctrlproxy instances",
+					 state->started);
+		g_queue_free(state->queue);
+		g_free(state);
+	}
+}
+
+static void prewarm_add_user(struct daemon_user *user, const char *ctrlproxy_path,
+							 struct irc_listener *listener, gpointer userdata)
+{
+	struct prewarm_state *state = userdata;
+
+	if (user == NULL)
+		return;
+
+	/* Skip users that don't have a configuration or haven't been
+	 * around for a while */
+	if (!daemon_user_exists(user) ||
+		!daemon_user_recently_active(user, state->max_age)) {
+		daemon_user_free(user);
+		return;
+	}
+
+	g_queue_push_tail(state->queue, user);
+}
+
+/**
+ * Start ctrlproxy instances for recently active users, with at most
+ * config->prewarm_parallel instances starting up at the same time.
+ */
+void daemon_users_prewarm(struct ctrlproxyd_config *config, struct irc_listener *listener)
+{
+	struct prewarm_state *state = g_new0(struct prewarm_state, 1);
+
+	state->queue = g_queue_new();
+	state->max_parallel = MAX(config->prewarm_parallel, 1);
+	state->max_age = config->prewarm_max_age;
+	state->ctrlproxy_path = config->ctrlproxy_path;
+	state->listener = listener;
+
+	foreach_daemon_user(config, listener, prewarm_add_user, state);
+
+	prewarm_next(state);
+}
+
 void foreach_daemon_user(struct ctrlproxyd_config *config, struct irc_listener *listener,
-						 void (*fn) (struct daemon_user *user, const char *ctrlproxy_path, struct irc_listener *l))
+						 void (*fn) (struct daemon_user *user, const char *ctrlproxy_path, struct irc_listener *l, gpointer userdata),
+						 gpointer userdata)
 {
 	struct daemon_user *user;
 
@@ -160,7 +527,7 @@ void foreach_daemon_user(struct ctrlproxyd_config *config, struct irc_listener *
 		setpwent();
 		while ((pwent = getpwent()) != NULL) {
 			user = get_daemon_user(config, pwent->pw_name);
-			fn(user, config->ctrlproxy_path, listener);
+			fn(user, config->ctrlproxy_path, listener, userdata);
 		}
 		endpwent();
 	} else {
@@ -170,7 +537,7 @@ void foreach_daemon_user(struct ctrlproxyd_config *config, struct irc_listener *
 			return;
 		while ((name = g_dir_read_name(dir)) != NULL) {
 			user = get_daemon_user(config, name);
-			fn(user, config->ctrlproxy_path, listener);
+			fn(user, config->ctrlproxy_path, listener, userdata);
 		}
 		g_dir_close(dir);
 	}
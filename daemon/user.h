@@ -22,9 +22,23 @@
 
 struct ctrlproxyd_config;
 
+/* Seconds to wait for a freshly spawned instance to report it is listening */
+#define DAEMON_USER_READY_TIMEOUT 30
+
+enum daemon_user_state {
+	DAEMON_USER_STOPPED = 0,
+	DAEMON_USER_STARTING,
+	DAEMON_USER_READY
+};
+
+struct daemon_user;
+
+typedef void (*daemon_user_ready_fn) (struct daemon_user *user, gboolean ready, gpointer userdata);
+
 struct daemon_user {
 	 char *configdir;
 	 char *pidpath;
+	 char *lastloginpath;
 	 char *socketpath;
 	 char *username;
 	 gint last_status;
@@ -32,15 +46,28 @@ struct daemon_user {
 	 uid_t uid; /* -1 if not a system user */
 	 GPid pid;
 	 struct irc_listener *listener;
+	 int refcount;
+	 enum daemon_user_state state;
+	 GIOChannel *ready_channel;
+	 gint ready_watch;
+	 gint ready_timeout;
+	 GList *ready_waiters;
 };
 
 gboolean daemon_user_exists(struct daemon_user *user);
 gboolean daemon_user_running(struct daemon_user *user);
+struct daemon_user *daemon_user_ref(struct daemon_user *user);
 void daemon_user_free(struct daemon_user *user);
 struct daemon_user *get_daemon_user(struct ctrlproxyd_config *config, const char *username);
 gboolean daemon_user_start(struct daemon_user *user, const char *ctrlproxy_path, struct irc_listener *l);
+void daemon_user_wait_ready(struct daemon_user *user, daemon_user_ready_fn fn, gpointer userdata);
+void daemon_user_cancel_wait(struct daemon_user *user, daemon_user_ready_fn fn, gpointer userdata);
+gboolean daemon_user_recently_active(struct daemon_user *user, int max_age);
+void daemon_user_touch(struct daemon_user *user);
+void daemon_users_prewarm(struct ctrlproxyd_config *config, struct irc_listener *listener);
 void foreach_daemon_user(struct ctrlproxyd_config *config, struct irc_listener *listener,
-						 void (*fn) (struct daemon_user *user, const char *ctrlproxy_path, struct irc_listener *l));
+						 void (*fn) (struct daemon_user *user, const char *ctrlproxy_path, struct irc_listener *l, gpointer userdata),
+						 gpointer userdata);
 struct daemon_user *domain_user_init(struct ctrlproxyd_config *config, const char *username);
 
 #endif
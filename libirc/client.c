@@ -190,6 +190,33 @@ gboolean client_send_line(struct irc_client *c, const struct irc_line *l, GError
 	return transport_send_line(c->transport, l, error);
 }
 
+/**
+ * Relay a line from the network to a client. While backlog is being
+ * sent the line is held back until the backlog is done; replies to the
+ * client's own commands are sent with client_send_line() instead.
+ * A client that falls too far behind is disconnected.
+ * @param c Client to send to
+ * @param l Line to send
+ * @return Whether the line was sent or queued successfully
+ */
+gboolean client_relay_line(struct irc_client *c, const struct irc_line *l, GError **error)
+{
+	if (c->holds == 0 || c->connected == FALSE)
+		return client_send_line(c, l, error);
+
+	if (g_queue_get_length(&c->held_lines) >= CLIENT_MAX_HELD_LINES) {
+		g_queue_foreach(&c->held_lines, (GFunc)free_line, NULL);
+		g_queue_clear(&c->held_lines);
+		client_disconnect(c, "Too many new lines while sending backlog");
+		g_set_error_literal(error, IRC_CLIENT_ERROR, IRC_CLIENT_ERROR_DISCONNECTED,
+				    "Not connected.");
+		return FALSE;
+	}
+
+	g_queue_push_tail(&c->held_lines, linedup(l));
+	return TRUE;
+}
+
 /*
  * Disconnect a client.
  *
@@ -222,9 +249,41 @@ void client_disconnect(struct irc_client *c, const char *reason)
 	}
 }
 
+/**
+ * Hold back lines relayed to a client until client_release_lines() is
+ * called, so that backlog sent over several main loop iterations isn't
+ * mixed with new lines. Calls nest.
+ * @param c Client to hold lines for
+ */
+void client_hold_lines(struct irc_client *c)
+{
+	c->holds++;
+}
+
+/**
+ * Send the lines held back since client_hold_lines().
+ * @param c Client to release lines for
+ */
+void client_release_lines(struct irc_client *c)
+{
+	struct irc_line *l;
+
+	g_assert(c->holds > 0);
+
+	if (--c->holds > 0)
+		return;
+
+	while ((l = g_queue_pop_head(&c->held_lines)) != NULL) {
+		client_send_line(c, l, NULL);
+		free_line(l);
+	}
+}
+
 static void free_client(struct irc_client *c)
 {
 	g_assert(c->connected == FALSE);
+	g_queue_foreach(&c->held_lines, (GFunc)free_line, NULL);
+	g_queue_clear(&c->held_lines);
 	g_free(c->description);
 	free_network_state(c->state);
 	free_login_details(c->login_details);
@@ -405,6 +464,7 @@ struct irc_client *irc_client_new(struct irc_transport *transport,
 		return NULL;
 	}
 	client->references = 1;
+	g_queue_init(&client->held_lines);
 
 	client->login_details = g_new0(struct irc_login_details, 1);
 	client->client_hostname = transport_get_peer_hostname(transport);
@@ -719,22 +779,17 @@ gboolean client_send_topic(struct irc_client *c, struct irc_channel_state *ch,
 	return TRUE;
 }
 
-gboolean client_send_nameslist(struct irc_client *c, struct irc_channel_state *ch)
+static GList *build_nameslist(struct irc_client *c, struct irc_channel_state *ch)
 {
-	GList *nl;
-	gboolean ret;
+	GList *nl, *lines = NULL;
 	struct irc_line *l = NULL;
 
-	g_assert(c != NULL);
-	g_assert(ch != NULL);
-
 	for (nl = ch->nicks; nl; nl = nl->next) {
 		char mode[2] = { ch->mode, 0 };
 		char *arg;
 		struct channel_nick *n = (struct channel_nick *)nl->data;
 		char prefix;
 
-		g_assert(c->state != NULL && c->state->info != NULL);
 		prefix = get_prefix_from_modes(c->state->info, n->modes);
 
 		if (prefix == 0) {
@@ -743,13 +798,10 @@ gboolean client_send_nameslist(struct irc_client *c, struct irc_channel_state *c
 			arg = g_strdup_printf("%c%s", prefix, n->global_nick->nick);
 		}
 
-		ret = TRUE;
-
 		if (l == NULL || !line_add_arg(l, arg)) {
 			char *tmp;
 			if (l != NULL) {
-				ret = client_send_line(c, l, NULL);
-				free_line(l);
+				lines = g_list_prepend(lines, l);
 			}
 
 			l = irc_parse_line_args(c->default_origin, "353",
@@ -762,16 +814,37 @@ gboolean client_send_nameslist(struct irc_client *c, struct irc_channel_state *c
 		}
 
 		g_free(arg);
-
-		if (!ret) {
-			return FALSE;
-		}
 	}
 
 	if (l != NULL) {
-		ret = client_send_line(c, l, NULL);
-		free_line(l);
-		if (!ret) {
+		lines = g_list_prepend(lines, l);
+	}
+
+	return g_list_reverse(lines);
+}
+
+gboolean client_send_nameslist(struct irc_client *c, struct irc_channel_state *ch)
+{
+	GList *gl;
+
+	g_assert(c != NULL);
+	g_assert(ch != NULL);
+	g_assert(c->state != NULL && c->state->info != NULL);
+
+	/* The 353 lines only change when the nick list does, so they are
+	 * kept with the channel until then */
+	if (!channel_reply_cache_matches(ch->names_cache, c->default_origin,
+					 client_get_default_target(c),
+					 c->state->info)) {
+		free_channel_reply_cache(ch->names_cache);
+		ch->names_cache = channel_reply_cache_new(c->default_origin,
+					 client_get_default_target(c),
+					 c->state->info);
+		ch->names_cache->lines = build_nameslist(c, ch);
+	}
+
+	for (gl = ch->names_cache->lines; gl; gl = gl->next) {
+		if (!client_send_line(c, gl->data, NULL)) {
 			return FALSE;
 		}
 	}
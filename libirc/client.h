@@ -75,6 +75,10 @@ struct irc_client {
 	const struct irc_client_callbacks *callbacks;
 	struct irc_transport *transport;
 	void *private_data;
+	/** Lines from the network held back while backlog is being sent,
+	 * and the number of backlog streams in progress. */
+	GQueue held_lines;
+	int holds;
 };
 
 /**
@@ -88,6 +92,9 @@ G_MODULE_EXPORT G_GNUC_NULL_TERMINATED gboolean client_send_args_ex(struct irc_c
 G_MODULE_EXPORT G_GNUC_NULL_TERMINATED gboolean client_send_response(struct irc_client *c,
 											  int response, ...);
 G_MODULE_EXPORT gboolean client_send_line(struct irc_client *c, const struct irc_line *, GError **error);
+G_MODULE_EXPORT gboolean client_relay_line(struct irc_client *c, const struct irc_line *l, GError **error);
+G_MODULE_EXPORT void client_hold_lines(struct irc_client *c);
+G_MODULE_EXPORT void client_release_lines(struct irc_client *c);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean client_set_charset(struct irc_client *c, const char *name);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT const char *client_get_default_target(struct irc_client *c);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT const char *client_get_own_hostmask(struct irc_client *c);
@@ -119,6 +126,9 @@ G_MODULE_EXPORT gboolean client_send_netsplit(struct irc_client *c, const char *
 G_MODULE_EXPORT gboolean clients_send_netsplit(GList *clients, const char *my_name, const char *lost_server);
 G_MODULE_EXPORT void free_login_details(struct irc_login_details *details);
 
+/** Maximum number of relayed lines held back while backlog is sent. */
+#define CLIENT_MAX_HELD_LINES 10000
+
 #define IRC_CLIENT_ERROR irc_client_error_quark()
 #define IRC_CLIENT_ERROR_DISCONNECTED 1
 GQuark irc_client_error_quark (void);
@@ -21,6 +21,8 @@
 #include "irc.h"
 #include "ssl.h"
 #include "transport.h"
+#include "resolver.h"
+#include "worker.h"
 #ifndef AF_LOCAL
 #define AF_LOCAL AF_UNIX
 #endif
@@ -354,39 +356,20 @@ gboolean network_send_args(struct irc_network *s, ...)
 static gboolean bindsock(struct irc_network *s,
 						 int sock, struct addrinfo *res,
 						 const char *address,
-						 const char *service)
+						 struct addrinfo *addrinfo_bind)
 {
-	struct addrinfo hints_bind;
-	int error;
-	struct addrinfo *res_bind, *addrinfo_bind;
-
-	memset(&hints_bind, 0, sizeof(hints_bind));
-	hints_bind.ai_family = res->ai_family;
-
-#ifdef AI_ADDRCONFIG
-	hints_bind.ai_flags = AI_ADDRCONFIG;
-#endif
-
-	hints_bind.ai_socktype = res->ai_socktype;
-	hints_bind.ai_protocol = res->ai_protocol;
-
-	error = getaddrinfo(address, service, &hints_bind, &addrinfo_bind);
-	if (error) {
-		network_log(LOG_ERROR, s,
-					"Unable to lookup %s:%s %s", address, service,
-					gai_strerror(error));
-		return FALSE;
-	}
+	struct addrinfo *res_bind;
 
 	for (res_bind = addrinfo_bind;
 		 res_bind; res_bind = res_bind->ai_next) {
+		if (res_bind->ai_family != res->ai_family)
+			continue;
 		if (bind(sock, res_bind->ai_addr, res_bind->ai_addrlen) < 0) {
-			network_log(LOG_ERROR, s, "Unable to bind to %s:%s %s",
-						address, service, strerror(errno));
+			network_log(LOG_ERROR, s, "Unable to bind to %s: %s",
+						address, strerror(errno));
 		} else
 			break;
 	}
-	freeaddrinfo(addrinfo_bind);
 
 	return (res_bind != NULL);
 }
@@ -409,18 +392,342 @@ static void ping_server(struct irc_network *server, gboolean ping_source)
 	}
 }
 
-static gboolean connect_current_tcp_server(struct irc_network *s)
+/* Milliseconds to wait for a connection attempt before also trying the
+ * next address (RFC 8305 "Connection Attempt Delay") */
+#define CONNECT_ATTEMPT_DELAY 250
+
+/**
+ * Connection to a single address, racing against the other addresses
+ * the server name resolved to.
+ */
+struct tcp_connect_attempt {
+	struct tcp_connect_context *ctx;
+	struct addrinfo *addr;
+	GIOChannel *ioc;
+	gint watch_id;
+};
+
+/**
+ * State of a TCP connection being set up: name lookups first, followed
+ * by staggered connection attempts to all returned addresses.
+ */
+struct tcp_connect_context {
+	struct irc_network *network;
+	struct irc_resolve_request *lookup;
+	struct irc_resolve_request *bind_lookup;
+	char *bind_address;
+	int pending_lookups;
+	gboolean lookup_failed;
+	struct addrinfo *addrinfo;
+	struct addrinfo *bind_addrinfo;
+	/* Addresses not tried yet, alternating between address families */
+	GList *candidates;
+	GList *attempts;
+	gint delay_id;
+	int last_error;
+};
+
+static void free_tcp_connect_attempt(struct tcp_connect_attempt *attempt)
+{
+	if (attempt->watch_id > 0)
+		g_source_remove(attempt->watch_id);
+	if (attempt->ioc != NULL)
+		g_io_channel_unref(attempt->ioc);
+	g_free(attempt);
+}
+
+static void free_tcp_connect_context(struct tcp_connect_context *ctx)
+{
+	irc_resolve_cancel(ctx->lookup);
+	irc_resolve_cancel(ctx->bind_lookup);
+	if (ctx->delay_id > 0)
+		g_source_remove(ctx->delay_id);
+	while (ctx->attempts != NULL) {
+		free_tcp_connect_attempt(ctx->attempts->data);
+		ctx->attempts = g_list_delete_link(ctx->attempts, ctx->attempts);
+	}
+	g_list_free(ctx->candidates);
+	if (ctx->addrinfo != NULL)
+		freeaddrinfo(ctx->addrinfo);
+	if (ctx->bind_addrinfo != NULL)
+		freeaddrinfo(ctx->bind_addrinfo);
+	g_free(ctx->bind_address);
+	g_free(ctx);
+}
+
+/**
+ * Order addresses so that address families alternate, starting with the
+ * family the resolver preferred.
+ */
+static GList *interleave_address_families(struct addrinfo *addrinfo)
 {
+	GList *preferred = NULL, *other = NULL, *ret = NULL;
 	struct addrinfo *res;
-	int sock = -1;
+
+	for (res = addrinfo; res; res = res->ai_next) {
+		if (res->ai_family == addrinfo->ai_family)
+			preferred = g_list_append(preferred, res);
+		else
+			other = g_list_append(other, res);
+	}
+
+	while (preferred != NULL || other != NULL) {
+		if (preferred != NULL) {
+			ret = g_list_append(ret, preferred->data);
+			preferred = g_list_delete_link(preferred, preferred);
+		}
+		if (other != NULL) {
+			ret = g_list_append(ret, other->data);
+			other = g_list_delete_link(other, other);
+		}
+	}
+
+	return ret;
+}
+
+static void tcp_connect_next(struct tcp_connect_context *ctx);
+
+static void tcp_connect_failed(struct tcp_connect_context *ctx)
+{
+	struct irc_network *s = ctx->network;
+	struct tcp_server_config *cs = s->connection.data.tcp.current_server;
+
+	if (ctx->lookup_failed)
+		network_report_disconnect(s, "Unable to lookup %s:%s, scheduling reconnect",
+								  cs->host, cs->port);
+	else
+		network_report_disconnect(s, "Unable to connect to %s:%s: %s",
+								  cs->host, cs->port, strerror(ctx->last_error));
+
+	reconnect(s);
+}
+
+static void tcp_connect_succeeded(struct tcp_connect_context *ctx,
+								  struct tcp_connect_attempt *attempt)
+{
+	struct irc_network *s = ctx->network;
+	struct tcp_server_config *cs = s->connection.data.tcp.current_server;
+	GIOChannel *ioc = attempt->ioc;
+	socklen_t size;
+#ifdef HAVE_GNUTLS
+	char *session_key;
+#endif
+
+	g_assert(s->connection.data.tcp.local_name == NULL);
+	g_assert(s->connection.data.tcp.remote_name == NULL);
+
+	s->connection.data.tcp.remote_name = g_memdup2(attempt->addr->ai_addr,
+												  attempt->addr->ai_addrlen);
+	size = sizeof(struct sockaddr_storage);
+	s->connection.data.tcp.local_name = g_malloc(size);
+	s->connection.data.tcp.namelen = getsockname(g_io_channel_unix_get_fd(ioc), s->connection.data.tcp.local_name, &size);
+
+	/* Take over the channel and give up on all other attempts */
+	attempt->ioc = NULL;
+	ctx->attempts = g_list_remove(ctx->attempts, attempt);
+	free_tcp_connect_attempt(attempt);
+	s->connection.data.tcp.connect_context = NULL;
+	free_tcp_connect_context(ctx);
+
+	g_io_channel_set_close_on_unref(ioc, TRUE);
+
+	if (cs->ssl) {
+#ifdef HAVE_GNUTLS
+		g_io_channel_set_flags(ioc, G_IO_FLAG_NONBLOCK, NULL);
+
+		ioc = ssl_wrap_iochannel (ioc, SSL_TYPE_CLIENT,
+								 s->connection.data.tcp.current_server->host,
+								 s->ssl_credentials
+								 );
+		if (!ioc) {
+			network_report_disconnect(s, "Couldn't connect via server %s:%s", cs->host, cs->port);
+			reconnect(s);
+			return;
+		}
+		session_key = g_strdup_printf("%s:%s", cs->host, cs->port);
+		ssl_set_session_key(ioc, session_key);
+		g_free(session_key);
+#else
+		network_log(LOG_WARNING, s, "SSL enabled for %s:%s, but no SSL support loaded", cs->host, cs->port);
+#endif
+	}
+
+	server_finish_connect(ioc, G_IO_OUT, s);
+
+	g_io_channel_unref(ioc);
+}
+
+static void tcp_connect_attempt_done(struct tcp_connect_context *ctx,
+									 struct tcp_connect_attempt *attempt)
+{
+	ctx->attempts = g_list_remove(ctx->attempts, attempt);
+	free_tcp_connect_attempt(attempt);
+
+	/* No point in waiting for the delay to expire */
+	if (ctx->delay_id > 0) {
+		g_source_remove(ctx->delay_id);
+		ctx->delay_id = 0;
+	}
+
+	tcp_connect_next(ctx);
+}
+
+static gboolean tcp_connect_attempt_ready(GIOChannel *ioc, GIOCondition cond,
+										  void *data)
+{
+	struct tcp_connect_attempt *attempt = data;
+	struct tcp_connect_context *ctx = attempt->ctx;
+	int valopt = 0;
+	socklen_t valoptlen = sizeof(valopt);
+
+	/* Returning FALSE removes the watch */
+	attempt->watch_id = 0;
+
+	if (getsockopt(g_io_channel_unix_get_fd(ioc), SOL_SOCKET, SO_ERROR,
+				   &valopt, &valoptlen) < 0)
+		valopt = errno;
+
+	if ((cond & G_IO_OUT) && valopt == 0) {
+		tcp_connect_succeeded(ctx, attempt);
+		return FALSE;
+	}
+
+	ctx->last_error = (valopt != 0)?valopt:ECONNREFUSED;
+	network_log(LOG_TRACE, ctx->network, "Connection attempt failed: %s",
+				strerror(ctx->last_error));
+
+	tcp_connect_attempt_done(ctx, attempt);
+
+	return FALSE;
+}
+
+static gboolean tcp_connect_delay_expired(gpointer data)
+{
+	struct tcp_connect_context *ctx = data;
+
+	ctx->delay_id = 0;
+	tcp_connect_next(ctx);
+
+	return FALSE;
+}
+
+/**
+ * Start a connection attempt to the next candidate address. Attempts
+ * that fail right away are skipped, so this only returns once an attempt
+ * is in progress, the connection has been set up or all addresses have
+ * been tried.
+ */
+static void tcp_connect_next(struct tcp_connect_context *ctx)
+{
+	struct irc_network *s = ctx->network;
+
+	while (ctx->candidates != NULL) {
+		struct addrinfo *res = ctx->candidates->data;
+		struct tcp_connect_attempt *attempt;
+		int sock;
+
+		ctx->candidates = g_list_delete_link(ctx->candidates, ctx->candidates);
+
+		sock = socket(res->ai_family, res->ai_socktype,
+					  res->ai_protocol);
+		if (sock < 0) {
+			ctx->last_error = errno;
+			continue;
+		}
+
+		if (ctx->bind_addrinfo != NULL)
+			bindsock(s, sock, res, ctx->bind_address, ctx->bind_addrinfo);
+
+		attempt = g_new0(struct tcp_connect_attempt, 1);
+		attempt->ctx = ctx;
+		attempt->addr = res;
+		attempt->ioc = g_io_channel_unix_new(sock);
+		g_io_channel_set_close_on_unref(attempt->ioc, TRUE);
+		g_io_channel_set_flags(attempt->ioc, G_IO_FLAG_NONBLOCK, NULL);
+
+		if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
+			tcp_connect_succeeded(ctx, attempt);
+			return;
+		}
+
+		if (errno != EINPROGRESS) {
+			ctx->last_error = errno;
+			free_tcp_connect_attempt(attempt);
+			continue;
+		}
+
+		attempt->watch_id = g_io_add_watch(attempt->ioc,
+										   G_IO_OUT|G_IO_ERR|G_IO_HUP,
+										   tcp_connect_attempt_ready, attempt);
+		ctx->attempts = g_list_append(ctx->attempts, attempt);
+
+		/* Give this attempt a head start before racing the next address */
+		if (ctx->candidates != NULL)
+			ctx->delay_id = g_timeout_add(CONNECT_ATTEMPT_DELAY,
+										  tcp_connect_delay_expired, ctx);
+		return;
+	}
+
+	if (ctx->attempts == NULL)
+		tcp_connect_failed(ctx);
+}
+
+static void tcp_connect_lookups_done(struct tcp_connect_context *ctx)
+{
+	if (--ctx->pending_lookups > 0)
+		return;
+
+	if (ctx->lookup_failed || ctx->addrinfo == NULL) {
+		ctx->lookup_failed = TRUE;
+		tcp_connect_failed(ctx);
+		return;
+	}
+
+	ctx->candidates = interleave_address_families(ctx->addrinfo);
+	tcp_connect_next(ctx);
+}
+
+static void tcp_server_resolved(struct addrinfo *res, int error, gpointer userdata)
+{
+	struct tcp_connect_context *ctx = userdata;
+	struct tcp_server_config *cs = ctx->network->connection.data.tcp.current_server;
+
+	ctx->lookup = NULL;
+
+	if (error) {
+		network_log(LOG_ERROR, ctx->network, "Unable to lookup %s:%s %s",
+					cs->host, cs->port, gai_strerror(error));
+		ctx->lookup_failed = TRUE;
+	} else {
+		ctx->addrinfo = res;
+	}
+
+	tcp_connect_lookups_done(ctx);
+}
+
+static void tcp_bind_address_resolved(struct addrinfo *res, int error, gpointer userdata)
+{
+	struct tcp_connect_context *ctx = userdata;
+
+	ctx->bind_lookup = NULL;
+
+	/* Not fatal, we'll just connect from the default address */
+	if (error)
+		network_log(LOG_ERROR, ctx->network, "Unable to lookup %s: %s",
+					ctx->bind_address, gai_strerror(error));
+	else
+		ctx->bind_addrinfo = res;
+
+	tcp_connect_lookups_done(ctx);
+}
+
+static gboolean connect_current_tcp_server(struct irc_network *s)
+{
 	struct tcp_server_config *cs;
-	GIOChannel *ioc = NULL;
 	struct addrinfo hints;
-	struct addrinfo *addrinfo = NULL;
-	int error;
-	socklen_t size;
-	gboolean connect_finished = TRUE;
 	struct network_config *nc;
+	struct tcp_connect_context *ctx;
+	const char *bind_address;
 
 	g_assert(s != NULL);
 
@@ -441,6 +748,13 @@ static gboolean connect_current_tcp_server(struct irc_network *s)
 
 	network_log(LOG_INFO, s, "Connecting with %s:%s", cs->host, cs->port);
 
+	g_assert(s->connection.data.tcp.connect_context == NULL);
+
+	ctx = g_new0(struct tcp_connect_context, 1);
+	ctx->network = s;
+	s->connection.data.tcp.connect_context = ctx;
+	s->connection.state = NETWORK_CONNECTION_STATE_CONNECTING;
+
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = PF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
@@ -449,98 +763,217 @@ static gboolean connect_current_tcp_server(struct irc_network *s)
 	hints.ai_flags = AI_ADDRCONFIG;
 #endif
 
-	/* Lookup */
-	error = getaddrinfo(cs->host, cs->port, &hints, &addrinfo);
-	if (error) {
-		network_log(LOG_ERROR, s, "Unable to lookup %s:%s %s",
-					cs->host, cs->port, gai_strerror(error));
-		if (addrinfo != NULL)
-			freeaddrinfo(addrinfo);
-		return FALSE;
-	}
+	/* Lookups happen off the main loop; the connection attempts are
+	 * started once both have finished. */
+	if (cs->bind_address)
+		bind_address = cs->bind_address;
+	else
+		bind_address = nc->type_settings.tcp.default_bind_address;
 
-	/* Connect */
+	ctx->pending_lookups = (bind_address != NULL)?2:1;
+	ctx->bind_address = g_strdup(bind_address);
 
-	for (res = addrinfo; res; res = res->ai_next) {
+	if (bind_address != NULL)
+		ctx->bind_lookup = irc_resolve_async(bind_address, NULL, &hints,
+											 tcp_bind_address_resolved, ctx);
 
-		sock = socket(res->ai_family, res->ai_socktype,
-					  res->ai_protocol);
-		if (sock < 0) {
-			continue;
-		}
+	ctx->lookup = irc_resolve_async(cs->host, cs->port, &hints,
+									tcp_server_resolved, ctx);
 
-		if (cs->bind_address)
-			bindsock(s, sock, res, cs->bind_address, NULL);
-		else if (nc->type_settings.tcp.default_bind_address)
-			bindsock(s, sock, res, nc->type_settings.tcp.default_bind_address, NULL);
+	return TRUE;
+}
 
-		ioc = g_io_channel_unix_new(sock);
-		g_io_channel_set_flags(ioc, G_IO_FLAG_NONBLOCK, NULL);
+/* Networks waiting for a connect slot, highest priority first. */
+static GList *connect_queue = NULL;
+static guint connects_in_flight = 0;
+static guint connect_dispatch_id = 0;
 
-		if (connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
-			if (errno == EINPROGRESS) {
-				connect_finished = FALSE;
-				break;
-			}
-			g_io_channel_unref(ioc);
-			ioc = NULL;
-			continue;
-		}
+/**
+ * Determine how long to wait before the next connection attempt.
+ *
+ * The interval doubles with every consecutive failure, up to max_interval,
+ * and up to a quarter of it is added at random so that networks that lost
+ * their connection at the same time don't all reconnect at the same
+ * moment. The configured interval is never shortened.
+ *
+ * @param interval Base reconnect interval, in seconds
+ * @param max_interval Upper bound for the interval, in seconds
+ * @param attempts Number of consecutive failed attempts so far
+ * @return Delay in milliseconds
+ */
+guint irc_network_backoff_delay(int interval, int max_interval, guint attempts)
+{
+	guint64 base;
 
-		break;
-	}
+	if (interval <= 0)
+		return 0;
 
-	size = sizeof(struct sockaddr_storage);
-	g_assert(s->connection.data.tcp.local_name == NULL);
-	g_assert(s->connection.data.tcp.remote_name == NULL);
+	if (max_interval < interval)
+		max_interval = interval;
 
-	if (!res || !ioc) {
-		network_log(LOG_ERROR, s, "Unable to connect: %s", strerror(errno));
-		return FALSE;
-	}
+	base = interval;
+	while (attempts-- > 0 && base < max_interval)
+		base *= 2;
 
-	s->connection.data.tcp.remote_name = g_memdup2(res->ai_addr,
-												  res->ai_addrlen);
-	s->connection.data.tcp.local_name = g_malloc(size);
-	s->connection.data.tcp.namelen = getsockname(sock, s->connection.data.tcp.local_name, &size);
+	if (base > max_interval)
+		base = max_interval;
 
-	freeaddrinfo(addrinfo);
+	base *= 1000;
 
-	g_io_channel_set_close_on_unref(ioc, TRUE);
+	return base + (guint64)(g_random_double() * (base / 4));
+}
 
-	cs = s->connection.data.tcp.current_server;
-	if (cs->ssl) {
-#ifdef HAVE_GNUTLS
-		g_io_channel_set_close_on_unref(ioc, TRUE);
-		g_io_channel_set_flags(ioc, G_IO_FLAG_NONBLOCK, NULL);
+/**
+ * Number of networks that are currently setting up a connection.
+ */
+guint irc_network_connects_in_flight(void)
+{
+	return connects_in_flight;
+}
 
-		ioc = ssl_wrap_iochannel (ioc, SSL_TYPE_CLIENT,
-								 s->connection.data.tcp.current_server->host,
-								 s->ssl_credentials
-								 );
-		if (!ioc) {
-			network_report_disconnect(s, "Couldn't connect via server %s:%s", cs->host, cs->port);
-			reconnect(s);
-			return FALSE;
-		}
-#else
-		network_log(LOG_WARNING, s, "SSL enabled for %s:%s, but no SSL support loaded", cs->host, cs->port);
-#endif
+/**
+ * Networks that are waiting for a connect slot, in the order in
+ * which they will be connected.
+ */
+GList *irc_network_connect_queue(void)
+{
+	return connect_queue;
+}
+
+static gboolean connect_slot_available(struct irc_network *n)
+{
+	struct network_config *nc = n->private_data;
+	int max = DEFAULT_MAX_CONCURRENT_CONNECTS;
+
+	if (nc->global != NULL)
+		max = nc->global->max_concurrent_connects;
+
+	return (max <= 0 || connects_in_flight < (guint)max);
+}
+
+static gboolean dispatch_queued_connects(gpointer data);
+
+static void schedule_connect_dispatch(void)
+{
+	if (connect_dispatch_id == 0 && connect_queue != NULL)
+		connect_dispatch_id = g_idle_add(dispatch_queued_connects, NULL);
+}
+
+static void network_take_connect_slot(struct irc_network *n)
+{
+	if (n->connect_slot)
+		return;
+
+	n->connect_slot = TRUE;
+	connects_in_flight++;
+}
+
+static void network_release_connect_slot(struct irc_network *n)
+{
+	if (!n->connect_slot)
+		return;
+
+	n->connect_slot = FALSE;
+	g_assert(connects_in_flight > 0);
+	connects_in_flight--;
+
+	schedule_connect_dispatch();
+}
+
+static void network_dequeue_connect(struct irc_network *n)
+{
+	if (!n->connect_queued)
+		return;
+
+	connect_queue = g_list_remove(connect_queue, n);
+	n->connect_queued = FALSE;
+}
+
+static void network_queue_connect(struct irc_network *n)
+{
+	struct network_config *nc = n->private_data;
+	GList *gl;
+
+	g_assert(!n->connect_queued);
+
+	/* Networks with equal priority are connected in the order
+	 * in which they were queued */
+	for (gl = connect_queue; gl; gl = gl->next) {
+		struct irc_network *q = gl->data;
+		struct network_config *qc = q->private_data;
+		if (qc->connect_priority < nc->connect_priority)
+			break;
 	}
 
-	s->connection.state = NETWORK_CONNECTION_STATE_CONNECTING;
+	connect_queue = g_list_insert_before(connect_queue, gl, n);
+	n->connect_queued = TRUE;
 
-	if (!connect_finished) {
-		s->connection.data.tcp.connect_id = g_io_add_watch(ioc,
-												   G_IO_OUT|G_IO_ERR|G_IO_HUP,
-												   server_finish_connect, s);
-	} else {
-		server_finish_connect(ioc, G_IO_OUT, s);
+	schedule_connect_dispatch();
+}
+
+static void network_schedule_reconnect(struct irc_network *n)
+{
+	guint delay = irc_network_backoff_delay(n->reconnect_interval,
+											n->max_reconnect_interval,
+											n->reconnect_attempts);
+
+	n->reconnect_attempts++;
+	n->connection.state = NETWORK_CONNECTION_STATE_RECONNECT_PENDING;
+	n->reconnect_at = time(NULL) + delay / 1000;
+	network_log(LOG_INFO, n, "Reconnecting in %d seconds",
+				(delay + 500) / 1000);
+	n->reconnect_id = g_timeout_add(delay,
+									(GSourceFunc) delayed_connect_server, n);
+}
+
+static gboolean network_start_connect(struct irc_network *n)
+{
+	struct network_config *nc = n->private_data;
+
+	/* The slot is held until login has completed or the
+	 * connection is closed */
+	if (nc->type != NETWORK_VIRTUAL)
+		network_take_connect_slot(n);
+
+	if (connect_server(n))
+		return TRUE;
+
+	network_release_connect_slot(n);
+
+	if (n->connection.state == NETWORK_CONNECTION_STATE_RECONNECT_PENDING)
+		network_schedule_reconnect(n);
+
+	return FALSE;
+}
+
+static gboolean dispatch_queued_connects(gpointer data)
+{
+	connect_dispatch_id = 0;
+
+	while (connect_queue != NULL) {
+		struct irc_network *n = connect_queue->data;
+
+		if (!connect_slot_available(n))
+			break;
+
+		network_dequeue_connect(n);
+		network_start_connect(n);
 	}
 
-	g_io_channel_unref(ioc);
+	return FALSE;
+}
 
-	return TRUE;
+/**
+ * Mark login to a network as completed. This resets the reconnect
+ * backoff and lets the next queued network start connecting.
+ *
+ * @param n Network that has finished logging in
+ */
+void irc_network_login_complete(struct irc_network *n)
+{
+	n->connection.state = NETWORK_CONNECTION_STATE_MOTD_RECVD;
+	n->reconnect_attempts = 0;
+	network_release_connect_slot(n);
 }
 
 static void reconnect(struct irc_network *server)
@@ -560,12 +993,7 @@ static void reconnect(struct irc_network *server)
 	if (nc->type == NETWORK_TCP ||
 		nc->type == NETWORK_IOCHANNEL ||
 		nc->type == NETWORK_PROGRAM) {
-		server->connection.state = NETWORK_CONNECTION_STATE_RECONNECT_PENDING;
-		network_log(LOG_INFO, server, "Reconnecting in %d seconds",
-					server->reconnect_interval);
-		server->reconnect_id = g_timeout_add(1000 *
-								server->reconnect_interval,
-								(GSourceFunc) delayed_connect_server, server);
+		network_schedule_reconnect(server);
 	} else {
 		connect_server(server);
 	}
@@ -585,15 +1013,21 @@ static gboolean close_server(struct irc_network *n)
 
 	g_assert(n);
 
+	network_dequeue_connect(n);
+	network_release_connect_slot(n);
+
 	if (n->connection.state == NETWORK_CONNECTION_STATE_RECONNECT_PENDING) {
-		g_source_remove(n->reconnect_id);
+		if (n->reconnect_id > 0)
+			g_source_remove(n->reconnect_id);
 		n->reconnect_id = 0;
 		n->connection.state = NETWORK_CONNECTION_STATE_NOT_CONNECTED;
 	}
 
 	if (n->connection.state == NETWORK_CONNECTION_STATE_CONNECTING) {
-		g_source_remove(n->connection.data.tcp.connect_id);
-		n->connection.data.tcp.connect_id = 0;
+		if (n->connection.data.tcp.connect_context != NULL) {
+			free_tcp_connect_context(n->connection.data.tcp.connect_context);
+			n->connection.data.tcp.connect_context = NULL;
+		}
 		n->connection.state = NETWORK_CONNECTION_STATE_NOT_CONNECTED;
 		if (nc->type == NETWORK_TCP)
 			free_tcp_names(n);
@@ -695,7 +1129,6 @@ static gboolean server_finish_connect(GIOChannel *ioc, GIOCondition cond,
 	if (cond & G_IO_OUT) {
 		s->connection.state = NETWORK_CONNECTION_STATE_CONNECTED;
 
-		s->connection.data.tcp.connect_id = 0; /* Otherwise data will be queued */
 		if (!network_set_iochannel(s, ioc)) {
 			network_log(LOG_ERROR, s, "Failed to set IO channel after connection");
 			return FALSE;
@@ -849,8 +1282,9 @@ static gboolean connect_server(struct irc_network *s)
 static gboolean delayed_connect_server(struct irc_network *s)
 {
 	g_assert(s);
-	connect_server(s);
-	return (s->connection.state == NETWORK_CONNECTION_STATE_RECONNECT_PENDING);
+	s->reconnect_id = 0;
+	network_queue_connect(s);
+	return FALSE;
 }
 
 struct irc_network *irc_network_new(const struct irc_network_callbacks *callbacks, void *private_data)
@@ -862,6 +1296,7 @@ struct irc_network *irc_network_new(const struct irc_network_callbacks *callback
 	s->references = 1;
 	s->private_data = private_data;
 	s->reconnect_interval = ((struct network_config *)private_data)->reconnect_interval == -1?DEFAULT_RECONNECT_INTERVAL:((struct network_config *)private_data)->reconnect_interval;
+	s->max_reconnect_interval = ((struct network_config *)private_data)->max_reconnect_interval == -1?DEFAULT_MAX_RECONNECT_INTERVAL:((struct network_config *)private_data)->max_reconnect_interval;
 	s->info = network_info_init();
 	s->name = g_strdup(((struct network_config *)private_data)->name);
 	s->info->ircd = g_strdup("ctrlproxy");
@@ -886,7 +1321,14 @@ gboolean connect_network(struct irc_network *s)
 	g_assert(s->connection.state == NETWORK_CONNECTION_STATE_NOT_CONNECTED ||
 			 s->connection.state == NETWORK_CONNECTION_STATE_RECONNECT_PENDING);
 
-	return connect_server(s);
+	/* Explicit requests don't wait for the reconnect timer or the queue */
+	network_dequeue_connect(s);
+	if (s->reconnect_id > 0) {
+		g_source_remove(s->reconnect_id);
+		s->reconnect_id = 0;
+	}
+
+	return network_start_connect(s);
 }
 
 static void free_network(struct irc_network *s)
@@ -895,6 +1337,15 @@ static void free_network(struct irc_network *s)
 
 	nc = s->private_data;
 
+	network_dequeue_connect(s);
+	network_release_connect_slot(s);
+
+	if (s->worker != NULL) {
+		if (s->linestack != NULL)
+			linestack_set_worker(s->linestack, NULL);
+		irc_worker_free(s->worker);
+	}
+
 	free_network_info(s->info);
 	if (nc->type == NETWORK_TCP)
 		g_free(s->connection.data.tcp.last_disconnect_reason);
@@ -918,7 +1369,8 @@ static void free_network(struct irc_network *s)
 gboolean disconnect_network(struct irc_network *s)
 {
 	g_assert(s);
-	if (s->connection.state == NETWORK_CONNECTION_STATE_NOT_CONNECTED) {
+	if (s->connection.state == NETWORK_CONNECTION_STATE_NOT_CONNECTED &&
+		!s->connect_queued) {
 		return FALSE;
 	}
 
@@ -947,7 +1399,9 @@ struct virtual_network_ops *find_virtual_network(const char *name)
 }
 
 /**
- * Autoconnect to all the networks in a list.
+ * Autoconnect to all the networks in a list. Virtual networks are
+ * connected immediately, other networks are queued in priority order
+ * and connected as connect slots become available.
  *
  * @param networks GList with networks
  * @return TRUE
@@ -961,8 +1415,13 @@ gboolean autoconnect_networks(GList *networks)
 		struct network_config *nc = n->private_data;
 		g_assert(n);
 		g_assert(nc);
-		if (nc->autoconnect)
+		if (!nc->autoconnect)
+			continue;
+		if (nc->type == NETWORK_VIRTUAL)
 			connect_network(n);
+		else if (!n->connect_queued &&
+				 n->connection.state == NETWORK_CONNECTION_STATE_NOT_CONNECTED)
+			network_queue_connect(n);
 	}
 
 	return TRUE;
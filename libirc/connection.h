@@ -42,6 +42,7 @@ struct irc_network;
 struct irc_client;
 struct irc_line;
 struct linestack_context;
+struct irc_worker;
 
 enum irc_network_connection_state {
 		NETWORK_CONNECTION_STATE_NOT_CONNECTED = 0,
@@ -78,8 +79,8 @@ struct irc_network_connection {
 			char *last_disconnect_reason;
 			/** Source ID for function that regularly pings the network. */
 			gint ping_id;
-			/** Source ID for function that finishes connect. */
-			gint connect_id;
+			/** Lookup and connection attempts in progress, if any. */
+			struct tcp_connect_context *connect_context;
 		} tcp;
 	
 		struct {
@@ -129,6 +130,21 @@ struct irc_network {
 
 	int reconnect_interval;
 
+	/** Upper bound for reconnect_interval after repeated failures. */
+	int max_reconnect_interval;
+
+	/** Number of consecutive failed connection attempts. */
+	guint reconnect_attempts;
+
+	/** Time at which the pending reconnect timer expires. */
+	time_t reconnect_at;
+
+	/** Whether this network is waiting for a free connect slot. */
+	gboolean connect_queued;
+
+	/** Whether this network is occupying a connect slot. */
+	gboolean connect_slot;
+
 	/** External network state, when connected. */
 	struct irc_network_state *external_state;
 
@@ -146,6 +162,9 @@ struct irc_network {
 	/** How many linestack errors have occurred so far */
 	guint linestack_errors;
 
+	/** Worker thread for this network, or NULL. */
+	struct irc_worker *worker;
+
 	const struct irc_network_callbacks *callbacks;
 
 	struct query_stack *queries;
@@ -157,6 +176,10 @@ G_MODULE_EXPORT gboolean autoconnect_networks(GList *);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct irc_network *irc_network_new(const struct irc_network_callbacks *callbacks, void *private_data);
 G_MODULE_EXPORT gboolean connect_network(struct irc_network *);
 G_MODULE_EXPORT void irc_network_select_next_server(struct irc_network *n);
+G_MODULE_EXPORT void irc_network_login_complete(struct irc_network *n);
+G_MODULE_EXPORT guint irc_network_backoff_delay(int interval, int max_interval, guint attempts);
+G_MODULE_EXPORT guint irc_network_connects_in_flight(void);
+G_MODULE_EXPORT GList *irc_network_connect_queue(void);
 G_MODULE_EXPORT gboolean disconnect_network(struct irc_network *s);
 G_MODULE_EXPORT gboolean network_send_line(struct irc_network *s, struct irc_client *c, const struct irc_line *);
 G_MODULE_EXPORT gboolean network_send_args(struct irc_network *s, ...);
@@ -24,10 +24,27 @@
 
 #include "ssl.h"
 
+#if defined(HAVE_LINUX_TLS_H) && GNUTLS_VERSION_NUMBER >= 0x030400
+#define HAVE_KTLS 1
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
+
 gboolean ssl_supported = TRUE;
 
 #define DH_BITS 2048
 
+/* Servers rarely keep sessions around for longer than this */
+#define SESSION_CACHE_MAX_AGE (24 * 60 * 60)
+
 typedef struct {
 	gnutls_certificate_credentials_t cred;
 	gboolean have_ca_file;
@@ -41,9 +58,75 @@ typedef struct {
 	GNUTLSCred *cred;
 	char *hostname;
 	gboolean established;
+	gboolean ticket_stored;
 	SSLType type;
+	char *session_key;
+	gboolean ktls_tried;
+	/* Records are encrypted/decrypted by the kernel */
+	gboolean ktls_tx;
+	gboolean ktls_rx;
 } GNUTLSChannel;
 
+typedef struct {
+	gnutls_datum_t data;
+	time_t stored;
+} GNUTLSCachedSession;
+
+/* Client session data, by server, for resumption after reconnects */
+static GHashTable *session_cache = NULL;
+static guint resumed_handshakes = 0;
+static guint full_handshakes = 0;
+
+static gboolean kernel_tls = FALSE;
+static guint ktls_offloaded = 0;
+static guint ktls_fallbacks = 0;
+
+static void
+free_cached_session (GNUTLSCachedSession *cached)
+{
+	g_free (cached->data.data);
+	g_free (cached);
+}
+
+static GHashTable *
+get_session_cache (void)
+{
+	if (session_cache == NULL)
+		session_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+						       g_free, (GDestroyNotify) free_cached_session);
+	return session_cache;
+}
+
+static void
+session_cache_insert (const char *key, const void *data, gsize size,
+		      time_t stored)
+{
+	GNUTLSCachedSession *cached;
+
+	cached = g_new0 (GNUTLSCachedSession, 1);
+	cached->data.data = g_memdup2 (data, size);
+	cached->data.size = size;
+	cached->stored = stored;
+
+	g_hash_table_replace (get_session_cache (), g_strdup (key), cached);
+}
+
+static void
+session_cache_store (GNUTLSChannel *chan)
+{
+	gnutls_datum_t data;
+
+	if (chan->session_key == NULL)
+		return;
+
+	if (gnutls_session_get_data2 (chan->session, &data) != 0)
+		return;
+
+	session_cache_insert (chan->session_key, data.data, data.size,
+			      time (NULL));
+	gnutls_free (data.data);
+}
+
 static gboolean
 verify_certificate (gnutls_session_t session, const char *hostname, GError **err)
 {
@@ -134,6 +217,268 @@ verify_certificate (gnutls_session_t session, const char *hostname, GError **err
 
 #define GNUTLS_CHANNEL_NONBLOCKING(chan) (fcntl ((chan)->fd, F_GETFL, 0) & O_NONBLOCK)
 
+#ifdef HAVE_KTLS
+#define TLS_RECORD_ALERT 21
+#define TLS_RECORD_APPLICATION_DATA 23
+
+union ktls_crypto_info {
+	struct tls_crypto_info info;
+	struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+	struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+};
+
+/* The GCM structures only differ in key size. With TLS 1.2 the explicit
+ * part of the nonce is the record sequence number. */
+static gboolean
+ktls_fill_gcm (unsigned char *ci_iv, unsigned char *ci_salt,
+	       unsigned char *ci_key, gsize key_size, unsigned char *ci_seq,
+	       const gnutls_datum_t *iv, const gnutls_datum_t *key,
+	       const unsigned char *seq, gboolean tls13)
+{
+	if (key->size != key_size)
+		return FALSE;
+
+	if (tls13) {
+		if (iv->size != 12)
+			return FALSE;
+		memcpy (ci_salt, iv->data, 4);
+		memcpy (ci_iv, iv->data + 4, 8);
+	} else {
+		if (iv->size != 4)
+			return FALSE;
+		memcpy (ci_salt, iv->data, 4);
+		memcpy (ci_iv, seq, 8);
+	}
+
+	memcpy (ci_key, key->data, key_size);
+	memcpy (ci_seq, seq, 8);
+
+	return TRUE;
+}
+
+static gboolean
+ktls_crypto_info (gnutls_session_t session, gboolean read,
+		  union ktls_crypto_info *ci, socklen_t *len)
+{
+	gnutls_datum_t mac_key, iv, key;
+	unsigned char seq[8];
+	gboolean tls13;
+
+	memset (ci, 0, sizeof(*ci));
+
+	switch (gnutls_protocol_get_version (session)) {
+	case GNUTLS_TLS1_2:
+		ci->info.version = TLS_1_2_VERSION;
+		tls13 = FALSE;
+		break;
+#if GNUTLS_VERSION_NUMBER >= 0x030603 && defined(TLS_1_3_VERSION)
+	case GNUTLS_TLS1_3:
+		ci->info.version = TLS_1_3_VERSION;
+		tls13 = TRUE;
+		break;
+#endif
+	default:
+		return FALSE;
+	}
+
+	if (gnutls_record_get_state (session, read?1:0, &mac_key, &iv, &key,
+				     seq) < 0)
+		return FALSE;
+
+	switch (gnutls_cipher_get (session)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		*len = sizeof(ci->aes_gcm_128);
+		return ktls_fill_gcm (ci->aes_gcm_128.iv, ci->aes_gcm_128.salt,
+				      ci->aes_gcm_128.key,
+				      TLS_CIPHER_AES_GCM_128_KEY_SIZE,
+				      ci->aes_gcm_128.rec_seq,
+				      &iv, &key, seq, tls13);
+	case GNUTLS_CIPHER_AES_256_GCM:
+		ci->info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		*len = sizeof(ci->aes_gcm_256);
+		return ktls_fill_gcm (ci->aes_gcm_256.iv, ci->aes_gcm_256.salt,
+				      ci->aes_gcm_256.key,
+				      TLS_CIPHER_AES_GCM_256_KEY_SIZE,
+				      ci->aes_gcm_256.rec_seq,
+				      &iv, &key, seq, tls13);
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		if (key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE ||
+		    iv.size != TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE)
+			return FALSE;
+		ci->info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		*len = sizeof(ci->chacha20_poly1305);
+		memcpy (ci->chacha20_poly1305.iv, iv.data, iv.size);
+		memcpy (ci->chacha20_poly1305.key, key.data, key.size);
+		memcpy (ci->chacha20_poly1305.rec_seq, seq, 8);
+		return TRUE;
+#endif
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Hand the record layer over to the kernel once the handshake is done,
+ * if the kernel and the negotiated cipher allow it. Both directions are
+ * offloaded or neither: GnuTLS writes records of its own (alerts, and
+ * key update replies with TLS 1.3) that would bypass the kernel's
+ * sequence numbers if only sending was offloaded. That rules out TLS 1.3,
+ * where servers send session tickets and key updates after the
+ * handshake, and connections where GnuTLS already buffered records.
+ */
+static void
+ktls_setup (GNUTLSChannel *chan)
+{
+	union ktls_crypto_info tx, rx;
+	socklen_t tx_len, rx_len;
+
+	if (!kernel_tls || chan->ktls_tried)
+		return;
+
+	chan->ktls_tried = TRUE;
+
+	if (gnutls_protocol_get_version (chan->session) != GNUTLS_TLS1_2 ||
+	    gnutls_record_check_pending (chan->session) != 0 ||
+	    !ktls_crypto_info (chan->session, FALSE, &tx, &tx_len) ||
+	    !ktls_crypto_info (chan->session, TRUE, &rx, &rx_len) ||
+	    setsockopt (chan->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+		ktls_fallbacks++;
+		goto out;
+	}
+
+	/* Receiving first: if sending can't be offloaded afterwards GnuTLS
+	 * keeps writing to a plain socket, which is still consistent */
+	chan->ktls_rx = (setsockopt (chan->fd, SOL_TLS, TLS_RX, &rx, rx_len) == 0);
+	if (chan->ktls_rx)
+		chan->ktls_tx = (setsockopt (chan->fd, SOL_TLS, TLS_TX, &tx, tx_len) == 0);
+
+	if (chan->ktls_tx)
+		ktls_offloaded++;
+	else
+		ktls_fallbacks++;
+
+out:
+	memset (&tx, 0, sizeof(tx));
+	memset (&rx, 0, sizeof(rx));
+}
+
+static GIOStatus
+ktls_read (GNUTLSChannel *chan, gchar *buf, gsize count,
+	   gsize *bytes_read, GError **err)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	memset (&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = count;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		ret = recvmsg (chan->fd, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return G_IO_STATUS_AGAIN;
+
+	if (ret < 0) {
+		g_set_error (err, G_IO_CHANNEL_ERROR,
+			     g_io_channel_error_from_errno (errno),
+			     "%s", g_strerror (errno));
+		return G_IO_STATUS_ERROR;
+	}
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+	    *(unsigned char *)CMSG_DATA (cmsg) != TLS_RECORD_APPLICATION_DATA) {
+		/* Alerts all end the connection, close_notify included */
+		if (*(unsigned char *)CMSG_DATA (cmsg) == TLS_RECORD_ALERT)
+			return G_IO_STATUS_EOF;
+
+		g_set_error (err, G_IO_CHANNEL_ERROR,
+			     G_IO_CHANNEL_ERROR_FAILED,
+			     "Unexpected TLS record");
+		return G_IO_STATUS_ERROR;
+	}
+
+	*bytes_read = ret;
+
+	return (ret > 0) ? G_IO_STATUS_NORMAL : G_IO_STATUS_EOF;
+}
+
+static GIOStatus
+ktls_write (GNUTLSChannel *chan, const gchar *buf, gsize count,
+	    gsize *bytes_written, GError **err)
+{
+	ssize_t ret;
+
+	do {
+		ret = write (chan->fd, buf, count);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return G_IO_STATUS_AGAIN;
+
+	if (ret < 0) {
+		g_set_error (err, G_IO_CHANNEL_ERROR,
+			     g_io_channel_error_from_errno (errno),
+			     "%s", g_strerror (errno));
+		return G_IO_STATUS_ERROR;
+	}
+
+	*bytes_written = ret;
+
+	return G_IO_STATUS_NORMAL;
+}
+
+static void
+ktls_send_close_notify (GNUTLSChannel *chan)
+{
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	unsigned char alert[2] = { 1 /* warning */, 0 /* close_notify */ };
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+
+	memset (&msg, 0, sizeof(msg));
+	iov.iov_base = alert;
+	iov.iov_len = sizeof(alert);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN (sizeof(unsigned char));
+	*(unsigned char *)CMSG_DATA (cmsg) = TLS_RECORD_ALERT;
+
+	sendmsg (chan->fd, &msg, MSG_DONTWAIT);
+}
+#else
+static void
+ktls_setup (GNUTLSChannel *chan)
+{
+	if (kernel_tls && !chan->ktls_tried) {
+		chan->ktls_tried = TRUE;
+		ktls_fallbacks++;
+	}
+}
+#endif
+
 static GIOStatus
 do_handshake (GNUTLSChannel *chan, GError **err)
 {
@@ -168,6 +513,17 @@ again:
 	    !verify_certificate (chan->session, chan->hostname, err))
 		return G_IO_STATUS_ERROR;
 
+	if (chan->type == SSL_TYPE_CLIENT) {
+		if (gnutls_session_is_resumed (chan->session))
+			resumed_handshakes++;
+		else
+			full_handshakes++;
+
+		session_cache_store (chan);
+	}
+
+	ktls_setup (chan);
+
 	return G_IO_STATUS_NORMAL;
 }
 
@@ -196,9 +552,30 @@ again:
 		chan->established = TRUE;
 	}
 
+#ifdef HAVE_KTLS
+	if (chan->ktls_rx)
+		return ktls_read (chan, buf, count, bytes_read, err);
+#endif
+
 	result = gnutls_record_recv (chan->session, buf, count);
 
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	/* With TLS 1.3 the resumption ticket arrives after the handshake */
+	if (!chan->ticket_stored && chan->session_key != NULL &&
+	    (gnutls_session_get_flags (chan->session) & GNUTLS_SFLAGS_SESSION_TICKET)) {
+		session_cache_store (chan);
+		chan->ticket_stored = TRUE;
+	}
+#endif
+
 	if (result == GNUTLS_E_REHANDSHAKE) {
+		if (chan->ktls_tx) {
+			/* The kernel holds the sending keys now */
+			g_set_error (err, G_IO_CHANNEL_ERROR,
+				     G_IO_CHANNEL_ERROR_FAILED,
+				     "Renegotiation not supported with kernel TLS");
+			return G_IO_STATUS_ERROR;
+		}
 		chan->established = FALSE;
 		goto again;
 	}
@@ -250,6 +627,11 @@ again:
 		chan->established = TRUE;
 	}
 
+#ifdef HAVE_KTLS
+	if (chan->ktls_tx)
+		return ktls_write (chan, buf, count, bytes_written, err);
+#endif
+
 	result = gnutls_record_send (chan->session, buf, count);
 
 	/* This can't actually happen in response to a write, but... */
@@ -297,6 +679,11 @@ gnutls_close (GIOChannel  *channel,
 {
 	GNUTLSChannel *chan = (GNUTLSChannel *) channel;
 
+#ifdef HAVE_KTLS
+	if (chan->ktls_tx) {
+		ktls_send_close_notify (chan);
+	} else
+#endif
 	if (chan->established) {
 		int ret;
 
@@ -325,6 +712,7 @@ _gnutls_free (GIOChannel *channel)
 	g_io_channel_unref (chan->real_sock);
 	gnutls_deinit (chan->session);
 	g_free (chan->hostname);
+	g_free (chan->session_key);
 	g_free (chan);
 }
 
@@ -454,6 +842,233 @@ ssl_wrap_iochannel (GIOChannel *sock, SSLType type,
 	return NULL;
 }
 
+/**
+ * ssl_set_session_key:
+ * @channel: a client #GIOChannel returned by ssl_wrap_iochannel()
+ * @key: identifies the server, usually host and port
+ *
+ * Makes @channel try to resume a previous session with the server
+ * identified by @key, and remember the session negotiated by this
+ * channel for later connections. Must be called before any data is
+ * sent or received on @channel.
+ **/
+void
+ssl_set_session_key (GIOChannel *channel, const char *key)
+{
+	GNUTLSChannel *chan = (GNUTLSChannel *) channel;
+	GNUTLSCachedSession *cached;
+
+	g_return_if_fail (chan->type == SSL_TYPE_CLIENT);
+	g_return_if_fail (!chan->established);
+
+	g_free (chan->session_key);
+	chan->session_key = g_strdup (key);
+
+	cached = g_hash_table_lookup (get_session_cache (), key);
+	if (cached == NULL)
+		return;
+
+	if (cached->stored + SESSION_CACHE_MAX_AGE < time (NULL) ||
+	    gnutls_session_set_data (chan->session, cached->data.data,
+				     cached->data.size) != 0)
+		g_hash_table_remove (session_cache, key);
+}
+
+/**
+ * ssl_set_kernel_tls:
+ * @enabled: whether to use kernel TLS
+ *
+ * Sets whether channels that finish their handshake after this call
+ * let the kernel encrypt and decrypt records where possible. Channels
+ * fall back to GnuTLS if the kernel or the negotiated cipher does not
+ * support it.
+ **/
+void
+ssl_set_kernel_tls (gboolean enabled)
+{
+	kernel_tls = enabled;
+}
+
+/**
+ * ssl_kernel_tls_stats:
+ * @offloaded: location to store the number of channels using kernel TLS
+ * @fallbacks: location to store the number of channels that could not
+ **/
+void
+ssl_kernel_tls_stats (guint *offloaded, guint *fallbacks)
+{
+	*offloaded = ktls_offloaded;
+	*fallbacks = ktls_fallbacks;
+}
+
+/**
+ * ssl_session_cache_stats:
+ * @resumed: location to store the number of resumed client handshakes
+ * @full: location to store the number of full client handshakes
+ * @cached: location to store the number of servers with a cached session
+ **/
+void
+ssl_session_cache_stats (guint *resumed, guint *full, guint *cached)
+{
+	*resumed = resumed_handshakes;
+	*full = full_handshakes;
+	*cached = (session_cache == NULL)?0:g_hash_table_size (session_cache);
+}
+
+static GNUTLSCachedSession *
+session_cache_parse (GKeyFile *kf, const char *group, GError **err)
+{
+	GNUTLSCachedSession *cached;
+	GError *error = NULL;
+	gint64 stored;
+	char *encoded, *check;
+	guchar *data;
+	gsize size;
+
+	stored = g_key_file_get_int64 (kf, group, "stored", &error);
+	if (error != NULL) {
+		g_propagate_error (err, error);
+		return NULL;
+	}
+
+	encoded = g_key_file_get_string (kf, group, "data", err);
+	if (encoded == NULL)
+		return NULL;
+
+	/* g_base64_decode() skips anything it doesn't understand, so make
+	 * sure the data survives a round trip */
+	data = g_base64_decode (encoded, &size);
+	check = g_base64_encode (data, size);
+	if (size == 0 || strcmp (check, encoded) != 0) {
+		g_set_error (err, G_KEY_FILE_ERROR,
+			     G_KEY_FILE_ERROR_INVALID_VALUE,
+			     "Invalid session data for %s", group);
+		g_free (check);
+		g_free (encoded);
+		g_free (data);
+		return NULL;
+	}
+	g_free (check);
+	g_free (encoded);
+
+	cached = g_new0 (GNUTLSCachedSession, 1);
+	cached->data.data = data;
+	cached->data.size = size;
+	cached->stored = stored;
+
+	return cached;
+}
+
+/**
+ * ssl_session_cache_load:
+ * @path: file written by ssl_session_cache_save()
+ * @err: location to store error, if any
+ *
+ * Adds the sessions stored in @path to the session cache. Sessions that
+ * are too old to be resumed are skipped. A missing file is not an error;
+ * a damaged file is, and then none of its sessions are used.
+ **/
+gboolean
+ssl_session_cache_load (const char *path, GError **err)
+{
+	GKeyFile *kf;
+	GError *error = NULL;
+	GHashTable *loaded;
+	GHashTableIter iter;
+	gpointer key, value;
+	char **groups;
+	gsize i, ngroups;
+	time_t now = time (NULL);
+
+	kf = g_key_file_new ();
+
+	if (!g_key_file_load_from_file (kf, path, G_KEY_FILE_NONE, &error)) {
+		g_key_file_free (kf);
+		if (g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_error_free (error);
+			return TRUE;
+		}
+		g_propagate_error (err, error);
+		return FALSE;
+	}
+
+	loaded = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					(GDestroyNotify) free_cached_session);
+	groups = g_key_file_get_groups (kf, &ngroups);
+
+	for (i = 0; i < ngroups; i++) {
+		GNUTLSCachedSession *cached;
+
+		cached = session_cache_parse (kf, groups[i], &error);
+		if (cached == NULL)
+			break;
+
+		if (cached->stored + SESSION_CACHE_MAX_AGE < now)
+			free_cached_session (cached);
+		else
+			g_hash_table_replace (loaded, g_strdup (groups[i]), cached);
+	}
+
+	g_strfreev (groups);
+	g_key_file_free (kf);
+
+	if (error != NULL) {
+		g_hash_table_destroy (loaded);
+		g_propagate_error (err, error);
+		return FALSE;
+	}
+
+	g_hash_table_iter_init (&iter, loaded);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		g_hash_table_iter_steal (&iter);
+		g_hash_table_replace (get_session_cache (), key, value);
+	}
+	g_hash_table_destroy (loaded);
+
+	return TRUE;
+}
+
+/**
+ * ssl_session_cache_save:
+ * @path: file to write the session cache to
+ * @err: location to store error, if any
+ *
+ * Writes all sessions in the cache to @path. The file contains session
+ * secrets and is only readable by the current user.
+ **/
+gboolean
+ssl_session_cache_save (const char *path, GError **err)
+{
+	GKeyFile *kf;
+	GHashTableIter iter;
+	gpointer key, value;
+	char *contents;
+	gsize length;
+	gboolean ret;
+
+	kf = g_key_file_new ();
+
+	g_hash_table_iter_init (&iter, get_session_cache ());
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GNUTLSCachedSession *cached = value;
+		char *encoded;
+
+		encoded = g_base64_encode (cached->data.data, cached->data.size);
+		g_key_file_set_int64 (kf, key, "stored", cached->stored);
+		g_key_file_set_string (kf, key, "data", encoded);
+		g_free (encoded);
+	}
+
+	contents = g_key_file_to_data (kf, &length, NULL);
+	g_key_file_free (kf);
+
+	ret = g_file_set_contents_full (path, contents, length,
+					G_FILE_SET_CONTENTS_CONSISTENT, 0600, err);
+	g_free (contents);
+
+	return ret;
+}
+
 static gboolean gnutls_inited = FALSE;
 
 static void
@@ -183,6 +183,7 @@
 #define RPL_LOCALUSERS 265
 #define RPL_GLOBALUSERS 266
 #define RPL_WHOISSSL 275
+#define RPL_WHOISSECURE 671
 
 /* These are obsolete */
 #define RPL_STATSQLINE 217
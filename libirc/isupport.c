@@ -643,6 +643,37 @@ int irccmp(const struct irc_network_info *n, const char *a, const char *b)
 	return 0;
 }
 
+/**
+ * Convert a nick or channel name to lower case, using the case mapping of
+ * the network. Two names compare equal with irccmp() if and only if
+ * their folded forms are identical.
+ */
+char *irc_casefold(const struct irc_network_info *n, const char *s)
+{
+	char *ret = g_strdup(s);
+	char *p;
+	char last;
+
+	switch(n != NULL?n->casemapping:CASEMAP_UNKNOWN) {
+	case CASEMAP_ASCII:
+		last = 'Z';
+		break;
+	case CASEMAP_STRICT_RFC1459:
+		last = ']';
+		break;
+	default:
+		last = '^';
+		break;
+	}
+
+	for (p = ret; *p; p++) {
+		if (*p >= 'A' && *p <= last)
+			*p += 'a' - 'A';
+	}
+
+	return ret;
+}
+
 gboolean is_channelname(const char *name, const struct irc_network_info *n)
 {
 	g_assert(n != NULL);
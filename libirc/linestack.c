@@ -24,14 +24,28 @@
 #endif /* HAVE_CONFIG_H */
 
 #include "irc.h"
+#include "worker.h"
+#include "search.h"
 #include <string.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <glib/gstdio.h>
 #include <sys/stat.h>
 #include <inttypes.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* A line queued on the worker, until it can be read from the files */
+struct pending_line {
+	guint64 index;
+	time_t time;
+	guint64 state_line_index;
+	char *raw;
+};
 
 /**
  * A linestack instance.
@@ -44,7 +58,38 @@ struct linestack_context
 	GIOChannel *index_file;
 	int count;
 	int last_line_with_state;
-
+	/** Whether the linestack is reopened rather than truncated after a
+	 * restart, so snapshots have to be synced to disk. */
+	gboolean recover;
+	/** Worker that writes new lines, or NULL to write them directly. */
+	struct irc_worker *worker;
+	/** Lines queued on the worker that can't be read from the files yet,
+	 * and the number of lines that can. Readers use these rather than
+	 * waiting for the worker; pending_lock protects them. */
+	GArray *pending;
+	guint64 readable;
+	gboolean publish_queued;
+	GMutex pending_lock;
+	/** Number of lines written, and the first line of the block being
+	 * filled. Only used by the thread that writes lines. */
+	guint64 written;
+	guint64 block_first;
+	/** Backlog streams in progress. */
+	GList *streams;
+	/** Full-text index of the lines, and where it is saved. The index
+	 * is NULL until it has been loaded, and only kept if search has been
+	 * enabled with linestack_enable_search(). It is updated by the
+	 * worker if there is one, and search_lock protects it. */
+	gboolean search_enabled;
+	struct search_index *search;
+	char *search_file;
+	guint64 search_saved;
+	GMutex search_lock;
+	/** Whether lines are stored in compressed blocks. */
+	gboolean compressed;
+	/** Lines not yet written out as a block, and where it will go. */
+	GString *block;
+	guint64 block_offset;
 };
 
 /* Index file format
@@ -55,6 +100,36 @@ struct linestack_context
 
 #define INDEX_RECORD_SIZE (sizeof(guint64) + sizeof(time_t) + sizeof(guint64))
 #define STATE_DUMP_INTERVAL 1000
+#define SEARCH_SAVE_INTERVAL 50000
+#define SEARCH_READ_BLOCK 1024
+#define TRAVERSE_READ_BLOCK 1024
+
+/* Backlog streaming: lines sent per main loop iteration, and the number of
+ * lines that may be waiting in the client's send queue before pausing. */
+#define STREAM_CHUNK_LINES 100
+#define STREAM_MAX_QUEUED_LINES 200
+#define STREAM_BACKOFF_INTERVAL 100
+
+/*
+ * Compressed line files
+ *
+ * With compression enabled, the line file ("lines.zst") is a series of
+ * blocks: two 32-bit sizes (compressed and uncompressed) followed by
+ * about BLOCK_SIZE bytes of lines compressed with zstd. The offset of a
+ * line in the index is the offset of its block in the file shifted left
+ * by BLOCK_OFFSET_BITS, plus the offset of the line in the uncompressed
+ * block. Lines are collected in memory until the block is full, a
+ * snapshot is taken or the lines are synced for linestack_read_block(),
+ * so the block being filled is lost on a crash much like the lines
+ * buffered by the GIOChannel are without compression.
+ */
+#define BLOCK_OFFSET_BITS 16
+#define BLOCK_SIZE (1 << BLOCK_OFFSET_BITS)
+#define BLOCK_HEADER_SIZE (2 * sizeof(guint32))
+#define BLOCK_MAX_RAW_SIZE (16 * 1024 * 1024)
+#define BLOCK_COMPRESSION_LEVEL 3
+
+static const char *linestack_compression = "none";
 
 #define LF_CHECK_IO_STATUS(status)	if (status != G_IO_STATUS_NORMAL) { \
 		log_global(LOG_ERROR, "%s:%d: Unable to write to linestack file: %s", \
@@ -91,12 +166,529 @@ static gint64 g_io_channel_tell_position(GIOChannel *gio)
 	return lseek(fd, 0, SEEK_CUR);
 }
 
+/*
+ * Find the end of the line starting at offset in the line file.
+ *
+ * Returns the offset just past the terminating newline, or -1 if the line
+ * is incomplete.
+ */
+static off_t line_end(int fd, guint64 offset, off_t size)
+{
+	char buf[512];
+	off_t pos = offset;
+
+	while (pos < size) {
+		ssize_t n = pread(fd, buf, sizeof(buf), pos);
+		char *nl;
+		if (n <= 0)
+			return -1;
+		nl = memchr(buf, '\n', n);
+		if (nl != NULL)
+			return pos + (nl - buf) + 1;
+		pos += n;
+	}
+
+	return -1;
+}
+
+/**
+ * Select how lines are stored in newly created linestacks. Existing
+ * linestacks keep the format they were created with.
+ *
+ * @param name "none" or "zstd"
+ * @return whether the compression method is known and available
+ */
+gboolean linestack_set_compression(const char *name)
+{
+	if (!strcmp(name, "none")) {
+		linestack_compression = "none";
+		return TRUE;
+	}
+
+#ifdef HAVE_ZSTD
+	if (!strcmp(name, "zstd")) {
+		linestack_compression = "zstd";
+		return TRUE;
+	}
+#endif
+
+	return FALSE;
+}
+
+const char *linestack_get_compression(void)
+{
+	return linestack_compression;
+}
+
+static gboolean block_compress(const char *raw, gsize len, char **out,
+							   gsize *out_len, GError **error)
+{
+#ifdef HAVE_ZSTD
+	gsize ret;
+
+	*out = g_malloc(BLOCK_HEADER_SIZE + ZSTD_compressBound(len));
+	ret = ZSTD_compress(*out + BLOCK_HEADER_SIZE, ZSTD_compressBound(len),
+						raw, len, BLOCK_COMPRESSION_LEVEL);
+	if (ZSTD_isError(ret)) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"compressing block failed: %s", ZSTD_getErrorName(ret));
+		g_free(*out);
+		return FALSE;
+	}
+	*out_len = BLOCK_HEADER_SIZE + ret;
+	return TRUE;
+#else
+	g_set_error_literal(error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+						"compression not available");
+	return FALSE;
+#endif
+}
+
+static gboolean block_decompress(const char *in, gsize in_len, char *raw,
+								 gsize raw_len, GError **error)
+{
+#ifdef HAVE_ZSTD
+	gsize ret = ZSTD_decompress(raw, raw_len, in, in_len);
+
+	if (ZSTD_isError(ret) || ret != raw_len) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"decompressing block failed: %s",
+					ZSTD_isError(ret)?ZSTD_getErrorName(ret):"size mismatch");
+		return FALSE;
+	}
+	return TRUE;
+#else
+	g_set_error_literal(error, G_FILE_ERROR, G_FILE_ERROR_NOSYS,
+						"compression not available");
+	return FALSE;
+#endif
+}
+
+/*
+ * Compress the lines collected so far and append them to the line file
+ * as a block.
+ */
+static gboolean write_compressed_block(struct linestack_context *ctx,
+									   GError **error)
+{
+	int fd = g_io_channel_unix_get_fd(ctx->line_file);
+	guint32 header[2];
+	char *out;
+	gsize len;
+
+	if (ctx->block->len == 0)
+		return TRUE;
+
+	if (!block_compress(ctx->block->str, ctx->block->len, &out, &len, error))
+		return FALSE;
+
+	header[0] = len - BLOCK_HEADER_SIZE;
+	header[1] = ctx->block->len;
+	memcpy(out, header, BLOCK_HEADER_SIZE);
+
+	if (pwrite(fd, out, len, ctx->block_offset) != len) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"writing block failed: %s", g_strerror(errno));
+		g_free(out);
+		/* Don't leave a partial block for the next one to follow */
+		if (ftruncate(fd, ctx->block_offset) < 0)
+			g_warning("unable to truncate linestack: %s", g_strerror(errno));
+		return FALSE;
+	}
+	g_free(out);
+
+	ctx->block_offset += len;
+	ctx->block_first = ctx->written;
+	g_string_truncate(ctx->block, 0);
+	return TRUE;
+}
+
+static gboolean linestack_flush_block(struct linestack_context *ctx)
+{
+	GError *error = NULL;
+
+	if (!ctx->compressed)
+		return TRUE;
+
+	if (!write_compressed_block(ctx, &error)) {
+		log_global(LOG_ERROR, "Unable to write to linestack file: %s",
+				   error->message);
+		g_error_free(error);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Read and decompress the block at offset. The returned data is
+ * nul-terminated and owned by the caller.
+ */
+static gboolean read_compressed_block(int fd, guint64 offset, char **raw,
+									  gsize *raw_len, GError **error)
+{
+	guint32 header[2];
+	char *in;
+
+	if (pread(fd, header, BLOCK_HEADER_SIZE, offset) != BLOCK_HEADER_SIZE) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"reading block at %"PRIu64" failed", offset);
+		return FALSE;
+	}
+
+	if (header[0] > BLOCK_MAX_RAW_SIZE || header[1] > BLOCK_MAX_RAW_SIZE) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"block at %"PRIu64" is corrupt", offset);
+		return FALSE;
+	}
+
+	in = g_malloc(header[0]);
+	if (pread(fd, in, header[0], offset + BLOCK_HEADER_SIZE) != header[0]) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"reading block at %"PRIu64" failed", offset);
+		g_free(in);
+		return FALSE;
+	}
+
+	*raw = g_malloc(header[1] + 1);
+	if (!block_decompress(in, header[0], *raw, header[1], error)) {
+		g_free(in);
+		g_free(*raw);
+		return FALSE;
+	}
+	g_free(in);
+
+	(*raw)[header[1]] = '\0';
+	*raw_len = header[1];
+	return TRUE;
+}
+
+/*
+ * Copy the line starting at offset in a block, without line ending.
+ * Returns NULL if the line is incomplete.
+ */
+static char *block_line(const char *data, gsize len, gsize offset)
+{
+	const char *line, *nl;
+
+	if (offset >= len)
+		return NULL;
+
+	line = data + offset;
+	nl = memchr(line, '\n', len - offset);
+	if (nl == NULL)
+		return NULL;
+	if (nl > line && nl[-1] == '\r')
+		nl--;
+	return g_strndup(line, nl - line);
+}
+
+/*
+ * Find the end of the compressed block that holds the line at offset.
+ *
+ * Returns -1 if the block is incomplete or does not hold the line.
+ */
+static off_t block_end(int fd, guint64 offset, off_t size)
+{
+	guint64 block = offset >> BLOCK_OFFSET_BITS;
+	guint32 header[2];
+
+	if (block + BLOCK_HEADER_SIZE > size)
+		return -1;
+	if (pread(fd, header, BLOCK_HEADER_SIZE, block) != BLOCK_HEADER_SIZE)
+		return -1;
+	if ((offset & (BLOCK_SIZE - 1)) >= header[1] ||
+		block + BLOCK_HEADER_SIZE + header[0] > size)
+		return -1;
+
+	return block + BLOCK_HEADER_SIZE + header[0];
+}
+
+static gboolean report_search_error(gpointer data)
+{
+	char *message = data;
+	log_global(LOG_WARNING, "%s", message);
+	g_free(message);
+	return FALSE;
+}
+
+/*
+ * Write out lines buffered for the line and index files, so they can be
+ * read with linestack_read_block(). Has to be called from the thread
+ * that writes lines: the worker if there is one.
+ */
+static gboolean flush_files(struct linestack_context *ctx, GError **error)
+{
+	if (ctx->compressed && !write_compressed_block(ctx, error))
+		return FALSE;
+
+	if (g_io_channel_flush(ctx->line_file, error) != G_IO_STATUS_NORMAL)
+		return FALSE;
+
+	if (g_io_channel_flush(ctx->index_file, error) != G_IO_STATUS_NORMAL)
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Load the search index saved when the linestack was last closed, and
+ * add the lines before line "to" that were written after that. If there
+ * is no usable index, it is rebuilt from all lines. This runs on the
+ * worker if there is one, so problems are logged from the main loop.
+ */
+static void linestack_open_search(struct linestack_context *ctx, guint64 to)
+{
+	struct search_index *search = NULL;
+	GError *error = NULL;
+	GArray *entries;
+	guint64 from;
+	guint i;
+
+	if (!flush_files(ctx, &error)) {
+		irc_main_invoke(report_search_error,
+				g_strdup_printf("Unable to index linestack: %s",
+								error->message));
+		g_error_free(error);
+		error = NULL;
+	}
+
+	if (g_file_test(ctx->search_file, G_FILE_TEST_EXISTS)) {
+		search = search_index_load(ctx->search_file, &error);
+		if (search == NULL) {
+			irc_main_invoke(report_search_error,
+					g_strdup_printf("Rebuilding search index: %s",
+									error->message));
+			g_error_free(error);
+			error = NULL;
+		} else if (search_index_get_lines(search) > to) {
+			irc_main_invoke(report_search_error,
+					g_strdup_printf("Search index `%s' does not match "
+									"linestack, rebuilding", ctx->search_file));
+			search_index_free(search);
+			search = NULL;
+		}
+	}
+
+	if (search == NULL)
+		search = search_index_new();
+
+	from = search_index_get_lines(search);
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	while (from < to) {
+		if (!linestack_read_block(ctx, &from, to, 0, 0,
+								  SEARCH_READ_BLOCK, entries, &error)) {
+			irc_main_invoke(report_search_error,
+					g_strdup_printf("Unable to index linestack: %s",
+									error->message));
+			g_error_free(error);
+			break;
+		}
+
+		for (i = 0; i < entries->len; i++) {
+			struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+			struct irc_line *l = irc_parse_line(e->raw);
+			if (l != NULL) {
+				search_index_add_line(search, e->index, l);
+				free_line(l);
+			}
+			g_free(e->raw);
+		}
+		g_array_set_size(entries, 0);
+	}
+	g_array_free(entries, TRUE);
+
+	/* Lines that could not be read are not searchable */
+	search_index_set_lines(search, to);
+
+	g_mutex_lock(&ctx->search_lock);
+	ctx->search = search;
+	ctx->search_saved = to;
+	g_mutex_unlock(&ctx->search_lock);
+}
+
+static void linestack_save_search(struct linestack_context *ctx)
+{
+	GError *error = NULL;
+
+	g_mutex_lock(&ctx->search_lock);
+	if (!search_index_save(ctx->search, ctx->search_file, &error)) {
+		irc_main_invoke(report_search_error,
+				g_strdup_printf("Unable to save search index: %s",
+								error->message));
+		g_error_free(error);
+	}
+	ctx->search_saved = search_index_get_lines(ctx->search);
+	g_mutex_unlock(&ctx->search_lock);
+}
+
+/*
+ * Add a line to the search index, saving the index every now and then.
+ * Called from whichever thread writes lines.
+ */
+static void linestack_search_add(struct linestack_context *ctx,
+								 guint64 index, const struct irc_line *l)
+{
+	if (ctx->search == NULL)
+		return;
+
+	g_mutex_lock(&ctx->search_lock);
+	search_index_add_line(ctx->search, index, l);
+	g_mutex_unlock(&ctx->search_lock);
+
+	if (index + 1 >= ctx->search_saved + SEARCH_SAVE_INTERVAL)
+		linestack_save_search(ctx);
+}
+
+struct open_search_job {
+	struct linestack_context *ctx;
+	guint64 to;
+};
+
+static void run_open_search_job(void *data)
+{
+	struct open_search_job *job = data;
+
+	linestack_open_search(job->ctx, job->to);
+}
+
+/**
+ * Keep a full-text index of the lines in a linestack, for
+ * linestack_search(). The index is loaded or rebuilt on the worker if
+ * there is one, so it may not be available right away.
+ *
+ * @param ctx Linestack context
+ */
+void linestack_enable_search(struct linestack_context *ctx)
+{
+	struct open_search_job *job;
+
+	if (ctx->search_enabled)
+		return;
+
+	ctx->search_enabled = TRUE;
+
+	if (ctx->worker == NULL) {
+		linestack_open_search(ctx, ctx->count);
+		return;
+	}
+
+	job = g_new0(struct open_search_job, 1);
+	job->ctx = ctx;
+	job->to = ctx->count;
+	irc_worker_push(ctx->worker, run_open_search_job, job, g_free);
+}
+
+/*
+ * Reopen an existing linestack after a restart or crash.
+ *
+ * Lines are appended to the line file and index file independently, so
+ * after a crash either may have a torn or missing tail. Walk back from the
+ * last index record until one points at a complete line and refers to a
+ * snapshot that exists, then cut both files off right after it. Usually
+ * only the last record or two have to be looked at.
+ */
+static gboolean linestack_recover(struct linestack_context *data)
+{
+	int index_fd = g_io_channel_unix_get_fd(data->index_file);
+	int line_fd = g_io_channel_unix_get_fd(data->line_file);
+	struct stat st;
+	off_t line_size, end = 0;
+	guint64 count, state_index = 0, dropped = 0;
+	const char *fname;
+	GDir *dir;
+
+	if (fstat(index_fd, &st) < 0) {
+		log_global(LOG_WARNING, "Unable to stat linestack index: %s",
+				   strerror(errno));
+		return FALSE;
+	}
+	count = st.st_size / INDEX_RECORD_SIZE;
+
+	if (fstat(line_fd, &st) < 0) {
+		log_global(LOG_WARNING, "Unable to stat linestack lines: %s",
+				   strerror(errno));
+		return FALSE;
+	}
+	line_size = st.st_size;
+
+	while (count > 0) {
+		guint64 offset;
+		off_t record = (count - 1) * INDEX_RECORD_SIZE;
+		char *path;
+		gboolean have_state;
+
+		if (pread(index_fd, &offset, sizeof(guint64), record) != sizeof(guint64) ||
+			pread(index_fd, &state_index, sizeof(guint64),
+				  record + sizeof(guint64) + sizeof(time_t)) != sizeof(guint64)) {
+			log_global(LOG_WARNING, "Unable to read linestack index: %s",
+					   strerror(errno));
+			return FALSE;
+		}
+
+		path = state_path(data, state_index);
+		have_state = g_file_test(path, G_FILE_TEST_IS_REGULAR);
+		g_free(path);
+
+		if (have_state && state_index < count) {
+			if (data->compressed)
+				end = block_end(line_fd, offset, line_size);
+			else
+				end = line_end(line_fd, offset, line_size);
+			if (end >= 0)
+				break;
+		}
+
+		count--;
+		dropped++;
+	}
+
+	if (count == 0) {
+		end = 0;
+		state_index = 0;
+	}
+
+	if (ftruncate(index_fd, count * INDEX_RECORD_SIZE) < 0 ||
+		ftruncate(line_fd, end) < 0) {
+		log_global(LOG_WARNING, "Unable to truncate linestack: %s",
+				   strerror(errno));
+		return FALSE;
+	}
+
+	/* Snapshots beyond the last line were taken after the lines that
+	 * were just dropped, or never finished writing. */
+	dir = g_dir_open(data->state_dir, 0, NULL);
+	if (dir != NULL) {
+		while ((fname = g_dir_read_name(dir))) {
+			char *endptr;
+			guint64 id = g_ascii_strtoull(fname, &endptr, 10);
+			if (*endptr != '\0' || id > count) {
+				char *path = g_build_filename(data->state_dir, fname, NULL);
+				g_unlink(path);
+				g_free(path);
+			}
+		}
+		g_dir_close(dir);
+	}
+
+	data->count = count;
+	data->last_line_with_state = state_index;
+	data->block_offset = end;
+
+	if (dropped > 0 || end != line_size)
+		log_global(LOG_INFO, "Recovered linestack with %"PRIu64" lines, "
+				   "dropped %"PRIu64" incomplete entries", count, dropped);
+
+	return TRUE;
+}
+
 struct linestack_context *create_linestack(const char *data_dir,
 										   gboolean truncate,
 										   const struct irc_network_state *state)
 {
 	struct linestack_context *data = g_new0(struct linestack_context, 1);
-	char *data_file;
+	char *data_file, *plain_file, *compressed_file;
 	char *index_file, *state_file;
 	GError *error = NULL;
 	const char *fname;
@@ -104,8 +696,39 @@ struct linestack_context *create_linestack(const char *data_dir,
 	const char *mode;
 
 	g_mkdir(data_dir, 0700);
-	data_file = g_build_filename(data_dir, "lines", NULL);
-	g_assert(data_file != NULL);
+	data->recover = !truncate;
+	plain_file = g_build_filename(data_dir, "lines", NULL);
+	compressed_file = g_build_filename(data_dir, "lines.zst", NULL);
+
+	/* An existing linestack keeps its format until it is truncated */
+	if (!truncate && g_file_test(compressed_file, G_FILE_TEST_EXISTS))
+		data->compressed = TRUE;
+	else if (!truncate && g_file_test(plain_file, G_FILE_TEST_EXISTS))
+		data->compressed = FALSE;
+	else
+		data->compressed = !strcmp(linestack_compression, "zstd");
+
+#ifndef HAVE_ZSTD
+	if (data->compressed) {
+		log_global(LOG_WARNING, "Unable to open `%s': compressed linestacks "
+				   "are not supported", compressed_file);
+		g_free(plain_file);
+		g_free(compressed_file);
+		g_free(data);
+		return NULL;
+	}
+#endif
+
+	if (data->compressed) {
+		data_file = compressed_file;
+		g_unlink(plain_file);
+		g_free(plain_file);
+		data->block = g_string_sized_new(BLOCK_SIZE + 1024);
+	} else {
+		data_file = plain_file;
+		g_unlink(compressed_file);
+		g_free(compressed_file);
+	}
 
 	if (truncate)
 		mode = "w+";
@@ -150,6 +773,12 @@ struct linestack_context *create_linestack(const char *data_dir,
 
 	if (!truncate) {
 		GIOStatus status;
+
+		if (!linestack_recover(data)) {
+			g_free(data);
+			return NULL;
+		}
+
 		status = g_io_channel_seek_position(data->index_file, 0, G_SEEK_END,
 											&error);
 		if (status != G_IO_STATUS_NORMAL) {
@@ -169,11 +798,6 @@ struct linestack_context *create_linestack(const char *data_dir,
 			g_free(data);
 			return NULL;
 		}
-
-		data->count = g_io_channel_tell_position(data->index_file) / INDEX_RECORD_SIZE;
-
-		/* FIXME: Write the diff between the previously stored state and
-		 * the state to store now. */
 	} else {
 		dir = g_dir_open(data->state_dir, 0, &error);
 		if (dir == NULL) {
@@ -193,74 +817,252 @@ struct linestack_context *create_linestack(const char *data_dir,
 		g_dir_close(dir);
 	}
 
-	if (!file_insert_state(data, state, 0)) {
+	if (!file_insert_state(data, state, data->count)) {
 		log_global(LOG_WARNING, "Unable to insert state");
 		g_free(data);
 		return NULL;
 	}
+
+	g_mutex_init(&data->search_lock);
+	g_mutex_init(&data->pending_lock);
+	data->pending = g_array_new(FALSE, FALSE, sizeof(struct pending_line));
+	data->written = data->block_first = data->readable = data->count;
+	data->search_file = g_build_filename(data_dir, "search", NULL);
+	if (truncate)
+		g_unlink(data->search_file);
+
 	return data;
 }
 
-void free_linestack_context(struct linestack_context *data)
+/*
+ * Drop pending lines before line "to". Called with pending_lock held, or
+ * while the worker is idle.
+ */
+static void clear_pending(struct linestack_context *ctx, guint64 to)
 {
-	g_io_channel_unref(data->line_file);
-	g_io_channel_unref(data->index_file);
-	g_free(data->state_dir);
-	g_free(data);
+	guint n;
+
+	for (n = 0; n < ctx->pending->len; n++) {
+		struct pending_line *p = &g_array_index(ctx->pending,
+												struct pending_line, n);
+		if (p->index >= to)
+			break;
+		g_free(p->raw);
+	}
+	g_array_remove_range(ctx->pending, 0, n);
 }
 
-struct irc_network_state *linestack_get_state(
-		struct linestack_context *nd, linestack_marker to_index)
+/*
+ * Copy the pending lines from *from up to "to", called with
+ * pending_lock held.
+ */
+static gboolean read_pending(struct linestack_context *nd, guint64 *from,
+							 guint64 to, time_t since, time_t until,
+							 guint max, GArray *entries, GError **error)
 {
-	struct irc_network_state *ret;
-	gint64 t;
-	guint64 state_index;
-	GError *error = NULL;
-	GIOStatus status;
-	char *data_file;
-	GIOChannel *state_file;
-
-	g_assert(nd != NULL);
+	guint64 first, i, end = MIN(to, *from + max);
 
-	if (nd == NULL)
-		return NULL;
+	first = (nd->pending->len == 0)?nd->readable:
+		g_array_index(nd->pending, struct pending_line, 0).index;
 
-	/* Flush channel before reading otherwise data corruption may occur */
-	status = g_io_channel_flush(nd->line_file, &error);
-	LF_CHECK_IO_STATUS(status);
+	for (i = *from; i < end && i - first < nd->pending->len; i++) {
+		struct pending_line *p = &g_array_index(nd->pending,
+												struct pending_line, i - first);
+		struct linestack_entry e;
 
-	status = g_io_channel_flush(nd->index_file, &error);
-	LF_CHECK_IO_STATUS(status);
+		if (p->time < since || (until != 0 && p->time >= until))
+			continue;
 
-	if (to_index != NULL) {
-		t = (*to_index)-1;
-		status = g_io_channel_seek_position(nd->index_file,
-			t * INDEX_RECORD_SIZE + sizeof(guint64) + sizeof(time_t),
-			G_SEEK_SET, &error);
-		LF_CHECK_IO_STATUS(status);
-		status = g_io_channel_read_chars(nd->index_file, (void *)&state_index,
-										 sizeof(guint64), NULL, &error);
-		if (status == G_IO_STATUS_ERROR) {
-			log_global(LOG_ERROR, "Unable to ready entry %"PRIi64" in index: %s",
-					   t, error->message);
-			g_error_free(error);
-			return NULL;
-		} else if (status == G_IO_STATUS_EOF) {
-			log_global(LOG_ERROR, "EOF reading entry %"PRIi64" in index", t);
-			return NULL;
-		}
+		e.index = p->index;
+		e.time = p->time;
+		e.raw = g_strdup(p->raw);
+		g_array_append_val(entries, e);
+	}
 
-		/* Go back to the end of the index file */
-		status = g_io_channel_seek_position(nd->index_file, 0, G_SEEK_END,
-											&error);
-		LF_CHECK_IO_STATUS(status);
-	} else {
-		state_index = nd->last_line_with_state;
+	if (i == *from) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"line %"PRIu64" does not exist", *from);
+		return FALSE;
 	}
 
-	data_file = state_path(nd, state_index);
+	*from = i;
+	return TRUE;
+}
+
+/**
+ * Wait for any lines queued on the worker to be written.
+ */
+void linestack_flush(struct linestack_context *ctx)
+{
+	if (ctx->worker != NULL)
+		irc_worker_flush(ctx->worker);
+}
+
+/**
+ * Make all lines inserted so far available to linestack_read_block().
+ * Lines written directly are flushed to disk; lines queued on a worker
+ * are read from memory until the worker has written them out, so this
+ * doesn't wait for the worker.
+ */
+gboolean linestack_sync(struct linestack_context *ctx)
+{
+	GError *error = NULL;
+	GIOStatus status;
+
+	if (ctx->worker != NULL)
+		return TRUE;
+
+	if (!linestack_flush_block(ctx))
+		return FALSE;
+
+	status = g_io_channel_flush(ctx->line_file, &error);
+	LF_CHECK_IO_STATUS(status);
+
+	status = g_io_channel_flush(ctx->index_file, &error);
+	LF_CHECK_IO_STATUS(status);
+
+	return TRUE;
+}
+
+/**
+ * Write new lines from a worker thread rather than from the main loop.
+ *
+ * @param ctx Linestack context
+ * @param worker Worker to use, or NULL to write lines directly
+ */
+void linestack_set_worker(struct linestack_context *ctx,
+						  struct irc_worker *worker)
+{
+	GError *error = NULL;
+
+	linestack_flush(ctx);
+
+	/* Everything written so far has to be readable from the files */
+	if (!flush_files(ctx, &error)) {
+		log_global(LOG_ERROR, "Unable to write to linestack file: %s",
+				   error->message);
+		g_error_free(error);
+	}
+	clear_pending(ctx, G_MAXUINT64);
+	ctx->readable = ctx->count;
+
+	ctx->worker = worker;
+}
+
+struct linestack_stream;
+static void free_stream(struct linestack_stream *stream);
+
+void free_linestack_context(struct linestack_context *data)
+{
+	while (data->streams != NULL)
+		free_stream(data->streams->data);
+	linestack_flush(data);
+	clear_pending(data, G_MAXUINT64);
+	g_array_free(data->pending, TRUE);
+	g_mutex_clear(&data->pending_lock);
+	if (data->compressed) {
+		linestack_flush_block(data);
+		g_string_free(data->block, TRUE);
+	}
+	if (data->search != NULL) {
+		linestack_save_search(data);
+		search_index_free(data->search);
+	}
+	g_mutex_clear(&data->search_lock);
+	g_free(data->search_file);
+	g_io_channel_unref(data->line_file);
+	g_io_channel_unref(data->index_file);
+	g_free(data->state_dir);
+	g_free(data);
+}
+
+/*
+ * Find the snapshot that the state after line i is based on, from the
+ * pending lines if the line hasn't been written out yet.
+ */
+static gboolean read_state_index(struct linestack_context *nd, guint64 i,
+								 guint64 *state_index)
+{
+	int fd = g_io_channel_unix_get_fd(nd->index_file);
+
+	if (nd->worker != NULL) {
+		g_mutex_lock(&nd->pending_lock);
+		if (i >= nd->readable && nd->pending->len > 0) {
+			guint64 first = g_array_index(nd->pending,
+										  struct pending_line, 0).index;
+			if (i >= first && i - first < nd->pending->len) {
+				*state_index = g_array_index(nd->pending, struct pending_line,
+											 i - first).state_line_index;
+				g_mutex_unlock(&nd->pending_lock);
+				return TRUE;
+			}
+		}
+		g_mutex_unlock(&nd->pending_lock);
+	}
+
+	return pread(fd, state_index, sizeof(guint64),
+				 i * INDEX_RECORD_SIZE + sizeof(guint64) + sizeof(time_t))
+		== sizeof(guint64);
+}
+
+/*
+ * Open a snapshot. One taken while lines are written on a worker may not
+ * have been moved into place by the worker yet.
+ */
+static GIOChannel *open_state_file(struct linestack_context *nd,
+								   const char *data_file, GError **error)
+{
+	GIOChannel *ret;
+	char *tmp_file;
+
+	ret = g_io_channel_new_file(data_file, "r", error);
+	if (ret != NULL || nd->worker == NULL)
+		return ret;
+
+	tmp_file = g_strdup_printf("%s.tmp", data_file);
+	ret = g_io_channel_new_file(tmp_file, "r", NULL);
+	g_free(tmp_file);
+
+	/* The worker may have moved it in the meantime */
+	if (ret == NULL)
+		ret = g_io_channel_new_file(data_file, "r", NULL);
+
+	if (ret != NULL)
+		g_clear_error(error);
 
-	state_file = g_io_channel_new_file(data_file, "r", &error);
+	return ret;
+}
+
+struct irc_network_state *linestack_get_state(
+		struct linestack_context *nd, linestack_marker to_index)
+{
+	struct irc_network_state *ret;
+	guint64 state_index;
+	GError *error = NULL;
+	char *data_file;
+	GIOChannel *state_file;
+
+	g_assert(nd != NULL);
+
+	if (nd == NULL)
+		return NULL;
+
+	if (!linestack_sync(nd))
+		return NULL;
+
+	if (to_index != NULL) {
+		if (!read_state_index(nd, (*to_index)-1, &state_index)) {
+			log_global(LOG_ERROR, "Unable to read entry %"PRIi64" in index",
+					   (*to_index)-1);
+			return NULL;
+		}
+	} else {
+		state_index = nd->last_line_with_state;
+	}
+
+	data_file = state_path(nd, state_index);
+
+	state_file = open_state_file(nd, data_file, &error);
 	if (state_file == NULL) {
 		log_global(LOG_WARNING, "Error opening `%s': %s",
 						  data_file, error->message);
@@ -297,107 +1099,272 @@ gboolean linestack_read_entry(struct linestack_context *nd,
 							  time_t *time
 							 )
 {
-	guint64 offset;
 	GError *error = NULL;
-	gchar *raw = NULL;
-	GIOStatus status;
+	GArray *entries;
+	struct linestack_entry *e;
 
-	status = g_io_channel_seek_position(nd->index_file,
-										i * INDEX_RECORD_SIZE,
-										G_SEEK_SET, &error);
-	if (status != G_IO_STATUS_NORMAL) {
-		log_global(LOG_WARNING, "seeking line %"PRIi64" in index failed: %s", i,
-				   error->message);
-		g_error_free(error);
+	if (!linestack_sync(nd))
 		return FALSE;
-	}
 
-	status = g_io_channel_read_chars(nd->index_file, (void *)&offset,
-									 sizeof(guint64), NULL, &error);
-	if (status != G_IO_STATUS_NORMAL) {
-		log_global(LOG_WARNING, "reading line %"PRIi64" in index failed: %s", i,
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	if (!linestack_read_block(nd, &i, i + 1, 0, 0, 1, entries, &error)) {
+		log_global(LOG_WARNING, "reading line %"PRIi64" failed: %s", i,
 				   error->message);
 		g_error_free(error);
+		g_array_free(entries, TRUE);
 		return FALSE;
 	}
 
-	status = g_io_channel_read_chars(nd->index_file, (void *)time,
-									 sizeof(time_t), NULL, &error);
-	if (status != G_IO_STATUS_NORMAL) {
-		log_global(LOG_WARNING, "reading time %"PRIi64" in index failed: %s", i,
-				   error->message);
-		g_error_free(error);
+	if (entries->len == 0) {
+		log_global(LOG_WARNING, "line %"PRIi64" does not exist", i);
+		g_array_free(entries, TRUE);
 		return FALSE;
 	}
 
-	status = g_io_channel_seek_position(nd->line_file, offset, G_SEEK_SET,
-										&error);
-	if (status != G_IO_STATUS_NORMAL) {
-		log_global(LOG_WARNING, "seeking line %"PRIi64" (%"PRIi64") in data failed: %s",
-				   i, offset, error->message);
-		g_error_free(error);
-		return FALSE;
+	e = &g_array_index(entries, struct linestack_entry, 0);
+	*line = irc_parse_line(e->raw);
+	*time = e->time;
+	g_free(e->raw);
+	g_array_free(entries, TRUE);
+
+	return TRUE;
+}
+
+static gboolean read_compressed_lines(int fd, GArray *entries, guint first,
+									  const guint64 *offsets, GError **error)
+{
+	guint64 current = G_MAXUINT64;
+	char *data = NULL;
+	gsize len = 0;
+	guint i;
+
+	for (i = first; i < entries->len; i++) {
+		struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+		guint64 block = offsets[i - first] >> BLOCK_OFFSET_BITS;
+
+		if (block != current) {
+			g_free(data);
+			data = NULL;
+			if (!read_compressed_block(fd, block, &data, &len, error))
+				return FALSE;
+			current = block;
+		}
+
+		e->raw = block_line(data, len, offsets[i - first] & (BLOCK_SIZE - 1));
+		if (e->raw == NULL) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+						"line %"PRIu64" is incomplete", e->index);
+			g_free(data);
+			return FALSE;
+		}
 	}
 
-	status = g_io_channel_read_line(nd->line_file, &raw, NULL, NULL, &error);
-	if (status == G_IO_STATUS_ERROR) {
-		log_global(LOG_WARNING, "read_line() failed: %s", error->message);
-		g_error_free(error);
+	g_free(data);
+	return TRUE;
+}
+
+/**
+ * Read a block of raw entries.
+ *
+ * Reads up to max index records starting at *from with a single read,
+ * and the lines they refer to with another, without touching the file
+ * positions of the linestack. This does not log or use any other global
+ * state, so it can be run without holding locks the caller takes around
+ * other linestack calls; lines written directly have to be flushed with
+ * linestack_sync() first. Lines queued on a worker that haven't been
+ * written out yet are copied from memory, and are returned in a
+ * separate call from the lines before them.
+ *
+ * @param nd Linestack context
+ * @param from Index of the first entry to read, advanced past the
+ *             entries that were read
+ * @param to Index of the entry to stop at
+ * @param since Skip entries older than this time
+ * @param until Skip entries at or after this time, or 0 for no limit
+ * @param max Maximum number of index records to read
+ * @param entries Array of struct linestack_entry to append to. The raw
+ *                lines are owned by the caller.
+ * @return FALSE if the files could not be read or are inconsistent
+ */
+gboolean linestack_read_block(struct linestack_context *nd, guint64 *from,
+							  guint64 to, time_t since, time_t until,
+							  guint max, GArray *entries, GError **error)
+{
+	int index_fd = g_io_channel_unix_get_fd(nd->index_file);
+	int line_fd = g_io_channel_unix_get_fd(nd->line_file);
+	guint64 n, i, start = G_MAXUINT64, end = 0;
+	guint64 *offsets, on_disk = nd->count;
+	guint first = entries->len;
+	char *records, *data = NULL;
+	struct stat st;
+
+	if (*from >= to)
+		return TRUE;
+
+	if (nd->worker != NULL) {
+		gboolean ret;
+
+		g_mutex_lock(&nd->pending_lock);
+		on_disk = nd->readable;
+		if (*from >= on_disk) {
+			ret = read_pending(nd, from, to, since, until, max, entries,
+							   error);
+			g_mutex_unlock(&nd->pending_lock);
+			return ret;
+		}
+		g_mutex_unlock(&nd->pending_lock);
+
+		to = MIN(to, on_disk);
+	}
+
+	n = MIN(to - *from, max);
+	records = g_malloc(n * INDEX_RECORD_SIZE);
+	if (pread(index_fd, records, n * INDEX_RECORD_SIZE,
+			  *from * INDEX_RECORD_SIZE) != n * INDEX_RECORD_SIZE) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"reading index of line %"PRIu64" failed", *from);
+		g_free(records);
 		return FALSE;
 	}
 
-	*line = irc_parse_line(raw);
-	g_free(raw);
+	offsets = g_new(guint64, n);
+	for (i = 0; i < n; i++) {
+		struct linestack_entry e;
+
+		memcpy(&e.time, records + i * INDEX_RECORD_SIZE + sizeof(guint64),
+			   sizeof(time_t));
+
+		if (e.time < since || (until != 0 && e.time >= until))
+			continue;
+
+		memcpy(&offsets[entries->len - first], records + i * INDEX_RECORD_SIZE,
+			   sizeof(guint64));
+		start = MIN(start, offsets[entries->len - first]);
+		e.index = *from + i;
+		e.raw = NULL;
+		g_array_append_val(entries, e);
+	}
+	g_free(records);
+
+	if (entries->len == first)
+		goto done;
+
+	if (nd->compressed) {
+		if (!read_compressed_lines(line_fd, entries, first, offsets, error))
+			goto fail;
+		goto done;
+	}
+
+	/* Lines are stored back to back, so read everything from the first
+	 * wanted line up to the line after the block in one go, and find
+	 * where each line ends by looking for its newline. Only the last
+	 * line has no index record after it; its end is the end of the
+	 * file. The record may not have been written out yet if the
+	 * linestack is being appended to, so fall back to the file size if
+	 * it can't be read. */
+	if (*from + n >= on_disk ||
+		pread(index_fd, &end, sizeof(guint64),
+			  (*from + n) * INDEX_RECORD_SIZE) != sizeof(guint64)) {
+		if (fstat(line_fd, &st) < 0) {
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+						"%s", g_strerror(errno));
+			goto fail;
+		}
+		end = st.st_size;
+	}
+
+	if (end <= start) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"index offsets out of order near line %"PRIu64, *from);
+		goto fail;
+	}
+
+	data = g_malloc(end - start);
+	if (pread(line_fd, data, end - start, start) != end - start) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+					"reading lines near %"PRIu64" failed", *from);
+		goto fail;
+	}
+
+	for (i = first; i < entries->len; i++) {
+		struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+		guint64 offset = offsets[i - first];
+		char *line, *nl = NULL;
+
+		if (offset < end) {
+			line = data + (offset - start);
+			nl = memchr(line, '\n', end - offset);
+		}
+		if (nl == NULL) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+						"line %"PRIu64" is incomplete", e->index);
+			goto fail;
+		}
+		if (nl > line && nl[-1] == '\r')
+			nl--;
+		e->raw = g_strndup(line, nl - line);
+	}
+	g_free(data);
 
+done:
+	g_free(offsets);
+	*from += n;
 	return TRUE;
+
+fail:
+	g_free(data);
+	g_free(offsets);
+	for (i = first; i < entries->len; i++)
+		g_free(g_array_index(entries, struct linestack_entry, i).raw);
+	g_array_set_size(entries, first);
+	return FALSE;
 }
 
 gboolean linestack_traverse(struct linestack_context *nd,
 		linestack_marker lm_from, linestack_marker lm_to,
 		linestack_traverse_fn handler, void *userdata)
 {
-	gint64 start_index, end_index;
+	guint64 from, to;
 	gboolean ret = TRUE;
 	GError *error = NULL;
-	GIOStatus status = G_IO_STATUS_NORMAL;
-	struct irc_line *l;
-	time_t time;
-	guint64 i;
+	GArray *entries;
+	guint i;
 
 	if (nd == NULL)
 		return FALSE;
 
-	/* Flush channel before reading otherwise data corruption may occur */
-	g_io_channel_flush(nd->line_file, &error);
+	if (!linestack_sync(nd))
+		return FALSE;
 
-	g_io_channel_flush(nd->index_file, &error);
+	from = (lm_from == NULL)?0:*lm_from;
+	to = (lm_to == NULL)?nd->count:*lm_to;
 
-	if (lm_from == NULL) {
-		start_index = 0;
-	} else {
-		start_index = *lm_from;
-	}
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	while (ret && from < to) {
+		if (!linestack_read_block(nd, &from, to, 0, 0, TRAVERSE_READ_BLOCK,
+								  entries, &error)) {
+			log_global(LOG_WARNING, "Unable to read linestack: %s",
+					   error->message);
+			g_error_free(error);
+			ret = FALSE;
+			break;
+		}
 
-	if (lm_to == NULL) {
-		end_index = nd->count;
-	} else {
-		end_index = *((guint64 *)lm_to);
-	}
+		for (i = 0; i < entries->len; i++) {
+			struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+			struct irc_line *l = irc_parse_line(e->raw);
 
-	for (i = start_index; i < end_index; i++) {
-		l = NULL;
-		ret = linestack_read_entry(nd, i, &l, &time);
-		if (ret)
-			ret &= handler(l, time, userdata);
-		free_line(l);
-		if (!ret) break;
+			if (ret && l != NULL)
+				ret = handler(l, e->time, userdata);
+			free_line(l);
+			g_free(e->raw);
+		}
+		g_array_set_size(entries, 0);
 	}
-
-	status = g_io_channel_seek_position(nd->line_file, 0, G_SEEK_END, &error);
-	LF_CHECK_IO_STATUS(status);
-
-	status = g_io_channel_seek_position(nd->index_file, 0, G_SEEK_END, &error);
-	LF_CHECK_IO_STATUS(status);
+	g_array_free(entries, TRUE);
 
 	return ret;
 }
@@ -480,26 +1447,121 @@ static const char *linestack_messages[] = {
 	"329", /* RPL_CREATIONTIME */
 	NULL };
 
-gboolean write_index_entry(GIOChannel *ioc, guint64 line_offset, time_t time,
-					   guint64 state_line_index)
+static gboolean write_line(struct linestack_context *nd,
+						   const struct irc_line *l, time_t t,
+						   guint64 state_line_index, GError **error)
 {
-	GError *error = NULL;
+	guint64 offset;
 	GIOStatus status;
 
-	status = g_io_channel_write_chars(ioc, (void *)&line_offset, sizeof(guint64), NULL,
-									  &error);
-	LF_CHECK_IO_STATUS(status);
+	if (nd->compressed)
+		offset = (nd->block_offset << BLOCK_OFFSET_BITS) | nd->block->len;
+	else
+		offset = g_io_channel_tell_position(nd->line_file);
 
-	status = g_io_channel_write_chars(ioc, (void *)&time, sizeof(time_t), NULL, &error);
-	LF_CHECK_IO_STATUS(status);
+	status = g_io_channel_write_chars(nd->index_file, (void *)&offset,
+									  sizeof(guint64), NULL, error);
+	if (status != G_IO_STATUS_NORMAL)
+		return FALSE;
 
-	status = g_io_channel_write_chars(ioc, (void *)&state_line_index, sizeof(guint64),
-									  NULL, &error);
-	LF_CHECK_IO_STATUS(status);
+	status = g_io_channel_write_chars(nd->index_file, (void *)&t,
+									  sizeof(time_t), NULL, error);
+	if (status != G_IO_STATUS_NORMAL)
+		return FALSE;
+
+	status = g_io_channel_write_chars(nd->index_file,
+									  (void *)&state_line_index,
+									  sizeof(guint64), NULL, error);
+	if (status != G_IO_STATUS_NORMAL)
+		return FALSE;
 
+	if (nd->compressed) {
+		char *raw = irc_line_string_nl(l);
+		g_string_append(nd->block, raw);
+		g_free(raw);
+		nd->written++;
+		if (nd->block->len >= BLOCK_SIZE)
+			return write_compressed_block(nd, error);
+		return TRUE;
+	}
+
+	status = irc_send_line(nd->line_file, (GIConv)-1, l, error);
+	if (status != G_IO_STATUS_NORMAL)
+		return FALSE;
+
+	nd->written++;
 	return TRUE;
 }
 
+struct write_line_job {
+	struct linestack_context *ctx;
+	struct irc_line *line;
+	guint64 index;
+	time_t time;
+	guint64 state_line_index;
+};
+
+static void free_write_line_job(void *data)
+{
+	struct write_line_job *job = data;
+	free_line(job->line);
+	g_free(job);
+}
+
+static gboolean report_write_error(gpointer data)
+{
+	char *message = data;
+	log_global(LOG_ERROR, "Unable to write to linestack file: %s", message);
+	g_free(message);
+	return FALSE;
+}
+
+/* Runs on the worker thread, so errors are reported from the main loop */
+static void run_write_line_job(void *data)
+{
+	struct write_line_job *job = data;
+	GError *error = NULL;
+
+	if (!write_line(job->ctx, job->line, job->time, job->state_line_index,
+					&error)) {
+		irc_main_invoke(report_write_error,
+						g_strdup(error != NULL?error->message:"Unknown"));
+		if (error != NULL)
+			g_error_free(error);
+	}
+
+	if (job->ctx->search_enabled)
+		linestack_search_add(job->ctx, job->index, job->line);
+}
+
+/*
+ * Write out the lines queued before this job, so readers find them in
+ * the files rather than in the pending lines. Lines in the compressed
+ * block being filled stay pending. Runs on the worker thread.
+ */
+static void run_publish_job(void *data)
+{
+	struct linestack_context *ctx = data;
+	GError *error = NULL;
+	gboolean flushed;
+
+	flushed = g_io_channel_flush(ctx->line_file, &error) == G_IO_STATUS_NORMAL &&
+		g_io_channel_flush(ctx->index_file, &error) == G_IO_STATUS_NORMAL;
+	if (!flushed) {
+		irc_main_invoke(report_write_error,
+						g_strdup(error != NULL?error->message:"Unknown"));
+		if (error != NULL)
+			g_error_free(error);
+	}
+
+	g_mutex_lock(&ctx->pending_lock);
+	if (flushed) {
+		ctx->readable = ctx->compressed?ctx->block_first:ctx->written;
+		clear_pending(ctx, ctx->readable);
+	}
+	ctx->publish_queued = FALSE;
+	g_mutex_unlock(&ctx->pending_lock);
+}
 
 gboolean linestack_insert_line(struct linestack_context *nd,
 							   const struct irc_line *l, enum data_direction dir,
@@ -508,7 +1570,6 @@ gboolean linestack_insert_line(struct linestack_context *nd,
 	int i;
 	gboolean needed = FALSE;
 	GError *error = NULL;
-	GIOStatus status;
 	gboolean ret;
 
 	if (nd == NULL) return TRUE;
@@ -544,55 +1605,203 @@ gboolean linestack_insert_line(struct linestack_context *nd,
 			return FALSE;
 	}
 
-	if (!write_index_entry(nd->index_file,
-					  g_io_channel_tell_position(nd->line_file),
-					  time(NULL),
-					  nd->last_line_with_state))
-		return FALSE;
-
-	status = irc_send_line(nd->line_file, (GIConv)-1, l, &error);
-
-	if (status != G_IO_STATUS_NORMAL) {
-		log_global(LOG_ERROR, "Unable to write to linestack file: %s", error->message);
-		g_error_free(error);
+	if (nd->worker != NULL) {
+		struct write_line_job *job = g_new0(struct write_line_job, 1);
+		struct pending_line p;
+		gboolean publish;
+
+		job->ctx = nd;
+		job->line = linedup(l);
+		job->index = nd->count;
+		job->time = time(NULL);
+		job->state_line_index = nd->last_line_with_state;
+
+		p.index = job->index;
+		p.time = job->time;
+		p.state_line_index = job->state_line_index;
+		p.raw = irc_line_string(l);
+
+		g_mutex_lock(&nd->pending_lock);
+		g_array_append_val(nd->pending, p);
+		publish = !nd->publish_queued;
+		nd->publish_queued = TRUE;
+		g_mutex_unlock(&nd->pending_lock);
+
+		irc_worker_push(nd->worker, run_write_line_job, job,
+						free_write_line_job);
+		if (publish)
+			irc_worker_push(nd->worker, run_publish_job, nd, NULL);
+	} else if (!write_line(nd, l, time(NULL), nd->last_line_with_state,
+						   &error)) {
+		log_global(LOG_ERROR, "Unable to write to linestack file: %s",
+				   error != NULL?error->message:"Unknown");
+		if (error != NULL)
+			g_error_free(error);
 		return FALSE;
+	} else if (nd->search_enabled) {
+		linestack_search_add(nd, nd->count, l);
 	}
 
 	nd->count++;
+
 	return TRUE;
 }
 
-struct send_line_privdata {
-	int time_offset;
-	struct irc_client *client;
-};
-
-static gboolean send_line(struct irc_line *l, time_t t, void *_privdata)
+/* Index of the first line written at or after t */
+static guint64 linestack_find_time(struct linestack_context *nd, time_t t)
 {
-	struct send_line_privdata *privdata = _privdata;
-	return client_send_line(privdata->client, l, NULL);
-}
+	int fd = g_io_channel_unix_get_fd(nd->index_file);
+	guint64 lo = 0, hi = nd->count;
+	guint i;
+
+	/* Lines that haven't been written out yet are the most recent */
+	if (nd->worker != NULL) {
+		g_mutex_lock(&nd->pending_lock);
+		hi = nd->readable;
+		for (i = 0; i < nd->pending->len; i++) {
+			struct pending_line *p = &g_array_index(nd->pending,
+													struct pending_line, i);
+			if (p->time < t)
+				lo = p->index + 1;
+		}
+		g_mutex_unlock(&nd->pending_lock);
 
-static gboolean send_line_timed(struct irc_line *l, time_t t, void *_privdata)
-{
-	struct send_line_privdata *privdata = _privdata;
+		if (lo > 0)
+			return lo;
+	}
 
-	if ((!base_strcmp(l->args[0], "PRIVMSG") ||
-		!base_strcmp(l->args[0], "NOTICE")) &&
-		l->argc > 2) {
-		line_prefix_time(l, t+privdata->time_offset);
+	while (lo < hi) {
+		guint64 mid = lo + (hi - lo) / 2;
+		time_t mid_time;
+
+		if (pread(fd, &mid_time, sizeof(time_t),
+				  mid * INDEX_RECORD_SIZE + sizeof(guint64)) != sizeof(time_t))
+			break;
+
+		if (mid_time < t)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
-	return client_send_line(privdata->client, l, NULL);
+
+	return lo;
 }
 
-static gboolean send_line_timed_dataonly(struct irc_line *l, time_t t, void *_privdata)
+/**
+ * Search the linestack for lines containing all words in a query.
+ *
+ * @param nd Linestack context
+ * @param query Words to search for
+ * @param since Only return lines written at or after this time, or 0
+ * @param max Maximum number of lines to return
+ * @return Array of guint64 line numbers, most recent first, or NULL if
+ *         search is not enabled, the index is still being loaded or the
+ *         linestack could not be read
+ */
+GArray *linestack_search(struct linestack_context *nd, const char *query,
+						 time_t since, guint max)
 {
-	struct send_line_privdata *privdata = _privdata;
-	gboolean ret;
+	guint64 min_line = 0;
+	GArray *ret = NULL;
 
-	if (base_strcmp(l->args[0], "PRIVMSG") != 0 &&
-		base_strcmp(l->args[0], "NOTICE") != 0)
-		return TRUE;
+	if (nd == NULL || !nd->search_enabled)
+		return NULL;
+
+	if (since != 0) {
+		if (!linestack_sync(nd))
+			return NULL;
+		min_line = linestack_find_time(nd, since);
+	}
+
+	g_mutex_lock(&nd->search_lock);
+	if (nd->search != NULL)
+		ret = search_index_lookup(nd->search, query, min_line, max);
+	g_mutex_unlock(&nd->search_lock);
+
+	return ret;
+}
+
+/**
+ * Whether a full-text index is kept for a linestack.
+ */
+gboolean linestack_search_enabled(struct linestack_context *nd)
+{
+	return nd != NULL && nd->search_enabled;
+}
+
+/**
+ * Report the number of distinct words in the search index and the
+ * memory used by it.
+ */
+void linestack_search_stats(struct linestack_context *nd, guint *tokens,
+							gsize *size)
+{
+	*tokens = 0;
+	*size = 0;
+
+	g_mutex_lock(&nd->search_lock);
+	if (nd->search != NULL)
+		search_index_stats(nd->search, tokens, size);
+	g_mutex_unlock(&nd->search_lock);
+}
+
+/**
+ * Report the number of lines in a linestack and the number of bytes
+ * its files take up on disk.
+ */
+void linestack_get_size(struct linestack_context *nd, guint64 *lines,
+						goffset *bytes)
+{
+	GIOChannel *files[] = { nd->line_file, nd->index_file, nd->state_file };
+	struct stat st;
+	int i;
+
+	if (lines != NULL)
+		*lines = nd->count;
+
+	if (bytes == NULL)
+		return;
+
+	*bytes = 0;
+	for (i = 0; i < G_N_ELEMENTS(files); i++) {
+		if (files[i] == NULL)
+			continue;
+		if (fstat(g_io_channel_unix_get_fd(files[i]), &st) == 0)
+			*bytes += st.st_size;
+	}
+}
+
+struct send_line_privdata {
+	int time_offset;
+	struct irc_client *client;
+};
+
+static gboolean send_line(struct irc_line *l, time_t t, void *_privdata)
+{
+	struct send_line_privdata *privdata = _privdata;
+	return client_send_line(privdata->client, l, NULL);
+}
+
+static gboolean send_line_timed(struct irc_line *l, time_t t, void *_privdata)
+{
+	struct send_line_privdata *privdata = _privdata;
+
+	if ((!base_strcmp(l->args[0], "PRIVMSG") ||
+		!base_strcmp(l->args[0], "NOTICE")) &&
+		l->argc > 2) {
+		line_prefix_time(l, t+privdata->time_offset);
+	}
+	return client_send_line(privdata->client, l, NULL);
+}
+
+static gboolean send_line_timed_dataonly(struct irc_line *l, time_t t, void *_privdata)
+{
+	struct send_line_privdata *privdata = _privdata;
+	gboolean ret;
+
+	if (base_strcmp(l->args[0], "PRIVMSG") != 0 &&
+		base_strcmp(l->args[0], "NOTICE") != 0)
+		return TRUE;
 
 	if (l->argc <= 2) {
 		return TRUE;
@@ -617,25 +1826,30 @@ static gboolean send_line_dataonly(struct irc_line *l, time_t t, void *_privdata
 	return client_send_line(privdata->client, l, NULL);
 }
 
-gboolean linestack_send(struct linestack_context *ctx, linestack_marker mf, linestack_marker mt, struct irc_client *c, gboolean dataonly, gboolean timed, int time_offset)
+static linestack_traverse_fn send_line_fn(gboolean dataonly, gboolean timed)
 {
-	struct send_line_privdata privdata;
-	linestack_traverse_fn trav_fn;
-
-	privdata.client = c;
-	privdata.time_offset = time_offset;
-
 	if (dataonly) {
 		if (timed)
-			trav_fn = send_line_timed_dataonly;
+			return send_line_timed_dataonly;
 		else
-			trav_fn = send_line_dataonly;
+			return send_line_dataonly;
 	} else {
 		if (timed)
-			trav_fn = send_line_timed;
+			return send_line_timed;
 		else
-			trav_fn = send_line;
+			return send_line;
 	}
+}
+
+gboolean linestack_send(struct linestack_context *ctx, linestack_marker mf, linestack_marker mt, struct irc_client *c, gboolean dataonly, gboolean timed, int time_offset)
+{
+	struct send_line_privdata privdata;
+	linestack_traverse_fn trav_fn;
+
+	privdata.client = c;
+	privdata.time_offset = time_offset;
+
+	trav_fn = send_line_fn(dataonly, timed);
 
 	return linestack_traverse(ctx, mf, mt, trav_fn, &privdata);
 }
@@ -648,21 +1862,150 @@ gboolean linestack_send_object(struct linestack_context *ctx, const char *obj, l
 	privdata.client = c;
 	privdata.time_offset = time_offset;
 
-	if (dataonly) {
-		if (timed)
-			trav_fn = send_line_timed_dataonly;
-		else
-			trav_fn = send_line_dataonly;
-	} else {
-		if (timed)
-			trav_fn = send_line_timed;
-		else
-			trav_fn = send_line;
-	}
+	trav_fn = send_line_fn(dataonly, timed);
 
 	return linestack_traverse_object(ctx, obj, mf, mt, trav_fn, &privdata);
 }
 
+/*
+ * Backlog streaming
+ *
+ * linestack_send() sends the whole range from a single main loop callback,
+ * which stalls every other network and client while a large backlog is
+ * replayed. A stream sends a bounded number of lines per main loop
+ * iteration instead, read with a single linestack_read_block(), and
+ * waits while the client still has a lot of lines queued. Lines relayed
+ * from the network are held back until the stream is done, so they don't
+ * end up in the middle of the backlog; replies to the client are not.
+ */
+
+struct linestack_stream {
+	struct linestack_context *ctx;
+	struct irc_client *client;
+	struct traverse_object_data object;
+	struct send_line_privdata privdata;
+	guint64 next;
+	guint64 end;
+	guint source_id;
+};
+
+static void free_stream(struct linestack_stream *stream)
+{
+	if (stream->source_id != 0)
+		g_source_remove(stream->source_id);
+	stream->ctx->streams = g_list_remove(stream->ctx->streams, stream);
+	client_release_lines(stream->client);
+	client_unref(stream->client);
+	g_free((char *)stream->object.object);
+	g_free(stream);
+}
+
+static gboolean stream_lines(gpointer data)
+{
+	struct linestack_stream *stream = data;
+	GError *error = NULL;
+	GArray *entries;
+	gboolean ret = TRUE;
+	guint64 sent = 0;
+	guint i;
+
+	stream->source_id = 0;
+
+	if (stream->client->connected &&
+		transport_get_queue_length(stream->client->transport) <=
+			STREAM_MAX_QUEUED_LINES) {
+		guint64 from = stream->next;
+
+		entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+		ret = linestack_read_block(stream->ctx, &stream->next, stream->end,
+								   0, 0, STREAM_CHUNK_LINES, entries, &error);
+		if (!ret) {
+			log_global(LOG_ERROR, "Unable to read backlog: %s",
+					   error->message);
+			g_error_free(error);
+		}
+
+		for (i = 0; i < entries->len; i++) {
+			struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+			struct irc_line *l = irc_parse_line(e->raw);
+
+			if (ret && l != NULL && stream->client->connected) {
+				if (stream->object.object != NULL)
+					ret = traverse_object_handler(l, e->time, &stream->object);
+				else
+					ret = stream->object.handler(l, e->time,
+												 &stream->privdata);
+			}
+			free_line(l);
+			g_free(e->raw);
+		}
+		g_array_free(entries, TRUE);
+
+		sent = stream->next - from;
+	}
+
+	if (!ret || !stream->client->connected || stream->next >= stream->end) {
+		free_stream(stream);
+		return FALSE;
+	}
+
+	if (sent < STREAM_CHUNK_LINES)
+		stream->source_id = g_timeout_add(STREAM_BACKOFF_INTERVAL,
+										  stream_lines, stream);
+	else
+		stream->source_id = g_idle_add(stream_lines, stream);
+
+	return FALSE;
+}
+
+/**
+ * Send part of the linestack to a client from the main loop, a chunk of
+ * lines at a time.
+ *
+ * The stream stops when the client disconnects or the linestack is freed.
+ * Lines relayed to the client in the meantime are held back until
+ * the stream stops.
+ *
+ * @param ctx Linestack context
+ * @param obj Only send lines for this channel or nick, or NULL for all
+ * @param mf Marker to start at, or NULL for the beginning
+ * @param mt Marker to stop at, or NULL for the current end
+ * @param c Client to send lines to
+ */
+gboolean linestack_stream(struct linestack_context *ctx, const char *obj,
+						  linestack_marker mf, linestack_marker mt,
+						  struct irc_client *c, gboolean dataonly,
+						  gboolean timed, int time_offset)
+{
+	struct linestack_stream *stream;
+
+	if (ctx == NULL)
+		return FALSE;
+
+	/* Lines up to now have to be readable with linestack_read_block() */
+	if (!linestack_sync(ctx))
+		return FALSE;
+
+	stream = g_new0(struct linestack_stream, 1);
+	stream->ctx = ctx;
+	stream->client = client_ref(c);
+	stream->next = (mf == NULL)?0:*mf;
+	stream->end = (mt == NULL)?ctx->count:*mt;
+	stream->privdata.client = c;
+	stream->privdata.time_offset = time_offset;
+	stream->object.handler = send_line_fn(dataonly, timed);
+	stream->object.object = g_strdup(obj);
+	stream->object.userdata = &stream->privdata;
+
+	ctx->streams = g_list_append(ctx->streams, stream);
+	client_hold_lines(c);
+
+	stream_lines(stream);
+
+	return TRUE;
+}
+
 static gboolean replay_line(struct irc_line *l, time_t t, void *state)
 {
 	struct irc_network_state *st = state;
@@ -679,7 +2022,7 @@ gboolean linestack_replay(struct linestack_context *ctx,
 }
 
 
-#define marshall_new(m,t) if ((m) == MARSHALL_PULL) *(t) = g_malloc(sizeof(**t));
+#define marshall_new(m,t) if ((m) == MARSHALL_PULL) *(t) = g_malloc0(sizeof(**t));
 
 static const char tabs[10] = {'\t', '\t', '\t', '\t', '\t',
 			       '\t', '\t', '\t', '\t', '\t' };
@@ -983,12 +2326,28 @@ static gboolean marshall_channel_state (struct irc_network_state *nst,
 	ret &= marshall_string(nst, "topic", level+1, m, t, &(*c)->topic);
 	ret &= marshall_string(nst, "topic_set_by", level+1, m, t, &(*c)->topic_set_by);
 	ret &= marshall_time(nst, "topic_set_time", level+1, m, t, &(*c)->topic_set_time);
+	/* All modes are written, to keep the format of older state files */
 	for (i = 0; i < MAXMODES; i++) {
 		char name[20];
+		GList *nicklist = NULL;
+		char *option = NULL;
+		struct irc_channel_mode *cm;
+
+		if (m == MARSHALL_PUSH) {
+			nicklist = channel_mode_nicklist(*c, i);
+			option = (char *)channel_mode_option(*c, i);
+		}
+
 		g_snprintf(name, sizeof(name), "mode_nicklist[%d]", i);
-		ret &= marshall_GList(nst, name, level+1, m, t, &(*c)->chanmode_nicklist[i], (marshall_fn_t)marshall_nicklist_entry);
+		ret &= marshall_GList(nst, name, level+1, m, t, &nicklist, (marshall_fn_t)marshall_nicklist_entry);
 		g_snprintf(name, sizeof(name), "mode_option[%d]", i);
-		ret &= marshall_string(nst, name, level+1, m, t, &(*c)->chanmode_option[i]);
+		ret &= marshall_string(nst, name, level+1, m, t, &option);
+
+		if (m == MARSHALL_PULL && (nicklist != NULL || option != NULL)) {
+			cm = channel_mode_find_add(*c, i);
+			cm->nicklist = nicklist;
+			cm->option = option;
+		}
 	}
 	(*c)->network = nst;
 
@@ -1060,6 +2419,14 @@ static gboolean marshall_network_state(enum marshall_mode m, GIOChannel *t,
 	}
 	ret &= marshall_network_nick(n, "me", 0, m, t, &n->me);
 	ret &= marshall_GList(n, "nicks", 0, m, t, &n->nicks, (marshall_fn_t)marshall_network_nick_p);
+	if (m == MARSHALL_PULL) {
+		GList *gl;
+		n->nicks_tail = NULL;
+		for (gl = n->nicks; gl; gl = gl->next) {
+			((struct network_nick *)gl->data)->network_link = gl;
+			n->nicks_tail = gl;
+		}
+	}
 	ret &= marshall_GList(n, "channels", 0, m, t, &n->channels, (marshall_fn_t)marshall_channel_state);
 
 	g_assert(n->me.nick);
@@ -1079,6 +2446,91 @@ static char *state_path(struct linestack_context *lf_data, guint64 state_id)
 	return ret;
 }
 
+static gboolean sync_fd(int fd, GError **error)
+{
+	if (fsync(fd) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"Unable to sync linestack file: %s", g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Put a snapshot written to tmp_file in place. If the linestack is
+ * recovered after a restart, the lines before the snapshot are synced to
+ * disk first and so is the snapshot, so that after a crash only lines
+ * after the last snapshot need to be checked. Runs on the worker if
+ * there is one, as it touches the files the lines are written to.
+ */
+static gboolean commit_state(struct linestack_context *nd,
+							 const char *tmp_file, const char *data_file,
+							 GError **error)
+{
+	if (nd->recover) {
+		int fd;
+		gboolean ok;
+
+		if (!flush_files(nd, error) ||
+			!sync_fd(g_io_channel_unix_get_fd(nd->line_file), error) ||
+			!sync_fd(g_io_channel_unix_get_fd(nd->index_file), error))
+			return FALSE;
+
+		fd = open(tmp_file, O_RDONLY);
+		if (fd < 0) {
+			g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+						"Error opening `%s': %s", tmp_file, g_strerror(errno));
+			return FALSE;
+		}
+		ok = sync_fd(fd, error);
+		close(fd);
+		if (!ok)
+			return FALSE;
+	}
+
+	if (g_rename(tmp_file, data_file) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"Error renaming `%s' to `%s': %s", tmp_file, data_file,
+					g_strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+struct state_job {
+	struct linestack_context *ctx;
+	char *tmp_file;
+	char *data_file;
+};
+
+static void free_state_job(void *data)
+{
+	struct state_job *job = data;
+	g_free(job->tmp_file);
+	g_free(job->data_file);
+	g_free(job);
+}
+
+/* Runs on the worker thread, so errors are reported from the main loop */
+static void run_state_job(void *data)
+{
+	struct state_job *job = data;
+	GError *error = NULL;
+
+	if (!commit_state(job->ctx, job->tmp_file, job->data_file, &error)) {
+		g_unlink(job->tmp_file);
+		irc_main_invoke(report_write_error, g_strdup(error->message));
+		g_error_free(error);
+	}
+}
+
+/*
+ * Write a snapshot of the network state. The state is marshalled here,
+ * as it is owned by the main loop, and the rest is left to
+ * commit_state().
+ */
 static gboolean file_insert_state(struct linestack_context *nd,
 							  const struct irc_network_state *state,
 							  guint64 state_id)
@@ -1086,34 +2538,842 @@ static gboolean file_insert_state(struct linestack_context *nd,
 	GError *error = NULL;
 	GIOStatus status;
 	GIOChannel *state_file;
-	char *data_file;
+	char *data_file, *tmp_file;
 
 	log_global(LOG_TRACE, "Inserting state");
 
 	data_file = state_path(nd, state_id);
+	tmp_file = g_strdup_printf("%s.tmp", data_file);
 
-	state_file = g_io_channel_new_file(data_file, "w+", &error);
+	state_file = g_io_channel_new_file(tmp_file, "w+", &error);
 	if (state_file == NULL) {
 		log_global(LOG_WARNING, "Error opening `%s': %s",
-						  data_file, error->message);
+						  tmp_file, error->message);
 		g_error_free(error);
+		g_free(tmp_file);
 		g_free(data_file);
 		return FALSE;
 	}
-	g_free(data_file);
 
 	g_io_channel_set_encoding(state_file, NULL, NULL);
 
-	nd->last_line_with_state = nd->count;
-
 	marshall_network_state(MARSHALL_PUSH, state_file, (struct irc_network_state *)state);
 
 	status = g_io_channel_flush(state_file, &error);
-	LF_CHECK_IO_STATUS(status);
-
 	g_io_channel_unref(state_file);
+	if (status != G_IO_STATUS_NORMAL) {
+		log_global(LOG_ERROR, "Unable to write `%s': %s", tmp_file,
+				   error != NULL?error->message:"Unknown");
+		if (error != NULL)
+			g_error_free(error);
+		g_unlink(tmp_file);
+		g_free(tmp_file);
+		g_free(data_file);
+		return FALSE;
+	}
+
+	nd->last_line_with_state = nd->count;
+
+	if (nd->worker != NULL) {
+		struct state_job *job = g_new0(struct state_job, 1);
+		job->ctx = nd;
+		job->tmp_file = tmp_file;
+		job->data_file = data_file;
+		irc_worker_push(nd->worker, run_state_job, job, free_state_job);
+		return TRUE;
+	}
+
+	if (!commit_state(nd, tmp_file, data_file, &error)) {
+		log_global(LOG_WARNING, "%s", error->message);
+		g_error_free(error);
+		g_unlink(tmp_file);
+		g_free(tmp_file);
+		g_free(data_file);
+		return FALSE;
+	}
+
+	g_free(tmp_file);
+	g_free(data_file);
 
 	return TRUE;
 }
 
+/*
+ * Offline checking and repair
+ *
+ * These work on the files of a linestack that is not in use, so they
+ * read with pread() from several threads at once and don't go through
+ * the writer's state.
+ */
+
+#define CHECK_READ_RECORDS 4096
+#define CHECK_MAX_PROBLEMS 100
+#define REINDEX_BUFFER_SIZE (1024 * 1024)
 
+/**
+ * Open an existing linestack for reading only. Nothing is recovered or
+ * written, so this can be used on a damaged linestack.
+ */
+struct linestack_context *linestack_open_readonly(const char *data_dir,
+												  GError **error)
+{
+	struct linestack_context *data = g_new0(struct linestack_context, 1);
+	struct stat st;
+	char *path;
+
+	path = g_build_filename(data_dir, "lines.zst", NULL);
+	data->compressed = g_file_test(path, G_FILE_TEST_EXISTS);
+	if (!data->compressed) {
+		g_free(path);
+		path = g_build_filename(data_dir, "lines", NULL);
+	}
+	data->line_file = g_io_channel_new_file(path, "r", error);
+	g_free(path);
+	if (data->line_file == NULL) {
+		g_free(data);
+		return NULL;
+	}
+	g_io_channel_set_encoding(data->line_file, NULL, NULL);
+
+	path = g_build_filename(data_dir, "index", NULL);
+	data->index_file = g_io_channel_new_file(path, "r", error);
+	g_free(path);
+	if (data->index_file == NULL) {
+		g_io_channel_unref(data->line_file);
+		g_free(data);
+		return NULL;
+	}
+	g_io_channel_set_encoding(data->index_file, NULL, NULL);
+
+	if (fstat(g_io_channel_unix_get_fd(data->index_file), &st) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"%s", g_strerror(errno));
+		g_io_channel_unref(data->line_file);
+		g_io_channel_unref(data->index_file);
+		g_free(data);
+		return NULL;
+	}
+	data->count = st.st_size / INDEX_RECORD_SIZE;
+
+	if (data->compressed) {
+		/* There is no block being filled; point past the last one */
+		data->block = g_string_new("");
+		if (fstat(g_io_channel_unix_get_fd(data->line_file), &st) == 0)
+			data->block_offset = st.st_size;
+	}
+
+	data->state_dir = g_build_filename(data_dir, "states", NULL);
+	g_mutex_init(&data->search_lock);
+	g_mutex_init(&data->pending_lock);
+	data->pending = g_array_new(FALSE, FALSE, sizeof(struct pending_line));
+
+	return data;
+}
+
+struct check_problem {
+	guint64 line;
+	char *message;
+};
+
+struct check_chunk {
+	struct linestack_context *ctx;
+	guint64 from, to;
+	struct linestack_check_result result;
+	GArray *problems;
+	/* Snapshots referred to, without repeats */
+	GArray *states;
+	/* Offset of the last line in the chunk */
+	guint64 last_offset;
+	GError *error;
+};
+
+static void check_problem(struct check_chunk *chunk, guint64 line,
+						  const char *fmt, ...)
+{
+	struct check_problem p;
+	va_list ap;
+
+	if (chunk->problems->len >= CHECK_MAX_PROBLEMS)
+		return;
+
+	va_start(ap, fmt);
+	p.line = line;
+	p.message = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+	g_array_append_val(chunk->problems, p);
+}
+
+static void check_raw_line(struct check_chunk *chunk, guint64 index,
+						   const char *raw)
+{
+	struct irc_line *l = irc_parse_line(raw);
+
+	if (l == NULL || l->argc == 0) {
+		chunk->result.bad_lines++;
+		check_problem(chunk, index, "unable to parse line");
+	}
+	free_line(l);
+}
+
+/*
+ * Read the lines of a block of records. If the block can't be read as a
+ * whole, fall back to reading the lines one by one to find the bad ones.
+ */
+static void check_lines(struct check_chunk *chunk, guint64 from, guint64 to,
+						GArray *entries)
+{
+	GError *error = NULL;
+	guint64 next = from;
+	guint i;
+
+	if (!linestack_read_block(chunk->ctx, &next, to, 0, 0, to - from,
+							  entries, &error)) {
+		g_error_free(error);
+		error = NULL;
+		for (next = from; next < to; ) {
+			guint64 index = next;
+			if (!linestack_read_block(chunk->ctx, &next, index + 1, 0, 0, 1,
+									  entries, &error)) {
+				chunk->result.bad_lines++;
+				check_problem(chunk, index, "%s", error->message);
+				g_error_free(error);
+				error = NULL;
+				next = index + 1;
+			}
+		}
+	}
+
+	for (i = 0; i < entries->len; i++) {
+		struct linestack_entry *e = &g_array_index(entries,
+											struct linestack_entry, i);
+		check_raw_line(chunk, e->index, e->raw);
+		g_free(e->raw);
+	}
+	g_array_set_size(entries, 0);
+}
+
+static gpointer check_chunk_run(gpointer data)
+{
+	struct check_chunk *chunk = data;
+	int index_fd = g_io_channel_unix_get_fd(chunk->ctx->index_file);
+	char *records = g_malloc(CHECK_READ_RECORDS * INDEX_RECORD_SIZE);
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	guint64 prev_offset = 0, last_state = G_MAXUINT64;
+	time_t prev_time = 0;
+	gboolean have_prev = FALSE;
+	guint64 from, i;
+
+	/* Compare the first record against the one before the chunk */
+	if (chunk->from > 0 &&
+		pread(index_fd, records, INDEX_RECORD_SIZE,
+			  (chunk->from - 1) * INDEX_RECORD_SIZE) == INDEX_RECORD_SIZE) {
+		memcpy(&prev_offset, records, sizeof(guint64));
+		memcpy(&prev_time, records + sizeof(guint64), sizeof(time_t));
+		have_prev = TRUE;
+	}
+
+	for (from = chunk->from; from < chunk->to; from += CHECK_READ_RECORDS) {
+		guint64 n = MIN(chunk->to - from, CHECK_READ_RECORDS);
+
+		if (pread(index_fd, records, n * INDEX_RECORD_SIZE,
+				  from * INDEX_RECORD_SIZE) != n * INDEX_RECORD_SIZE) {
+			g_set_error(&chunk->error, G_FILE_ERROR, G_FILE_ERROR_IO,
+						"reading index of line %"PRIu64" failed", from);
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			const char *record = records + i * INDEX_RECORD_SIZE;
+			guint64 offset, state;
+			time_t t;
+
+			memcpy(&offset, record, sizeof(guint64));
+			memcpy(&t, record + sizeof(guint64), sizeof(time_t));
+			memcpy(&state, record + sizeof(guint64) + sizeof(time_t),
+				   sizeof(guint64));
+
+			if (have_prev && offset <= prev_offset) {
+				chunk->result.bad_offsets++;
+				check_problem(chunk, from + i, "offset %"PRIu64" is not "
+							  "after that of the previous line", offset);
+			}
+			if (have_prev && t < prev_time)
+				chunk->result.time_reversals++;
+
+			if (state > from + i) {
+				chunk->result.bad_states++;
+				check_problem(chunk, from + i, "refers to snapshot %"PRIu64
+							  " taken after it", state);
+			} else if (state != last_state) {
+				g_array_append_val(chunk->states, state);
+				last_state = state;
+			}
+
+			prev_offset = offset;
+			prev_time = t;
+			have_prev = TRUE;
+		}
+
+		check_lines(chunk, from, from + n, entries);
+		chunk->result.lines += n;
+	}
+
+	chunk->last_offset = prev_offset;
+	g_array_free(entries, TRUE);
+	g_free(records);
+	return NULL;
+}
+
+/* Whether a snapshot exists and looks like one */
+static gboolean check_state_file(struct linestack_context *ctx, guint64 id)
+{
+	char *path = state_path(ctx, id);
+	char buf[2];
+	gboolean ret = FALSE;
+	FILE *f;
+
+	f = fopen(path, "r");
+	g_free(path);
+	if (f == NULL)
+		return FALSE;
+	ret = (fread(buf, 1, sizeof(buf), f) == sizeof(buf) &&
+		   !strncmp(buf, "me", sizeof(buf)));
+	fclose(f);
+	return ret;
+}
+
+static guint check_threads(guint threads, guint64 units)
+{
+	if (threads == 0)
+		threads = g_get_num_processors();
+	/* Not worth a thread for less than a few blocks of records */
+	return MAX(1, MIN(threads, units / CHECK_READ_RECORDS));
+}
+
+/**
+ * Verify that the index, lines and snapshots of a linestack are
+ * consistent. The records are split in ranges that are checked by
+ * separate threads.
+ *
+ * @param ctx Linestack opened with linestack_open_readonly()
+ * @param threads Number of threads to use, or 0 for one per processor
+ * @param result Counts of the problems found
+ * @param report Function called for the first problems found, in order
+ * @return FALSE if the files could not be read at all
+ */
+gboolean linestack_check(struct linestack_context *ctx, guint threads,
+						 struct linestack_check_result *result,
+						 linestack_problem_fn report, void *userdata,
+						 GError **error)
+{
+	struct check_chunk *chunks;
+	GHashTable *states;
+	guint64 last_offset = 0;
+	guint i, j, reported = 0;
+	gboolean ret = TRUE;
+	struct stat st;
+	off_t end;
+	int line_fd = g_io_channel_unix_get_fd(ctx->line_file);
+
+	memset(result, 0, sizeof(*result));
+
+	threads = check_threads(threads, ctx->count);
+	chunks = g_new0(struct check_chunk, threads);
+	for (i = 0; i < threads; i++) {
+		chunks[i].ctx = ctx;
+		chunks[i].from = (guint64)ctx->count * i / threads;
+		chunks[i].to = (guint64)ctx->count * (i + 1) / threads;
+		chunks[i].problems = g_array_new(FALSE, FALSE, sizeof(struct check_problem));
+		chunks[i].states = g_array_new(FALSE, FALSE, sizeof(guint64));
+	}
+
+	if (threads == 1) {
+		check_chunk_run(&chunks[0]);
+	} else {
+		GThread **workers = g_new(GThread *, threads);
+		for (i = 0; i < threads; i++)
+			workers[i] = g_thread_new("linestack-check", check_chunk_run,
+									  &chunks[i]);
+		for (i = 0; i < threads; i++)
+			g_thread_join(workers[i]);
+		g_free(workers);
+	}
+
+	states = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+	for (i = 0; i < threads; i++) {
+		struct check_chunk *chunk = &chunks[i];
+
+		if (chunk->error != NULL && ret) {
+			g_propagate_error(error, chunk->error);
+			chunk->error = NULL;
+			ret = FALSE;
+		}
+		if (chunk->error != NULL)
+			g_error_free(chunk->error);
+
+		result->lines += chunk->result.lines;
+		result->bad_lines += chunk->result.bad_lines;
+		result->bad_offsets += chunk->result.bad_offsets;
+		result->time_reversals += chunk->result.time_reversals;
+		result->bad_states += chunk->result.bad_states;
+
+		for (j = 0; j < chunk->problems->len; j++) {
+			struct check_problem *p = &g_array_index(chunk->problems,
+													 struct check_problem, j);
+			if (report != NULL && reported++ < CHECK_MAX_PROBLEMS)
+				report(p->line, p->message, userdata);
+			g_free(p->message);
+		}
+		g_array_free(chunk->problems, TRUE);
+
+		for (j = 0; j < chunk->states->len; j++) {
+			guint64 state = g_array_index(chunk->states, guint64, j);
+			if (g_hash_table_lookup(states, &state) == NULL)
+				g_hash_table_insert(states, g_memdup2(&state, sizeof(state)),
+									GINT_TO_POINTER(1));
+		}
+		g_array_free(chunk->states, TRUE);
+
+		if (chunk->to > chunk->from)
+			last_offset = chunk->last_offset;
+	}
+	g_free(chunks);
+
+	if (ret) {
+		GHashTableIter iter;
+		guint64 *state;
+
+		g_hash_table_iter_init(&iter, states);
+		while (g_hash_table_iter_next(&iter, (gpointer *)&state, NULL)) {
+			if (check_state_file(ctx, *state))
+				continue;
+			result->bad_states++;
+			if (report != NULL && reported++ < CHECK_MAX_PROBLEMS) {
+				char *msg = g_strdup_printf("snapshot %"PRIu64" is missing "
+											"or unreadable", *state);
+				report(*state, msg, userdata);
+				g_free(msg);
+			}
+		}
+	}
+	g_hash_table_destroy(states);
+
+	if (ret && fstat(line_fd, &st) == 0) {
+		if (ctx->count == 0)
+			end = 0;
+		else if (ctx->compressed)
+			end = block_end(line_fd, last_offset, st.st_size);
+		else
+			end = line_end(line_fd, last_offset, st.st_size);
+		if (end >= 0)
+			result->trailing_bytes = st.st_size - end;
+	}
+
+	return ret;
+}
+
+struct reindex_chunk {
+	int fd;
+	gboolean compressed;
+	/* Plain files: the range of bytes whose lines this chunk indexes */
+	guint64 from, to, size;
+	/* Compressed files: the blocks this chunk indexes */
+	const guint64 *blocks;
+	guint num_blocks;
+	GArray *offsets;
+	guint64 skipped;
+	GError *error;
+};
+
+static void reindex_add_line(struct reindex_chunk *chunk, guint64 offset,
+							 char *raw, gsize len)
+{
+	struct irc_line *l;
+
+	if (len > 0 && raw[len-1] == '\r')
+		len--;
+	raw[len] = '\0';
+
+	/* Unparseable lines would only trip up whatever replays them */
+	l = irc_parse_line(raw);
+	if (l != NULL && l->argc > 0)
+		g_array_append_val(chunk->offsets, offset);
+	else
+		chunk->skipped++;
+	free_line(l);
+}
+
+/*
+ * Find the lines that start in a range of a plain line file. A line that
+ * started in the previous range is skipped, and the last line may be read
+ * past the end of the range. A line without newline at the end of the
+ * file is torn and not indexed.
+ */
+static gpointer reindex_plain_run(gpointer data)
+{
+	struct reindex_chunk *chunk = data;
+	char *buf = g_malloc(REINDEX_BUFFER_SIZE);
+	GString *line = g_string_new("");
+	guint64 pos = chunk->from, line_start = chunk->from;
+	gboolean skipping = FALSE;
+
+	if (pos > 0) {
+		char c;
+		if (pread(chunk->fd, &c, 1, pos - 1) != 1) {
+			g_set_error(&chunk->error, G_FILE_ERROR, G_FILE_ERROR_IO,
+						"reading lines at %"PRIu64" failed", pos);
+			goto done;
+		}
+		skipping = (c != '\n');
+	}
+
+	while (pos < chunk->size) {
+		ssize_t n = pread(chunk->fd, buf,
+						  MIN(REINDEX_BUFFER_SIZE, chunk->size - pos), pos);
+		gsize i, start = 0;
+
+		if (n <= 0) {
+			g_set_error(&chunk->error, G_FILE_ERROR, G_FILE_ERROR_IO,
+						"reading lines at %"PRIu64" failed", pos);
+			goto done;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (buf[i] != '\n')
+				continue;
+			if (skipping) {
+				skipping = FALSE;
+			} else {
+				g_string_append_len(line, buf + start, i - start);
+				reindex_add_line(chunk, line_start, line->str, line->len);
+				g_string_truncate(line, 0);
+			}
+			start = i + 1;
+			line_start = pos + i + 1;
+			if (line_start >= chunk->to)
+				goto done;
+		}
+
+		if (!skipping)
+			g_string_append_len(line, buf + start, n - start);
+		pos += n;
+	}
+
+done:
+	g_string_free(line, TRUE);
+	g_free(buf);
+	return NULL;
+}
+
+static gpointer reindex_compressed_run(gpointer data)
+{
+	struct reindex_chunk *chunk = data;
+	guint b;
+
+	for (b = 0; b < chunk->num_blocks; b++) {
+		guint64 block = chunk->blocks[b];
+		char *raw, *line, *nl;
+		gsize len;
+
+		if (!read_compressed_block(chunk->fd, block, &raw, &len,
+								   &chunk->error))
+			return NULL;
+
+		for (line = raw; (nl = memchr(line, '\n', len - (line - raw))) != NULL;
+			 line = nl + 1) {
+			gsize in_block = line - raw;
+
+			if (in_block >= BLOCK_SIZE) {
+				chunk->skipped++;
+				continue;
+			}
+			reindex_add_line(chunk, (block << BLOCK_OFFSET_BITS) | in_block,
+							 line, nl - line);
+		}
+
+		g_free(raw);
+	}
+
+	return NULL;
+}
+
+static int compare_state_ids(const void *a, const void *b)
+{
+	guint64 x = *(const guint64 *)a, y = *(const guint64 *)b;
+	return (x > y) - (x < y);
+}
+
+/* Snapshots in a linestack, in ascending order */
+static GArray *list_state_ids(const char *state_dir)
+{
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(guint64));
+	const char *fname;
+	GDir *dir;
+
+	dir = g_dir_open(state_dir, 0, NULL);
+	if (dir != NULL) {
+		while ((fname = g_dir_read_name(dir))) {
+			char *endptr;
+			guint64 id = g_ascii_strtoull(fname, &endptr, 10);
+			if (*endptr == '\0')
+				g_array_append_val(ids, id);
+		}
+		g_dir_close(dir);
+	}
+
+	qsort(ids->data, ids->len, sizeof(guint64), compare_state_ids);
+	return ids;
+}
+
+/*
+ * Write an index for the offsets found. Times are taken from the old
+ * index where it has a record for the same line, and carried over from
+ * the line before otherwise, since the line file has no times.
+ */
+static gboolean reindex_write(const char *data_dir, GArray **offsets,
+							  guint num_chunks, time_t default_time,
+							  GError **error)
+{
+	char *index_path = g_build_filename(data_dir, "index", NULL);
+	char *tmp_path = g_build_filename(data_dir, "index.new", NULL);
+	char *state_dir = g_build_filename(data_dir, "states", NULL);
+	char *old_records = g_malloc(CHECK_READ_RECORDS * INDEX_RECORD_SIZE);
+	char *out = g_malloc(CHECK_READ_RECORDS * INDEX_RECORD_SIZE);
+	GArray *states = list_state_ids(state_dir);
+	guint64 old_count = 0, old_pos = 0, old_loaded = 0, old_start = 0;
+	guint64 index = 0, state = 0;
+	guint next_state = 0, buffered = 0, c, i;
+	gboolean ret = FALSE;
+	time_t last_time = default_time;
+	int old_fd, new_fd;
+	struct stat st;
+
+	old_fd = open(index_path, O_RDONLY);
+	if (old_fd >= 0 && fstat(old_fd, &st) == 0) {
+		old_count = st.st_size / INDEX_RECORD_SIZE;
+		if (old_count > 0 &&
+			pread(old_fd, &last_time, sizeof(time_t),
+				  sizeof(guint64)) != sizeof(time_t))
+			last_time = default_time;
+	}
+
+	new_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (new_fd < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"unable to create `%s': %s", tmp_path, g_strerror(errno));
+		goto out;
+	}
+
+	for (c = 0; c < num_chunks; c++) {
+		for (i = 0; i < offsets[c]->len; i++, index++) {
+			guint64 offset = g_array_index(offsets[c], guint64, i);
+			char *record = out + buffered * INDEX_RECORD_SIZE;
+
+			/* Walk the old index along, it is sorted by offset as well */
+			while (old_pos < old_count) {
+				guint64 old_offset;
+				const char *old;
+
+				if (old_pos >= old_start + old_loaded) {
+					old_start = old_pos;
+					old_loaded = MIN(old_count - old_pos, CHECK_READ_RECORDS);
+					if (pread(old_fd, old_records,
+							  old_loaded * INDEX_RECORD_SIZE,
+							  old_start * INDEX_RECORD_SIZE) !=
+							old_loaded * INDEX_RECORD_SIZE) {
+						old_count = old_pos;
+						break;
+					}
+				}
+				old = old_records + (old_pos - old_start) * INDEX_RECORD_SIZE;
+				memcpy(&old_offset, old, sizeof(guint64));
+				if (old_offset > offset)
+					break;
+				if (old_offset == offset)
+					memcpy(&last_time, old + sizeof(guint64), sizeof(time_t));
+				old_pos++;
+			}
+
+			while (next_state < states->len &&
+				   g_array_index(states, guint64, next_state) <= index)
+				state = g_array_index(states, guint64, next_state++);
+
+			memcpy(record, &offset, sizeof(guint64));
+			memcpy(record + sizeof(guint64), &last_time, sizeof(time_t));
+			memcpy(record + sizeof(guint64) + sizeof(time_t), &state,
+				   sizeof(guint64));
+
+			if (++buffered == CHECK_READ_RECORDS) {
+				if (write(new_fd, out, buffered * INDEX_RECORD_SIZE) !=
+						buffered * INDEX_RECORD_SIZE)
+					goto write_error;
+				buffered = 0;
+			}
+		}
+	}
+
+	if (buffered > 0 &&
+		write(new_fd, out, buffered * INDEX_RECORD_SIZE) !=
+			buffered * INDEX_RECORD_SIZE)
+		goto write_error;
+
+	if (fsync(new_fd) < 0)
+		goto write_error;
+
+	if (g_rename(tmp_path, index_path) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"unable to rename `%s': %s", tmp_path, g_strerror(errno));
+		goto out;
+	}
+
+	ret = TRUE;
+	goto out;
+
+write_error:
+	g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+				"unable to write `%s': %s", tmp_path, g_strerror(errno));
+	g_unlink(tmp_path);
+out:
+	if (new_fd >= 0)
+		close(new_fd);
+	if (old_fd >= 0)
+		close(old_fd);
+	g_array_free(states, TRUE);
+	g_free(out);
+	g_free(old_records);
+	g_free(state_dir);
+	g_free(tmp_path);
+	g_free(index_path);
+	return ret;
+}
+
+/**
+ * Rebuild the index of a linestack that is not in use from its line
+ * file. The line file is scanned and its lines parsed by several
+ * threads; lines that can't be parsed are left out of the index. The
+ * search index is removed, so it is rebuilt the next time the linestack
+ * is opened.
+ *
+ * @param data_dir Directory of the linestack
+ * @param threads Number of threads to use, or 0 for one per processor
+ * @param lines Set to the number of lines indexed
+ * @param skipped Set to the number of lines left out
+ */
+gboolean linestack_reindex(const char *data_dir, guint threads,
+						   guint64 *lines, guint64 *skipped, GError **error)
+{
+	struct reindex_chunk *chunks;
+	GArray **offsets;
+	GArray *blocks = NULL;
+	gboolean compressed, ret = TRUE;
+	struct stat st;
+	char *path;
+	int fd;
+	guint i;
+
+	path = g_build_filename(data_dir, "lines.zst", NULL);
+	compressed = g_file_test(path, G_FILE_TEST_EXISTS);
+	if (!compressed) {
+		g_free(path);
+		path = g_build_filename(data_dir, "lines", NULL);
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"unable to open `%s': %s", path, g_strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		g_free(path);
+		return FALSE;
+	}
+	g_free(path);
+
+	if (compressed) {
+		/* Blocks can only be found by following the headers */
+		guint64 pos = 0;
+		guint32 header[2];
+
+		blocks = g_array_new(FALSE, FALSE, sizeof(guint64));
+		while (pos + BLOCK_HEADER_SIZE <= st.st_size &&
+			   pread(fd, header, BLOCK_HEADER_SIZE, pos) == BLOCK_HEADER_SIZE &&
+			   pos + BLOCK_HEADER_SIZE + header[0] <= st.st_size) {
+			g_array_append_val(blocks, pos);
+			pos += BLOCK_HEADER_SIZE + header[0];
+		}
+		threads = MAX(1, MIN(threads?threads:g_get_num_processors(),
+							 blocks->len));
+	} else {
+		threads = MAX(1, MIN(threads?threads:g_get_num_processors(),
+							 st.st_size / REINDEX_BUFFER_SIZE));
+	}
+
+	chunks = g_new0(struct reindex_chunk, threads);
+	for (i = 0; i < threads; i++) {
+		chunks[i].fd = fd;
+		chunks[i].compressed = compressed;
+		chunks[i].offsets = g_array_new(FALSE, FALSE, sizeof(guint64));
+		chunks[i].size = st.st_size;
+		if (compressed) {
+			guint first = (guint64)blocks->len * i / threads;
+			guint last = (guint64)blocks->len * (i + 1) / threads;
+			chunks[i].blocks = &g_array_index(blocks, guint64, 0) + first;
+			chunks[i].num_blocks = last - first;
+		} else {
+			chunks[i].from = (guint64)st.st_size * i / threads;
+			chunks[i].to = (guint64)st.st_size * (i + 1) / threads;
+		}
+	}
+
+	if (threads == 1) {
+		if (compressed)
+			reindex_compressed_run(&chunks[0]);
+		else
+			reindex_plain_run(&chunks[0]);
+	} else {
+		GThread **workers = g_new(GThread *, threads);
+		for (i = 0; i < threads; i++)
+			workers[i] = g_thread_new("linestack-reindex",
+									  compressed?reindex_compressed_run:reindex_plain_run,
+									  &chunks[i]);
+		for (i = 0; i < threads; i++)
+			g_thread_join(workers[i]);
+		g_free(workers);
+	}
+
+	*lines = 0;
+	*skipped = 0;
+	offsets = g_new(GArray *, threads);
+	for (i = 0; i < threads; i++) {
+		if (chunks[i].error != NULL) {
+			if (ret)
+				g_propagate_error(error, chunks[i].error);
+			else
+				g_error_free(chunks[i].error);
+			ret = FALSE;
+		}
+		offsets[i] = chunks[i].offsets;
+		*lines += offsets[i]->len;
+		*skipped += chunks[i].skipped;
+	}
+
+	if (ret)
+		ret = reindex_write(data_dir, offsets, threads, st.st_mtime, error);
+
+	if (ret) {
+		/* Line numbers may have changed */
+		path = g_build_filename(data_dir, "search", NULL);
+		g_unlink(path);
+		g_free(path);
+	}
+
+	for (i = 0; i < threads; i++)
+		g_array_free(offsets[i], TRUE);
+	g_free(offsets);
+	g_free(chunks);
+	if (blocks != NULL)
+		g_array_free(blocks, TRUE);
+	close(fd);
+
+	return ret;
+}
@@ -34,6 +34,7 @@ struct irc_client;
 #include "hooks.h"
 
 struct irc_network_state;
+struct irc_worker;
 /**
  * Mark set a specific point in time in a linestack.
  */
@@ -43,6 +44,16 @@ struct ctrlproxy_config;
 /* linestack.c */
 typedef gboolean (*linestack_traverse_fn) (struct irc_line *, time_t, void *);
 
+/**
+ * Raw entry read by linestack_read_block().
+ */
+struct linestack_entry {
+	guint64 index;
+	time_t time;
+	/** Line as stored, without line ending. */
+	char *raw;
+};
+
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct irc_network_state *linestack_get_state (
 		struct linestack_context *,
 		linestack_marker );
@@ -81,6 +92,16 @@ G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_send_object (
 		gboolean timed,
 		int time_offset);
 
+G_MODULE_EXPORT gboolean linestack_stream (
+		struct linestack_context *,
+		const char *object, /* Can be NULL for all lines */
+		linestack_marker from,
+		linestack_marker to, /* Can be NULL for 'now' */
+		struct irc_client *,
+		gboolean dataonly,
+		gboolean timed,
+		int time_offset);
+
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_replay (
 		struct linestack_context *,
 		linestack_marker from,
@@ -93,6 +114,18 @@ G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_insert_line(
 		enum data_direction dir,
 		const struct irc_network_state *);
 
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT GArray *linestack_search(
+		struct linestack_context *,
+		const char *query,
+		time_t since, /* 0 for all lines */
+		guint max);
+G_MODULE_EXPORT void linestack_enable_search(struct linestack_context *);
+G_MODULE_EXPORT gboolean linestack_search_enabled(struct linestack_context *);
+G_MODULE_EXPORT void linestack_search_stats(struct linestack_context *,
+											guint *tokens, gsize *size);
+G_MODULE_EXPORT void linestack_get_size(struct linestack_context *,
+										guint64 *lines, goffset *bytes);
+
 G_MODULE_EXPORT void linestack_free_marker(linestack_marker );
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT linestack_marker linestack_get_marker(struct linestack_context *);
 
@@ -106,6 +139,45 @@ G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT linestack_marker linestack_get_marker(
  */
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct linestack_context *create_linestack(const char *data_dir, gboolean truncate, const struct irc_network_state *);
 G_MODULE_EXPORT void free_linestack_context(struct linestack_context *);
+G_MODULE_EXPORT gboolean linestack_set_compression(const char *name);
+G_MODULE_EXPORT const char *linestack_get_compression(void);
+G_MODULE_EXPORT void linestack_set_worker(struct linestack_context *ctx, struct irc_worker *worker);
+G_MODULE_EXPORT void linestack_flush(struct linestack_context *ctx);
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_sync(struct linestack_context *ctx);
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_read_block(struct linestack_context *nd,
+							  guint64 *from, guint64 to,
+							  time_t since, time_t until,
+							  guint max, GArray *entries,
+							  GError **error);
+
+/**
+ * Problems found by linestack_check().
+ */
+struct linestack_check_result {
+	guint64 lines;
+	/** Lines that could not be read or parsed */
+	guint64 bad_lines;
+	/** Index records that don't point past the line before them */
+	guint64 bad_offsets;
+	/** Index records with a time before that of the line before them */
+	guint64 time_reversals;
+	/** Snapshots that are referred to but missing or unreadable */
+	guint64 bad_states;
+	/** Bytes in the line file after the last indexed line */
+	guint64 trailing_bytes;
+};
+
+typedef void (*linestack_problem_fn) (guint64 line, const char *problem, void *userdata);
+
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct linestack_context *linestack_open_readonly(const char *data_dir, GError **error);
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_check(struct linestack_context *ctx,
+							  guint threads,
+							  struct linestack_check_result *result,
+							  linestack_problem_fn report, void *userdata,
+							  GError **error);
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_reindex(const char *data_dir,
+							  guint threads, guint64 *lines,
+							  guint64 *skipped, GError **error);
 
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean linestack_read_entry(struct linestack_context *nd,
 							  guint64 i,
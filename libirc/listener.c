@@ -34,6 +34,7 @@
 
 #include <netdb.h>
 #include "socks.h"
+#include "resolver.h"
 
 #ifdef HAVE_GSSAPI
 static gboolean gssapi_fail(struct pending_client *pc);
@@ -138,8 +139,28 @@ void log_gssapi(struct irc_listener *l, enum log_level level, const char *messag
 #endif
 
 
+struct listener_lookup {
+	struct irc_listener *listener;
+	struct irc_resolve_request *req;
+	char *address;
+	char *port;
+};
+
+static void free_listener_lookup(struct listener_lookup *lookup)
+{
+	g_free(lookup->address);
+	g_free(lookup->port);
+	g_free(lookup);
+}
+
 gboolean listener_stop(struct irc_listener *l)
 {
+	if (l->lookup != NULL) {
+		irc_resolve_cancel(l->lookup->req);
+		free_listener_lookup(l->lookup);
+		l->lookup = NULL;
+	}
+
 	while (l->incoming != NULL) {
 		struct listener_iochannel *lio = l->incoming->data;
 
@@ -381,39 +402,13 @@ void listener_add_iochannel(struct irc_listener *l, GIOChannel *ioc,
 	l->active = TRUE;
 }
 
-/**
- * Start a listener.
- *
- * @param l Listener to start.
- */
-gboolean listener_start_tcp(struct irc_listener *l, const char *address, const char *port)
+static gboolean listener_bind_addrinfo(struct irc_listener *l, const char *address,
+									   const char *port, struct addrinfo *all_res)
 {
 	int sock = -1;
 	const int on = 1;
-	struct addrinfo *res, *all_res;
+	struct addrinfo *res;
 	int error;
-	struct addrinfo hints;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = PF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = AI_PASSIVE;
-
-#ifdef AI_ADDRCONFIG
-	hints.ai_flags |= AI_ADDRCONFIG;
-#endif
-
-	g_assert(!l->active);
-
-	if (port == NULL)
-		port = DEFAULT_IRC_PORT;
-
-	error = getaddrinfo(address, port, &hints, &all_res);
-	if (error) {
-		listener_log(LOG_ERROR, l, "Can't get address for %s:%s: %s",
-					 address?address:"", port, gai_strerror(error));
-		return FALSE;
-	}
 
 	for (res = all_res; res; res = res->ai_next) {
 		GIOChannel *ioc;
@@ -470,11 +465,89 @@ gboolean listener_start_tcp(struct irc_listener *l, const char *address, const c
 		listener_add_iochannel(l, ioc, canon_address, canon_port);
 	}
 
-	freeaddrinfo(all_res);
-
 	return l->active;
 }
 
+static void listener_address_resolved(struct addrinfo *res, int error, gpointer userdata)
+{
+	struct listener_lookup *lookup = userdata;
+	struct irc_listener *l = lookup->listener;
+
+	l->lookup = NULL;
+
+	if (error) {
+		listener_log(LOG_ERROR, l, "Can't get address for %s:%s: %s",
+					 lookup->address, lookup->port, gai_strerror(error));
+	} else {
+		listener_bind_addrinfo(l, lookup->address, lookup->port, res);
+		freeaddrinfo(res);
+	}
+
+	free_listener_lookup(lookup);
+}
+
+/**
+ * Start a listener.
+ *
+ * Numeric addresses are bound immediately. Host names are looked up
+ * without blocking the main loop, in which case TRUE is returned and
+ * any failure to bind is only logged.
+ *
+ * @param l Listener to start.
+ */
+gboolean listener_start_tcp(struct irc_listener *l, const char *address, const char *port)
+{
+	struct addrinfo *all_res;
+	int error;
+	struct addrinfo hints;
+	struct listener_lookup *lookup;
+	gboolean ret;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+#ifdef AI_ADDRCONFIG
+	hints.ai_flags |= AI_ADDRCONFIG;
+#endif
+
+	g_assert(!l->active);
+	g_assert(l->lookup == NULL);
+
+	if (port == NULL)
+		port = DEFAULT_IRC_PORT;
+
+	/* Wildcard and numeric addresses don't need DNS */
+	if (address != NULL)
+		hints.ai_flags |= AI_NUMERICHOST;
+
+	error = getaddrinfo(address, port, &hints, &all_res);
+	if (error == 0) {
+		ret = listener_bind_addrinfo(l, address, port, all_res);
+		freeaddrinfo(all_res);
+		return ret;
+	}
+
+	if (address == NULL || error != EAI_NONAME) {
+		listener_log(LOG_ERROR, l, "Can't get address for %s:%s: %s",
+					 address?address:"", port, gai_strerror(error));
+		return FALSE;
+	}
+
+	hints.ai_flags &= ~AI_NUMERICHOST;
+
+	lookup = g_new0(struct listener_lookup, 1);
+	lookup->listener = l;
+	lookup->address = g_strdup(address);
+	lookup->port = g_strdup(port);
+	lookup->req = irc_resolve_async(address, port, &hints,
+									listener_address_resolved, lookup);
+	l->lookup = lookup;
+
+	return TRUE;
+}
+
 
 /* TODO:
  *  - support for ipv4 and ipv6 atyp's
@@ -22,6 +22,7 @@ struct irc_listener;
 typedef void (*listener_log_fn) (enum log_level, const struct irc_listener *, const char *);
 
 struct pending_client;
+struct listener_lookup;
 
 /** Callbacks used by listener implementations */
 struct irc_listener_ops {
@@ -56,6 +57,8 @@ struct irc_listener {
 	struct global *global;
 	listener_log_fn log_fn;
 	struct irc_listener_ops *ops;
+	/** Address lookup in progress, if any. */
+	struct listener_lookup *lookup;
 };
 
 enum client_type {
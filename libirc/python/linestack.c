@@ -161,45 +161,115 @@ static PyObject *py_linestack_send(PyLinestackObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+#define LINESTACK_ITER_BLOCK_SIZE 1024
+
+/*
+ * Lines are read a block at a time with linestack_read_block(), with the
+ * GIL released while reading and parsing. In raw mode the lines are
+ * returned as strings and never parsed.
+ */
 typedef struct {
     PyObject_HEAD
     PyLinestackObject *parent;
     guint64 from, to;
+    time_t since, until;
+    gboolean raw;
+    guint block_size;
+    GArray *entries;
+    struct irc_line **lines;
+    guint pos;
 } PyLinestackIterObject;
 
+static void py_linestack_iter_clear(PyLinestackIterObject *self)
+{
+    guint i;
+    for (i = 0; i < self->entries->len; i++) {
+        g_free(g_array_index(self->entries, struct linestack_entry, i).raw);
+        if (self->lines != NULL && self->lines[i] != NULL)
+            free_line(self->lines[i]);
+    }
+    g_array_set_size(self->entries, 0);
+    g_free(self->lines);
+    self->lines = NULL;
+    self->pos = 0;
+}
+
 static int py_linestack_iter_dealloc(PyLinestackIterObject *self)
 {
+    if (self->entries != NULL) {
+        py_linestack_iter_clear(self);
+        g_array_free(self->entries, TRUE);
+    }
     Py_DECREF(self->parent);
     PyObject_Del(self);
     return 0;
 }
 
-static PyObject *py_linestack_iter_next(PyLinestackIterObject *self)
+static gboolean py_linestack_iter_fill(PyLinestackIterObject *self)
 {
-    time_t time;
-    struct irc_line *line = NULL;
+    GError *error = NULL;
     gboolean ret;
+    guint i;
+
+    py_linestack_iter_clear(self);
+
+    while (self->entries->len == 0 && self->from < self->to) {
+        if (!linestack_sync(self->parent->linestack)) {
+            PyErr_SetNone(PyExc_RuntimeError);
+            return FALSE;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        ret = linestack_read_block(self->parent->linestack, &self->from,
+                                   self->to, self->since, self->until,
+                                   self->block_size, self->entries, &error);
+        if (ret && !self->raw) {
+            self->lines = g_new0(struct irc_line *, self->entries->len);
+            for (i = 0; i < self->entries->len; i++)
+                self->lines[i] = irc_parse_line(g_array_index(self->entries,
+                                            struct linestack_entry, i).raw);
+        }
+        Py_END_ALLOW_THREADS
+
+        if (!ret) {
+            PyErr_SetString(PyExc_RuntimeError, error->message);
+            g_error_free(error);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static PyObject *py_linestack_iter_next(PyLinestackIterObject *self)
+{
+    struct linestack_entry *e;
     PyLineObject *py_line;
-    PyObject *py_ret;
-    if (self->from == self->to) {
-        PyErr_SetNone(PyExc_StopIteration);
-        return NULL;
+
+    if (self->pos == self->entries->len) {
+        if (!py_linestack_iter_fill(self))
+            return NULL;
+        if (self->entries->len == 0) {
+            PyErr_SetNone(PyExc_StopIteration);
+            return NULL;
+        }
     }
 
-    ret = linestack_read_entry(self->parent->linestack, self->from,
-                         &line, &time);
-    if (ret == FALSE) {
-        PyErr_SetNone(PyExc_RuntimeError);
-        return NULL;
+    e = &g_array_index(self->entries, struct linestack_entry, self->pos);
+
+    if (self->raw) {
+        self->pos++;
+        return Py_BuildValue("(sl)", e->raw, e->time);
     }
 
     py_line = PyObject_New(PyLineObject, &PyLineType);
-    py_line->line = line;
-
-    py_ret = Py_BuildValue("(Nl)", py_line, time);
+    if (py_line == NULL)
+        return NULL;
+    py_line->line = self->lines[self->pos];
+    self->lines[self->pos] = NULL;
+    self->pos++;
 
-    self->from++;
-    return py_ret;
+    return Py_BuildValue("(Nl)", py_line, e->time);
 }
 
 PyTypeObject PyLinestackIterType = {
@@ -211,9 +281,26 @@ PyTypeObject PyLinestackIterType = {
     .tp_dealloc = (destructor)py_linestack_iter_dealloc,
 };
 
-static PyObject *py_linestack_traverse(PyLinestackObject *self, PyObject *args)
+static PyObject *py_linestack_traverse(PyLinestackObject *self, PyObject *args, PyObject *kwargs)
 {
+    char *kwnames[] = { "from", "to", "raw", "since", "until", "block_size",
+                        NULL };
     PyLinestackIterObject *ret;
+    guint64 from, to;
+    long since = 0, until = 0;
+    int raw = FALSE;
+    unsigned int block_size = LINESTACK_ITER_BLOCK_SIZE;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "LL|illI", kwnames,
+                                     &from, &to, &raw, &since, &until,
+                                     &block_size))
+        return NULL;
+
+    if (block_size == 0) {
+        PyErr_SetString(PyExc_ValueError, "block_size must be positive");
+        return NULL;
+    }
+
     ret = PyObject_New(PyLinestackIterObject, &PyLinestackIterType);
     if (ret == NULL) {
         PyErr_NoMemory();
@@ -222,11 +309,15 @@ static PyObject *py_linestack_traverse(PyLinestackObject *self, PyObject *args)
 
     Py_INCREF(self);
     ret->parent = self;
-
-    if (!PyArg_ParseTuple(args, "LL", &ret->from, &ret->to)) {
-        Py_DECREF(ret);
-        return NULL;
-    }
+    ret->from = from;
+    ret->to = to;
+    ret->since = since;
+    ret->until = until;
+    ret->raw = raw;
+    ret->block_size = block_size;
+    ret->entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+    ret->lines = NULL;
+    ret->pos = 0;
 
     return (PyObject *)ret;
 }
@@ -240,8 +331,11 @@ static PyMethodDef py_linestack_methods[] = {
         METH_NOARGS, "Get marker" },
     { "send", (PyCFunction)py_linestack_send, METH_VARARGS,
         "Send" },
-    { "traverse", (PyCFunction)py_linestack_traverse, METH_VARARGS,
-        "Traverse" },
+    { "traverse", (PyCFunction)py_linestack_traverse,
+        METH_VARARGS|METH_KEYWORDS,
+        "traverse(from, to, raw=False, since=0, until=0, block_size=1024)\n"
+        "Iterate over (line, time) tuples. With raw, lines are returned as "
+        "strings without parsing them." },
     { NULL }
 };
 
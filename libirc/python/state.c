@@ -258,12 +258,12 @@ static PyObject *py_channel_mode_dict_get(PyChannelModeDictObject *self, PyObjec
         return NULL;
     }
 
-    if (self->parent->state->chanmode_option[(uint8_t)mode] == NULL) {
+    if (channel_mode_option(self->parent->state, mode) == NULL) {
         PyErr_SetNone(PyExc_KeyError);
         return NULL;
     }
 
-    return PyString_FromString(self->parent->state->chanmode_option[(uint8_t)mode]);
+    return PyString_FromString(channel_mode_option(self->parent->state, mode));
 }
 
 static int py_channel_mode_dict_set(PyChannelModeDictObject *self, PyObject *py_name, PyObject *py_value)
@@ -286,11 +286,7 @@ static int py_channel_mode_dict_set(PyChannelModeDictObject *self, PyObject *py_
         return -1;
     }
 
-    if (self->parent->state->chanmode_option[(uint8_t)mode] != NULL) {
-        g_free(self->parent->state->chanmode_option[(uint8_t)mode]);
-    }
-
-    self->parent->state->chanmode_option[(uint8_t)mode] = g_strdup(PyString_AsString(py_value));
+    channel_mode_set_option(self->parent->state, mode, PyString_AsString(py_value));
 
     return 0;
 }
@@ -452,7 +448,7 @@ static PyObject *py_channel_nick_dict_add(PyChannelNickDictObject *self, PyObjec
         Py_INCREF(self->parent);
         py_nick->parent = (PyObject *)self->parent;
         if (cs->network != NULL)
-            cs->network->nicks = g_list_append(cs->network->nicks, py_nick->nick);
+            network_state_add_nick(cs->network, py_nick->nick);
     } else {
         /* FIXME: What if we're adding the same nick to multiple channels ? */
         PyErr_SetNone(PyExc_TypeError);
@@ -465,8 +461,7 @@ static PyObject *py_channel_nick_dict_add(PyChannelNickDictObject *self, PyObjec
     string2mode(modestr, cn->modes);
 	cn->channel = cs;
 	cn->global_nick = py_nick->nick;
-	cs->nicks = g_list_append(cs->nicks, cn);
-    cn->global_nick->channel_nicks = g_list_append(cn->global_nick->channel_nicks, cn);
+    channel_state_add_nick(cs, cn);
 
     Py_RETURN_NONE;
 }
@@ -908,7 +903,7 @@ static PyObject *py_network_state_add(PyNetworkStateObject *self, PyObject *obj)
         for (gl = chobj->state->nicks; gl != NULL; gl = gl->next) {
             struct channel_nick *cn = gl->data;
 
-            self->state->nicks = g_list_append(self->state->nicks, cn->global_nick);
+            network_state_add_nick(self->state, cn->global_nick);
         }
 
         Py_RETURN_NONE;
@@ -925,7 +920,7 @@ static PyObject *py_network_state_add(PyNetworkStateObject *self, PyObject *obj)
             return NULL;
         }
 
-        self->state->nicks = g_list_append(self->state->nicks, nickobj->nick);
+        network_state_add_nick(self->state, nickobj->nick);
 
         Py_INCREF(self);
         nickobj->parent = (PyObject *)self;
@@ -15,6 +15,7 @@
 
 import irc
 import os
+import time
 import unittest
 
 class LineTestCase(unittest.TestCase):
@@ -705,3 +706,25 @@ class LinestackTests(unittest.TestCase):
                        irc.FROM_SERVER, state)
         m2 = ls.get_marker()
         self.assertEquals([irc.Line(":somebody!some@host JOIN #bla"), irc.Line(":somebody!some@host PRIVMSG #bla :BAR!")], [l for (l, t) in ls.traverse(m1, m2)])
+
+    def test_traverse_blocks(self):
+        state = self.get_state()
+        ls = irc.Linestack(self.get_path("insert_line"), state, True)
+        m1 = ls.get_marker()
+        for i in range(10):
+            ls.insert_line(":somebody!some@host PRIVMSG #bla :%d" % i,
+                           irc.FROM_SERVER, state)
+        m2 = ls.get_marker()
+        self.assertEquals([":somebody!some@host PRIVMSG #bla :%d" % i for i in range(10)],
+                          [l for (l, t) in ls.traverse(m1, m2, raw=True, block_size=3)])
+
+    def test_traverse_time_range(self):
+        state = self.get_state()
+        ls = irc.Linestack(self.get_path("insert_line"), state, True)
+        m1 = ls.get_marker()
+        ls.insert_line(":somebody!some@host JOIN #bla", irc.FROM_SERVER, state)
+        m2 = ls.get_marker()
+        now = time.time()
+        self.assertEquals([], list(ls.traverse(m1, m2, until=1)))
+        self.assertEquals([], list(ls.traverse(m1, m2, since=int(now) + 3600)))
+        self.assertEquals(1, len(list(ls.traverse(m1, m2, since=int(now) - 3600))))
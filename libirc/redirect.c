@@ -24,6 +24,16 @@
 
 /* TODO: Clean up stack occasionally */
 
+/* Queries that only read information, so that identical queries sent by
+ * different clients at about the same time can share a single reply. */
+static const char *coalesce_queries[] = {
+	"WHO", "NAMES", "MODE", "WHOIS", "LIST", NULL
+};
+
+/* Don't attach to queries older than this (in seconds), the server may
+ * never have answered them. */
+#define QUERY_COALESCE_TIMEOUT 30
+
 struct query_stack *new_query_stack(void (*ref_userdata) (void *), void (*unref_userdata) (void *))
 {
 	struct query_stack *stack = g_new0(struct query_stack, 1);
@@ -518,14 +528,27 @@ static struct query *find_query(char *name)
 
 static void query_stack_free_entry(struct query_stack *stack, struct query_stack_entry *s)
 {
+	GList *gl;
+
 	stack->unref_userdata(s->userdata);
+	for (gl = s->requesters; gl; gl = gl->next)
+		stack->unref_userdata(gl->data);
+	g_list_free(s->requesters);
+	g_free(s->key);
 	g_free(s);
 }
 
-void *query_stack_match_response(struct query_stack *stack, const struct irc_line *l)
+/**
+ * Find the query a response belongs to, and remove it from the stack if
+ * this is the last response to it.
+ *
+ * @return List of requesters to send the response to, first the one
+ * that sent the query upstream.
+ */
+GList *query_stack_match_responses(struct query_stack *stack, const struct irc_line *l)
 {
 	int n;
-	void *ret = NULL;
+	GList *ret;
 	GList *gl;
 
 	g_assert(l->args[0]);
@@ -538,8 +561,8 @@ void *query_stack_match_response(struct query_stack *stack, const struct irc_lin
 		if (is_reply(s->query->replies, n) ||
 			is_reply(s->query->errors, n) ||
 			is_reply(s->query->end_replies, n)) {
-			
-			ret = s->userdata;
+
+			ret = g_list_prepend(g_list_copy(s->requesters), s->userdata);
 
 			/* Not a valid in-between reply ? Remove from stack */
 			if (!is_reply(s->query->replies, n)) {
@@ -555,6 +578,80 @@ void *query_stack_match_response(struct query_stack *stack, const struct irc_lin
 	return NULL;
 }
 
+void *query_stack_match_response(struct query_stack *stack, const struct irc_line *l)
+{
+	GList *requesters = query_stack_match_responses(stack, l);
+	void *ret = (requesters != NULL)?requesters->data:NULL;
+
+	g_list_free(requesters);
+
+	return ret;
+}
+
+static char *coalesce_key(const struct irc_line *l)
+{
+	int i;
+
+	for (i = 0; coalesce_queries[i]; i++) {
+		if (!base_strcmp(coalesce_queries[i], l->args[0]))
+			break;
+	}
+
+	if (coalesce_queries[i] == NULL)
+		return NULL;
+
+	/* Only channel mode and list queries, not changes */
+	if (!base_strcmp(l->args[0], "MODE") &&
+		(l->argc < 2 || l->argc > 3 ||
+		 (l->argc == 3 && strspn(l->args[2], "+beI") != strlen(l->args[2]))))
+		return NULL;
+
+	return g_strjoinv(" ", l->args);
+}
+
+/**
+ * Attach a requester to an identical query that is still waiting for
+ * replies.
+ *
+ * @return TRUE if the query was attached to an outstanding query and
+ * should not be sent to the server, FALSE otherwise.
+ */
+gboolean query_stack_coalesce(struct query_stack *stack, void *userdata, const struct irc_line *l)
+{
+	char *key;
+	GList *gl;
+	time_t now = time(NULL);
+
+	g_assert(l);
+	g_assert(l->args[0]);
+
+	key = coalesce_key(l);
+	if (key == NULL)
+		return FALSE;
+
+	for (gl = stack->entries; gl; gl = gl->next) {
+		struct query_stack_entry *s = gl->data;
+
+		if (s->key == NULL || base_strcmp(s->key, key) != 0 ||
+			now - s->time > QUERY_COALESCE_TIMEOUT)
+			continue;
+
+		/* A requester that asks twice expects two sets of replies */
+		if (s->userdata == userdata ||
+			g_list_find(s->requesters, userdata) != NULL)
+			continue;
+
+		stack->ref_userdata(userdata);
+		s->requesters = g_list_append(s->requesters, userdata);
+
+		g_free(key);
+		return TRUE;
+	}
+
+	g_free(key);
+	return FALSE;
+}
+
 void query_stack_clear(struct query_stack *stack)
 {
 	while (stack->entries != NULL) {
@@ -600,6 +697,8 @@ static int handle_default(const struct irc_line *l, struct query_stack *stack,
 	s->userdata = userdata;
 	s->time = time(NULL);
 	s->query = q;
+	s->key = coalesce_key(l);
+	s->requesters = NULL;
 	stack->entries = g_list_append(stack->entries, s);
 	return 1;
 }
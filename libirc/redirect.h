@@ -45,6 +45,10 @@ struct query_stack_entry {
 	const struct query *query;
 	void *userdata;
 	time_t time;
+	/** Arguments of the query, if it can be shared with other requesters. */
+	char *key;
+	/** Other requesters waiting for the replies to this query. */
+	GList *requesters;
 };
 
 struct query_stack {
@@ -56,7 +60,9 @@ struct query_stack {
 
 
 void *query_stack_match_response(struct query_stack *stack, const struct irc_line *l);
+G_GNUC_WARN_UNUSED_RESULT GList *query_stack_match_responses(struct query_stack *stack, const struct irc_line *l);
 gboolean query_stack_record(struct query_stack *stack, void *c, const struct irc_line *l);
+gboolean query_stack_coalesce(struct query_stack *stack, void *c, const struct irc_line *l);
 G_GNUC_WARN_UNUSED_RESULT struct query_stack *new_query_stack(void (*ref_userdata) (void *), void (*unref_userdata) (void *));
 void query_stack_clear(struct query_stack *n);
 void query_stack_free(struct query_stack *n);
@@ -0,0 +1,145 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "internals.h"
+#include "resolver.h"
+
+/* Number of lookups that can be in progress at the same time */
+#define RESOLVER_MAX_THREADS 4
+
+/*
+ * getaddrinfo() blocks, so lookups are run on a small pool of worker
+ * threads. The worker only fills in the result; the callback is always
+ * run from the main context that requested the lookup, so callers never
+ * have to deal with locking.
+ */
+
+struct irc_resolve_request {
+	char *host;
+	char *service;
+	struct addrinfo hints;
+	gboolean has_hints;
+	struct addrinfo *result;
+	int error;
+	gboolean cancelled;
+	irc_resolve_fn fn;
+	gpointer userdata;
+	GMainContext *context;
+};
+
+static GThreadPool *resolver_pool = NULL;
+
+static void free_resolve_request(struct irc_resolve_request *req)
+{
+	if (req->result != NULL)
+		freeaddrinfo(req->result);
+	if (req->context != NULL)
+		g_main_context_unref(req->context);
+	g_free(req->host);
+	g_free(req->service);
+	g_free(req);
+}
+
+static gboolean resolve_finished(gpointer data)
+{
+	struct irc_resolve_request *req = data;
+
+	if (!req->cancelled) {
+		req->fn(req->result, req->error, req->userdata);
+		req->result = NULL;
+	}
+
+	free_resolve_request(req);
+
+	return FALSE;
+}
+
+static void resolve_worker(gpointer data, gpointer user_data)
+{
+	struct irc_resolve_request *req = data;
+	GSource *source;
+
+	req->error = getaddrinfo(req->host, req->service,
+							 req->has_hints?&req->hints:NULL, &req->result);
+	if (req->error != 0)
+		req->result = NULL;
+
+	source = g_idle_source_new();
+	g_source_set_callback(source, resolve_finished, req, NULL);
+	g_source_attach(source, req->context);
+	g_source_unref(source);
+}
+
+/**
+ * Look up a host name without blocking the main loop.
+ *
+ * @param host Host name to look up
+ * @param service Service name or port number, may be NULL
+ * @param hints Hints to pass to getaddrinfo(), may be NULL
+ * @param fn Function to call with the result
+ * @param userdata Data to pass to fn
+ * @return Handle that can be used to cancel the request
+ */
+struct irc_resolve_request *irc_resolve_async(const char *host, const char *service,
+											  const struct addrinfo *hints,
+											  irc_resolve_fn fn, gpointer userdata)
+{
+	struct irc_resolve_request *req;
+	GError *error = NULL;
+
+	g_assert(fn != NULL);
+
+	req = g_new0(struct irc_resolve_request, 1);
+	req->host = g_strdup(host);
+	req->service = g_strdup(service);
+	if (hints != NULL) {
+		req->hints = *hints;
+		req->has_hints = TRUE;
+	}
+	req->fn = fn;
+	req->userdata = userdata;
+	req->context = g_main_context_ref_thread_default();
+
+	if (resolver_pool == NULL) {
+		resolver_pool = g_thread_pool_new(resolve_worker, NULL,
+										  RESOLVER_MAX_THREADS, FALSE, &error);
+		if (resolver_pool == NULL) {
+			g_warning("Unable to create resolver threads: %s", error->message);
+			g_error_free(error);
+			/* Fall back to resolving synchronously */
+			resolve_worker(req, NULL);
+			return req;
+		}
+	}
+
+	g_thread_pool_push(resolver_pool, req, NULL);
+
+	return req;
+}
+
+/**
+ * Cancel a pending lookup. The callback will not be called.
+ */
+void irc_resolve_cancel(struct irc_resolve_request *req)
+{
+	if (req == NULL)
+		return;
+
+	req->cancelled = TRUE;
+}
@@ -0,0 +1,45 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef __LIBIRC_RESOLVER_H__
+#define __LIBIRC_RESOLVER_H__
+
+/**
+ * @file
+ * @brief Asynchronous host name resolution
+ */
+
+#include <glib.h>
+#include <netdb.h>
+
+struct irc_resolve_request;
+
+/**
+ * Called from the main context that started the lookup once it has
+ * finished. The callback takes ownership of res and should free it
+ * with freeaddrinfo().
+ */
+typedef void (*irc_resolve_fn) (struct addrinfo *res, int error, gpointer userdata);
+
+G_GNUC_WARN_UNUSED_RESULT struct irc_resolve_request *irc_resolve_async(const char *host, const char *service,
+												  const struct addrinfo *hints,
+												  irc_resolve_fn fn, gpointer userdata);
+void irc_resolve_cancel(struct irc_resolve_request *req);
+
+#endif /* __LIBIRC_RESOLVER_H__ */
@@ -0,0 +1,458 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "internals.h"
+#include "search.h"
+#include <string.h>
+
+/*
+ * Inverted index from tokens to the numbers of the linestack lines they
+ * appear in. The text of PRIVMSG, NOTICE and TOPIC lines and the nick
+ * that sent them are split into lowercased tokens of letters, digits and
+ * non-ASCII characters. Lines are added in order, so every posting list
+ * is kept as a sequence of varint-encoded deltas that is only ever
+ * appended to.
+ *
+ * Saved file format (host byte order):
+ *  8 bytes - magic
+ *  4 bytes - version
+ *  8 bytes - number of linestack lines covered
+ *  4 bytes - number of tokens
+ * For each token:
+ *  4 bytes - length of token, followed by the token
+ *  8 bytes - last line number
+ *  4 bytes - number of lines
+ *  4 bytes - length of deltas, followed by the deltas
+ */
+
+#define SEARCH_MAGIC "CPSEARCH"
+#define SEARCH_VERSION 1
+#define SEARCH_MIN_TOKEN 2
+#define SEARCH_MAX_TOKEN 64
+
+struct posting {
+	guint64 last;
+	guint32 count;
+	GByteArray *deltas;
+};
+
+struct search_index {
+	GHashTable *tokens;
+	guint64 lines;
+	gsize size;
+};
+
+typedef void (*token_fn) (const char *token, gsize len, gpointer data);
+
+static void tokenize(const char *text, const char *end, token_fn fn,
+					 gpointer data)
+{
+	char buf[SEARCH_MAX_TOKEN+1];
+	gsize len = 0;
+	const char *p;
+
+	for (p = text; ; p++) {
+		unsigned char c = (p == end)?'\0':*p;
+
+		if (c != '\0' && (g_ascii_isalnum(c) || c == '_' || c >= 0x80)) {
+			if (len < SEARCH_MAX_TOKEN)
+				buf[len++] = g_ascii_tolower(c);
+			continue;
+		}
+
+		if (len >= SEARCH_MIN_TOKEN) {
+			buf[len] = '\0';
+			fn(buf, len, data);
+		}
+		len = 0;
+
+		if (c == '\0')
+			break;
+	}
+}
+
+static void free_posting(struct posting *p)
+{
+	g_byte_array_free(p->deltas, TRUE);
+	g_free(p);
+}
+
+struct search_index *search_index_new(void)
+{
+	struct search_index *idx = g_new0(struct search_index, 1);
+
+	idx->tokens = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+										(GDestroyNotify)free_posting);
+
+	return idx;
+}
+
+void search_index_free(struct search_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	g_hash_table_destroy(idx->tokens);
+	g_free(idx);
+}
+
+static void append_varint(GByteArray *ba, guint64 v)
+{
+	guint8 buf[10];
+	int n = 0;
+
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+	g_byte_array_append(ba, buf, n);
+}
+
+static gboolean read_varint(const guint8 **p, const guint8 *end, guint64 *v)
+{
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		guint8 b = *(*p)++;
+		*v |= (guint64)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return TRUE;
+		shift += 7;
+	}
+
+	return FALSE;
+}
+
+struct add_data {
+	struct search_index *idx;
+	guint64 lineno;
+};
+
+static void add_token(const char *token, gsize len, gpointer data)
+{
+	struct add_data *d = data;
+	struct posting *p = g_hash_table_lookup(d->idx->tokens, token);
+	gsize old_len;
+
+	if (p == NULL) {
+		p = g_new0(struct posting, 1);
+		p->deltas = g_byte_array_new();
+		g_hash_table_insert(d->idx->tokens, g_strndup(token, len), p);
+		d->idx->size += len + 1 + sizeof(struct posting);
+	} else if (p->last >= d->lineno) {
+		/* Already seen on this line */
+		return;
+	}
+
+	old_len = p->deltas->len;
+	append_varint(p->deltas, d->lineno - p->last);
+	d->idx->size += p->deltas->len - old_len;
+	p->last = d->lineno;
+	p->count++;
+}
+
+/**
+ * Add a line to the index. Lines have to be added in order.
+ *
+ * @param idx Index
+ * @param lineno Number of the line in the linestack
+ * @param l The line
+ */
+void search_index_add_line(struct search_index *idx, guint64 lineno,
+						   const struct irc_line *l)
+{
+	struct add_data d;
+
+	if (lineno < idx->lines)
+		return;
+
+	idx->lines = lineno + 1;
+
+	if (l->argc < 3)
+		return;
+
+	if (base_strcmp(l->args[0], "PRIVMSG") &&
+		base_strcmp(l->args[0], "NOTICE") &&
+		base_strcmp(l->args[0], "TOPIC"))
+		return;
+
+	/* The first delta of a posting list is relative to line 0, so line
+	 * numbers are stored off by one to keep that delta non-zero. */
+	d.idx = idx;
+	d.lineno = lineno + 1;
+
+	if (l->origin != NULL)
+		tokenize(l->origin, strchr(l->origin, '!'), add_token, &d);
+
+	tokenize(l->args[l->argc-1], NULL, add_token, &d);
+}
+
+/**
+ * Number of linestack lines covered by the index.
+ */
+guint64 search_index_get_lines(const struct search_index *idx)
+{
+	return idx->lines;
+}
+
+/**
+ * Mark lines as covered by the index without adding them.
+ */
+void search_index_set_lines(struct search_index *idx, guint64 lines)
+{
+	idx->lines = MAX(idx->lines, lines);
+}
+
+void search_index_stats(const struct search_index *idx, guint *tokens,
+						gsize *size)
+{
+	if (tokens != NULL)
+		*tokens = g_hash_table_size(idx->tokens);
+	if (size != NULL)
+		*size = idx->size;
+}
+
+struct lookup_data {
+	const struct search_index *idx;
+	GPtrArray *postings;
+	gboolean missing;
+};
+
+static void lookup_token(const char *token, gsize len, gpointer data)
+{
+	struct lookup_data *d = data;
+	struct posting *p = g_hash_table_lookup(d->idx->tokens, token);
+
+	if (p == NULL)
+		d->missing = TRUE;
+	else
+		g_ptr_array_add(d->postings, p);
+}
+
+static gint posting_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct posting *pa = *(const struct posting **)a;
+	const struct posting *pb = *(const struct posting **)b;
+
+	if (pa->count < pb->count)
+		return -1;
+	return (pa->count > pb->count)?1:0;
+}
+
+/* Only keep the line numbers in matches that also appear in p */
+static void intersect(GArray *matches, const struct posting *p)
+{
+	const guint8 *cur = p->deltas->data, *end = cur + p->deltas->len;
+	guint64 value = 0, delta;
+	guint i, kept = 0;
+	gboolean have = FALSE;
+
+	for (i = 0; i < matches->len; i++) {
+		guint64 want = g_array_index(matches, guint64, i);
+
+		while ((!have || value < want) && read_varint(&cur, end, &delta)) {
+			value += delta;
+			have = TRUE;
+		}
+
+		if (!have || value < want)
+			break;
+
+		if (value == want)
+			g_array_index(matches, guint64, kept++) = want;
+	}
+
+	g_array_set_size(matches, kept);
+}
+
+/**
+ * Find the lines that contain all tokens in a query.
+ *
+ * @param idx Index
+ * @param query Text to search for
+ * @param min_line Ignore lines before this one
+ * @param max Maximum number of lines to return
+ * @return Array of guint64 line numbers, most recent first
+ */
+GArray *search_index_lookup(const struct search_index *idx, const char *query,
+							guint64 min_line, guint max)
+{
+	GArray *matches = g_array_new(FALSE, FALSE, sizeof(guint64));
+	struct lookup_data d;
+	const struct posting *p;
+	const guint8 *cur, *end;
+	guint64 value = 0, delta;
+	guint i, n;
+
+	d.idx = idx;
+	d.postings = g_ptr_array_new();
+	d.missing = FALSE;
+	tokenize(query, NULL, lookup_token, &d);
+
+	if (d.missing || d.postings->len == 0) {
+		g_ptr_array_free(d.postings, TRUE);
+		return matches;
+	}
+
+	/* Start with the rarest token, so the candidate list is as short as
+	 * possible */
+	g_ptr_array_sort(d.postings, posting_cmp);
+
+	p = g_ptr_array_index(d.postings, 0);
+	cur = p->deltas->data;
+	end = cur + p->deltas->len;
+	while (read_varint(&cur, end, &delta)) {
+		value += delta;
+		if (value > min_line)
+			g_array_append_val(matches, value);
+	}
+
+	for (i = 1; i < d.postings->len && matches->len > 0; i++)
+		intersect(matches, g_ptr_array_index(d.postings, i));
+
+	g_ptr_array_free(d.postings, TRUE);
+
+	/* Keep the last max matches, newest first, and undo the offset */
+	n = MIN(matches->len, max);
+	for (i = 0; i < n; i++) {
+		guint64 v = g_array_index(matches, guint64, matches->len - 1 - i);
+		g_array_index(matches, guint64, i) = v - 1;
+	}
+	g_array_set_size(matches, n);
+
+	return matches;
+}
+
+static void save_token(gpointer key, gpointer value, gpointer data)
+{
+	GByteArray *ba = data;
+	struct posting *p = value;
+	guint32 len = strlen(key);
+
+	g_byte_array_append(ba, (guint8 *)&len, sizeof(len));
+	g_byte_array_append(ba, key, len);
+	g_byte_array_append(ba, (guint8 *)&p->last, sizeof(p->last));
+	g_byte_array_append(ba, (guint8 *)&p->count, sizeof(p->count));
+	len = p->deltas->len;
+	g_byte_array_append(ba, (guint8 *)&len, sizeof(len));
+	g_byte_array_append(ba, p->deltas->data, len);
+}
+
+/**
+ * Write the index to a file, atomically replacing any earlier version.
+ */
+gboolean search_index_save(const struct search_index *idx, const char *path,
+						   GError **error)
+{
+	GByteArray *ba = g_byte_array_sized_new(idx->size + 64);
+	guint32 version = SEARCH_VERSION;
+	guint32 count = g_hash_table_size(idx->tokens);
+	gboolean ret;
+
+	g_byte_array_append(ba, (guint8 *)SEARCH_MAGIC, strlen(SEARCH_MAGIC));
+	g_byte_array_append(ba, (guint8 *)&version, sizeof(version));
+	g_byte_array_append(ba, (guint8 *)&idx->lines, sizeof(idx->lines));
+	g_byte_array_append(ba, (guint8 *)&count, sizeof(count));
+	g_hash_table_foreach(idx->tokens, save_token, ba);
+
+	ret = g_file_set_contents(path, (char *)ba->data, ba->len, error);
+	g_byte_array_free(ba, TRUE);
+	return ret;
+}
+
+static gboolean read_bytes(const guint8 **p, const guint8 *end, void *out,
+						   gsize len)
+{
+	if (end - *p < len)
+		return FALSE;
+	memcpy(out, *p, len);
+	*p += len;
+	return TRUE;
+}
+
+/**
+ * Load an index saved with search_index_save().
+ */
+struct search_index *search_index_load(const char *path, GError **error)
+{
+	struct search_index *idx;
+	char *contents;
+	gsize length;
+	const guint8 *p, *end;
+	char magic[8];
+	guint32 version, count, i;
+
+	if (!g_file_get_contents(path, &contents, &length, error))
+		return NULL;
+
+	p = (guint8 *)contents;
+	end = p + length;
+
+	if (!read_bytes(&p, end, magic, sizeof(magic)) ||
+		memcmp(magic, SEARCH_MAGIC, sizeof(magic)) != 0 ||
+		!read_bytes(&p, end, &version, sizeof(version)) ||
+		version != SEARCH_VERSION) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+					"`%s' is not a search index", path);
+		g_free(contents);
+		return NULL;
+	}
+
+	idx = search_index_new();
+
+	if (!read_bytes(&p, end, &idx->lines, sizeof(idx->lines)) ||
+		!read_bytes(&p, end, &count, sizeof(count)))
+		goto truncated;
+
+	for (i = 0; i < count; i++) {
+		struct posting *posting;
+		guint32 len;
+		char *token;
+
+		if (!read_bytes(&p, end, &len, sizeof(len)) || end - p < len)
+			goto truncated;
+		token = g_strndup((const char *)p, len);
+		p += len;
+
+		posting = g_new0(struct posting, 1);
+		posting->deltas = g_byte_array_new();
+		g_hash_table_replace(idx->tokens, token, posting);
+
+		if (!read_bytes(&p, end, &posting->last, sizeof(posting->last)) ||
+			!read_bytes(&p, end, &posting->count, sizeof(posting->count)) ||
+			!read_bytes(&p, end, &len, sizeof(len)) || end - p < len)
+			goto truncated;
+		g_byte_array_append(posting->deltas, p, len);
+		p += len;
+
+		idx->size += strlen(token) + 1 + sizeof(struct posting) + len;
+	}
+
+	g_free(contents);
+	return idx;
+
+truncated:
+	g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_FAILED,
+				"search index `%s' is truncated", path);
+	search_index_free(idx);
+	g_free(contents);
+	return NULL;
+}
@@ -0,0 +1,47 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef __LIBIRC_SEARCH_H__
+#define __LIBIRC_SEARCH_H__
+
+/**
+ * @file
+ * @brief Full-text index over the lines in a linestack
+ */
+
+#include <glib.h>
+
+struct irc_line;
+struct search_index;
+
+G_GNUC_WARN_UNUSED_RESULT struct search_index *search_index_new(void);
+void search_index_free(struct search_index *idx);
+void search_index_add_line(struct search_index *idx, guint64 lineno,
+						   const struct irc_line *l);
+guint64 search_index_get_lines(const struct search_index *idx);
+void search_index_set_lines(struct search_index *idx, guint64 lines);
+void search_index_stats(const struct search_index *idx, guint *tokens, gsize *size);
+G_GNUC_WARN_UNUSED_RESULT GArray *search_index_lookup(const struct search_index *idx,
+						   const char *query, guint64 min_line, guint max);
+gboolean search_index_save(const struct search_index *idx, const char *path,
+						   GError **error);
+G_GNUC_WARN_UNUSED_RESULT struct search_index *search_index_load(const char *path,
+																 GError **error);
+
+#endif /* __LIBIRC_SEARCH_H__ */
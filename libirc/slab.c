@@ -0,0 +1,232 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "internals.h"
+#include "slab.h"
+#include <stdlib.h>
+
+/*
+ * Objects are carved out of chunks of SLAB_CHUNK_SIZE bytes that are
+ * aligned to their own size, so the chunk an object belongs to can be
+ * found by masking its address. Every chunk keeps its own free list;
+ * chunks with free slots are kept on a separate list from full ones so
+ * allocation never has to search. A chunk whose last object is freed is
+ * returned to the system, except for one spare that is kept around so
+ * a join/part cycle does not allocate and release a chunk every time.
+ */
+
+#define SLAB_CHUNK_SIZE (64 * 1024)
+#define SLAB_ALIGN (2 * sizeof(gpointer))
+#define SLAB_ROUND(n) (((n) + SLAB_ALIGN - 1) & ~(gsize)(SLAB_ALIGN - 1))
+
+struct irc_slab_chunk {
+	struct irc_slab *slab;
+	struct irc_slab_chunk *prev, *next;
+	/* Objects that have been freed and can be handed out again */
+	gpointer free_list;
+	/* Number of objects carved out of the chunk so far */
+	guint carved;
+	guint in_use;
+};
+
+#define SLAB_HEADER_SIZE SLAB_ROUND(sizeof(struct irc_slab_chunk))
+
+struct irc_slab {
+	gsize object_size;
+	guint objects_per_chunk;
+	/* Chunks with at least one free slot */
+	struct irc_slab_chunk *partial;
+	struct irc_slab_chunk *full;
+	/* Empty chunk kept for reuse */
+	struct irc_slab_chunk *spare;
+	gsize in_use;
+	gsize num_chunks;
+};
+
+static void chunk_list_remove(struct irc_slab_chunk **list,
+							  struct irc_slab_chunk *chunk)
+{
+	if (chunk->prev != NULL)
+		chunk->prev->next = chunk->next;
+	else
+		*list = chunk->next;
+	if (chunk->next != NULL)
+		chunk->next->prev = chunk->prev;
+	chunk->prev = chunk->next = NULL;
+}
+
+static void chunk_list_push(struct irc_slab_chunk **list,
+							struct irc_slab_chunk *chunk)
+{
+	chunk->prev = NULL;
+	chunk->next = *list;
+	if (*list != NULL)
+		(*list)->prev = chunk;
+	*list = chunk;
+}
+
+static void chunk_list_free(struct irc_slab_chunk *list)
+{
+	while (list != NULL) {
+		struct irc_slab_chunk *next = list->next;
+		free(list);
+		list = next;
+	}
+}
+
+static struct irc_slab_chunk *chunk_new(struct irc_slab *slab)
+{
+	struct irc_slab_chunk *chunk;
+	void *mem;
+
+	if (posix_memalign(&mem, SLAB_CHUNK_SIZE, SLAB_CHUNK_SIZE) != 0)
+		g_error("unable to allocate %d bytes for slab", SLAB_CHUNK_SIZE);
+
+	chunk = mem;
+	chunk->slab = slab;
+	chunk->prev = chunk->next = NULL;
+	chunk->free_list = NULL;
+	chunk->carved = 0;
+	chunk->in_use = 0;
+	slab->num_chunks++;
+	return chunk;
+}
+
+/**
+ * Create a slab for objects of the specified size.
+ *
+ * @param object_size Size of the objects that will be allocated
+ */
+struct irc_slab *irc_slab_new(gsize object_size)
+{
+	struct irc_slab *slab = g_new0(struct irc_slab, 1);
+
+	slab->object_size = SLAB_ROUND(MAX(object_size, sizeof(gpointer)));
+	g_assert(slab->object_size <= SLAB_CHUNK_SIZE - SLAB_HEADER_SIZE);
+	slab->objects_per_chunk = (SLAB_CHUNK_SIZE - SLAB_HEADER_SIZE) / slab->object_size;
+
+	return slab;
+}
+
+/**
+ * Allocate a zero-filled object from a slab.
+ */
+gpointer irc_slab_alloc0(struct irc_slab *slab)
+{
+	struct irc_slab_chunk *chunk;
+	gpointer object;
+
+	g_assert(slab != NULL);
+
+	chunk = slab->partial;
+	if (chunk == NULL) {
+		if (slab->spare != NULL) {
+			chunk = slab->spare;
+			slab->spare = NULL;
+		} else {
+			chunk = chunk_new(slab);
+		}
+		chunk_list_push(&slab->partial, chunk);
+	}
+
+	if (chunk->free_list != NULL) {
+		object = chunk->free_list;
+		chunk->free_list = *(gpointer *)object;
+	} else {
+		g_assert(chunk->carved < slab->objects_per_chunk);
+		object = (char *)chunk + SLAB_HEADER_SIZE +
+				 chunk->carved * slab->object_size;
+		chunk->carved++;
+	}
+
+	chunk->in_use++;
+	slab->in_use++;
+
+	if (chunk->in_use == slab->objects_per_chunk) {
+		chunk_list_remove(&slab->partial, chunk);
+		chunk_list_push(&slab->full, chunk);
+	}
+
+	memset(object, 0, slab->object_size);
+	return object;
+}
+
+/**
+ * Return an object to the slab it was allocated from.
+ */
+void irc_slab_free(struct irc_slab *slab, gpointer object)
+{
+	struct irc_slab_chunk *chunk;
+
+	g_assert(slab != NULL);
+	g_assert(object != NULL);
+
+	chunk = (struct irc_slab_chunk *)((gsize)object & ~(gsize)(SLAB_CHUNK_SIZE - 1));
+	g_assert(chunk->slab == slab);
+	g_assert(chunk->in_use > 0);
+
+	if (chunk->in_use == slab->objects_per_chunk) {
+		chunk_list_remove(&slab->full, chunk);
+		chunk_list_push(&slab->partial, chunk);
+	}
+
+	*(gpointer *)object = chunk->free_list;
+	chunk->free_list = object;
+	chunk->in_use--;
+	slab->in_use--;
+
+	if (chunk->in_use == 0) {
+		chunk_list_remove(&slab->partial, chunk);
+		if (slab->spare == NULL) {
+			chunk->free_list = NULL;
+			chunk->carved = 0;
+			slab->spare = chunk;
+		} else {
+			free(chunk);
+			slab->num_chunks--;
+		}
+	}
+}
+
+/**
+ * Report the number of objects in use and the number of bytes
+ * allocated for a slab.
+ */
+void irc_slab_stats(const struct irc_slab *slab, gsize *in_use,
+					gsize *allocated)
+{
+	if (in_use != NULL)
+		*in_use = slab->in_use;
+	if (allocated != NULL)
+		*allocated = slab->num_chunks * SLAB_CHUNK_SIZE;
+}
+
+/**
+ * Release a slab and all objects allocated from it at once.
+ */
+void irc_slab_destroy(struct irc_slab *slab)
+{
+	if (slab == NULL)
+		return;
+
+	chunk_list_free(slab->partial);
+	chunk_list_free(slab->full);
+	free(slab->spare);
+	g_free(slab);
+}
@@ -0,0 +1,39 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef __LIBIRC_SLAB_H__
+#define __LIBIRC_SLAB_H__
+
+/**
+ * @file
+ * @brief Slab allocator for fixed-size objects
+ */
+
+#include <glib.h>
+#include <gmodule.h>
+
+struct irc_slab;
+
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct irc_slab *irc_slab_new(gsize object_size);
+G_GNUC_MALLOC G_MODULE_EXPORT gpointer irc_slab_alloc0(struct irc_slab *slab);
+G_MODULE_EXPORT void irc_slab_free(struct irc_slab *slab, gpointer object);
+G_MODULE_EXPORT void irc_slab_stats(const struct irc_slab *slab, gsize *in_use, gsize *allocated);
+G_MODULE_EXPORT void irc_slab_destroy(struct irc_slab *slab);
+
+#endif /* __LIBIRC_SLAB_H__ */
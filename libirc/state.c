@@ -19,6 +19,7 @@
 
 #include "internals.h"
 #include "irc.h"
+#include "slab.h"
 
 enum mode_type { REMOVE = 0, ADD = 1 };
 
@@ -29,8 +30,67 @@ enum mode_type { REMOVE = 0, ADD = 1 };
 		return; \
 	}
 
-void network_nick_set_data(struct network_nick *n, const char *nick,
-						   const char *username, const char *host)
+struct channel_reply_cache *channel_reply_cache_new(const char *origin,
+		const char *target, const struct irc_network_info *info)
+{
+	struct channel_reply_cache *cache = g_new0(struct channel_reply_cache, 1);
+
+	cache->origin = g_strdup(origin);
+	cache->target = g_strdup(target);
+	cache->info = info;
+
+	return cache;
+}
+
+/**
+ * Check whether cached replies were built for the same origin and target.
+ */
+gboolean channel_reply_cache_matches(const struct channel_reply_cache *cache,
+		const char *origin, const char *target,
+		const struct irc_network_info *info)
+{
+	return (cache != NULL && cache->info == info &&
+			g_strcmp0(cache->origin, origin) == 0 &&
+			g_strcmp0(cache->target, target) == 0);
+}
+
+void free_channel_reply_cache(struct channel_reply_cache *cache)
+{
+	if (cache == NULL)
+		return;
+
+	g_list_foreach(cache->lines, (GFunc)free_line, NULL);
+	g_list_free(cache->lines);
+	g_free(cache->origin);
+	g_free(cache->target);
+	g_free(cache);
+}
+
+/**
+ * Drop the cached NAMES and WHO replies for a channel, because its nick
+ * list or the information about one of its nicks changed.
+ */
+void channel_state_invalidate_replies(struct irc_channel_state *c)
+{
+	free_channel_reply_cache(c->names_cache);
+	c->names_cache = NULL;
+	free_channel_reply_cache(c->who_cache);
+	c->who_cache = NULL;
+}
+
+static void network_nick_invalidate_replies(struct network_nick *n)
+{
+	GList *gl;
+
+	for (gl = n->channel_nicks; gl; gl = gl->next) {
+		struct channel_nick *cn = gl->data;
+		channel_state_invalidate_replies(cn->channel);
+	}
+}
+
+/* Returns whether anything changed; the caller invalidates the replies */
+static gboolean update_nick_data(struct network_nick *n, const char *nick,
+								 const char *username, const char *host)
 {
 	gboolean changed = FALSE;
 
@@ -58,6 +118,15 @@ void network_nick_set_data(struct network_nick *n, const char *nick,
 		g_free(n->hostmask);
 		n->hostmask = g_strdup_printf("%s!%s@%s", nick, username, host);
 	}
+
+	return changed;
+}
+
+void network_nick_set_data(struct network_nick *n, const char *nick,
+						   const char *username, const char *host)
+{
+	if (update_nick_data(n, nick, username, host))
+		network_nick_invalidate_replies(n);
 }
 
 gboolean network_nick_set_nick(struct network_nick *n, const char *nick)
@@ -74,6 +143,8 @@ gboolean network_nick_set_nick(struct network_nick *n, const char *nick)
 	g_free(n->hostmask);
 	n->hostmask = g_strdup_printf("%s!%s@%s", nick, n->username, n->hostname);
 
+	network_nick_invalidate_replies(n);
+
 	return TRUE;
 }
 
@@ -91,6 +162,8 @@ gboolean network_nick_set_username(struct network_nick *n, const char *username)
 	g_free(n->hostmask);
 	n->hostmask = g_strdup_printf("%s!%s@%s", n->nick, n->username, n->hostname);
 
+	network_nick_invalidate_replies(n);
+
 	return TRUE;
 }
 
@@ -108,6 +181,8 @@ gboolean network_nick_set_hostname(struct network_nick *n, const char *hostname)
 	g_free(n->hostmask);
 	n->hostmask = g_strdup_printf("%s!%s@%s", n->nick, n->username, n->hostname);
 
+	network_nick_invalidate_replies(n);
+
 	return TRUE;
 }
 
@@ -124,6 +199,8 @@ gboolean network_nick_set_hostmask(struct network_nick *n, const char *hm)
 	if (n->hostmask && !strcmp(n->hostmask, hm))
 		return TRUE;
 
+	network_nick_invalidate_replies(n);
+
 	g_free(n->hostmask);
 	g_free(n->nick); n->nick = NULL;
 	g_free(n->username); n->username = NULL;
@@ -145,21 +222,162 @@ gboolean network_nick_set_hostmask(struct network_nick *n, const char *hm)
 	return TRUE;
 }
 
+/*
+ * Append data to a list, keeping track of the last element if tail is
+ * not NULL. Returns the new element, which can later be passed to
+ * list_unlink() to remove it in constant time.
+ */
+static GList *list_append_link(GList **list, GList **tail, gpointer data)
+{
+	GList *last, *link;
+
+	if (tail != NULL && *tail != NULL && (*tail)->next == NULL)
+		last = *tail;
+	else
+		last = g_list_last(*list);
+
+	link = g_list_alloc();
+	link->data = data;
+	link->next = NULL;
+	link->prev = last;
+
+	if (last != NULL)
+		last->next = link;
+	else
+		*list = link;
+
+	if (tail != NULL)
+		*tail = link;
+
+	return link;
+}
+
+static void list_unlink(GList **list, GList **tail, GList *link, gpointer data)
+{
+	/* Entries added by code that doesn't record the link */
+	if (link == NULL || link->data != data)
+		link = g_list_find(*list, data);
+
+	if (link == NULL)
+		return;
+
+	if (tail != NULL && *tail == link)
+		*tail = link->prev;
+
+	*list = g_list_delete_link(*list, link);
+}
+
+/**
+ * Add a nick to the list of nicks known on a network.
+ */
+void network_state_add_nick(struct irc_network_state *st, struct network_nick *nn)
+{
+	nn->network_link = list_append_link(&st->nicks, &st->nicks_tail, nn);
+}
+
+/**
+ * Add a nick to a channel.
+ */
+void channel_state_add_nick(struct irc_channel_state *c, struct channel_nick *cn)
+{
+	cn->channel_link = list_append_link(&c->nicks, &c->nicks_tail, cn);
+	cn->nick_link = list_append_link(&cn->global_nick->channel_nicks, NULL, cn);
+}
+
+/*
+ * While a NAMES reply for a channel is coming in, the channel members and
+ * the network nicks are indexed by their case folded name so that each
+ * entry in the reply can be handled without searching the lists. The
+ * index is dropped as soon as anything else changes the state, and
+ * rebuilt if more of the reply follows.
+ */
+struct names_burst {
+	struct irc_channel_state *channel;
+	GHashTable *members;
+	GHashTable *nicks;
+};
+
+static void names_burst_free(struct irc_network_state *s)
+{
+	if (s == NULL || s->names_burst == NULL)
+		return;
+
+	g_hash_table_destroy(s->names_burst->members);
+	g_hash_table_destroy(s->names_burst->nicks);
+	g_free(s->names_burst);
+	s->names_burst = NULL;
+}
+
+static struct names_burst *names_burst_get(struct irc_network_state *s,
+										   struct irc_channel_state *c)
+{
+	struct names_burst *burst;
+	GList *gl;
+
+	if (s->names_burst != NULL && s->names_burst->channel == c)
+		return s->names_burst;
+
+	names_burst_free(s);
+
+	burst = g_new0(struct names_burst, 1);
+	burst->channel = c;
+	burst->members = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	burst->nicks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	for (gl = c->nicks; gl; gl = gl->next) {
+		struct channel_nick *cn = gl->data;
+		g_hash_table_replace(burst->members,
+			irc_casefold(s->info, cn->global_nick->nick), cn);
+	}
+
+	for (gl = s->nicks; gl; gl = gl->next) {
+		struct network_nick *nn = gl->data;
+		g_hash_table_replace(burst->nicks, irc_casefold(s->info, nn->nick), nn);
+	}
+	g_hash_table_replace(burst->nicks, irc_casefold(s->info, s->me.nick), &s->me);
+
+	s->names_burst = burst;
+
+	return burst;
+}
+
+static struct channel_nick *channel_nick_alloc(struct irc_channel_state *c)
+{
+	struct channel_nick *n;
+
+	n = irc_slab_alloc0(c->network->channel_nick_slab);
+	n->slab_allocated = TRUE;
+	n->channel = c;
+	return n;
+}
+
 static void free_channel_nick(struct channel_nick *n)
 {
+	struct irc_network_state *st;
+
 	g_assert(n);
 
 	g_assert(n->channel);
 	g_assert(n->global_nick);
 
-	n->channel->nicks = g_list_remove(n->channel->nicks, n);
-	n->global_nick->channel_nicks = g_list_remove(n->global_nick->channel_nicks, n);
+	st = n->channel->network;
+	names_burst_free(st);
 
-	if (g_list_length(n->global_nick->channel_nicks) == 0 && n->global_nick->query == 0)
-		free_network_nick(n->channel->network, n->global_nick);
+	channel_state_invalidate_replies(n->channel);
+	list_unlink(&n->channel->nicks, &n->channel->nicks_tail,
+				n->channel_link, n);
+	list_unlink(&n->global_nick->channel_nicks, NULL, n->nick_link, n);
+
+	if (n->global_nick->channel_nicks == NULL && n->global_nick->query == 0)
+		free_network_nick(st, n->global_nick);
 
 	g_free(n->last_flags);
-	g_free(n);
+	if (n->slab_allocated) {
+		g_assert(st != NULL);
+		irc_slab_free(st->channel_nick_slab, n);
+	} else {
+		g_free(n);
+	}
 }
 
 gboolean nicklist_add_entry(GList **nicklist, const char *opt_arg,
@@ -225,6 +443,7 @@ static void free_names(struct irc_channel_state *c)
 		free_channel_nick((struct channel_nick *)c->nicks->data);
 	}
 	c->nicks = NULL;
+	c->nicks_tail = NULL;
 }
 
 void free_channel_state(struct irc_channel_state *c)
@@ -232,7 +451,9 @@ void free_channel_state(struct irc_channel_state *c)
 	int i;
 	if (c == NULL)
 		return;
+	names_burst_free(c->network);
 	free_names(c);
+	channel_state_invalidate_replies(c);
 	g_free(c->name);
 	g_free(c->topic);
 	g_free(c->topic_set_by);
@@ -240,13 +461,127 @@ void free_channel_state(struct irc_channel_state *c)
 		c->network->channels = g_list_remove(c->network->channels, c);
 		c->network = NULL;
 	}
-	for (i = 0; i < MAXMODES; i++)
-		g_free(c->chanmode_option[i]);
-	for (i = 0; i < MAXMODES; i++)
-		free_nicklist(&c->chanmode_nicklist[i]);
+	for (i = 0; i < c->num_chanmodes; i++) {
+		g_free(c->chanmodes[i].option);
+		free_nicklist(&c->chanmodes[i].nicklist);
+	}
+	g_free(c->chanmodes);
 	g_free(c);
 }
 
+struct irc_channel_mode *channel_mode_find(const struct irc_channel_state *c, char mode)
+{
+	int i;
+
+	for (i = 0; i < c->num_chanmodes; i++) {
+		if (c->chanmodes[i].mode == mode)
+			return &c->chanmodes[i];
+	}
+
+	return NULL;
+}
+
+struct irc_channel_mode *channel_mode_find_add(struct irc_channel_state *c, char mode)
+{
+	struct irc_channel_mode *cm;
+
+	cm = channel_mode_find(c, mode);
+	if (cm != NULL)
+		return cm;
+
+	c->chanmodes = g_renew(struct irc_channel_mode, c->chanmodes,
+						   c->num_chanmodes+1);
+	cm = &c->chanmodes[c->num_chanmodes++];
+	memset(cm, 0, sizeof(*cm));
+	cm->mode = mode;
+
+	return cm;
+}
+
+/* Drop the entry for a mode once nothing is known about it anymore */
+static void channel_mode_prune(struct irc_channel_state *c, struct irc_channel_mode *cm)
+{
+	int i = cm - c->chanmodes;
+
+	if (cm->option != NULL || cm->nicklist != NULL || cm->nicklist_present)
+		return;
+
+	c->num_chanmodes--;
+	memmove(cm, cm+1, (c->num_chanmodes - i) * sizeof(*cm));
+	if (c->num_chanmodes == 0) {
+		g_free(c->chanmodes);
+		c->chanmodes = NULL;
+	}
+}
+
+GList *channel_mode_get_nicklist(const struct irc_channel_state *c, char mode)
+{
+	struct irc_channel_mode *cm = channel_mode_find(c, mode);
+
+	return (cm == NULL)?NULL:cm->nicklist;
+}
+
+/**
+ * Obtain the list for a mode, for changing it. Creates an entry for the
+ * mode if there wasn't one yet.
+ */
+GList **channel_mode_nicklist_ref(struct irc_channel_state *c, char mode)
+{
+	return &channel_mode_find_add(c, mode)->nicklist;
+}
+
+gboolean channel_mode_get_nicklist_present(const struct irc_channel_state *c, char mode)
+{
+	struct irc_channel_mode *cm = channel_mode_find(c, mode);
+
+	return (cm == NULL)?FALSE:cm->nicklist_present;
+}
+
+void channel_mode_set_nicklist_present(struct irc_channel_state *c, char mode, gboolean present)
+{
+	struct irc_channel_mode *cm;
+
+	if (present) {
+		channel_mode_find_add(c, mode)->nicklist_present = TRUE;
+		return;
+	}
+
+	cm = channel_mode_find(c, mode);
+	if (cm == NULL)
+		return;
+
+	cm->nicklist_present = FALSE;
+	channel_mode_prune(c, cm);
+}
+
+const char *channel_mode_get_option(const struct irc_channel_state *c, char mode)
+{
+	struct irc_channel_mode *cm = channel_mode_find(c, mode);
+
+	return (cm == NULL)?NULL:cm->option;
+}
+
+void channel_mode_set_option(struct irc_channel_state *c, char mode, const char *option)
+{
+	struct irc_channel_mode *cm;
+
+	if (option != NULL) {
+		char *tmp = g_strdup(option);
+		cm = channel_mode_find_add(c, mode);
+		g_free(cm->option);
+		cm->option = tmp;
+		return;
+	}
+
+	cm = channel_mode_find(c, mode);
+	if (cm == NULL)
+		return;
+
+	g_free(cm->option);
+	cm->option = NULL;
+	channel_mode_prune(c, cm);
+}
+
 struct irc_channel_state *find_channel(struct irc_network_state *st, const char *name)
 {
 	GList *cl;
@@ -373,6 +708,21 @@ struct network_nick *find_network_nick(struct irc_network_state *n,
 	return NULL;
 }
 
+static struct network_nick *network_nick_new(struct irc_network_state *n,
+											const char *name)
+{
+	struct network_nick *nd;
+
+	nd = irc_slab_alloc0(n->network_nick_slab);
+	nd->slab_allocated = TRUE;
+	g_assert(!is_prefix(name[0], n->info));
+	nd->nick = g_strdup(name);
+	nd->hops = -1;
+
+	network_state_add_nick(n, nd);
+	return nd;
+}
+
 /**
  * Search for a network nick, or add it if not found.
  *
@@ -392,14 +742,7 @@ struct network_nick *find_add_network_nick(struct irc_network_state *n,
 	if (nd != NULL)
 		return nd;
 
-	/* create one, if it doesn't exist */
-	nd = g_new0(struct network_nick,1);
-	g_assert(!is_prefix(name[0], n->info));
-	nd->nick = g_strdup(name);
-	nd->hops = -1;
-
-	n->nicks = g_list_append(n->nicks, nd);
-	return nd;
+	return network_nick_new(n, name);
 }
 
 /**
@@ -430,18 +773,15 @@ struct channel_nick *find_add_channel_nick(struct irc_channel_state *c,
 	if (n != NULL)
 		return n;
 
-	n = g_new0(struct channel_nick,1);
-	g_assert(n != NULL);
-
-	n->channel = c;
+	n = channel_nick_alloc(c);
 	n->global_nick = find_add_network_nick(c->network, realname);
 	if (prefix != 0) {
 		char mode = get_mode_by_prefix(prefix, c->network->info);
 		if (mode)
 			modes_set_mode(n->modes, mode);
     }
-	c->nicks = g_list_append(c->nicks, n);
-	n->global_nick->channel_nicks = g_list_append(n->global_nick->channel_nicks, n);
+	channel_state_invalidate_replies(c);
+	channel_state_add_nick(c, n);
 	return n;
 }
 
@@ -666,6 +1006,7 @@ static void handle_namreply(struct irc_network_state *s, const struct irc_line *
 {
 	gchar **names;
 	int i;
+	struct names_burst *burst;
 	struct irc_channel_state *c = find_channel(s, l->args[3]);
 
 	if (c == NULL) {
@@ -682,16 +1023,64 @@ static void handle_namreply(struct irc_network_state *s, const struct irc_line *
 	}
 
 	c->mode = l->args[2][0];
+	channel_state_invalidate_replies(c);
+
 	if (!c->namreply_started) {
-		free_names(c);
+		GList *gl;
+		for (gl = c->nicks; gl; gl = gl->next)
+			((struct channel_nick *)gl->data)->names_seen = FALSE;
 		c->namreply_started = TRUE;
 	}
 
+	burst = names_burst_get(s, c);
+
+	/* Members that are already known are kept, so only their modes
+	 * change; members that are not listed are removed at the end */
 	for (i = 0; names[i]; i++) {
-		if (strlen(names[i]) == 0) {
+		const char *realname = names[i];
+		struct channel_nick *cn;
+		char prefix = 0;
+		char *key;
+
+		if (realname[0] == '\0') {
 			continue;
 		}
-		find_add_channel_nick(c, names[i]);
+
+		if (is_prefix(realname[0], s->info)) {
+			prefix = realname[0];
+			realname++;
+		}
+
+		if (realname[0] == '\0') {
+			continue;
+		}
+
+		key = irc_casefold(s->info, realname);
+		cn = g_hash_table_lookup(burst->members, key);
+		if (cn != NULL) {
+			modes_clear(cn->modes);
+			g_free(key);
+		} else {
+			struct network_nick *nn = g_hash_table_lookup(burst->nicks, key);
+
+			if (nn == NULL) {
+				nn = network_nick_new(s, realname);
+				g_hash_table_replace(burst->nicks, g_strdup(key), nn);
+			}
+
+			cn = channel_nick_alloc(c);
+			cn->global_nick = nn;
+			channel_state_add_nick(c, cn);
+			g_hash_table_replace(burst->members, key, cn);
+		}
+
+		if (prefix != 0) {
+			char mode = get_mode_by_prefix(prefix, s->info);
+			if (mode)
+				modes_set_mode(cn->modes, mode);
+		}
+
+		cn->names_seen = TRUE;
 	}
 	g_strfreev(names);
 }
@@ -699,9 +1088,21 @@ static void handle_namreply(struct irc_network_state *s, const struct irc_line *
 static void handle_end_names(struct irc_network_state *s, const struct irc_line *l)
 {
 	struct irc_channel_state *c = find_channel(s, l->args[2]);
-	if (c != NULL)
+	if (c != NULL) {
+		GList *gl, *next;
+
+		if (c->namreply_started) {
+			for (gl = c->nicks; gl; gl = next) {
+				struct channel_nick *cn = gl->data;
+				next = gl->next;
+				if (!cn->names_seen)
+					free_channel_nick(cn);
+				else
+					cn->names_seen = FALSE;
+			}
+		}
 		c->namreply_started = FALSE;
-	else
+	} else
 		network_state_log(LOG_WARNING, s,
 				  "Can't end /NAMES command for %s: channel not found",
 				  l->args[2]);
@@ -719,7 +1120,7 @@ static void handle_invitelist_entry(struct irc_network_state *s, const struct ir
 		return;
 	}
 
-	list = &channel_mode_nicklist(c, 'I');
+	list = channel_mode_nicklist_ref(c, 'I');
 
 	if (!c->invitelist_started) {
 		free_nicklist(list);
@@ -739,7 +1140,7 @@ static void handle_end_invitelist(struct irc_network_state *s, const struct irc_
 	}
 
 	c->invitelist_started = FALSE;
-	channel_mode_nicklist_present(c,'I') = TRUE;
+	channel_mode_set_nicklist_present(c, 'I', TRUE);
 }
 
 static void handle_exceptlist_entry(struct irc_network_state *s, const struct irc_line *l)
@@ -754,7 +1155,7 @@ static void handle_exceptlist_entry(struct irc_network_state *s, const struct ir
 		return;
 	}
 
-	list = &channel_mode_nicklist(c, 'e');
+	list = channel_mode_nicklist_ref(c, 'e');
 
 	if (!c->exceptlist_started) {
 		free_nicklist(list);
@@ -773,7 +1174,7 @@ static void handle_end_exceptlist(struct irc_network_state *s, const struct irc_
 		return;
 	}
 	c->exceptlist_started = FALSE;
-	channel_mode_nicklist_present(c, 'e') = TRUE;
+	channel_mode_set_nicklist_present(c, 'e', TRUE);
 }
 
 
@@ -790,7 +1191,7 @@ static void handle_banlist_entry(struct irc_network_state *s, const struct irc_l
 		return;
 	}
 
-	list = &channel_mode_nicklist(c, 'b');
+	list = channel_mode_nicklist_ref(c, 'b');
 
 	if (!c->banlist_started) {
 		free_nicklist(list);
@@ -812,7 +1213,7 @@ static void handle_end_banlist(struct irc_network_state *s, const struct irc_lin
 	}
 
 	c->banlist_started = FALSE;
-	channel_mode_nicklist_present(c,'b') = TRUE;
+	channel_mode_set_nicklist_present(c, 'b', TRUE);
 }
 
 static void handle_whoreply(struct irc_network_state *s, const struct irc_line *l)
@@ -821,44 +1222,57 @@ static void handle_whoreply(struct irc_network_state *s, const struct irc_line *
 	struct network_nick *nn;
 	struct channel_nick *cn;
 	char *fullname;
+	int hops;
+	gboolean changed;
 
 	nn = find_add_network_nick(s, l->args[6]);
 	g_assert(nn != NULL);
-	network_nick_set_data(nn, l->args[6], l->args[3], l->args[4]);
+	changed = update_nick_data(nn, l->args[6], l->args[3], l->args[4]);
 
 	fullname = NULL;
-	nn->hops = strtol(l->args[8], &fullname, 10);
+	hops = strtol(l->args[8], &fullname, 10);
 	g_assert(fullname);
+	if (nn->hops != hops) {
+		nn->hops = hops;
+		changed = TRUE;
+	}
 
 	if (nn->fullname == NULL) {
 		if (fullname[0] == ' ')
 			fullname++;
 
-		g_free(nn->fullname);
 		nn->fullname = g_strdup(fullname);
+		changed = TRUE;
 	}
 
-	g_free(nn->server);
-	nn->server = g_strdup(l->args[5]);
+	if (nn->server == NULL || strcmp(nn->server, l->args[5]) != 0) {
+		g_free(nn->server);
+		nn->server = g_strdup(l->args[5]);
+		changed = TRUE;
+	}
 
 	cs = find_channel(s, l->args[2]);
-	if (cs == NULL)
-		return;
-
-	cn = find_channel_nick(cs, nn->nick);
+	cn = (cs == NULL)?NULL:find_channel_nick(cs, nn->nick);
 
-	if (cn == NULL) {
+	if (cs != NULL && cn == NULL) {
 		network_state_log(LOG_WARNING,
 						  s,
 						  "User %s in WHO reply not in expected channel %s!",
 						  nn->nick, l->args[2]);
-		return;
 	}
 
-	g_free(cn->last_flags);
-	cn->last_flags = g_strdup(l->args[7]);
+	if (cn != NULL) {
+		if (cn->last_flags == NULL || strcmp(cn->last_flags, l->args[7]) != 0) {
+			g_free(cn->last_flags);
+			cn->last_flags = g_strdup(l->args[7]);
+			changed = TRUE;
+		}
+
+		cn->last_update = time(NULL);
+	}
 
-	cn->last_update = time(NULL);
+	if (changed)
+		network_nick_invalidate_replies(nn);
 }
 
 static void handle_end_who(struct irc_network_state *s, const struct irc_line *l)
@@ -919,10 +1333,10 @@ static int channel_state_change_mode(struct irc_network_state *s, struct network
 
 		if (channel_mode_nicklist_present(c, mode)) {
 			if (set) {
-				nicklist_add_entry(&channel_mode_nicklist(c, mode), opt_arg,
+				nicklist_add_entry(channel_mode_nicklist_ref(c, mode), opt_arg,
 								   by?by->nick:NULL, time(NULL));
 			} else {
-				if (!nicklist_remove_entry(&channel_mode_nicklist(c, mode), opt_arg))  {
+				if (!nicklist_remove_entry(channel_mode_nicklist_ref(c, mode), opt_arg))  {
 					network_state_log(LOG_WARNING, s, "Unable to remove nonpresent %c MODE entry '%s' on %s", mode, opt_arg, c->name);
 					return 1;
 				}
@@ -936,13 +1350,11 @@ static int channel_state_change_mode(struct irc_network_state *s, struct network
 				return -1;
 			}
 
-			g_free(channel_mode_option(c, mode));
-			channel_mode_option(c, mode) = g_strdup(opt_arg);
+			channel_mode_set_option(c, mode, opt_arg);
 
 			return 1;
 		} else {
-			g_free(channel_mode_option(c, mode));
-			channel_mode_option(c, mode) = NULL;
+			channel_mode_set_option(c, mode, NULL);
 
 			return 0;
 		}
@@ -964,6 +1376,7 @@ static int channel_state_change_mode(struct irc_network_state *s, struct network
 		} else {
 			modes_unset_mode(n->modes, mode);
 		}
+		channel_state_invalidate_replies(c);
 		return 1;
 	} else if (cmt == CHANMODE_BOOL) {
 		modes_change_mode(c->modes, set, mode);
@@ -1216,6 +1629,8 @@ gboolean state_handle_data(struct irc_network_state *s, const struct irc_line *l
 				if (l->args[j] == NULL)
 					return FALSE;
 			}
+			if (irc_commands[i].handler != handle_namreply)
+				names_burst_free(s);
 			irc_commands[i].handler(s,l);
 			return TRUE;
 		}
@@ -1232,6 +1647,8 @@ struct irc_network_state *network_state_init(const char *nick,
 	state->me.query = 1;
 	network_nick_set_data(&state->me, nick, username, hostname);
 	state->info = network_info_init();
+	state->network_nick_slab = irc_slab_new(sizeof(struct network_nick));
+	state->channel_nick_slab = irc_slab_new(sizeof(struct channel_nick));
 
 	return state;
 }
@@ -1244,6 +1661,8 @@ void free_network_nick(struct irc_network_state *st, struct network_nick *nn)
 	/* No recursion please... */
 	nn->query = 1;
 
+	names_burst_free(st);
+
 	while (nn->channel_nicks) {
 		struct channel_nick *n = nn->channel_nicks->data;
 		free_channel_nick(n);
@@ -1256,8 +1675,13 @@ void free_network_nick(struct irc_network_state *st, struct network_nick *nn)
 	g_free(nn->server);
 	g_free(nn->nick);
 	if (st != NULL)
-		st->nicks = g_list_remove(st->nicks, nn);
-	g_free(nn);
+		list_unlink(&st->nicks, &st->nicks_tail, nn->network_link, nn);
+	if (nn->slab_allocated) {
+		g_assert(st != NULL);
+		irc_slab_free(st->network_nick_slab, nn);
+	} else {
+		g_free(nn);
+	}
 }
 
 void free_network_state(struct irc_network_state *state)
@@ -1265,6 +1689,8 @@ void free_network_state(struct irc_network_state *state)
 	if (state == NULL)
 		return;
 
+	names_burst_free(state);
+
 	while (state->channels != NULL)
 		free_channel_state((struct irc_channel_state *)state->channels->data);
 
@@ -1280,9 +1706,93 @@ void free_network_state(struct irc_network_state *state)
 	}
 
 	free_network_info(state->info);
+	irc_slab_destroy(state->network_nick_slab);
+	irc_slab_destroy(state->channel_nick_slab);
 	g_free(state);
 }
 
+#define STRING_SIZE(s) ((s) == NULL?0:strlen(s) + 1)
+
+static gsize nicklist_memory(GList *nicklist)
+{
+	gsize size = 0;
+	GList *gl;
+
+	for (gl = nicklist; gl; gl = gl->next) {
+		struct nicklist_entry *be = gl->data;
+		size += sizeof(GList) + sizeof(*be) +
+				STRING_SIZE(be->hostmask) + STRING_SIZE(be->by);
+	}
+
+	return size;
+}
+
+static gsize channel_state_memory(const struct irc_channel_state *ch)
+{
+	gsize size = sizeof(*ch);
+	GList *gl;
+	int i;
+
+	size += STRING_SIZE(ch->name) + STRING_SIZE(ch->topic) +
+			STRING_SIZE(ch->topic_set_by);
+
+	for (gl = ch->nicks; gl; gl = gl->next) {
+		struct channel_nick *cn = gl->data;
+		/* One link in the channel, one in the global nick */
+		size += 2 * sizeof(GList) + STRING_SIZE(cn->last_flags);
+		if (!cn->slab_allocated)
+			size += sizeof(*cn);
+	}
+
+	size += ch->num_chanmodes * sizeof(struct irc_channel_mode);
+	for (i = 0; i < ch->num_chanmodes; i++) {
+		size += STRING_SIZE(ch->chanmodes[i].option);
+		size += nicklist_memory(ch->chanmodes[i].nicklist);
+	}
+
+	return size;
+}
+
+static gsize network_nick_memory(const struct network_nick *nn)
+{
+	return STRING_SIZE(nn->nick) + STRING_SIZE(nn->fullname) +
+		   STRING_SIZE(nn->username) + STRING_SIZE(nn->hostname) +
+		   STRING_SIZE(nn->hostmask) + STRING_SIZE(nn->server);
+}
+
+/**
+ * Estimate the number of bytes used by a network state.
+ *
+ * Nicks are counted by the slabs they live in; strings, channels and
+ * list links are summed up by walking the state, so this is meant for
+ * occasional reporting rather than for calling on every line.
+ */
+gsize network_state_memory(const struct irc_network_state *st)
+{
+	gsize size = sizeof(*st);
+	gsize slab_size;
+	GList *gl;
+
+	irc_slab_stats(st->network_nick_slab, NULL, &slab_size);
+	size += slab_size;
+	irc_slab_stats(st->channel_nick_slab, NULL, &slab_size);
+	size += slab_size;
+
+	size += network_nick_memory(&st->me);
+
+	for (gl = st->nicks; gl; gl = gl->next) {
+		struct network_nick *nn = gl->data;
+		size += sizeof(GList) + network_nick_memory(nn);
+		if (!nn->slab_allocated)
+			size += sizeof(*nn);
+	}
+
+	for (gl = st->channels; gl; gl = gl->next)
+		size += sizeof(GList) + channel_state_memory(gl->data);
+
+	return size;
+}
+
 void network_state_log(enum log_level l,
 					   const struct irc_network_state *st, const char *fmt, ...)
 {
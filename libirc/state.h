@@ -34,6 +34,7 @@ typedef gboolean irc_modes_t[MAXMODES];
 struct irc_network;
 struct irc_client;
 struct irc_line;
+struct irc_slab;
 
 /* When changing one of these structs, also change the marshalling
  * function for that struct in state.c */
@@ -45,6 +46,14 @@ struct channel_nick {
 	irc_modes_t modes;
 	struct network_nick *global_nick;
 	struct irc_channel_state *channel;
+	/* Links of this nick in channel->nicks and global_nick->channel_nicks,
+	 * so it can be removed without searching the lists */
+	GList *channel_link;
+	GList *nick_link;
+	/* Whether the nick was listed in the NAMES reply being received */
+	gboolean names_seen;
+	/* Whether this struct was allocated from the network state slab */
+	gboolean slab_allocated;
 
 	/* This information is not always set and may change */
 	time_t last_update; /* last time this section was updated */
@@ -62,6 +71,10 @@ struct network_nick {
 	irc_modes_t modes;
 	char *server;
 	GList *channel_nicks;
+	/* Link of this nick in the nicks list of the network state */
+	GList *network_link;
+	/* Whether this struct was allocated from the network state slab */
+	gboolean slab_allocated;
 
 	int hops; /* IRC hops from user to this user */
 };
@@ -81,9 +94,36 @@ void free_nicklist(GList **nicklist);
 gboolean nicklist_add_entry(GList **nicklist, const char *opt_arg,
 								   const char *by_nick, time_t at);
 gboolean nicklist_remove_entry(GList **nicklist, const char *hostmask);
-#define channel_mode_nicklist(ch,mode) ((ch)->chanmode_nicklist[(unsigned char)mode])
-#define channel_mode_nicklist_present(ch,mode) ((ch)->chanmode_nicklist_present[(unsigned char)mode])
-#define channel_mode_option(ch,mode) ((ch)->chanmode_option[(unsigned char)mode])
+
+/**
+ * State of a channel mode that keeps a list (bans, exceptions, ...) or
+ * has an argument (key, limit, ...). Channels only have entries for the
+ * modes that are actually set.
+ */
+struct irc_channel_mode {
+	char mode;
+	gboolean nicklist_present;
+	GList *nicklist;
+	char *option;
+};
+
+#define channel_mode_nicklist(ch,mode) channel_mode_get_nicklist(ch,mode)
+#define channel_mode_nicklist_present(ch,mode) channel_mode_get_nicklist_present(ch,mode)
+#define channel_mode_option(ch,mode) channel_mode_get_option(ch,mode)
+
+/**
+ * Replies to a NAMES or WHO query for a channel, as built for a client.
+ * Kept until the information in them changes, so the next client asking
+ * for them does not need them rebuilt.
+ */
+struct channel_reply_cache {
+	char *origin;
+	char *target;
+	const struct irc_network_info *info;
+	GList *lines;
+	/** Oldest time any of the nicks in a WHO reply was updated */
+	time_t oldest_update;
+};
 
 /**
  * The state of a particular channel.
@@ -102,12 +142,16 @@ struct irc_channel_state {
 	gboolean exceptlist_started;
 	gboolean mode_received;
 	GList *nicks;
+	GList *nicks_tail;
 
 	struct irc_network_state *network;
 
-	GList *chanmode_nicklist[MAXMODES];
-	gboolean chanmode_nicklist_present[MAXMODES];
-	char *chanmode_option[MAXMODES];
+	struct irc_channel_mode *chanmodes;
+	int num_chanmodes;
+
+	/* Not marshalled, rebuilt on demand */
+	struct channel_reply_cache *names_cache;
+	struct channel_reply_cache *who_cache;
 };
 
 /**
@@ -123,22 +167,33 @@ struct irc_network_state
 	GList *channels;
 	/** List of known nicks. */
 	GList *nicks;
+	/** Last element of nicks. */
+	GList *nicks_tail;
 	/** Information for the user itself. */
 	struct network_nick me;
 	/** Network static info. */
 	struct irc_network_info *info;
 	/** Whether or not the user is currently away. */
 	gboolean is_away;
+	/** Lookup tables for the NAMES reply being received, if any. */
+	struct names_burst *names_burst;
+	/** Slabs the nicks on this network are allocated from, released
+	 * as a whole when the state is freed. */
+	struct irc_slab *network_nick_slab;
+	struct irc_slab *channel_nick_slab;
 };
 
 /* state.c */
 G_GNUC_WARN_UNUSED_RESULT G_GNUC_MALLOC G_MODULE_EXPORT struct irc_network_state *network_state_init(const char *nick, const char *username, const char *hostname);
 G_MODULE_EXPORT void free_network_state(struct irc_network_state *);
+G_MODULE_EXPORT gsize network_state_memory(const struct irc_network_state *st);
 G_MODULE_EXPORT gboolean state_handle_data(struct irc_network_state *s, const struct irc_line *l);
 
 G_MODULE_EXPORT struct irc_channel_state *find_channel(struct irc_network_state *st, const char *name);
 G_MODULE_EXPORT struct channel_nick *find_channel_nick(struct irc_channel_state *c, const char *name);
 G_MODULE_EXPORT struct channel_nick *find_channel_nick_hostmask(struct irc_channel_state *c, const char *hostmask);
+G_MODULE_EXPORT void network_state_add_nick(struct irc_network_state *st, struct network_nick *nn);
+G_MODULE_EXPORT void channel_state_add_nick(struct irc_channel_state *c, struct channel_nick *cn);
 G_MODULE_EXPORT struct channel_nick *find_add_channel_nick(struct irc_channel_state *c, const char *name);
 G_MODULE_EXPORT struct network_nick *find_network_nick(struct irc_network_state *c, const char *name);
 G_MODULE_EXPORT gboolean network_nick_set_hostmask(struct network_nick *n, const char *hm);
@@ -163,6 +218,18 @@ G_MODULE_EXPORT char get_prefix_by_mode(char mode, const struct irc_network_info
 G_MODULE_EXPORT gboolean is_prefix_mode(const struct irc_network_info *info, char mode);
 
 G_MODULE_EXPORT void free_channel_state(struct irc_channel_state *c);
+G_MODULE_EXPORT struct irc_channel_mode *channel_mode_find(const struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT struct irc_channel_mode *channel_mode_find_add(struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT GList *channel_mode_get_nicklist(const struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT GList **channel_mode_nicklist_ref(struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT gboolean channel_mode_get_nicklist_present(const struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT void channel_mode_set_nicklist_present(struct irc_channel_state *c, char mode, gboolean present);
+G_MODULE_EXPORT const char *channel_mode_get_option(const struct irc_channel_state *c, char mode);
+G_MODULE_EXPORT void channel_mode_set_option(struct irc_channel_state *c, char mode, const char *option);
+G_MODULE_EXPORT void channel_state_invalidate_replies(struct irc_channel_state *c);
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct channel_reply_cache *channel_reply_cache_new(const char *origin, const char *target, const struct irc_network_info *info);
+G_MODULE_EXPORT gboolean channel_reply_cache_matches(const struct channel_reply_cache *cache, const char *origin, const char *target, const struct irc_network_info *info);
+G_MODULE_EXPORT void free_channel_reply_cache(struct channel_reply_cache *cache);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct irc_channel_state *irc_channel_state_new(const char *name);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean network_nick_set_nick(struct network_nick *n, const char *nick);
 G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT gboolean network_nick_set_hostname(struct network_nick *n, const char *hostname);
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include "line.h"
 #include "linestack.h"
 #include "cache.h"
@@ -19,6 +20,11 @@ static void handle_state(int, char **);
 static void handle_exit(int, char **);
 static void handle_insert(int, char **);
 static GHashTable *markers = NULL;
+static int threads = 0;
+static gboolean json = FALSE;
+static gint64 export_from = 0, export_to = -1;
+
+#define EXPORT_BLOCK 4096
 
 /* there are no hup signals here */
 void register_hup_handler(void *fn, void *data) {}
@@ -36,6 +42,7 @@ struct cmd {
 	{ "state", handle_state },
 	{ "exit", handle_exit },
 	{ "insert", handle_insert },
+	{ NULL }
 };
 
 
@@ -170,6 +177,154 @@ static void freels(void)
 	free_linestack_context(ctx);
 }
 
+static void report_problem(guint64 line, const char *problem, void *userdata)
+{
+	printf("line %"PRIu64": %s\n", line, problem);
+}
+
+static int run_fsck(const char *path)
+{
+	struct linestack_context *ls;
+	struct linestack_check_result result;
+	GError *error = NULL;
+	guint64 problems;
+
+	ls = linestack_open_readonly(path, &error);
+	if (ls == NULL) {
+		fprintf(stderr, "Unable to open linestack: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	if (!linestack_check(ls, threads, &result, report_problem, NULL, &error)) {
+		fprintf(stderr, "Unable to check linestack: %s\n", error->message);
+		g_error_free(error);
+		free_linestack_context(ls);
+		return 1;
+	}
+	free_linestack_context(ls);
+
+	printf("%"PRIu64" lines checked\n", result.lines);
+	printf("%"PRIu64" unreadable lines\n", result.bad_lines);
+	printf("%"PRIu64" index records out of order\n", result.bad_offsets);
+	printf("%"PRIu64" missing or unreadable snapshots\n", result.bad_states);
+	/* These are harmless: the clock went back, or a crash left a
+	 * partial line that is cut off the next time the linestack is opened */
+	printf("%"PRIu64" lines older than the line before them\n",
+		   result.time_reversals);
+	printf("%"PRIu64" bytes after the last line\n", result.trailing_bytes);
+
+	problems = result.bad_lines + result.bad_offsets + result.bad_states;
+	return (problems > 0)?1:0;
+}
+
+static int run_reindex(const char *path)
+{
+	GError *error = NULL;
+	guint64 lines, skipped;
+
+	if (!linestack_reindex(path, threads, &lines, &skipped, &error)) {
+		fprintf(stderr, "Unable to rebuild index: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	printf("Indexed %"PRIu64" lines, skipped %"PRIu64" unreadable lines\n",
+		   lines, skipped);
+	return 0;
+}
+
+static void print_json_string(FILE *f, const char *s)
+{
+	char *converted = NULL;
+
+	/* Lines are stored in whatever charset the server used */
+	if (!g_utf8_validate(s, -1, NULL)) {
+		converted = g_convert(s, -1, "UTF-8", "ISO-8859-1", NULL, NULL, NULL);
+		if (converted != NULL)
+			s = converted;
+	}
+
+	fputc('"', f);
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+
+	g_free(converted);
+}
+
+static int run_export(const char *path)
+{
+	struct linestack_context *ls;
+	linestack_marker end;
+	GError *error = NULL;
+	GArray *entries;
+	guint64 from, to;
+	int ret = 0;
+	guint i;
+
+	ls = linestack_open_readonly(path, &error);
+	if (ls == NULL) {
+		fprintf(stderr, "Unable to open linestack: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	end = linestack_get_marker(ls);
+	from = MAX(export_from, 0);
+	to = (export_to < 0 || export_to > *end)?*end:export_to;
+	linestack_free_marker(end);
+
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	while (from < to) {
+		if (!linestack_read_block(ls, &from, to, 0, 0, EXPORT_BLOCK, entries,
+								  &error)) {
+			fprintf(stderr, "Unable to read linestack: %s\n", error->message);
+			g_error_free(error);
+			ret = 1;
+			break;
+		}
+
+		for (i = 0; i < entries->len; i++) {
+			struct linestack_entry *e = &g_array_index(entries,
+												struct linestack_entry, i);
+			if (json) {
+				printf("{\"line\": %"PRIu64", \"time\": %ld, \"raw\": ",
+					   e->index, (long)e->time);
+				print_json_string(stdout, e->raw);
+				printf("}\n");
+			} else {
+				printf("[%ld] %s\n", (long)e->time, e->raw);
+			}
+			g_free(e->raw);
+		}
+		g_array_set_size(entries, 0);
+	}
+	g_array_free(entries, TRUE);
+	free_linestack_context(ls);
+
+	return ret;
+}
+
+/**
+ * Command that runs on a linestack that is not in use, without the shell.
+ */
+struct batch_cmd {
+	const char *name;
+	int (*handler) (const char *path);
+} batch_cmds[] = {
+	{ "fsck", run_fsck },
+	{ "reindex", run_reindex },
+	{ "export", run_export },
+	{ NULL }
+};
+
 int main(int argc, char **argv)
 {
 	GOptionContext *pc;
@@ -177,19 +332,43 @@ int main(int argc, char **argv)
 	struct irc_network_info *info;
 	char *path;
 	GOptionEntry options[] = {
+		{ "threads", 't', 0, G_OPTION_ARG_INT, &threads, "Number of threads for fsck and reindex (default: one per processor)", "N" },
+		{ "json", 0, 0, G_OPTION_ARG_NONE, &json, "Export lines as JSON, one object per line" },
+		{ "from", 0, 0, G_OPTION_ARG_INT64, &export_from, "First line to export", "N" },
+		{ "to", 0, 0, G_OPTION_ARG_INT64, &export_to, "Line to stop exporting at", "N" },
 		{ NULL }
 	};
 
-	pc = g_option_context_new("");
+	pc = g_option_context_new("<directory> <name> [fsck|reindex|export]");
 	g_option_context_add_main_entries(pc, options, NULL);
 	if(!g_option_context_parse(pc, &argc, &argv, NULL))
 		return 1;
 
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <directory> <name>\n", argv[0]);
+		fprintf(stderr, "Usage: %s <directory> <name> [fsck|reindex|export]\n", argv[0]);
 		return 1;
 	}
 
+	if (argc > 3) {
+		int i, ret;
+
+		for (i = 0; batch_cmds[i].name; i++) {
+			if (!strcmp(batch_cmds[i].name, argv[3]))
+				break;
+		}
+
+		if (batch_cmds[i].name == NULL) {
+			fprintf(stderr, "Unknown command `%s'\n", argv[3]);
+			return 1;
+		}
+
+		path = g_build_filename(argv[1], argv[2], NULL);
+		ret = batch_cmds[i].handler(path);
+		g_free(path);
+		g_option_context_free(pc);
+		return ret;
+	}
+
 	info = g_new0(struct irc_network_info, 1);
 
 	state = network_state_init("nick", "username", "hostname");
@@ -28,6 +28,36 @@
 #include <fcntl.h>
 #include <netdb.h>
 
+static const char *transport_backend = "iochannel";
+
+/**
+ * Select the backend used for new transports.
+ *
+ * @param name "iochannel" or "epoll"
+ * @return whether the backend is known and available on this platform
+ */
+gboolean irc_transport_set_backend(const char *name)
+{
+	if (!strcmp(name, "iochannel")) {
+		transport_backend = "iochannel";
+		return TRUE;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	if (!strcmp(name, "epoll")) {
+		transport_backend = "epoll";
+		return TRUE;
+	}
+#endif
+
+	return FALSE;
+}
+
+const char *irc_transport_get_backend(void)
+{
+	return transport_backend;
+}
+
 void irc_transport_disconnect(struct irc_transport *transport)
 {
 	if (!transport->backend_ops->is_connected(transport->backend_data))
@@ -78,7 +108,11 @@ gboolean transport_send_line(struct irc_transport *transport,
 		return FALSE;
 	}
 
-	return transport->backend_ops->send_line(transport, l, error);
+	if (!transport->backend_ops->send_line(transport, l, error))
+		return FALSE;
+
+	irc_line_rate_add(&transport->sent);
+	return TRUE;
 }
 
 gboolean transport_send_response(struct irc_transport *transport, GError **error, const char *from, const char *to, int response, ...)
@@ -124,6 +158,72 @@ char *transport_get_peer_hostname(struct irc_transport *transport)
 	return transport->backend_ops->get_peer_name(transport->backend_data);
 }
 
+/**
+ * Number of lines waiting to be written to the transport.
+ */
+guint transport_get_queue_length(struct irc_transport *transport)
+{
+	if (transport->backend_ops->queue_length == NULL)
+		return 0;
+
+	return transport->backend_ops->queue_length(transport->backend_data);
+}
+
+/**
+ * Number of bytes waiting to be written to the transport.
+ */
+gsize transport_get_queue_size(struct irc_transport *transport)
+{
+	if (transport->backend_ops->queue_size == NULL)
+		return 0;
+
+	return transport->backend_ops->queue_size(transport->backend_data);
+}
+
+/* Number of seconds the lines/sec average is taken over */
+#define LINE_RATE_WINDOW 60
+
+static double line_rate_decay(double per_second, guint count, time_t elapsed)
+{
+	/* Fold in the last full second, then decay for the idle ones */
+	per_second += (count - per_second) / LINE_RATE_WINDOW;
+	for (elapsed--; elapsed > 0 && per_second > 0.001; elapsed--)
+		per_second -= per_second / LINE_RATE_WINDOW;
+	return per_second;
+}
+
+/**
+ * Count a line. Cheap enough to be called for every line.
+ */
+void irc_line_rate_add(struct irc_line_rate *rate)
+{
+	time_t now = time(NULL);
+
+	if (now != rate->second) {
+		if (rate->second != 0 && now > rate->second)
+			rate->per_second = line_rate_decay(rate->per_second, rate->count,
+											   now - rate->second);
+		rate->second = now;
+		rate->count = 0;
+	}
+
+	rate->count++;
+	rate->total++;
+}
+
+/**
+ * Average number of lines per second over roughly the last minute.
+ */
+double irc_line_rate_get(const struct irc_line_rate *rate)
+{
+	time_t now = time(NULL);
+
+	if (rate->second == 0 || now <= rate->second)
+		return rate->per_second;
+
+	return line_rate_decay(rate->per_second, rate->count, now - rate->second);
+}
+
 void irc_transport_set_callbacks(struct irc_transport *transport, const struct irc_transport_callbacks *callbacks, void *userdata)
 {
 	transport->userdata = userdata;
@@ -47,6 +47,19 @@ struct irc_transport_ops {
 	char *(*get_peer_name)(void *data);
 	void (*activate) (struct irc_transport *);
 	gboolean (*set_charset) (struct irc_transport *, const char *);
+	guint (*queue_length) (void *data);
+	gsize (*queue_size) (void *data);
+};
+
+/**
+ * Number of lines that passed through a transport in one direction,
+ * and a moving average of the number of lines per second.
+ */
+struct irc_line_rate {
+	guint64 total;
+	time_t second;
+	guint count;
+	double per_second;
 };
 
 struct irc_transport {
@@ -56,9 +69,14 @@ struct irc_transport {
 	const struct irc_transport_callbacks *callbacks;
 	void *userdata;
 	time_t last_line_sent;
+	struct irc_line_rate received;
+	struct irc_line_rate sent;
 };
 
 G_GNUC_WARN_UNUSED_RESULT struct irc_transport *irc_transport_new_iochannel(GIOChannel *iochannel);
+G_GNUC_WARN_UNUSED_RESULT struct irc_transport *irc_transport_new_epoll(GIOChannel *iochannel);
+gboolean irc_transport_set_backend(const char *name);
+const char *irc_transport_get_backend(void);
 void irc_transport_set_callbacks(struct irc_transport *transport, const struct irc_transport_callbacks *callbacks, void *userdata);
 void irc_transport_disconnect(struct irc_transport *transport);
 void free_irc_transport(struct irc_transport *);
@@ -70,6 +88,10 @@ void transport_parse_buffer(struct irc_transport *transport);
 void irc_transport_set_callbacks(struct irc_transport *transport,
 								 const struct irc_transport_callbacks *callbacks, void *userdata);
 G_GNUC_WARN_UNUSED_RESULT char *transport_get_peer_hostname(struct irc_transport *transport);
+guint transport_get_queue_length(struct irc_transport *transport);
+gsize transport_get_queue_size(struct irc_transport *transport);
+void irc_line_rate_add(struct irc_line_rate *rate);
+double irc_line_rate_get(const struct irc_line_rate *rate);
 
 GQuark irc_transport_error_quark(void);
 #define IRC_TRANSPORT_ERROR irc_transport_error_quark()
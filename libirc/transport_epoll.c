@@ -0,0 +1,686 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Transport backend that talks to sockets directly, using a single epoll
+ * instance for all of them. The epoll fd is the only thing the GLib main
+ * loop polls, so the cost of a main loop iteration does not grow with the
+ * number of sockets.
+ *
+ * Lines are converted and appended to a per-transport output buffer when
+ * they are sent. The buffers are written out right before the main loop
+ * goes back to polling, so all lines generated while handling one event
+ * go out in a single write().
+ */
+
+#include "internals.h"
+#include "transport.h"
+#include "line.h"
+#include "util.h"
+#include "irc.h"
+#include <glib.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+
+/* Number of events handled per epoll_wait() call */
+#define EPOLL_MAX_EVENTS 256
+
+/* Size of the receive buffer that is shared by all transports */
+#define EPOLL_RECV_BUFFER_SIZE 65536
+
+/* Number of reads from a single socket per event, so that one busy
+ * connection can not starve the others */
+#define EPOLL_MAX_READS 4
+
+/* Write immediately rather than at the end of the main loop iteration
+ * once this much output is buffered */
+#define EPOLL_MAX_BUFFERED 65536
+
+struct irc_transport_data_epoll {
+	struct irc_transport *transport;
+	GIOChannel *channel;
+	int fd;
+	guint32 events;
+	gboolean registered;
+	gboolean reading;
+	gboolean pending_disconnect;
+	gboolean dirty;
+	gboolean freed;
+	GIConv incoming_iconv;
+	GIConv outgoing_iconv;
+	GString *inbuf;
+	GString *outbuf;
+	gsize outbuf_offset;
+	guint queued_lines;
+};
+
+struct epoll_reactor {
+	GSource source;
+	GPollFD pfd;
+	int epfd;
+	gboolean dispatching;
+	/* Transports with output that has not been written yet */
+	GList *dirty;
+	/* Transports freed while events for them may still be pending */
+	GList *graveyard;
+};
+
+static struct epoll_reactor *reactor = NULL;
+static char recv_buffer[EPOLL_RECV_BUFFER_SIZE];
+
+static void flush_output(struct irc_transport_data_epoll *bd);
+
+static void update_events(struct irc_transport_data_epoll *bd)
+{
+	struct epoll_event ev;
+	guint32 events = 0;
+
+	if (bd->fd == -1)
+		return;
+
+	if (bd->reading)
+		events |= EPOLLIN;
+	if (bd->outbuf->len > bd->outbuf_offset && !bd->dirty)
+		events |= EPOLLOUT;
+
+	if (bd->registered && events == bd->events)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = bd;
+
+	if (epoll_ctl(reactor->epfd, bd->registered?EPOLL_CTL_MOD:EPOLL_CTL_ADD,
+				  bd->fd, &ev) == 0) {
+		bd->registered = TRUE;
+		bd->events = events;
+	}
+}
+
+static void really_disconnect(struct irc_transport_data_epoll *bd)
+{
+	if (bd->fd == -1)
+		return;
+
+	if (bd->registered)
+		epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, bd->fd, NULL);
+	bd->registered = FALSE;
+	bd->fd = -1;
+
+	if (bd->dirty) {
+		reactor->dirty = g_list_remove(reactor->dirty, bd);
+		bd->dirty = FALSE;
+	}
+
+	g_io_channel_unref(bd->channel);
+	bd->channel = NULL;
+}
+
+static void free_epoll_data(struct irc_transport_data_epoll *bd)
+{
+	if (bd->outgoing_iconv != (GIConv)-1)
+		g_iconv_close(bd->outgoing_iconv);
+	if (bd->incoming_iconv != (GIConv)-1)
+		g_iconv_close(bd->incoming_iconv);
+
+	g_string_free(bd->inbuf, TRUE);
+	g_string_free(bd->outbuf, TRUE);
+	g_free(bd);
+}
+
+static void irc_transport_epoll_free_data(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+
+	g_assert(bd->pending_disconnect);
+
+	really_disconnect(bd);
+	bd->freed = TRUE;
+	bd->transport = NULL;
+
+	if (reactor->dispatching)
+		reactor->graveyard = g_list_prepend(reactor->graveyard, bd);
+	else
+		free_epoll_data(bd);
+}
+
+static char *irc_transport_epoll_get_peer_name(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+	socklen_t len = sizeof(struct sockaddr_storage);
+	struct sockaddr_storage sa;
+	char hostname[NI_MAXHOST];
+
+	if (bd->fd == -1)
+		return NULL;
+
+	if (getpeername(bd->fd, (struct sockaddr *)&sa, &len) < 0) {
+		return NULL;
+	}
+
+	if (sa.ss_family == AF_INET || sa.ss_family == AF_INET6) {
+		if (getnameinfo((struct sockaddr *)&sa, len, hostname, sizeof(hostname),
+						NULL, 0, 0) == 0) {
+			return g_strdup(hostname);
+		}
+	} else if (sa.ss_family == AF_UNIX) {
+		return g_strdup("localhost");
+	}
+
+	return NULL;
+}
+
+static gboolean irc_transport_epoll_set_charset(struct irc_transport *transport, const char *name)
+{
+	struct irc_transport_data_epoll *bd = transport->backend_data;
+	GIConv tmp;
+
+	if (name != NULL) {
+		tmp = g_iconv_open(name, "UTF-8");
+
+		if (tmp == (GIConv)-1) {
+			return FALSE;
+		}
+	} else {
+		tmp = (GIConv)-1;
+	}
+
+	if (bd->outgoing_iconv != (GIConv)-1)
+		g_iconv_close(bd->outgoing_iconv);
+
+	bd->outgoing_iconv = tmp;
+
+	if (name != NULL) {
+		tmp = g_iconv_open("UTF-8", name);
+
+		if (tmp == (GIConv)-1) {
+			return FALSE;
+		}
+	} else {
+		tmp = (GIConv)-1;
+	}
+
+	if (bd->incoming_iconv != (GIConv)-1)
+		g_iconv_close(bd->incoming_iconv);
+
+	bd->incoming_iconv = tmp;
+
+	return TRUE;
+}
+
+static void irc_transport_epoll_disconnect(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+
+	bd->pending_disconnect = TRUE;
+	bd->reading = FALSE;
+
+	/* Try to get the remaining output out now, the main loop may not
+	 * run again before the channel is closed */
+	flush_output(bd);
+
+	if (bd->outbuf->len == bd->outbuf_offset)
+		really_disconnect(bd);
+	else
+		update_events(bd);
+}
+
+static void mark_dirty(struct irc_transport_data_epoll *bd)
+{
+	if (bd->dirty || (bd->events & EPOLLOUT))
+		return;
+
+	bd->dirty = TRUE;
+	reactor->dirty = g_list_prepend(reactor->dirty, bd);
+}
+
+static gboolean irc_transport_epoll_send_line(struct irc_transport *transport, const struct irc_line *l, GError **error)
+{
+	struct irc_transport_data_epoll *bd = transport->backend_data;
+	char *raw, *cvrt;
+	GError *tmp = NULL;
+
+	raw = irc_line_string_nl(l);
+	if (bd->outgoing_iconv != (GIConv)-1) {
+		cvrt = g_convert_with_iconv(raw, -1, bd->outgoing_iconv, NULL, NULL, &tmp);
+		g_free(raw);
+		if (cvrt == NULL) {
+			transport->callbacks->log(transport, l, tmp);
+			g_propagate_error(error, tmp);
+			return FALSE;
+		}
+	} else {
+		cvrt = raw;
+	}
+
+	g_string_append(bd->outbuf, cvrt);
+	g_free(cvrt);
+	bd->queued_lines++;
+
+	if (bd->outbuf->len - bd->outbuf_offset >= EPOLL_MAX_BUFFERED)
+		flush_output(bd);
+	else
+		mark_dirty(bd);
+
+	return TRUE;
+}
+
+static guint count_lines(const char *data, gsize len)
+{
+	guint count = 0;
+	const char *end = data + len;
+
+	while ((data = memchr(data, '\n', end - data)) != NULL) {
+		count++;
+		data++;
+	}
+
+	return count;
+}
+
+static void flush_output(struct irc_transport_data_epoll *bd)
+{
+	struct irc_transport *transport = bd->transport;
+	ssize_t ret;
+
+	if (bd->dirty) {
+		reactor->dirty = g_list_remove(reactor->dirty, bd);
+		bd->dirty = FALSE;
+	}
+
+	while (bd->fd != -1 && bd->outbuf->len > bd->outbuf_offset) {
+		ret = write(bd->fd, bd->outbuf->str + bd->outbuf_offset,
+					bd->outbuf->len - bd->outbuf_offset);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+
+		if (ret < 0) {
+			/* Nothing more can be written */
+			g_string_truncate(bd->outbuf, 0);
+			bd->outbuf_offset = 0;
+			bd->queued_lines = 0;
+			if (transport != NULL && transport->callbacks != NULL &&
+				!bd->pending_disconnect)
+				transport->callbacks->hangup(transport);
+			return;
+		}
+
+		bd->queued_lines -= MIN(bd->queued_lines,
+			count_lines(bd->outbuf->str + bd->outbuf_offset, ret));
+		bd->outbuf_offset += ret;
+		if (transport != NULL)
+			transport->last_line_sent = time(NULL);
+	}
+
+	if (bd->outbuf_offset == bd->outbuf->len) {
+		g_string_truncate(bd->outbuf, 0);
+		bd->outbuf_offset = 0;
+		if (bd->pending_disconnect) {
+			really_disconnect(bd);
+			return;
+		}
+	} else if (bd->outbuf_offset > bd->outbuf->len / 2) {
+		g_string_erase(bd->outbuf, 0, bd->outbuf_offset);
+		bd->outbuf_offset = 0;
+	}
+
+	update_events(bd);
+}
+
+static void handle_input(struct irc_transport_data_epoll *bd)
+{
+	struct irc_transport *transport = bd->transport;
+	int reads;
+
+	for (reads = 0; reads < EPOLL_MAX_READS && bd->reading; reads++) {
+		ssize_t len;
+		char *start, *end;
+
+		len = read(bd->fd, recv_buffer, sizeof(recv_buffer));
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+
+		if (len <= 0) {
+			bd->reading = FALSE;
+			update_events(bd);
+			if (len == 0) {
+				transport->callbacks->hangup(transport);
+			} else {
+				char *tmp = g_strdup_printf("Error reading from client: %s",
+											strerror(errno));
+				transport->callbacks->error(transport, tmp);
+				g_free(tmp);
+			}
+			return;
+		}
+
+		/* Only the incomplete line at the end of the data is copied
+		 * into the transport's own buffer */
+		if (bd->inbuf->len > 0) {
+			g_string_append_len(bd->inbuf, recv_buffer, len);
+			start = bd->inbuf->str;
+			end = start + bd->inbuf->len;
+		} else {
+			start = recv_buffer;
+			end = start + len;
+		}
+
+		while (start < end) {
+			char *nl = memchr(start, '\n', end - start);
+			char *raw, *cvrt;
+			struct irc_line *l;
+			gboolean ret;
+
+			if (nl == NULL)
+				break;
+
+			raw = g_strndup(start, nl - start);
+			start = nl + 1;
+
+			if (bd->incoming_iconv != (GIConv)-1) {
+				GError *error = NULL;
+				cvrt = g_convert_with_iconv(raw, -1, bd->incoming_iconv,
+											NULL, NULL, &error);
+				if (cvrt == NULL) {
+					transport->callbacks->charset_error(transport,
+														error->message);
+					g_error_free(error);
+					g_free(raw);
+					continue;
+				}
+				g_free(raw);
+			} else {
+				cvrt = raw;
+			}
+
+			l = irc_parse_line(cvrt);
+			g_free(cvrt);
+			if (l == NULL)
+				continue;
+
+			irc_line_rate_add(&transport->received);
+			ret = transport->callbacks->recv(transport, l);
+			free_line(l);
+
+			if (bd->freed || bd->fd == -1)
+				return;
+
+			if (!ret) {
+				bd->reading = FALSE;
+				update_events(bd);
+				return;
+			}
+		}
+
+		if (start == bd->inbuf->str) {
+			/* Nothing consumed */
+		} else if (bd->inbuf->len > 0) {
+			g_string_erase(bd->inbuf, 0, start - bd->inbuf->str);
+		} else if (start < end) {
+			g_string_append_len(bd->inbuf, start, end - start);
+		}
+
+		if (bd->inbuf->len > IRC_MAXLINELEN * 4) {
+			/* No line ending in sight */
+			g_string_truncate(bd->inbuf, 0);
+		}
+	}
+}
+
+static void handle_event(struct irc_transport_data_epoll *bd, guint32 events)
+{
+	struct irc_transport *transport = bd->transport;
+
+	if (bd->freed || bd->fd == -1 || transport == NULL ||
+		transport->callbacks == NULL)
+		return;
+
+	if (events & EPOLLERR) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		char *tmp;
+
+		getsockopt(bd->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		bd->reading = FALSE;
+		update_events(bd);
+		tmp = g_strdup_printf("Error reading from client: %s", strerror(err));
+		transport->callbacks->error(transport, tmp);
+		g_free(tmp);
+		return;
+	}
+
+	if (events & EPOLLOUT) {
+		flush_output(bd);
+		if (bd->freed || bd->fd == -1)
+			return;
+	}
+
+	if ((events & EPOLLIN) && bd->reading) {
+		handle_input(bd);
+		return;
+	}
+
+	if ((events & EPOLLHUP) && bd->reading) {
+		bd->reading = FALSE;
+		update_events(bd);
+		transport->callbacks->hangup(transport);
+	}
+}
+
+static void flush_dirty(void)
+{
+	while (reactor->dirty != NULL)
+		flush_output(reactor->dirty->data);
+}
+
+static void bury_dead(void)
+{
+	while (reactor->graveyard != NULL) {
+		free_epoll_data(reactor->graveyard->data);
+		reactor->graveyard = g_list_delete_link(reactor->graveyard,
+												reactor->graveyard);
+	}
+}
+
+static gboolean reactor_prepare(GSource *source, gint *timeout)
+{
+	/* Write out everything that was sent during this iteration before
+	 * the main loop goes to sleep */
+	reactor->dispatching = TRUE;
+	flush_dirty();
+	reactor->dispatching = FALSE;
+	bury_dead();
+
+	*timeout = -1;
+	return FALSE;
+}
+
+static gboolean reactor_check(GSource *source)
+{
+	return (reactor->pfd.revents & G_IO_IN) != 0;
+}
+
+static gboolean reactor_dispatch(GSource *source, GSourceFunc callback,
+								 gpointer user_data)
+{
+	struct epoll_event events[EPOLL_MAX_EVENTS];
+	int n, i;
+
+	n = epoll_wait(reactor->epfd, events, EPOLL_MAX_EVENTS, 0);
+
+	reactor->dispatching = TRUE;
+	for (i = 0; i < n; i++)
+		handle_event(events[i].data.ptr, events[i].events);
+	flush_dirty();
+	reactor->dispatching = FALSE;
+
+	bury_dead();
+
+	return TRUE;
+}
+
+static GSourceFuncs reactor_funcs = {
+	reactor_prepare,
+	reactor_check,
+	reactor_dispatch,
+	NULL
+};
+
+static gboolean init_reactor(void)
+{
+	int epfd;
+
+	if (reactor != NULL)
+		return TRUE;
+
+	epfd = epoll_create(EPOLL_MAX_EVENTS);
+	if (epfd < 0)
+		return FALSE;
+
+	fcntl(epfd, F_SETFD, FD_CLOEXEC);
+
+	reactor = (struct epoll_reactor *)g_source_new(&reactor_funcs,
+												   sizeof(struct epoll_reactor));
+	reactor->epfd = epfd;
+	reactor->pfd.fd = epfd;
+	reactor->pfd.events = G_IO_IN;
+	g_source_add_poll(&reactor->source, &reactor->pfd);
+	g_source_attach(&reactor->source, NULL);
+
+	return TRUE;
+}
+
+static void irc_transport_epoll_activate(struct irc_transport *transport)
+{
+	struct irc_transport_data_epoll *bd = transport->backend_data;
+
+	bd->reading = TRUE;
+	update_events(bd);
+}
+
+static gboolean irc_transport_epoll_is_connected(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+
+	return (bd->fd != -1 && !bd->pending_disconnect);
+}
+
+static guint irc_transport_epoll_queue_length(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+
+	return bd->queued_lines;
+}
+
+static gsize irc_transport_epoll_queue_size(void *data)
+{
+	struct irc_transport_data_epoll *bd = data;
+
+	return bd->outbuf->len - bd->outbuf_offset;
+}
+
+static const struct irc_transport_ops irc_transport_epoll_ops = {
+	.free_data = irc_transport_epoll_free_data,
+	.is_connected = irc_transport_epoll_is_connected,
+	.disconnect = irc_transport_epoll_disconnect,
+	.send_line = irc_transport_epoll_send_line,
+	.get_peer_name = irc_transport_epoll_get_peer_name,
+	.activate = irc_transport_epoll_activate,
+	.set_charset = irc_transport_epoll_set_charset,
+	.queue_length = irc_transport_epoll_queue_length,
+	.queue_size = irc_transport_epoll_queue_size,
+};
+
+/* Whether the channel is a plain file descriptor channel, which can be
+ * bypassed safely. Channels that wrap other channels (TLS) can't. */
+static gboolean is_unix_channel(GIOChannel *iochannel)
+{
+	static GIOFuncs *unix_funcs = NULL;
+
+	if (unix_funcs == NULL) {
+		GIOChannel *tmp = g_io_channel_unix_new(0);
+		unix_funcs = tmp->funcs;
+		g_io_channel_unref(tmp);
+	}
+
+	return iochannel->funcs == unix_funcs;
+}
+
+/**
+ * Create a transport that uses epoll for the file descriptor of a
+ * GIOChannel. The channel is only kept to close the file descriptor
+ * once the transport is disconnected.
+ *
+ * @param iochannel Channel to talk over
+ * @return New transport, or NULL if the channel can not be used with
+ * 	epoll (e.g. a TLS channel).
+ */
+struct irc_transport *irc_transport_new_epoll(GIOChannel *iochannel)
+{
+	struct irc_transport *ret;
+	struct irc_transport_data_epoll *bd;
+	int fd;
+
+	if (!is_unix_channel(iochannel) ||
+		g_io_channel_get_buffer_condition(iochannel) != 0)
+		return NULL;
+
+	if (!init_reactor())
+		return NULL;
+
+	fd = g_io_channel_unix_get_fd(iochannel);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	ret = g_new0(struct irc_transport, 1);
+	bd = g_new0(struct irc_transport_data_epoll, 1);
+
+	ret->backend_ops = &irc_transport_epoll_ops;
+	ret->backend_data = bd;
+	bd->transport = ret;
+	bd->channel = iochannel;
+	bd->fd = fd;
+	bd->inbuf = g_string_new("");
+	bd->outbuf = g_string_new("");
+	bd->outgoing_iconv = bd->incoming_iconv = (GIConv)-1;
+	g_io_channel_ref(iochannel);
+
+	return ret;
+}
+
+#else
+
+struct irc_transport *irc_transport_new_epoll(GIOChannel *iochannel)
+{
+	return NULL;
+}
+
+#endif
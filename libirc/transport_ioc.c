@@ -35,6 +35,8 @@ struct irc_transport_data_iochannel {
 	GIConv incoming_iconv;
 	GIConv outgoing_iconv;
 	GQueue *pending_lines;
+	/* Approximate number of bytes held in pending_lines */
+	gsize pending_bytes;
 };
 
 
@@ -46,6 +48,37 @@ static void free_pending_line(void *_line, void *userdata)
 	free_line((struct irc_line *)_line);
 }
 
+static gsize pending_line_size(const struct irc_line *l)
+{
+	gsize size = 2;
+	int i;
+
+	if (l->origin != NULL)
+		size += strlen(l->origin) + 2;
+	for (i = 0; i < l->argc; i++)
+		size += strlen(l->args[i]) + 1;
+	return size;
+}
+
+static void pending_line_push(struct irc_transport_data_iochannel *backend_data,
+							  struct irc_line *l, gboolean head)
+{
+	if (head)
+		g_queue_push_head(backend_data->pending_lines, l);
+	else
+		g_queue_push_tail(backend_data->pending_lines, l);
+	backend_data->pending_bytes += pending_line_size(l);
+}
+
+static struct irc_line *pending_line_pop(struct irc_transport_data_iochannel *backend_data)
+{
+	struct irc_line *l = g_queue_pop_head(backend_data->pending_lines);
+
+	backend_data->pending_bytes -= MIN(backend_data->pending_bytes,
+									   pending_line_size(l));
+	return l;
+}
+
 static void irc_transport_iochannel_free_data(void *data)
 {
 	struct irc_transport_data_iochannel *backend_data = (struct irc_transport_data_iochannel *)data;
@@ -163,7 +196,7 @@ static gboolean irc_transport_iochannel_send_line(struct irc_transport *transpor
 	}
 
 	if (backend_data->outgoing_id != 0) {
-		g_queue_push_tail(backend_data->pending_lines, linedup(l));
+		pending_line_push(backend_data, linedup(l), FALSE);
 		return TRUE;
 	}
 
@@ -173,7 +206,7 @@ static gboolean irc_transport_iochannel_send_line(struct irc_transport *transpor
 	case G_IO_STATUS_AGAIN:
 		backend_data->outgoing_id = g_io_add_watch(backend_data->incoming, G_IO_OUT,
 										transport_send_queue, transport);
-		g_queue_push_tail(backend_data->pending_lines, linedup(l));
+		pending_line_push(backend_data, linedup(l), FALSE);
 		break;
 	case G_IO_STATUS_EOF:
 		transport->callbacks->hangup(transport);
@@ -272,6 +305,7 @@ static gboolean handle_transport_receive(GIOChannel *c, GIOCondition cond,
 		while ((status = irc_recv_line(c, backend_data->incoming_iconv, &error,
 									   &l)) == G_IO_STATUS_NORMAL) {
 
+			irc_line_rate_add(&transport->received);
 			ret &= transport->callbacks->recv(transport, l);
 			free_line(l);
 
@@ -303,6 +337,20 @@ static gboolean irc_transport_iochannel_is_connected(void *data)
 	return (backend_data->incoming != NULL && !backend_data->pending_disconnect);
 }
 
+static guint irc_transport_iochannel_queue_length(void *data)
+{
+	struct irc_transport_data_iochannel *backend_data = (struct irc_transport_data_iochannel *)data;
+
+	return g_queue_get_length(backend_data->pending_lines);
+}
+
+static gsize irc_transport_iochannel_queue_size(void *data)
+{
+	struct irc_transport_data_iochannel *backend_data = (struct irc_transport_data_iochannel *)data;
+
+	return backend_data->pending_bytes;
+}
+
 static const struct irc_transport_ops irc_transport_iochannel_ops = {
 	.free_data = irc_transport_iochannel_free_data,
 	.is_connected = irc_transport_iochannel_is_connected,
@@ -311,6 +359,8 @@ static const struct irc_transport_ops irc_transport_iochannel_ops = {
 	.get_peer_name = irc_transport_iochannel_get_peer_name,
 	.activate = irc_transport_iochannel_activate,
 	.set_charset = irc_transport_iochannel_set_charset,
+	.queue_length = irc_transport_iochannel_queue_length,
+	.queue_size = irc_transport_iochannel_queue_size,
 };
 
 /* GIOChannels passed into this function
@@ -322,9 +372,19 @@ static const struct irc_transport_ops irc_transport_iochannel_ops = {
  */
 struct irc_transport *irc_transport_new_iochannel(GIOChannel *iochannel)
 {
-	struct irc_transport *ret = g_new0(struct irc_transport, 1);
-	struct irc_transport_data_iochannel *backend_data = g_new0(struct irc_transport_data_iochannel, 1);
-	
+	struct irc_transport *ret;
+	struct irc_transport_data_iochannel *backend_data;
+
+	if (!strcmp(irc_transport_get_backend(), "epoll")) {
+		ret = irc_transport_new_epoll(iochannel);
+		if (ret != NULL)
+			return ret;
+		/* Fall back to GIOChannel, e.g. for TLS */
+	}
+
+	ret = g_new0(struct irc_transport, 1);
+	backend_data = g_new0(struct irc_transport_data_iochannel, 1);
+
 	ret->backend_ops = &irc_transport_iochannel_ops;
 	ret->backend_data = backend_data;
 	backend_data->incoming = iochannel;
@@ -353,7 +413,7 @@ static gboolean transport_send_queue(GIOChannel *ioc, GIOCondition cond,
 
 	while (!g_queue_is_empty(backend_data->pending_lines)) {
 		GError *error = NULL;
-		struct irc_line *l = g_queue_pop_head(backend_data->pending_lines);
+		struct irc_line *l = pending_line_pop(backend_data);
 
 		g_assert(backend_data->incoming != NULL);
 		status = irc_send_line(backend_data->incoming,
@@ -361,7 +421,7 @@ static gboolean transport_send_queue(GIOChannel *ioc, GIOCondition cond,
 
 		switch (status) {
 		case G_IO_STATUS_AGAIN:
-			g_queue_push_head(backend_data->pending_lines, l);
+			pending_line_push(backend_data, l, TRUE);
 			return TRUE;
 		case G_IO_STATUS_ERROR:
 			transport->callbacks->log(transport, l, error);
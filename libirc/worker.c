@@ -0,0 +1,193 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "internals.h"
+#include "worker.h"
+
+/*
+ * A worker runs its own GMainLoop on a separate thread. Other threads
+ * never touch data owned by the worker directly; they queue jobs, which
+ * the worker runs in order from its main context. Anything that has to
+ * happen on the main thread (logging, touching networks or clients) is
+ * passed back with irc_main_invoke().
+ */
+
+struct irc_worker_job {
+	irc_worker_fn fn;
+	gpointer data;
+	GDestroyNotify free_fn;
+};
+
+struct irc_worker {
+	char *name;
+	GThread *thread;
+	GMainContext *context;
+	GMainLoop *loop;
+
+	GMutex lock;
+	/** Signalled when the job queue has been drained. */
+	GCond drained;
+	GQueue jobs;
+	/** Whether a job is running or a drain is scheduled. */
+	gboolean busy;
+};
+
+static gpointer worker_thread(gpointer data)
+{
+	struct irc_worker *worker = data;
+
+	g_main_context_push_thread_default(worker->context);
+	g_main_loop_run(worker->loop);
+	g_main_context_pop_thread_default(worker->context);
+
+	return NULL;
+}
+
+static gboolean worker_run_jobs(gpointer data)
+{
+	struct irc_worker *worker = data;
+	struct irc_worker_job *job;
+
+	g_mutex_lock(&worker->lock);
+	while ((job = g_queue_pop_head(&worker->jobs)) != NULL) {
+		g_mutex_unlock(&worker->lock);
+
+		job->fn(job->data);
+		if (job->free_fn != NULL)
+			job->free_fn(job->data);
+		g_free(job);
+
+		g_mutex_lock(&worker->lock);
+	}
+	worker->busy = FALSE;
+	g_cond_broadcast(&worker->drained);
+	g_mutex_unlock(&worker->lock);
+
+	return FALSE;
+}
+
+/**
+ * Start a new worker thread.
+ *
+ * @param name Name of the thread, used for debugging
+ */
+struct irc_worker *irc_worker_new(const char *name)
+{
+	struct irc_worker *worker = g_new0(struct irc_worker, 1);
+
+	worker->name = g_strdup(name);
+	worker->context = g_main_context_new();
+	worker->loop = g_main_loop_new(worker->context, FALSE);
+	g_mutex_init(&worker->lock);
+	g_cond_init(&worker->drained);
+	g_queue_init(&worker->jobs);
+
+	worker->thread = g_thread_new(worker->name, worker_thread, worker);
+
+	return worker;
+}
+
+/**
+ * Queue a job on a worker.
+ *
+ * @param worker Worker to run the job on
+ * @param fn Function to run on the worker thread
+ * @param data Data to pass to fn
+ * @param free_fn Function to free data with after fn has run, or NULL
+ */
+void irc_worker_push(struct irc_worker *worker, irc_worker_fn fn,
+					 gpointer data, GDestroyNotify free_fn)
+{
+	struct irc_worker_job *job = g_new0(struct irc_worker_job, 1);
+	gboolean schedule;
+
+	job->fn = fn;
+	job->data = data;
+	job->free_fn = free_fn;
+
+	g_mutex_lock(&worker->lock);
+	g_queue_push_tail(&worker->jobs, job);
+	schedule = !worker->busy;
+	worker->busy = TRUE;
+	g_mutex_unlock(&worker->lock);
+
+	if (schedule)
+		g_main_context_invoke(worker->context, worker_run_jobs, worker);
+}
+
+/**
+ * Wait until all jobs queued so far have finished.
+ *
+ * @param worker Worker to wait for
+ */
+void irc_worker_flush(struct irc_worker *worker)
+{
+	g_mutex_lock(&worker->lock);
+	while (worker->busy)
+		g_cond_wait(&worker->drained, &worker->lock);
+	g_mutex_unlock(&worker->lock);
+}
+
+/**
+ * Main context the worker runs, for attaching sources to.
+ */
+GMainContext *irc_worker_get_context(struct irc_worker *worker)
+{
+	return worker->context;
+}
+
+static gboolean worker_quit(gpointer data)
+{
+	struct irc_worker *worker = data;
+
+	g_main_loop_quit(worker->loop);
+
+	return FALSE;
+}
+
+/**
+ * Finish all queued jobs, stop the worker thread and free the worker.
+ *
+ * @param worker Worker to stop
+ */
+void irc_worker_free(struct irc_worker *worker)
+{
+	irc_worker_flush(worker);
+
+	g_main_context_invoke(worker->context, worker_quit, worker);
+	g_thread_join(worker->thread);
+
+	g_main_loop_unref(worker->loop);
+	g_main_context_unref(worker->context);
+	g_mutex_clear(&worker->lock);
+	g_cond_clear(&worker->drained);
+	g_free(worker->name);
+	g_free(worker);
+}
+
+/**
+ * Run a function on the main thread. Used by jobs to report back.
+ *
+ * @param fn Function to run from the default main context
+ * @param data Data to pass to fn
+ */
+void irc_main_invoke(GSourceFunc fn, gpointer data)
+{
+	g_main_context_invoke(NULL, fn, data);
+}
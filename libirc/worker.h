@@ -0,0 +1,47 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef __LIBIRC_WORKER_H__
+#define __LIBIRC_WORKER_H__
+
+/**
+ * @file
+ * @brief Worker threads with their own main context
+ */
+
+#include <glib.h>
+#include <gmodule.h>
+
+struct irc_worker;
+
+/**
+ * A job run on a worker thread. Jobs run in the order in which they
+ * were queued.
+ */
+typedef void (*irc_worker_fn) (gpointer data);
+
+G_GNUC_WARN_UNUSED_RESULT G_MODULE_EXPORT struct irc_worker *irc_worker_new(const char *name);
+G_MODULE_EXPORT void irc_worker_push(struct irc_worker *worker, irc_worker_fn fn,
+									 gpointer data, GDestroyNotify free_fn);
+G_MODULE_EXPORT void irc_worker_flush(struct irc_worker *worker);
+G_MODULE_EXPORT GMainContext *irc_worker_get_context(struct irc_worker *worker);
+G_MODULE_EXPORT void irc_worker_free(struct irc_worker *worker);
+G_MODULE_EXPORT void irc_main_invoke(GSourceFunc fn, gpointer data);
+
+#endif /* __LIBIRC_WORKER_H__ */
@@ -36,10 +36,362 @@ static PyObject *py_log_global(PyObject *self, PyObject *args)
 	Py_RETURN_NONE;
 }
 
+/*
+ * Server and log filters implemented in Python. A filter only sees lines
+ * with one of the commands it subscribed to, if it gave any. Filters
+ * with an interval only observe: their lines are queued and handed to
+ * the callback as a list every interval milliseconds (or earlier, once
+ * PY_FILTER_MAX_BATCH lines are queued), so Python is entered once per
+ * batch rather than once per line. Only synchronous filters can stop a
+ * line by returning False.
+ */
+
+#define PY_FILTER_DEFAULT_PRIORITY 500
+#define PY_FILTER_MAX_BATCH 1000
+
+struct py_filter {
+	char *name;
+	/* Unique name the filter is registered under with the hooks */
+	char *hook_name;
+	gboolean log;
+	gboolean removed;
+	PyObject *callback;
+	char **commands;
+	guint interval;
+	GArray *pending;
+	guint source_id;
+};
+
+struct py_filter_line {
+	struct irc_network *network;
+	struct irc_line *line;
+	enum data_direction dir;
+};
+
+static GHashTable *py_server_filters = NULL, *py_log_filters = NULL;
+
+static gboolean py_filter_wants(struct py_filter *f, const struct irc_line *l)
+{
+	int i;
+
+	if (f->removed || l->argc == 0)
+		return FALSE;
+
+	if (f->commands == NULL)
+		return TRUE;
+
+	for (i = 0; f->commands[i] != NULL; i++)
+		if (!base_strcmp(f->commands[i], l->args[0]))
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Steals the network reference and the line */
+static PyObject *py_filter_args(struct irc_network *n, struct irc_line *l,
+								enum data_direction dir)
+{
+	PyNetworkObject *py_network;
+	PyLineObject *py_line;
+
+	py_network = PyObject_New(PyNetworkObject, &PyNetworkType);
+	if (py_network == NULL) {
+		irc_network_unref(n);
+		free_line(l);
+		return NULL;
+	}
+	py_network->network = n;
+
+	py_line = PyObject_New(PyLineObject, &PyLineType);
+	if (py_line == NULL) {
+		Py_DECREF(py_network);
+		free_line(l);
+		return NULL;
+	}
+	py_line->line = l;
+
+	return Py_BuildValue("(NNi)", py_network, py_line, dir);
+}
+
+static void py_filter_free_lines(GArray *lines, guint from)
+{
+	guint i;
+
+	for (i = from; i < lines->len; i++) {
+		struct py_filter_line *pl = &g_array_index(lines,
+											struct py_filter_line, i);
+		irc_network_unref(pl->network);
+		free_line(pl->line);
+	}
+	g_array_free(lines, TRUE);
+}
+
+static void py_filter_flush(struct py_filter *f)
+{
+	GArray *lines = f->pending;
+	PyObject *list, *callback, *ret;
+	guint i;
+
+	if (f->removed || lines->len == 0)
+		return;
+
+	f->pending = g_array_new(FALSE, FALSE, sizeof(struct py_filter_line));
+
+	list = PyList_New(lines->len);
+	if (list == NULL) {
+		PyErr_Print();
+		py_filter_free_lines(lines, 0);
+		return;
+	}
+
+	for (i = 0; i < lines->len; i++) {
+		struct py_filter_line *pl = &g_array_index(lines,
+											struct py_filter_line, i);
+		PyObject *item = py_filter_args(pl->network, pl->line, pl->dir);
+		if (item == NULL) {
+			PyErr_Print();
+			Py_DECREF(list);
+			py_filter_free_lines(lines, i + 1);
+			return;
+		}
+		PyList_SET_ITEM(list, i, item);
+	}
+	g_array_free(lines, TRUE);
+
+	/* The callback may remove the filter */
+	callback = f->callback;
+	Py_INCREF(callback);
+	ret = PyObject_CallFunctionObjArgs(callback, list, NULL);
+	if (ret == NULL)
+		PyErr_Print();
+	Py_XDECREF(ret);
+	Py_DECREF(callback);
+	Py_DECREF(list);
+}
+
+static gboolean py_filter_flush_cb(gpointer data)
+{
+	struct py_filter *f = data;
+
+	f->source_id = 0;
+	py_filter_flush(f);
+
+	return FALSE;
+}
+
+static gboolean py_filter_run(struct irc_network *n, const struct irc_line *l,
+							  enum data_direction dir, void *userdata)
+{
+	struct py_filter *f = userdata;
+	PyObject *args, *callback, *ret;
+	gboolean keep;
+
+	if (!py_filter_wants(f, l))
+		return TRUE;
+
+	if (f->interval > 0) {
+		struct py_filter_line pl;
+
+		pl.network = irc_network_ref(n);
+		pl.line = linedup(l);
+		pl.dir = dir;
+		g_array_append_val(f->pending, pl);
+
+		if (f->pending->len >= PY_FILTER_MAX_BATCH) {
+			if (f->source_id != 0) {
+				g_source_remove(f->source_id);
+				f->source_id = 0;
+			}
+			py_filter_flush(f);
+		} else if (f->source_id == 0) {
+			f->source_id = g_timeout_add(f->interval, py_filter_flush_cb, f);
+		}
+		return TRUE;
+	}
+
+	args = py_filter_args(irc_network_ref(n), linedup(l), dir);
+	if (args == NULL) {
+		PyErr_Print();
+		return TRUE;
+	}
+
+	callback = f->callback;
+	Py_INCREF(callback);
+	ret = PyObject_CallObject(callback, args);
+	Py_DECREF(args);
+	Py_DECREF(callback);
+	if (ret == NULL) {
+		PyErr_Print();
+		return TRUE;
+	}
+
+	keep = (ret == Py_None || PyObject_IsTrue(ret));
+	Py_DECREF(ret);
+	return keep;
+}
+
+static gboolean py_filter_destroy(gpointer data)
+{
+	struct py_filter *f = data;
+
+	if (f->log)
+		del_log_filter(f->hook_name);
+	else
+		del_server_filter(f->hook_name);
+
+	if (f->source_id != 0)
+		g_source_remove(f->source_id);
+	py_filter_free_lines(f->pending, 0);
+	Py_DECREF(f->callback);
+	g_strfreev(f->commands);
+	g_free(f->hook_name);
+	g_free(f->name);
+	g_free(f);
+
+	return FALSE;
+}
+
+/* The filter may be running right now, so it is only unhooked and freed
+ * once control is back in the main loop. */
+static void py_filter_remove(gpointer data)
+{
+	struct py_filter *f = data;
+
+	f->removed = TRUE;
+	g_idle_add(py_filter_destroy, f);
+}
+
+static PyObject *py_add_filter(gboolean log, PyObject *args, PyObject *kwargs)
+{
+	char *kwnames[] = { "name", "callback", "commands", "priority",
+						"interval", NULL };
+	static guint counter = 0;
+	GHashTable **filters = log?&py_log_filters:&py_server_filters;
+	PyObject *callback, *py_commands = Py_None;
+	int priority = PY_FILTER_DEFAULT_PRIORITY;
+	unsigned int interval = 0;
+	struct py_filter *f;
+	char *name;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|OiI", kwnames,
+									 &name, &callback, &py_commands,
+									 &priority, &interval))
+		return NULL;
+
+	if (!PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "callback must be callable");
+		return NULL;
+	}
+
+	f = g_new0(struct py_filter, 1);
+
+	if (py_commands != Py_None) {
+		PyObject *seq = PySequence_Fast(py_commands,
+										"commands must be a sequence");
+		Py_ssize_t i;
+
+		if (seq == NULL) {
+			g_free(f);
+			return NULL;
+		}
+
+		f->commands = g_new0(char *, PySequence_Fast_GET_SIZE(seq) + 1);
+		for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+			PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+			if (!PyString_Check(item)) {
+				PyErr_SetString(PyExc_TypeError,
+								"commands must be strings");
+				Py_DECREF(seq);
+				g_strfreev(f->commands);
+				g_free(f);
+				return NULL;
+			}
+			f->commands[i] = g_ascii_strup(PyString_AsString(item), -1);
+		}
+		Py_DECREF(seq);
+	}
+
+	if (*filters == NULL)
+		*filters = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+										 py_filter_remove);
+
+	f->name = g_strdup(name);
+	f->hook_name = g_strdup_printf("python-%s-%u", name, ++counter);
+	f->log = log;
+	f->callback = callback;
+	Py_INCREF(callback);
+	f->interval = interval;
+	f->pending = g_array_new(FALSE, FALSE, sizeof(struct py_filter_line));
+
+	/* Replaces (and removes) an earlier filter with the same name */
+	g_hash_table_replace(*filters, f->name, f);
+
+	if (log)
+		add_log_filter(f->hook_name, py_filter_run, f, priority);
+	else
+		add_server_filter(f->hook_name, py_filter_run, f, priority);
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_del_filter(gboolean log, PyObject *args)
+{
+	GHashTable *filters = log?py_log_filters:py_server_filters;
+	char *name;
+
+	if (!PyArg_ParseTuple(args, "s", &name))
+		return NULL;
+
+	if (filters == NULL || !g_hash_table_remove(filters, name)) {
+		PyErr_SetString(PyExc_KeyError, name);
+		return NULL;
+	}
+
+	Py_RETURN_NONE;
+}
+
+static PyObject *py_add_server_filter(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return py_add_filter(FALSE, args, kwargs);
+}
+
+static PyObject *py_add_log_filter(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	return py_add_filter(TRUE, args, kwargs);
+}
+
+static PyObject *py_del_server_filter(PyObject *self, PyObject *args)
+{
+	return py_del_filter(FALSE, args);
+}
+
+static PyObject *py_del_log_filter(PyObject *self, PyObject *args)
+{
+	return py_del_filter(TRUE, args);
+}
+
 static PyMethodDef ctrlproxy_methods[] = {
 	{ "log_global", (PyCFunction)py_log_global, METH_VARARGS,
 		"log_global(level, text)\n"
 		"Log" },
+	{ "add_server_filter", (PyCFunction)py_add_server_filter,
+		METH_VARARGS|METH_KEYWORDS,
+		"add_server_filter(name, callback, commands=None, priority=500, interval=0)\n"
+		"Call callback(network, line, direction) for lines to and from servers "
+		"with one of the specified commands. Returning False stops the line. "
+		"With an interval in milliseconds, callback(lines) is instead called "
+		"with a list of (network, line, direction) tuples at most every "
+		"interval milliseconds." },
+	{ "add_log_filter", (PyCFunction)py_add_log_filter,
+		METH_VARARGS|METH_KEYWORDS,
+		"add_log_filter(name, callback, commands=None, priority=500, interval=0)\n"
+		"Like add_server_filter(), but for lines that are logged." },
+	{ "del_server_filter", (PyCFunction)py_del_server_filter, METH_VARARGS,
+		"del_server_filter(name)\n"
+		"Remove a server filter" },
+	{ "del_log_filter", (PyCFunction)py_del_log_filter, METH_VARARGS,
+		"del_log_filter(name)\n"
+		"Remove a log filter" },
 	{ NULL }
 };
 
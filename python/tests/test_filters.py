@@ -0,0 +1,155 @@
+# Copyright (C) 2009 Jelmer Vernooij <jelmer@jelmer.uk>
+
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# These tests only run inside ctrlproxy; see testsuite/pycheck.c.
+
+import ctrlproxy
+import ctrlproxy_test
+import irc
+import time
+import unittest
+
+
+def iterate_until(predicate, timeout=5):
+    end = time.time() + timeout
+    while not predicate() and time.time() < end:
+        ctrlproxy_test.iterate(True)
+
+
+def drain():
+    # Removed filters are freed from the main loop
+    while ctrlproxy_test.iterate(False):
+        pass
+
+
+class ServerFilterTests(unittest.TestCase):
+
+    def setUp(self):
+        self.names = []
+
+    def tearDown(self):
+        for name in self.names:
+            ctrlproxy.del_server_filter(name)
+        drain()
+
+    def add_filter(self, name, callback, **kwargs):
+        ctrlproxy.add_server_filter(name, callback, **kwargs)
+        self.names.append(name)
+
+    def test_all_commands(self):
+        seen = []
+        self.add_filter("all", lambda n, l, d: seen.append(l[0]))
+        self.assertTrue(ctrlproxy_test.server_filter(":a NOTICE b :c",
+                                                     irc.FROM_SERVER))
+        self.assertTrue(ctrlproxy_test.server_filter(":a PRIVMSG b :c",
+                                                     irc.FROM_SERVER))
+        self.assertEquals(["NOTICE", "PRIVMSG"], seen)
+
+    def test_subscribed_commands(self):
+        seen = []
+        self.add_filter("subscribed", lambda n, l, d: seen.append(l[0]),
+                        commands=["privmsg", "JOIN"])
+        ctrlproxy_test.server_filter(":a NOTICE b :c", irc.FROM_SERVER)
+        ctrlproxy_test.server_filter(":a PRIVMSG b :c", irc.FROM_SERVER)
+        ctrlproxy_test.server_filter(":a JOIN #b", irc.FROM_SERVER)
+        ctrlproxy_test.server_filter(":a PART #b", irc.FROM_SERVER)
+        self.assertEquals(["PRIVMSG", "JOIN"], seen)
+
+    def test_arguments(self):
+        seen = []
+        self.add_filter("arguments", lambda n, l, d: seen.append((n, l, d)))
+        ctrlproxy_test.server_filter("PRIVMSG b :c", irc.TO_SERVER)
+        (network, line, direction) = seen[0]
+        self.assertEquals("test", network.name)
+        self.assertEquals("PRIVMSG", line[0])
+        self.assertEquals(irc.TO_SERVER, direction)
+
+    def test_sync_false_stops_line(self):
+        self.add_filter("stop", lambda n, l, d: l[0] != "PRIVMSG")
+        self.assertFalse(ctrlproxy_test.server_filter(":a PRIVMSG b :c",
+                                                      irc.FROM_SERVER))
+        self.assertTrue(ctrlproxy_test.server_filter(":a NOTICE b :c",
+                                                     irc.FROM_SERVER))
+
+    def test_sync_false_skips_later_filters(self):
+        seen = []
+        self.add_filter("stop", lambda n, l, d: False, priority=100)
+        self.add_filter("later", lambda n, l, d: seen.append(l), priority=900)
+        self.assertFalse(ctrlproxy_test.server_filter(":a PRIVMSG b :c",
+                                                      irc.FROM_SERVER))
+        self.assertEquals([], seen)
+
+    def test_sync_none_keeps_line(self):
+        self.add_filter("none", lambda n, l, d: None)
+        self.assertTrue(ctrlproxy_test.server_filter(":a PRIVMSG b :c",
+                                                     irc.FROM_SERVER))
+
+    def test_batch(self):
+        batches = []
+        self.add_filter("batch", batches.append, commands=["PRIVMSG"],
+                        interval=10)
+        for i in range(3):
+            self.assertTrue(ctrlproxy_test.server_filter(
+                ":a PRIVMSG b :%d" % i, irc.FROM_SERVER))
+        ctrlproxy_test.server_filter(":a NOTICE b :c", irc.FROM_SERVER)
+        self.assertEquals([], batches)
+        iterate_until(lambda: batches)
+        self.assertEquals(1, len(batches))
+        self.assertEquals(["0", "1", "2"],
+                          [l[2] for (n, l, d) in batches[0]])
+        self.assertEquals(["test"] * 3, [n.name for (n, l, d) in batches[0]])
+        self.assertEquals([irc.FROM_SERVER] * 3,
+                          [d for (n, l, d) in batches[0]])
+
+    def test_batch_cannot_stop_line(self):
+        self.add_filter("batch", lambda lines: False, interval=10)
+        self.assertTrue(ctrlproxy_test.server_filter(":a PRIVMSG b :c",
+                                                     irc.FROM_SERVER))
+
+    def test_full_batch_delivered_immediately(self):
+        batches = []
+        self.add_filter("batch", batches.append, interval=60000)
+        for i in range(1000):
+            ctrlproxy_test.server_filter(":a PRIVMSG b :%d" % i,
+                                         irc.FROM_SERVER)
+        self.assertEquals([1000], [len(b) for b in batches])
+
+    def test_removed_batch_not_delivered(self):
+        batches = []
+        ctrlproxy.add_server_filter("batch", batches.append, interval=10)
+        ctrlproxy_test.server_filter(":a PRIVMSG b :c", irc.FROM_SERVER)
+        ctrlproxy.del_server_filter("batch")
+        drain()
+        time.sleep(0.02)
+        drain()
+        self.assertEquals([], batches)
+        ctrlproxy_test.server_filter(":a PRIVMSG b :c", irc.FROM_SERVER)
+        self.assertEquals([], batches)
+
+
+class LogFilterTests(unittest.TestCase):
+
+    def tearDown(self):
+        ctrlproxy.del_log_filter("log")
+        drain()
+
+    def test_subscribed_commands(self):
+        seen = []
+        ctrlproxy.add_log_filter("log", lambda n, l, d: seen.append(l[0]),
+                                 commands=["TOPIC"])
+        ctrlproxy_test.log_filter(":a TOPIC #b :c", irc.FROM_SERVER)
+        ctrlproxy_test.server_filter(":a TOPIC #b :c", irc.FROM_SERVER)
+        ctrlproxy_test.log_filter(":a PRIVMSG b :c", irc.FROM_SERVER)
+        self.assertEquals(["TOPIC"], seen)
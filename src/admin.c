@@ -26,6 +26,7 @@
 #include "admin.h"
 #include "help.h"
 #include "irc.h"
+#include "ssl.h"
 
 help_t *help;
 
@@ -474,6 +475,232 @@ static void list_networks_helper(admin_handle h)
 	}
 }
 
+static void cmd_reconnects(admin_handle h, const char * const *args, void *userdata)
+{
+	struct global *g = admin_get_global(h);
+	GList *gl;
+	int position = 1;
+	time_t now = time(NULL);
+
+	if (g->config->max_concurrent_connects > 0)
+		admin_out(h, "Connects in progress: %u (limit %d)",
+				  irc_network_connects_in_flight(),
+				  g->config->max_concurrent_connects);
+	else
+		admin_out(h, "Connects in progress: %u (no limit)",
+				  irc_network_connects_in_flight());
+
+	for (gl = irc_network_connect_queue(); gl; gl = gl->next) {
+		struct irc_network *n = gl->data;
+		struct network_config *nc = n->private_data;
+
+		admin_out(h, "%d. %s: Waiting for connect slot (priority %d)",
+				  position++, n->name, nc->connect_priority);
+	}
+
+	for (gl = g->networks; gl; gl = gl->next) {
+		struct irc_network *n = gl->data;
+
+		if (n->connect_slot)
+			admin_out(h, "%s: Connect in progress (%u failed attempts)",
+					  n->name, n->reconnect_attempts);
+		else if (n->connection.state == NETWORK_CONNECTION_STATE_RECONNECT_PENDING &&
+				 !n->connect_queued)
+			admin_out(h, "%s: Reconnecting in %ld seconds (%u failed attempts)",
+					  n->name, (long)MAX(n->reconnect_at - now, 0),
+					  n->reconnect_attempts);
+	}
+}
+
+static void print_cache_stats(const char *name, guint hits, guint misses,
+							  void *userdata)
+{
+	admin_handle h = userdata;
+
+	admin_out(h, "%s: %u answered from cache, %u sent to server",
+			  name, hits, misses);
+}
+
+static void cmd_cache(admin_handle h, const char * const *args, void *userdata)
+{
+	cache_foreach_stats(print_cache_stats, h);
+}
+
+static void cmd_replay(admin_handle h, const char * const *args, void *userdata)
+{
+	struct global *global = admin_get_global(h);
+	struct network_config *nc;
+	struct irc_network *n;
+	double speed = 1.0;
+	char *path, *base, *name;
+
+	if (args[1] == NULL) {
+		admin_out(h, "Usage: REPLAY <trace> [speed]");
+		return;
+	}
+
+	if (args[2] != NULL) {
+		char *end;
+		speed = g_ascii_strtod(args[2], &end);
+		if (*end != '\0' || speed < 0) {
+			admin_out(h, "Invalid speed `%s'", args[2]);
+			return;
+		}
+	}
+
+	/* Restricted users can only replay traces captured by this instance */
+	if (global->restricted || !g_path_is_absolute(args[1])) {
+		base = g_path_get_basename(args[1]);
+		path = g_build_filename(global->config->config_dir, "traces", base, NULL);
+		g_free(base);
+	} else {
+		path = g_strdup(args[1]);
+	}
+
+	if (!g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+		admin_out(h, "No such trace `%s'", path);
+		g_free(path);
+		return;
+	}
+
+	base = g_path_get_basename(path);
+	if (g_str_has_suffix(base, ".trace"))
+		base[strlen(base)-strlen(".trace")] = '\0';
+	name = g_strdup_printf("replay-%s", base);
+	g_free(base);
+
+	if (find_network(global->networks, name) != NULL) {
+		admin_out(h, "Network with name `%s' already exists", name);
+		g_free(name);
+		g_free(path);
+		return;
+	}
+
+	nc = network_config_init(global->config);
+	nc->name = name;
+	nc->implicit = 1;
+	nc->type = NETWORK_VIRTUAL;
+	nc->type_settings.virtual_name = g_strdup("replay");
+	nc->replay_trace = path;
+	nc->replay_speed = speed;
+
+	n = load_network(global, nc);
+	g_assert(n != NULL);
+
+	if (!connect_network(n)) {
+		admin_out(h, "Unable to replay `%s', see the log for details", path);
+		return;
+	}
+
+	admin_out(h, "Replaying `%s' on network `%s'", path, name);
+}
+
+#define KIB(bytes) ((guint64)((bytes) + 1023) / 1024)
+
+static void stats_transport(admin_handle h, const char *name,
+							struct irc_transport *transport)
+{
+	if (transport == NULL) {
+		admin_out(h, "%s: not connected", name);
+		return;
+	}
+
+	admin_out(h, "%s: queue %u lines (%" G_GUINT64_FORMAT " KiB), "
+			  "in %.1f lines/s (%" G_GUINT64_FORMAT " total), "
+			  "out %.1f lines/s (%" G_GUINT64_FORMAT " total)", name,
+			  transport_get_queue_length(transport),
+			  KIB(transport_get_queue_size(transport)),
+			  irc_line_rate_get(&transport->received), transport->received.total,
+			  irc_line_rate_get(&transport->sent), transport->sent.total);
+}
+
+static void stats_network(admin_handle h, struct irc_network *n, gboolean details)
+{
+	gsize state_size = 0;
+	guint64 lines = 0;
+	goffset bytes = 0;
+	GList *gl;
+
+	if (n->external_state != NULL)
+		state_size = network_state_memory(n->external_state);
+	if (n->linestack != NULL)
+		linestack_get_size(n->linestack, &lines, &bytes);
+
+	admin_out(h, "%s: state %" G_GUINT64_FORMAT " KiB, %u clients, "
+			  "%u pending queries, backlog %" G_GUINT64_FORMAT " lines "
+			  "(%" G_GUINT64_FORMAT " KiB)", n->name, KIB(state_size),
+			  g_list_length(n->clients),
+			  n->queries != NULL?g_list_length(n->queries->entries):0,
+			  lines, KIB(bytes));
+
+	if (!details)
+		return;
+
+	stats_transport(h, "  server", n->connection.transport);
+
+	if (linestack_search_enabled(n->linestack)) {
+		guint tokens;
+		gsize search_size;
+
+		linestack_search_stats(n->linestack, &tokens, &search_size);
+		admin_out(h, "  search index: %u words (%" G_GUINT64_FORMAT " KiB)",
+				  tokens, KIB(search_size));
+	}
+
+	for (gl = n->clients; gl; gl = gl->next) {
+		struct irc_client *c = gl->data;
+		char *name = g_strdup_printf("  client %s", c->description);
+
+		stats_transport(h, name, c->transport);
+		if (c->state != NULL)
+			admin_out(h, "  client %s: state %" G_GUINT64_FORMAT " KiB",
+					  c->description, KIB(network_state_memory(c->state)));
+		g_free(name);
+	}
+}
+
+static void cmd_stats(admin_handle h, const char * const *args, void *userdata)
+{
+	struct global *g = admin_get_global(h);
+	GList *gl;
+
+	if (args[1] != NULL) {
+		struct irc_network *n = find_network(g->networks, args[1]);
+
+		if (n == NULL) {
+			admin_out(h, "No such network '%s'", args[1]);
+			return;
+		}
+
+		stats_network(h, n, TRUE);
+		return;
+	}
+
+	for (gl = g->networks; gl; gl = gl->next)
+		stats_network(h, gl->data, FALSE);
+
+	admin_out(h, "Open log files: %u", log_support_open_files());
+}
+
+#ifdef HAVE_GNUTLS
+static void cmd_tls_sessions(admin_handle h, const char * const *args, void *userdata)
+{
+	guint resumed, full, cached;
+	guint offloaded, fallbacks;
+
+	ssl_session_cache_stats(&resumed, &full, &cached);
+
+	admin_out(h, "Resumed handshakes: %u", resumed);
+	admin_out(h, "Full handshakes: %u", full);
+	admin_out(h, "Servers with cached session: %u", cached);
+
+	ssl_kernel_tls_stats(&offloaded, &fallbacks);
+
+	admin_out(h, "Connections using kernel TLS: %u", offloaded);
+	admin_out(h, "Connections that could not use kernel TLS: %u", fallbacks);
+}
+#endif
+
 /* NETWORK LIST */
 /* NETWORK ADD OFTC */
 /* NETWORK DEL OFTC */
@@ -611,7 +838,7 @@ static void cmd_backlog(admin_handle h, const char * const *args, void *userdata
 	if (!args[1] || strlen(args[1]) == 0) {
 		admin_out(h, "Sending backlog for network '%s'", n->name);
 
-		if (!linestack_send(n->linestack, lm, NULL, admin_get_client(h),
+		if (!linestack_stream(n->linestack, NULL, lm, NULL, admin_get_client(h),
 					   TRUE, n->global->config->report_time != REPORT_TIME_NEVER,
 					   n->global->config->report_time_offset)) {
 			admin_out(h, "Some errors sending backlog.");
@@ -625,7 +852,7 @@ static void cmd_backlog(admin_handle h, const char * const *args, void *userdata
 	/* Backlog for specific nick/channel */
 	admin_out(h, "Sending backlog for channel %s", args[1]);
 
-	if (!linestack_send_object(n->linestack, args[1], lm, NULL,
+	if (!linestack_stream(n->linestack, args[1], lm, NULL,
 						  admin_get_client(h), TRUE,
 						  n->global->config->report_time != REPORT_TIME_NEVER,
 						  n->global->config->report_time_offset)) {
@@ -636,6 +863,111 @@ static void cmd_backlog(admin_handle h, const char * const *args, void *userdata
 	g_hash_table_replace(markers, n, linestack_get_marker(n->linestack));
 }
 
+#define SEARCH_MAX_RESULTS 20
+
+/* Parse an age such as 90s, 30m, 12h, 7d or 2w */
+static gboolean parse_age(const char *text, time_t *age)
+{
+	char *end;
+	long n = strtol(text, &end, 10);
+
+	if (end == text || n < 0 || end[0] == '\0' || end[1] != '\0')
+		return FALSE;
+
+	switch (end[0]) {
+	case 's': *age = n; break;
+	case 'm': *age = n * 60; break;
+	case 'h': *age = n * 60 * 60; break;
+	case 'd': *age = n * 24 * 60 * 60; break;
+	case 'w': *age = n * 7 * 24 * 60 * 60; break;
+	default: return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void cmd_search(admin_handle h, const char * const *args, void *userdata)
+{
+	struct irc_network *n;
+	GString *query;
+	GArray *matches, *entries;
+	time_t since = 0, age;
+	int i, end;
+
+	if (args[1] == NULL || args[2] == NULL) {
+		admin_out(h, "Usage: SEARCH <network> <words> [<age>]");
+		return;
+	}
+
+	n = find_network(admin_get_global(h)->networks, args[1]);
+	if (n == NULL) {
+		admin_out(h, "No such network '%s'", args[1]);
+		return;
+	}
+
+	if (n->linestack == NULL) {
+		admin_out(h, "No backlog available for '%s'", n->name);
+		return;
+	}
+
+	if (!linestack_search_enabled(n->linestack)) {
+		admin_out(h, "Search is not enabled; set linestack-search to true "
+				  "and reconnect to '%s'", n->name);
+		return;
+	}
+
+	for (end = 2; args[end] != NULL; end++);
+
+	if (end > 3 && parse_age(args[end-1], &age)) {
+		since = time(NULL) - age;
+		end--;
+	}
+
+	query = g_string_new(args[2]);
+	for (i = 3; i < end; i++)
+		g_string_append_printf(query, " %s", args[i]);
+
+	matches = linestack_search(n->linestack, query->str, since,
+							   SEARCH_MAX_RESULTS);
+	if (matches == NULL || !linestack_sync(n->linestack)) {
+		admin_out(h, "Unable to search backlog of '%s'", n->name);
+		g_string_free(query, TRUE);
+		if (matches != NULL)
+			g_array_free(matches, TRUE);
+		return;
+	}
+
+	if (matches->len == 0)
+		admin_out(h, "No lines matching '%s'", query->str);
+
+	/* Matches are most recent first, show them in order */
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	for (i = matches->len - 1; i >= 0; i--) {
+		guint64 from = g_array_index(matches, guint64, i);
+		GError *error = NULL;
+		struct linestack_entry *e;
+		char stime[20];
+
+		if (!linestack_read_block(n->linestack, &from, from + 1, 0, 0, 1,
+								  entries, &error)) {
+			admin_out(h, "Unable to read line: %s", error->message);
+			g_error_free(error);
+			break;
+		}
+
+		e = &g_array_index(entries, struct linestack_entry, 0);
+		strftime(stime, sizeof(stime), "%Y-%m-%d %H:%M:%S",
+				 localtime(&e->time));
+		admin_out(h, "[%s] %s", stime, e->raw);
+		g_free(e->raw);
+		g_array_set_size(entries, 0);
+	}
+	g_array_free(entries, TRUE);
+
+	g_array_free(matches, TRUE);
+	g_string_free(query, TRUE);
+}
+
 static char *logging_get(admin_handle h)
 {
 	struct global *g = admin_get_global(h);
@@ -1172,6 +1504,31 @@ static gboolean name ## _set(admin_handle h, const char *value) \
 BOOL_SETTING(autosave)
 BOOL_SETTING(admin_log)
 BOOL_SETTING(learn_network_name)
+BOOL_SETTING(persist_tls_sessions)
+BOOL_SETTING(network_threads)
+BOOL_SETTING(recover_linestack)
+BOOL_SETTING(capture_traffic)
+BOOL_SETTING(linestack_search)
+
+#ifdef HAVE_GNUTLS
+static char *kernel_tls_get(admin_handle h)
+{
+	struct global *g = admin_get_global(h);
+	return g_strdup(g->config->kernel_tls?"true":"false");
+}
+
+static gboolean kernel_tls_set(admin_handle h, const char *value)
+{
+	struct global *g = admin_get_global(h);
+
+	if (!interpret_boolean(h, value, &g->config->kernel_tls))
+		return FALSE;
+
+	ssl_set_kernel_tls(g->config->kernel_tls);
+
+	return TRUE;
+}
+#endif
 
 static char *report_time_get(admin_handle h)
 {
@@ -1281,6 +1638,58 @@ static gboolean max_who_age_set(admin_handle h, const char *value)
 	return TRUE;
 }
 
+static char *max_whois_age_get(admin_handle h)
+{
+	struct global *g = admin_get_global(h);
+
+	if (g->config->cache.max_whois_age == 0) {
+		return NULL;
+	}
+
+	return g_strdup_printf("%d", g->config->cache.max_whois_age);
+}
+
+static gboolean max_whois_age_set(admin_handle h, const char *value)
+{
+	struct global *g = admin_get_global(h);
+
+	if (value == NULL) {
+		g->config->cache.max_whois_age = 0;
+	} else {
+		gint64 val;
+		if (!g_ascii_string_to_signed(value, 10, 0, G_MAXINT, &val, NULL))
+			g->config->cache.max_whois_age = 0;
+		else
+			g->config->cache.max_whois_age = val;
+	}
+
+	return TRUE;
+}
+
+static char *max_concurrent_connects_get(admin_handle h)
+{
+	struct global *g = admin_get_global(h);
+
+	return g_strdup_printf("%d", g->config->max_concurrent_connects);
+}
+
+static gboolean max_concurrent_connects_set(admin_handle h, const char *value)
+{
+	struct global *g = admin_get_global(h);
+	gint64 val;
+
+	if (value == NULL) {
+		g->config->max_concurrent_connects = DEFAULT_MAX_CONCURRENT_CONNECTS;
+	} else if (!g_ascii_string_to_signed(value, 10, 0, G_MAXINT, &val, NULL)) {
+		admin_out(h, "Invalid value `%s' for max-concurrent-connects", value);
+		return FALSE;
+	} else {
+		g->config->max_concurrent_connects = val;
+	}
+
+	return TRUE;
+}
+
 static char *auto_away_time_get(admin_handle h)
 {
 	struct global *g = admin_get_global(h);
@@ -1564,6 +1973,46 @@ static gboolean default_client_charset_set(admin_handle h, const char *value)
 	return TRUE;
 }
 
+static char *transport_backend_get(admin_handle h)
+{
+	return g_strdup(irc_transport_get_backend());
+}
+
+static gboolean transport_backend_set(admin_handle h, const char *value)
+{
+	struct global *g = admin_get_global(h);
+
+	if (!irc_transport_set_backend(value)) {
+		admin_out(h, "Transport backend `%s' not available", value);
+		return FALSE;
+	}
+
+	g_free(g->config->transport_backend);
+	g->config->transport_backend = g_strdup(value);
+
+	return TRUE;
+}
+
+static char *linestack_compression_get(admin_handle h)
+{
+	return g_strdup(linestack_get_compression());
+}
+
+static gboolean linestack_compression_set(admin_handle h, const char *value)
+{
+	struct global *g = admin_get_global(h);
+
+	if (!linestack_set_compression(value)) {
+		admin_out(h, "Linestack compression `%s' not available", value);
+		return FALSE;
+	}
+
+	g_free(g->config->linestack_compression);
+	g->config->linestack_compression = g_strdup(value);
+
+	return TRUE;
+}
+
 static char *default_nick_get(admin_handle h)
 {
 	struct global *g = admin_get_global(h);
@@ -1658,19 +2107,31 @@ static struct admin_setting {
 	{ "auto-away-time", auto_away_time_get, auto_away_time_set },
 	{ "autosave", autosave_get, autosave_set },
 	{ "bind", bind_get, bind_set },
+	{ "capture-traffic", capture_traffic_get, capture_traffic_set },
 	{ "default-client-charset", default_client_charset_get, default_client_charset_set },
 	{ "default-network", default_network_get, default_network_set },
+#ifdef HAVE_GNUTLS
+	{ "kernel-tls", kernel_tls_get, kernel_tls_set },
+#endif
 	{ "learn-network-name", learn_network_name_get, learn_network_name_set },
 	{ "learn-nickserv", learn_nickserv_get, learn_nickserv_set },
+	{ "linestack-compression", linestack_compression_get, linestack_compression_set },
+	{ "linestack-search", linestack_search_get, linestack_search_set },
 	{ "log_level", log_level_get, log_level_set },
 	{ "logging", logging_get, logging_set },
+	{ "max-concurrent-connects", max_concurrent_connects_get, max_concurrent_connects_set },
 	{ "max_who_age", max_who_age_get, max_who_age_set },
+	{ "max-whois-age", max_whois_age_get, max_whois_age_set },
 	{ "motd-file", motd_file_get, motd_file_set },
+	{ "network-threads", network_threads_get, network_threads_set },
 	{ "password", password_get, password_set },
+	{ "persist-tls-sessions", persist_tls_sessions_get, persist_tls_sessions_set },
 	{ "port", port_get, port_set },
+	{ "recover-linestack", recover_linestack_get, recover_linestack_set },
 	{ "report-time", report_time_get, report_time_set },
 	{ "report-time-offset", report_time_offset_get, report_time_offset_set },
 	{ "replication", replication_get, replication_set },
+	{ "transport-backend", transport_backend_get, transport_backend_set },
 	{ "default-nick", default_nick_get, default_nick_set },
 	{ "default-username", default_username_get, default_username_set },
 	{ "default-fullname", default_fullname_get, default_fullname_set },
@@ -1741,6 +2202,14 @@ const static struct admin_command builtin_commands[] = {
 	{ "DISCONNECT", cmd_disconnect_network },
 	{ "ECHO", cmd_echo },
 	{ "NEXTSERVER", cmd_next_server },
+	{ "RECONNECTS", cmd_reconnects },
+	{ "CACHE", cmd_cache },
+	{ "REPLAY", cmd_replay },
+	{ "SEARCH", cmd_search },
+	{ "STATS", cmd_stats },
+#ifdef HAVE_GNUTLS
+	{ "TLSSESSIONS", cmd_tls_sessions },
+#endif
 	{ "CHARSET", cmd_charset },
 	{ "DIE", cmd_die },
 	{ "NETWORK", cmd_network },
@@ -24,6 +24,212 @@
 #include "internals.h"
 #include "irc.h"
 
+/* Maximum number of WHOIS results kept per network */
+#define WHOIS_CACHE_SIZE 64
+
+/**
+ * Replies to a WHOIS query for a single nick.
+ */
+struct whois_cache_entry {
+	char *nick;
+	GList *lines;
+	/** Time the last reply was received, 0 while still incomplete */
+	time_t time;
+};
+
+/* Per network list of WHOIS results, most recent first */
+static GHashTable *whois_cache = NULL;
+
+static void free_whois_cache_entry(struct whois_cache_entry *e)
+{
+	g_list_foreach(e->lines, (GFunc)free_line, NULL);
+	g_list_free(e->lines);
+	g_free(e->nick);
+	g_free(e);
+}
+
+static void free_whois_cache(GList *entries)
+{
+	g_list_foreach(entries, (GFunc)free_whois_cache_entry, NULL);
+	g_list_free(entries);
+}
+
+static struct whois_cache_entry *find_whois_cache_entry(struct irc_network *n,
+														const char *nick)
+{
+	GList *gl;
+
+	if (whois_cache == NULL)
+		return NULL;
+
+	for (gl = g_hash_table_lookup(whois_cache, n); gl; gl = gl->next) {
+		struct whois_cache_entry *e = gl->data;
+		if (!irccmp(n->info, e->nick, nick))
+			return e;
+	}
+
+	return NULL;
+}
+
+/* Numerics that make up a WHOIS reply */
+static gboolean is_whois_reply(int code)
+{
+	switch (code) {
+	case RPL_WHOISUSER:
+	case RPL_WHOISSERVER:
+	case RPL_WHOISOPERATOR:
+	case RPL_WHOISIDLE:
+	case RPL_ENDOFWHOIS:
+	case RPL_WHOISCHANNELS:
+	case RPL_WHOISACCOUNT:
+	case RPL_WHOISACTUALLY:
+	case RPL_WHOISSECURE:
+	case ERR_NOSUCHNICK:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/**
+ * Remember replies to WHOIS queries, so they can be answered from cache.
+ *
+ * @param n Network the reply was received from
+ * @param l Reply, already sent to the clients that asked for it
+ */
+void cache_handle_response(struct irc_network *n, const struct irc_line *l,
+						   const struct cache_settings *settings)
+{
+	struct whois_cache_entry *e;
+	GList *entries, *gl;
+	int code;
+
+	if (settings->max_whois_age == 0 || l->argc < 3)
+		return;
+
+	code = irc_line_respcode(l);
+	if (!is_whois_reply(code))
+		return;
+
+	if (whois_cache == NULL)
+		whois_cache = g_hash_table_new_full(NULL, NULL,
+					(GDestroyNotify)irc_network_unref,
+					(GDestroyNotify)free_whois_cache);
+
+	e = find_whois_cache_entry(n, l->args[2]);
+
+	if (code == RPL_WHOISUSER) {
+		struct irc_network *key = n;
+
+		entries = NULL;
+		if (g_hash_table_lookup_extended(whois_cache, n, NULL,
+										 (gpointer *)&entries))
+			g_hash_table_steal(whois_cache, n);
+		else
+			key = irc_network_ref(n);
+
+		if (e != NULL) {
+			entries = g_list_remove(entries, e);
+			free_whois_cache_entry(e);
+		}
+
+		e = g_new0(struct whois_cache_entry, 1);
+		e->nick = g_strdup(l->args[2]);
+		entries = g_list_prepend(entries, e);
+
+		while (g_list_length(entries) > WHOIS_CACHE_SIZE) {
+			gl = g_list_last(entries);
+			free_whois_cache_entry(gl->data);
+			entries = g_list_delete_link(entries, gl);
+		}
+
+		g_hash_table_insert(whois_cache, key, entries);
+	} else if (e == NULL || e->time != 0) {
+		return;
+	}
+
+	/* The idle time would be stale by the time it is replayed */
+	if (code != RPL_WHOISIDLE)
+		e->lines = g_list_append(e->lines, linedup(l));
+
+	if (code == RPL_ENDOFWHOIS || code == ERR_NOSUCHNICK)
+		e->time = time(NULL);
+}
+
+static void forget_whois(struct irc_network *n, const char *nick)
+{
+	struct whois_cache_entry *e;
+	struct irc_network *key;
+	GList *entries;
+
+	e = find_whois_cache_entry(n, nick);
+	if (e == NULL)
+		return;
+
+	g_hash_table_lookup_extended(whois_cache, n, (gpointer *)&key,
+								 (gpointer *)&entries);
+	g_hash_table_steal(whois_cache, n);
+
+	entries = g_list_remove(entries, e);
+	free_whois_cache_entry(e);
+
+	if (entries != NULL)
+		g_hash_table_insert(whois_cache, key, entries);
+	else
+		irc_network_unref(key);
+}
+
+/**
+ * Drop cached WHOIS replies about nicks that changed their nick or quit.
+ *
+ * @param n Network the line was received from
+ * @param l Line received from the network
+ */
+void cache_handle_line(struct irc_network *n, const struct irc_line *l)
+{
+	char *nick;
+
+	if (whois_cache == NULL || l->origin == NULL || l->argc == 0)
+		return;
+
+	if (base_strcmp(l->args[0], "NICK") && base_strcmp(l->args[0], "QUIT"))
+		return;
+
+	nick = line_get_nick(l);
+	forget_whois(n, nick);
+	g_free(nick);
+
+	/* Replies about an earlier user of the new nick are stale too */
+	if (!base_strcmp(l->args[0], "NICK") && l->argc > 1)
+		forget_whois(n, l->args[1]);
+}
+
+/**
+ * Forget the WHOIS replies received from a network, for example because
+ * the connection to it was lost.
+ *
+ * @param n Network to forget about
+ */
+void cache_forget_network(struct irc_network *n)
+{
+	if (whois_cache != NULL)
+		g_hash_table_remove(whois_cache, n);
+}
+
+static void client_send_nicklist(struct irc_client *c,
+				 struct irc_channel_state *ch, char mode,
+				 int reply, int end_reply, const char *end_msg)
+{
+	GList *gl;
+
+	for (gl = channel_mode_nicklist(ch, mode); gl; gl = gl->next) {
+		struct nicklist_entry *e = gl->data;
+		client_send_response(c, reply, ch->name, e->hostmask, NULL);
+	}
+
+	client_send_response(c, end_reply, ch->name, end_msg, NULL);
+}
+
 static gboolean client_try_cache_mode(struct irc_client *c,
 				      struct irc_network_state *net,
 				      struct irc_line *l,
@@ -54,13 +260,36 @@ static gboolean client_try_cache_mode(struct irc_client *c,
 			return FALSE;
 		}
 
+		/* Check all lists are known before sending anything */
 		for (i = 0; (m = l->args[2][i]); i++) {
 			switch (m) {
-			case 'b': client_send_banlist(c, ch); break;
+			case 'b': break;
+			case 'e':
+			case 'I':
+				if (!channel_mode_nicklist_present(ch, m)) {
+					return FALSE;
+				}
+				break;
 			default: return FALSE;
 			}
 		}
 
+		for (i = 0; (m = l->args[2][i]); i++) {
+			switch (m) {
+			case 'b': client_send_banlist(c, ch); break;
+			case 'e':
+				client_send_nicklist(c, ch, 'e', RPL_EXCEPTLIST,
+						     RPL_ENDOFEXCEPTLIST,
+						     "End of channel exception list");
+				break;
+			case 'I':
+				client_send_nicklist(c, ch, 'I', RPL_INVITELIST,
+						     RPL_ENDOFINVITELIST,
+						     "End of channel invite list");
+				break;
+			}
+		}
+
 		return TRUE;
 	/* Queries in the form MODE #channel */
 	} else if (l->argc == 2) {
@@ -114,8 +343,100 @@ static gboolean client_try_cache_topic(struct irc_client *c,
 
 static gboolean client_try_cache_userhost(struct irc_client *c, struct irc_network_state *net, struct irc_line *l, const struct cache_settings *settings)
 {
-	/* TODO */
-	return FALSE;
+	GString *reply;
+	time_t now = time(NULL);
+	int i;
+
+	/* Servers answer at most five nicks at a time */
+	if (l->argc < 2 || l->argc > 6) {
+		return FALSE;
+	}
+
+	reply = g_string_new("");
+
+	for (i = 1; i < l->argc; i++) {
+		struct network_nick *nn = find_network_nick(net, l->args[i]);
+		gboolean away, oper;
+
+		if (nn == NULL || nn->username == NULL || nn->hostname == NULL) {
+			g_string_free(reply, TRUE);
+			return FALSE;
+		}
+
+		if (nn == &net->me) {
+			away = net->is_away;
+			oper = nn->modes[(unsigned char)'o'];
+		} else {
+			/* Away and oper status are only known from recent WHO replies */
+			struct channel_nick *cn = NULL;
+			GList *gl;
+
+			if (settings->max_who_age == 0) {
+				g_string_free(reply, TRUE);
+				return FALSE;
+			}
+
+			for (gl = nn->channel_nicks; gl; gl = gl->next) {
+				struct channel_nick *n = gl->data;
+				if (n->last_flags != NULL && n->last_update != 0 &&
+					n->last_update + settings->max_who_age > now) {
+					cn = n;
+					break;
+				}
+			}
+
+			if (cn == NULL) {
+				g_string_free(reply, TRUE);
+				return FALSE;
+			}
+
+			away = (cn->last_flags[0] == 'G');
+			oper = (strchr(cn->last_flags, '*') != NULL);
+		}
+
+		g_string_append_printf(reply, "%s%s%s=%c%s@%s",
+							   reply->len > 0?" ":"", nn->nick,
+							   oper?"*":"", away?'-':'+',
+							   nn->username, nn->hostname);
+	}
+
+	client_send_response(c, RPL_USERHOST, reply->str, NULL);
+	g_string_free(reply, TRUE);
+
+	return TRUE;
+}
+
+static gboolean client_try_cache_whois(struct irc_client *c, struct irc_network_state *net, struct irc_line *l, const struct cache_settings *settings)
+{
+	struct whois_cache_entry *e;
+	GList *gl;
+
+	/* Only WHOIS <nick>, not remote or multiple queries */
+	if (l->argc != 2 || strchr(l->args[1], ',') || strchr(l->args[1], '*')) {
+		return FALSE;
+	}
+
+	if (settings->max_whois_age == 0 || c->network == NULL) {
+		return FALSE;
+	}
+
+	e = find_whois_cache_entry(c->network, l->args[1]);
+	if (e == NULL || e->time == 0 ||
+		e->time + settings->max_whois_age <= time(NULL)) {
+		return FALSE;
+	}
+
+	for (gl = e->lines; gl; gl = gl->next) {
+		struct irc_line *rl = linedup(gl->data);
+
+		/* Our nick may have changed since */
+		g_free(rl->args[1]);
+		rl->args[1] = g_strdup(net->me.nick);
+		client_send_line(c, rl, NULL);
+		free_line(rl);
+	}
+
+	return TRUE;
 }
 
 static gboolean client_try_cache_who(struct irc_client *c, struct irc_network_state *net, struct irc_line *l, const struct cache_settings *settings)
@@ -166,29 +487,61 @@ static gboolean client_try_cache_who(struct irc_client *c, struct irc_network_st
 
 	now = time(NULL);
 
-	/* Check that the cache data hasn't expired yet */
-	for (gl = ch->nicks; gl; gl = gl->next) {
-		struct channel_nick *cn = gl->data;
+	/* A WHO refresh that changed nothing leaves the cache alone, so
+	 * rebuild an expired one from the newer per-nick timestamps */
+	if (ch->who_cache != NULL &&
+		ch->who_cache->oldest_update + max_who_age <= now) {
+		free_channel_reply_cache(ch->who_cache);
+		ch->who_cache = NULL;
+	}
 
-		if (cn->last_update == 0) {
-			return FALSE;
+	/* Replies are built once and kept with the channel until one of the
+	 * nicks on it changes */
+	if (!channel_reply_cache_matches(ch->who_cache, c->default_origin,
+					 client_get_default_target(c), net->info)) {
+		struct channel_reply_cache *cache;
+		time_t oldest = now;
+
+		for (gl = ch->nicks; gl; gl = gl->next) {
+			struct channel_nick *cn = gl->data;
+
+			if (cn->last_update == 0) {
+				return FALSE;
+			}
+
+			oldest = MIN(oldest, cn->last_update);
 		}
 
-		if ((cn->last_update + max_who_age) <= now) {
-			return FALSE;
+		cache = channel_reply_cache_new(c->default_origin,
+					 client_get_default_target(c), net->info);
+		cache->oldest_update = oldest;
+
+		for (gl = ch->nicks; gl; gl = gl->next) {
+			struct channel_nick *cn = gl->data;
+			struct network_nick *nn = cn->global_nick;
+			char *info = g_strdup_printf("%d %s", nn->hops, nn->fullname);
+
+			cache->lines = g_list_prepend(cache->lines,
+					irc_parse_line_args(c->default_origin, "352",
+					     client_get_default_target(c), ch->name,
+					     nn->username, nn->hostname, nn->server,
+					     nn->nick, cn->last_flags, info, NULL));
+
+			g_free(info);
 		}
-	}
+		cache->lines = g_list_reverse(cache->lines);
 
-	for (gl = ch->nicks; gl; gl = gl->next) {
-		struct channel_nick *cn = gl->data;
-		struct network_nick *nn = cn->global_nick;
-		char *info = g_strdup_printf("%d %s", nn->hops, nn->fullname);
+		free_channel_reply_cache(ch->who_cache);
+		ch->who_cache = cache;
+	}
 
-		client_send_response(c, RPL_WHOREPLY, l->args[1], nn->username,
-				     nn->hostname, nn->server, nn->nick,
-				     cn->last_flags, info, NULL);
+	/* Check that the cache data hasn't expired yet */
+	if ((ch->who_cache->oldest_update + max_who_age) <= now) {
+		return FALSE;
+	}
 
-		g_free(info);
+	for (gl = ch->who_cache->lines; gl; gl = gl->next) {
+		client_send_line(c, gl->data, NULL);
 	}
 
 	client_send_response(c, RPL_ENDOFWHO, l->args[1], "End of /WHO list.", NULL);
@@ -196,6 +549,23 @@ static gboolean client_try_cache_who(struct irc_client *c, struct irc_network_st
 	return TRUE;
 }
 
+/* MODE #channel and list queries like MODE #channel b, but not changes */
+static gboolean is_mode_query(const struct irc_line *l)
+{
+	if (l->argc == 2)
+		return TRUE;
+
+	return l->argc == 3 &&
+		strspn(l->args[2] + (l->args[2][0] == '+'), "beI") ==
+			strlen(l->args[2] + (l->args[2][0] == '+'));
+}
+
+/* TOPIC #channel, but not setting the topic */
+static gboolean is_topic_query(const struct irc_line *l)
+{
+	return l->argc == 2;
+}
+
 static gboolean client_try_cache_names(struct irc_client *c,
 				       struct irc_network_state *net,
 				       struct irc_line *l,
@@ -241,11 +611,18 @@ struct cache_command {
 			       struct irc_network_state *net,
 			       struct irc_line *l,
 			       const struct cache_settings *settings);
+	/* Whether the line is a query rather than a change, or NULL if the
+	 * command is always a query */
+	gboolean (*is_query) (const struct irc_line *l);
+	/* Number of queries answered from cache, and sent to the server */
+	guint hits;
+	guint misses;
 } cache_commands[] = {
-	{ "MODE", client_try_cache_mode },
+	{ "MODE", client_try_cache_mode, is_mode_query },
 	{ "NAMES", client_try_cache_names },
-	{ "TOPIC", client_try_cache_topic },
+	{ "TOPIC", client_try_cache_topic, is_topic_query },
 	{ "WHO", client_try_cache_who },
+	{ "WHOIS", client_try_cache_whois },
 	{ "USERHOST", client_try_cache_userhost },
 	{ NULL, NULL }
 };
@@ -263,9 +640,33 @@ gboolean client_try_cache(struct irc_client *c, struct irc_network_state *net,
 
 	for (i = 0; cache_commands[i].name; i++) {
 		if (!base_strcmp(l->args[0], cache_commands[i].name)) {
-			return cache_commands[i].try_cache(c, net, l, settings);
+			if (cache_commands[i].try_cache(c, net, l, settings)) {
+				cache_commands[i].hits++;
+				return TRUE;
+			}
+			if (cache_commands[i].is_query == NULL ||
+				cache_commands[i].is_query(l))
+				cache_commands[i].misses++;
+			return FALSE;
 		}
 	}
 
 	return FALSE;
 }
+
+/**
+ * Report how often queries could be answered from cache.
+ *
+ * @param fn Function called for each cached command
+ */
+void cache_foreach_stats(void (*fn) (const char *name, guint hits,
+									 guint misses, void *userdata),
+						 void *userdata)
+{
+	int i;
+
+	for (i = 0; cache_commands[i].name; i++) {
+		fn(cache_commands[i].name, cache_commands[i].hits,
+		   cache_commands[i].misses, userdata);
+	}
+}
@@ -5,12 +5,18 @@
 struct irc_line;
 struct irc_network_state;
 struct irc_client;
+struct irc_network;
 
 /* cache.c */
 struct cache_settings {
 	int max_who_age;
+	int max_whois_age;
 };
 gboolean client_try_cache(struct irc_client *c, struct irc_network_state *n, struct irc_line *l, const struct cache_settings *settings);
+void cache_handle_response(struct irc_network *n, const struct irc_line *l, const struct cache_settings *settings);
+void cache_handle_line(struct irc_network *n, const struct irc_line *l);
+void cache_forget_network(struct irc_network *n);
+void cache_foreach_stats(void (*fn) (const char *name, guint hits, guint misses, void *userdata), void *userdata);
 
 #endif
 
@@ -72,8 +72,8 @@ void network_update_config(struct irc_network_state *ns, struct network_config *
 		}
 		g_free(cc->key);
 		cc->key = NULL;
-		if (cs->chanmode_option['k'])
-			cc->key = g_strdup(cs->chanmode_option['k']);
+		if (channel_mode_option(cs, 'k'))
+			cc->key = g_strdup(channel_mode_option(cs, 'k'));
 		cc->autojoin = TRUE;
 	}
 }
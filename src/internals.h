@@ -47,6 +47,8 @@
 #include "local.h"
 
 #define DEFAULT_RECONNECT_INTERVAL 	60
+#define DEFAULT_MAX_RECONNECT_INTERVAL	900
+#define DEFAULT_MAX_CONCURRENT_CONNECTS	4
 #define MIN_SILENT_TIME				60
 #define MAX_SILENT_TIME 			(2*MIN_SILENT_TIME)
 
@@ -21,6 +21,9 @@
 
 #define MAX_OPEN_LOGFILES 300
 
+/* Log files currently open, over all contexts */
+static guint open_log_files = 0;
+
 static void free_file_info(void *_data)
 {
 	struct log_file_info *data = _data;
@@ -28,8 +31,10 @@ static void free_file_info(void *_data)
 	if (data == NULL)
 		return;
 	
-	if (data->file != NULL)
+	if (data->file != NULL) {
 		fclose(data->file);
+		open_log_files--;
+	}
 	g_free(data);
 }
 
@@ -120,6 +125,7 @@ gboolean log_support_write(struct log_support_context *ctx,
 		}
 
 		ctx->num_opened++;
+		open_log_files++;
 	}
 
 	fputs(text, fi->file);
@@ -129,6 +135,14 @@ gboolean log_support_write(struct log_support_context *ctx,
 	return TRUE;
 }
 
+/**
+ * Number of log files kept open by all log support contexts.
+ */
+guint log_support_open_files(void)
+{
+	return open_log_files;
+}
+
 void log_support_writef(struct log_support_context *ctx,
 					   const char *path,
 					   const char *fmt, ...)
@@ -34,6 +34,8 @@
 #include <netdb.h>
 
 #include "help.h"
+#include "ssl.h"
+#include "trace.h"
 
 /* globals */
 static GMainLoop *main_loop;
@@ -106,6 +108,47 @@ static void signal_crash(int sig)
 	abort();
 }
 
+#ifdef HAVE_GNUTLS
+static char *tls_session_cache_file(struct global *global)
+{
+	return g_build_filename(global->config->config_dir, "tls_sessions", NULL);
+}
+
+static void load_tls_session_cache(struct global *global)
+{
+	GError *error = NULL;
+	char *path;
+
+	if (!global->config->persist_tls_sessions)
+		return;
+
+	path = tls_session_cache_file(global);
+	if (!ssl_session_cache_load(path, &error)) {
+		log_global(LOG_WARNING, "Unable to load TLS session cache '%s': %s",
+				   path, error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+}
+
+static void save_tls_session_cache(struct global *global)
+{
+	GError *error = NULL;
+	char *path;
+
+	if (!global->config->persist_tls_sessions)
+		return;
+
+	path = tls_session_cache_file(global);
+	if (!ssl_session_cache_save(path, &error)) {
+		log_global(LOG_WARNING, "Unable to save TLS session cache '%s': %s",
+				   path, error->message);
+		g_error_free(error);
+	}
+	g_free(path);
+}
+#endif
+
 static void clean_exit()
 {
 	char *path;
@@ -128,6 +171,9 @@ static void clean_exit()
 		save_configuration(my_global->config, path);
 		nickserv_save(my_global, path);
 	}
+#ifdef HAVE_GNUTLS
+	save_tls_session_cache(my_global);
+#endif
 	stop_unix_domain_socket_listener(my_global);
 	stop_admin_socket(my_global);
 	fini_listeners(my_global);
@@ -151,6 +197,21 @@ static gboolean signal_quit_handler(gpointer user_data)
 	return G_SOURCE_REMOVE;
 }
 
+/**
+ * Let whoever started us (usually ctrlproxyd) know that we are accepting
+ * connections on the unix domain socket.
+ */
+static void signal_ready(int fd)
+{
+	if (fd == -1)
+		return;
+
+	if (write(fd, "1", 1) < 0)
+		log_global(LOG_WARNING, "Unable to signal readiness: %s", strerror(errno));
+
+	close(fd);
+}
+
 static gboolean signal_save_handler(gpointer user_data)
 {
 	log_global(LOG_INFO, "Received USR1 signal, saving configuration...");
@@ -167,6 +228,9 @@ static gboolean signal_save_handler(gpointer user_data)
 	global_update_config(my_global);
 	save_configuration(my_global->config, my_global->config->config_dir);
 	nickserv_save(my_global, my_global->config->config_dir);
+#ifdef HAVE_GNUTLS
+	save_tls_session_cache(my_global);
+#endif
 
 	return G_SOURCE_REMOVE;
 }
@@ -188,6 +252,7 @@ int main(int argc, char **argv)
 	gboolean restricted = FALSE;
 	gboolean version = FALSE;
 	gboolean from_sourcedir = FALSE;
+	int ready_fd = -1;
 	pid_t pid;
 	GOptionContext *pc;
 	GOptionEntry options[] = {
@@ -210,6 +275,8 @@ int main(int argc, char **argv)
 			"Show version information"},
 		{"restricted", 0, 0, G_OPTION_ARG_NONE, &restricted,
 			"Restrict what user can do"},
+		{"ready-fd", 0, 0, G_OPTION_ARG_INT, &ready_fd,
+			"Write to file descriptor FD once listening", "FD"},
 		{ NULL }
 	};
 	GError *error = NULL;
@@ -299,6 +366,7 @@ int main(int argc, char **argv)
 
 	init_plugins(plugindir);
 	init_admin();
+	init_trace();
 	init_nickserv();
 	init_replication();
 	help = help_load_file(helpfile);
@@ -388,8 +456,16 @@ int main(int argc, char **argv)
 	write_pidfile(pidfile);
 	g_free(pidfile);
 
-	start_unix_domain_socket_listener(my_global);
+	if (start_unix_domain_socket_listener(my_global)) {
+		signal_ready(ready_fd);
+	} else if (ready_fd != -1) {
+		close(ready_fd);
+	}
 	start_admin_socket(my_global);
+#ifdef HAVE_GNUTLS
+	ssl_set_kernel_tls(my_global->config->kernel_tls);
+	load_tls_session_cache(my_global);
+#endif
 	autoconnect_networks(my_global->networks);
 	if (!init_listeners(my_global)) {
 		log_global(LOG_ERROR,
@@ -21,6 +21,8 @@
 #include "irc.h"
 #include <glib/gstdio.h>
 #include "ssl.h"
+#include "worker.h"
+#include "trace.h"
 
 /**
  * Update the isupport settings for a local network based on the
@@ -96,6 +98,7 @@ static gboolean process_from_server(struct irc_network *n, const struct irc_line
 	g_assert(l != NULL);
 
 	log_network_line(n, l, TRUE);
+	trace_server_line(n, l, TRUE);
 
 	/* Silently drop empty messages, as allowed by RFC */
 	if (l->argc == 0) {
@@ -141,7 +144,7 @@ static gboolean process_from_server(struct irc_network *n, const struct irc_line
 	} else if (response == RPL_ENDOFMOTD || response == ERR_NOMOTD) {
 		int i;
 		GList *gl;
-		n->connection.state = NETWORK_CONNECTION_STATE_MOTD_RECVD;
+		irc_network_login_complete(n);
 
 		/* Always save networks we've successfully connected to. */
 		nc->implicit = 0;
@@ -184,6 +187,8 @@ static gboolean process_from_server(struct irc_network *n, const struct irc_line
 		if (irc_line_respcode(l)) {
 			linestack_store &= (!redirect_response(n->queries, n, l));
 		} else {
+			cache_handle_line(n, l);
+
 			if (n->clients == NULL) {
 				if (!base_strcmp(l->args[0], "PRIVMSG") && l->argc > 2 &&
 					l->args[2][0] == '\001' &&
@@ -389,6 +394,7 @@ static void handle_network_disconnect(struct irc_network *n)
 		free_linestack_context(n->linestack);
 		n->linestack = NULL;
 	}
+	cache_forget_network(n);
 }
 
 static void handle_network_state_set(struct irc_network *s)
@@ -412,6 +418,7 @@ static gboolean process_to_server(struct irc_network *s,
 	}
 
 	log_network_line(s, l, FALSE);
+	trace_server_line(s, l, FALSE);
 	return TRUE;
 }
 
@@ -508,6 +515,8 @@ void unload_network(struct irc_network *s)
 		s->global->networks = g_list_remove(s->global->networks, s);
 	}
 
+	trace_network_close(s);
+
 	irc_network_unref(s);
 }
 
@@ -537,6 +546,9 @@ void fini_networks(struct global *global)
 gboolean network_forward_line(struct irc_network *s, struct irc_client *c,
 							  const struct irc_line *l, gboolean is_private)
 {
+	if (c != NULL)
+		trace_client_line(s, c, l, is_private);
+
 	/* Also write this message to all other clients currently connected */
 	if (!is_private &&
 	   (!base_strcmp(l->args[0], "PRIVMSG") ||
@@ -552,6 +564,10 @@ gboolean network_forward_line(struct irc_network *s, struct irc_client *c,
 		free_line(nl);
 	}
 
+	/* Identical query from another client still waiting for replies */
+	if (c != NULL && query_stack_coalesce(s->queries, c, l))
+		return TRUE;
+
 	if (!query_stack_record(s->queries, c, l)) {
 		if (c != NULL) {
 			client_log(LOG_WARNING, c, "Unknown command from client: %s",
@@ -591,7 +607,16 @@ struct linestack_context *new_linestack(struct irc_network *n,
 	}
 	data_dir = g_build_filename(basedir, n->name, NULL);
 	g_assert(data_dir != NULL);
-	ret = create_linestack(data_dir, TRUE, n->external_state);
+	ret = create_linestack(data_dir, !n->global->config->recover_linestack,
+						   n->external_state);
 	g_free(data_dir);
+
+	if (ret != NULL && n->global->config->network_threads) {
+		if (n->worker == NULL)
+			n->worker = irc_worker_new(n->name);
+		linestack_set_worker(ret, n->worker);
+	}
+	if (ret != NULL && n->global->config->linestack_search)
+		linestack_enable_search(ret);
 	return ret;
 }
@@ -85,12 +85,16 @@ gboolean redirect_response(struct query_stack *stack,
 						   const struct irc_line *l)
 {
 	struct irc_client *c = NULL;
+	GList *requesters, *gl;
 	int n;
 	int i;
 
-	c = (struct irc_client *)query_stack_match_response(stack, l);
-	if (c != NULL) {
-		client_send_line(c, l, NULL);
+	requesters = query_stack_match_responses(stack, l);
+	if (requesters != NULL) {
+		for (gl = requesters; gl; gl = gl->next)
+			client_send_line(gl->data, l, NULL);
+		g_list_free(requesters);
+		cache_handle_response(network, l, &network->global->config->cache);
 		return TRUE;
 	}
 
@@ -92,12 +92,9 @@ static void lastdisconnect_replicate(struct irc_client *c)
 	}
 	free_network_state(ns);
 
-	/* Silently ignore linestack send failures during replication */
-	{
-		gboolean G_GNUC_UNUSED ret = linestack_send(c->network->linestack, lm, NULL, c, FALSE,
+	linestack_stream(c->network->linestack, NULL, lm, NULL, c, FALSE,
 				   c->network->global->config->report_time != REPORT_TIME_NEVER,
 				   c->network->global->config->report_time_offset);
-	}
 }
 
 static gboolean log_data(struct irc_network *n, const struct irc_line *l, enum data_direction dir, void *userdata)
@@ -129,12 +126,9 @@ static void simple_replicate(struct irc_client *c)
 	}
 	free_network_state(ns);
 
-	/* Silently ignore linestack send failures during replication */
-	{
-		gboolean G_GNUC_UNUSED ret = linestack_send(c->network->linestack, m, NULL, c, FALSE,
+	linestack_stream(c->network->linestack, NULL, m, NULL, c, FALSE,
 				   c->network->global->config->report_time != REPORT_TIME_NEVER,
 				   c->network->global->config->report_time_offset);
-	}
 }
 
 static const struct replication_backend backends[] = {
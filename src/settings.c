@@ -59,8 +59,10 @@ static const char *builtin_known_keys[] = {
 	"auto-away-client-limit",
 	"auto-away-time",
 	"create-implicit",
+	"max-concurrent-connects",
 	"max-who-age",
 	"max_who_age",
+	"max-whois-age",
 	"replication",
 	"report-time",
 	"report-time-offset",
@@ -71,6 +73,14 @@ static const char *builtin_known_keys[] = {
 	"admin-log",
 	"admin-user",
 	"password",
+	"persist-tls-sessions",
+	"kernel-tls",
+	"network-threads",
+	"recover-linestack",
+	"capture-traffic",
+	"transport-backend",
+	"linestack-compression",
+	"linestack-search",
 	"default-username",
 	"default-nick",
 	"default-fullname",
@@ -214,10 +224,18 @@ static void config_save_network(struct ctrlproxy_config *cfg,
 		g_key_file_set_integer(kf, n->groupname, "queue-speed", n->queue_speed);
 	if (n->reconnect_interval != -1)
 		g_key_file_set_integer(kf, n->groupname, "reconnect-interval", n->reconnect_interval);
+	if (n->max_reconnect_interval != -1)
+		g_key_file_set_integer(kf, n->groupname, "max-reconnect-interval", n->max_reconnect_interval);
+	if (n->connect_priority)
+		g_key_file_set_integer(kf, n->groupname, "connect-priority", n->connect_priority);
 
 	switch(n->type) {
 	case NETWORK_VIRTUAL:
 		g_key_file_set_string(kf, n->groupname, "virtual", n->type_settings.virtual_name);
+		if (n->replay_trace != NULL) {
+			g_key_file_set_string(kf, n->groupname, "replay-trace", n->replay_trace);
+			g_key_file_set_double(kf, n->groupname, "replay-speed", n->replay_speed);
+		}
 		break;
 	case NETWORK_PROGRAM:
 		g_key_file_set_string(kf, n->groupname, "program", n->type_settings.program_location);
@@ -426,6 +444,44 @@ void save_configuration(struct ctrlproxy_config *cfg, const char *configuration_
 		g_key_file_set_integer(cfg->keyfile, "global", "max-who-age", cfg->cache.max_who_age);
 	}
 
+	if (g_key_file_has_key(cfg->keyfile, "global", "max-whois-age", NULL) ||
+		cfg->cache.max_whois_age != 0)
+		g_key_file_set_integer(cfg->keyfile, "global", "max-whois-age", cfg->cache.max_whois_age);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "max-concurrent-connects", NULL) ||
+		cfg->max_concurrent_connects != DEFAULT_MAX_CONCURRENT_CONNECTS)
+		g_key_file_set_integer(cfg->keyfile, "global", "max-concurrent-connects", cfg->max_concurrent_connects);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "persist-tls-sessions", NULL) ||
+		cfg->persist_tls_sessions)
+		g_key_file_set_boolean(cfg->keyfile, "global", "persist-tls-sessions", cfg->persist_tls_sessions);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "kernel-tls", NULL) ||
+		cfg->kernel_tls)
+		g_key_file_set_boolean(cfg->keyfile, "global", "kernel-tls", cfg->kernel_tls);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "network-threads", NULL) ||
+		cfg->network_threads)
+		g_key_file_set_boolean(cfg->keyfile, "global", "network-threads", cfg->network_threads);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "recover-linestack", NULL) ||
+		cfg->recover_linestack)
+		g_key_file_set_boolean(cfg->keyfile, "global", "recover-linestack", cfg->recover_linestack);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "capture-traffic", NULL) ||
+		cfg->capture_traffic)
+		g_key_file_set_boolean(cfg->keyfile, "global", "capture-traffic", cfg->capture_traffic);
+
+	if (cfg->transport_backend != NULL)
+		g_key_file_set_string(cfg->keyfile, "global", "transport-backend", cfg->transport_backend);
+
+	if (cfg->linestack_compression != NULL)
+		g_key_file_set_string(cfg->keyfile, "global", "linestack-compression", cfg->linestack_compression);
+
+	if (g_key_file_has_key(cfg->keyfile, "global", "linestack-search", NULL) ||
+		cfg->linestack_search)
+		g_key_file_set_boolean(cfg->keyfile, "global", "linestack-search", cfg->linestack_search);
+
 	if (g_key_file_has_key(cfg->keyfile, "global", "learn-nickserv", NULL) ||
 		!cfg->learn_nickserv)
 		g_key_file_set_boolean(cfg->keyfile, "global", "learn-nickserv", cfg->learn_nickserv);
@@ -605,6 +661,14 @@ static struct network_config *config_load_network_keyfile_group(struct ctrlproxy
 		n->reconnect_interval = g_key_file_get_integer(kf, groupname, "reconnect-interval", NULL);
 	}
 
+	if (g_key_file_has_key(kf, groupname, "max-reconnect-interval", NULL)) {
+		n->max_reconnect_interval = g_key_file_get_integer(kf, groupname, "max-reconnect-interval", NULL);
+	}
+
+	if (g_key_file_has_key(kf, groupname, "connect-priority", NULL)) {
+		n->connect_priority = g_key_file_get_integer(kf, groupname, "connect-priority", NULL);
+	}
+
 	if (g_key_file_has_key(kf, groupname, "queue-speed", NULL)) {
 		n->queue_speed = g_key_file_get_integer(kf, groupname, "queue-speed", NULL);
 	}
@@ -649,6 +713,9 @@ static struct network_config *config_load_network_keyfile_group(struct ctrlproxy
 		break;
 	case NETWORK_VIRTUAL:
 		n->type_settings.virtual_name = g_key_file_get_string(kf, groupname, "virtual", NULL);
+		n->replay_trace = g_key_file_get_string(kf, groupname, "replay-trace", NULL);
+		if (g_key_file_has_key(kf, groupname, "replay-speed", NULL))
+			n->replay_speed = g_key_file_get_double(kf, groupname, "replay-speed", NULL);
 		break;
 	case NETWORK_IOCHANNEL:
 		/* Don't store */
@@ -763,6 +830,7 @@ static struct network_config *find_create_network_config(struct ctrlproxy_config
 	nc->name = g_strdup(name);
 	nc->autoconnect = FALSE;
 	nc->reconnect_interval = -1;
+	nc->max_reconnect_interval = -1;
 	nc->type = NETWORK_TCP;
 	tc = g_new0(struct tcp_server_config, 1);
 	if (!irc_parse_url(name, &tc->host, &tc->port, &tc->ssl)) {
@@ -1303,6 +1371,10 @@ struct ctrlproxy_config *load_configuration(const char *dir,
 		cfg->cache.max_who_age = g_key_file_get_integer(kf, "global", "max-who-age", NULL);
 	}
 
+	if (g_key_file_has_key(kf, "global", "max-whois-age", NULL)) {
+		cfg->cache.max_whois_age = g_key_file_get_integer(kf, "global", "max-whois-age", NULL);
+	}
+
 
 	cfg->replication = g_key_file_get_string(kf, "global", "replication", NULL);
 
@@ -1346,6 +1418,44 @@ struct ctrlproxy_config *load_configuration(const char *dir,
 		cfg->client_charset = NULL;
 	}
 
+	if (g_key_file_has_key(kf, "global", "max-concurrent-connects", NULL)) {
+		cfg->max_concurrent_connects = g_key_file_get_integer(kf, "global", "max-concurrent-connects", NULL);
+	} else {
+		cfg->max_concurrent_connects = DEFAULT_MAX_CONCURRENT_CONNECTS;
+	}
+
+	if (g_key_file_has_key(kf, "global", "persist-tls-sessions", NULL)) {
+		cfg->persist_tls_sessions = g_key_file_get_boolean(kf, "global", "persist-tls-sessions", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "kernel-tls", NULL)) {
+		cfg->kernel_tls = g_key_file_get_boolean(kf, "global", "kernel-tls", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "network-threads", NULL)) {
+		cfg->network_threads = g_key_file_get_boolean(kf, "global", "network-threads", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "recover-linestack", NULL)) {
+		cfg->recover_linestack = g_key_file_get_boolean(kf, "global", "recover-linestack", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "capture-traffic", NULL)) {
+		cfg->capture_traffic = g_key_file_get_boolean(kf, "global", "capture-traffic", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "transport-backend", NULL)) {
+		cfg->transport_backend = g_key_file_get_string(kf, "global", "transport-backend", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "linestack-compression", NULL)) {
+		cfg->linestack_compression = g_key_file_get_string(kf, "global", "linestack-compression", NULL);
+	}
+
+	if (g_key_file_has_key(kf, "global", "linestack-search", NULL)) {
+		cfg->linestack_search = g_key_file_get_boolean(kf, "global", "linestack-search", NULL);
+	}
+
 	if (g_key_file_has_key(kf, "global", "learn-nickserv", NULL)) {
 		cfg->learn_nickserv = g_key_file_get_boolean(kf, "global", "learn-nickserv", NULL);
 	} else {
@@ -1472,6 +1582,8 @@ struct network_config *network_config_init(struct ctrlproxy_config *cfg)
 
 	s->autoconnect = FALSE;
 	s->reconnect_interval = -1;
+	s->max_reconnect_interval = -1;
+	s->replay_speed = 1.0;
 
 	if (cfg) {
 		cfg->networks = g_list_append(cfg->networks, s);
@@ -1511,6 +1623,7 @@ void free_config(struct ctrlproxy_config *cfg)
 			break;
 		case NETWORK_VIRTUAL:
 			g_free(nc->type_settings.virtual_name);
+			g_free(nc->replay_trace);
 			break;
 		case NETWORK_PROGRAM:
 			g_free(nc->type_settings.program_location);
@@ -1534,6 +1647,8 @@ void free_config(struct ctrlproxy_config *cfg)
 	g_free(cfg->replication);
 	g_free(cfg->motd_file);
 	g_free(cfg->admin_user);
+	g_free(cfg->transport_backend);
+	g_free(cfg->linestack_compression);
 	g_key_file_free(cfg->keyfile);
 	g_free(cfg);
 }
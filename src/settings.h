@@ -89,6 +89,12 @@ struct network_config
 	/** After how much seconds to attempt to reconnect. */
 	guint reconnect_interval;
 
+	/** Upper bound for the reconnect interval after repeated failures. */
+	guint max_reconnect_interval;
+
+	/** Networks with a higher priority are connected first. */
+	int connect_priority;
+
 	/** Channels that should be joined. */
 	GList *channels;
 
@@ -111,6 +117,13 @@ struct network_config
 	/** Commands to send on connect. */
 	char **autocmd;
 
+	/** Trace file to play back, for replay networks. */
+	char *replay_trace;
+
+	/** Playback speed relative to the original traffic, 0 for as fast
+	 * as possible. */
+	double replay_speed;
+
 	struct ctrlproxy_config *global;
 };
 
@@ -213,6 +226,25 @@ struct ctrlproxy_config {
 	struct listener_config *default_listener;
 	gboolean auto_listener;
 	int listener_autoport;
+	/** Maximum number of network connections being set up at once,
+	 * 0 for no limit. */
+	int max_concurrent_connects;
+	/** Whether to keep TLS sessions for upstream servers across restarts. */
+	gboolean persist_tls_sessions;
+	/** Whether to let the kernel handle TLS records after the handshake. */
+	gboolean kernel_tls;
+	/** Whether each network writes its linestack from its own thread. */
+	gboolean network_threads;
+	/** Whether to keep the linestack across reconnects and restarts. */
+	gboolean recover_linestack;
+	/** Whether to record the traffic of each network to a trace file. */
+	gboolean capture_traffic;
+	/** Transport backend to use for new connections ("iochannel" or "epoll"). */
+	char *transport_backend;
+	/** Compression for new linestacks ("none" or "zstd"). */
+	char *linestack_compression;
+	/** Whether to keep a full-text index of each linestack. */
+	gboolean linestack_search;
 	gboolean learn_nickserv;
 	gboolean learn_network_name;
 	/**
@@ -36,6 +36,19 @@ GIOChannel *ssl_wrap_iochannel          (GIOChannel  *sock,
 					      const char  *remote_host,
 					      gpointer     credentials);
 
+void        ssl_set_session_key         (GIOChannel  *channel,
+					      const char  *key);
+void        ssl_session_cache_stats     (guint       *resumed,
+					      guint       *full,
+					      guint       *cached);
+void        ssl_set_kernel_tls          (gboolean     enabled);
+void        ssl_kernel_tls_stats        (guint       *offloaded,
+					      guint       *fallbacks);
+gboolean    ssl_session_cache_load      (const char  *path,
+					      GError     **err);
+gboolean    ssl_session_cache_save      (const char  *path,
+					      GError     **err);
+
 #define SSL_ERROR ssl_error_quark()
 
 GQuark ssl_error_quark (void);
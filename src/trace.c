@@ -0,0 +1,570 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include "internals.h"
+#include "trace.h"
+
+/*
+ * Traffic traces.
+ *
+ * A trace file starts with TRACE_MAGIC, a version byte and the time the
+ * trace was started (microseconds since the epoch, 8 bytes, big endian).
+ * Each record after that consists of:
+ *
+ *  - time since the previous record in microseconds (varint)
+ *  - record type (1 byte)
+ *  - client id (varint), only for TRACE_FROM_CLIENT*
+ *  - length of the line (varint)
+ *  - the line itself, without CR/LF
+ *
+ * Varints are stored 7 bits at a time, least significant group first,
+ * with the high bit set on all but the last byte.
+ */
+
+#define TRACE_MAGIC "CTRLPROXY-TRACE\n"
+#define TRACE_VERSION 1
+#define TRACE_FLUSH_INTERVAL G_USEC_PER_SEC
+#define TRACE_MAX_LINE_LENGTH 65536
+
+/* Maximum number of records replayed before returning to the main loop */
+#define REPLAY_BATCH 1000
+
+struct trace_file {
+	FILE *f;
+	gboolean writing;
+	guint64 start;
+	guint64 last;
+	guint64 last_flush;
+};
+
+struct network_capture {
+	struct trace_file *trace;
+	GHashTable *client_ids;
+	guint next_client_id;
+};
+
+struct replay_context {
+	struct trace_file *trace;
+	struct trace_record next;
+	gboolean have_next;
+	double speed;
+	guint64 started;
+	guint64 lines;
+	guint source_id;
+};
+
+static GHashTable *captures = NULL;
+
+static guint64 trace_now(void)
+{
+	return g_get_real_time();
+}
+
+static gboolean write_varint(FILE *f, guint64 value)
+{
+	do {
+		int c = value & 0x7f;
+		value >>= 7;
+		if (value != 0)
+			c |= 0x80;
+		if (putc(c, f) == EOF)
+			return FALSE;
+	} while (value != 0);
+
+	return TRUE;
+}
+
+static gboolean read_varint(FILE *f, guint64 *value)
+{
+	int shift = 0;
+	int c;
+
+	*value = 0;
+	do {
+		c = getc(f);
+		if (c == EOF || shift > 63)
+			return FALSE;
+		*value |= (guint64)(c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return TRUE;
+}
+
+/**
+ * Create a new trace file, overwriting any existing file.
+ *
+ * The file is only readable by the owner, since traces contain
+ * everything sent to the server, passwords included.
+ *
+ * @param path Path of the trace file.
+ * @return New trace, or NULL on error (errno is set)
+ */
+struct trace_file *trace_file_create(const char *path)
+{
+	struct trace_file *t;
+	int fd, i;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return NULL;
+
+	/* An existing file keeps its mode otherwise */
+	if (fchmod(fd, 0600) < 0) {
+		int e = errno;
+		close(fd);
+		errno = e;
+		return NULL;
+	}
+
+	t = g_new0(struct trace_file, 1);
+	t->f = fdopen(fd, "w");
+	if (t->f == NULL) {
+		int e = errno;
+		close(fd);
+		g_free(t);
+		errno = e;
+		return NULL;
+	}
+
+	t->writing = TRUE;
+	t->start = t->last = t->last_flush = trace_now();
+
+	fwrite(TRACE_MAGIC, strlen(TRACE_MAGIC), 1, t->f);
+	putc(TRACE_VERSION, t->f);
+	for (i = 7; i >= 0; i--)
+		putc((t->start >> (i * 8)) & 0xff, t->f);
+
+	return t;
+}
+
+/**
+ * Append a line to a trace.
+ *
+ * @param t Trace opened with trace_file_create()
+ * @param type Where the line came from or went to
+ * @param client Client id, for lines sent by clients
+ * @param l Line to record
+ * @return Whether the line was written
+ */
+gboolean trace_file_write(struct trace_file *t, enum trace_record_type type,
+						  guint client, const struct irc_line *l)
+{
+	guint64 now = trace_now();
+	char *raw;
+	gboolean ret;
+
+	g_assert(t->writing);
+
+	raw = irc_line_string(l);
+	if (raw == NULL)
+		return FALSE;
+
+	/* Wall clock time can jump backwards */
+	if (now < t->last)
+		now = t->last;
+
+	ret = write_varint(t->f, now - t->last) &&
+		  putc(type, t->f) != EOF &&
+		  (!TRACE_TYPE_HAS_CLIENT(type) || write_varint(t->f, client)) &&
+		  write_varint(t->f, strlen(raw)) &&
+		  fwrite(raw, strlen(raw), 1, t->f) == 1;
+	g_free(raw);
+
+	t->last = now;
+
+	if (now - t->last_flush >= TRACE_FLUSH_INTERVAL) {
+		fflush(t->f);
+		t->last_flush = now;
+	}
+
+	return ret;
+}
+
+/**
+ * Open an existing trace for reading.
+ *
+ * @param path Path of the trace file.
+ * @param error Error
+ * @return Trace, or NULL if it could not be opened or is not a trace
+ */
+struct trace_file *trace_file_open(const char *path, GError **error)
+{
+	struct trace_file *t;
+	char magic[sizeof(TRACE_MAGIC)-1];
+	int i, c;
+
+	t = g_new0(struct trace_file, 1);
+	t->f = fopen(path, "r");
+	if (t->f == NULL) {
+		g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(errno),
+					"Unable to open %s: %s", path, strerror(errno));
+		g_free(t);
+		return NULL;
+	}
+
+	if (fread(magic, sizeof(magic), 1, t->f) != 1 ||
+		memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+		getc(t->f) != TRACE_VERSION) {
+		g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+					"%s is not a supported trace file", path);
+		fclose(t->f);
+		g_free(t);
+		return NULL;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if ((c = getc(t->f)) == EOF) {
+			g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+						"%s is truncated", path);
+			fclose(t->f);
+			g_free(t);
+			return NULL;
+		}
+		t->start = (t->start << 8) | c;
+	}
+
+	return t;
+}
+
+/**
+ * Read the next record from a trace.
+ *
+ * A record that was cut short (for example because ctrlproxy was
+ * killed while capturing) is treated as the end of the trace.
+ *
+ * @param t Trace opened with trace_file_open()
+ * @param r Record to fill in; r->line must be freed by the caller
+ * @return FALSE at the end of the trace
+ */
+gboolean trace_file_read(struct trace_file *t, struct trace_record *r)
+{
+	guint64 delta, client = 0, len;
+	char *raw;
+	int type;
+
+	g_assert(!t->writing);
+
+	if (!read_varint(t->f, &delta))
+		return FALSE;
+
+	type = getc(t->f);
+	if (type == EOF)
+		return FALSE;
+
+	if (TRACE_TYPE_HAS_CLIENT(type) && !read_varint(t->f, &client))
+		return FALSE;
+
+	if (!read_varint(t->f, &len) || len > TRACE_MAX_LINE_LENGTH)
+		return FALSE;
+
+	raw = g_malloc(len + 1);
+	if (len > 0 && fread(raw, len, 1, t->f) != 1) {
+		g_free(raw);
+		return FALSE;
+	}
+	raw[len] = '\0';
+
+	t->last += delta;
+
+	r->type = type;
+	r->client = client;
+	r->offset = t->last;
+	r->line = irc_parse_line(raw);
+	g_free(raw);
+
+	return r->line != NULL;
+}
+
+/**
+ * Time at which a trace was started, in microseconds since the epoch.
+ */
+guint64 trace_file_start_time(struct trace_file *t)
+{
+	return t->start;
+}
+
+void trace_file_close(struct trace_file *t)
+{
+	if (t == NULL)
+		return;
+
+	fclose(t->f);
+	g_free(t);
+}
+
+static void free_network_capture(struct network_capture *c)
+{
+	trace_file_close(c->trace);
+	g_hash_table_destroy(c->client_ids);
+	g_free(c);
+}
+
+static struct network_capture *get_capture(struct irc_network *n)
+{
+	struct network_capture *c;
+	char *dir, *name, *path;
+
+	if (captures == NULL)
+		return NULL;
+
+	c = g_hash_table_lookup(captures, n);
+
+	if (!n->global->config->capture_traffic) {
+		if (c != NULL)
+			g_hash_table_remove(captures, n);
+		return NULL;
+	}
+
+	if (c != NULL)
+		return c;
+
+	dir = g_build_filename(n->global->config->config_dir, "traces", NULL);
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		network_log(LOG_WARNING, n, "Unable to create trace directory %s: %s",
+					dir, strerror(errno));
+		g_free(dir);
+		return NULL;
+	}
+
+	name = g_strdup_printf("%s.trace", n->name);
+	path = g_build_filename(dir, name, NULL);
+	g_free(name);
+	g_free(dir);
+
+	c = g_new0(struct network_capture, 1);
+	c->trace = trace_file_create(path);
+	if (c->trace == NULL) {
+		/* Don't retry for every line */
+		network_log(LOG_WARNING, n, "Unable to create trace %s: %s",
+					path, strerror(errno));
+		n->global->config->capture_traffic = FALSE;
+		g_free(path);
+		g_free(c);
+		return NULL;
+	}
+
+	network_log(LOG_INFO, n, "Capturing traffic to %s", path);
+	g_free(path);
+
+	c->client_ids = g_hash_table_new(NULL, NULL);
+	g_hash_table_insert(captures, n, c);
+
+	return c;
+}
+
+/**
+ * Record a line sent to or received from the server of a network,
+ * if traffic capturing is enabled.
+ */
+void trace_server_line(struct irc_network *n, const struct irc_line *l,
+					   gboolean incoming)
+{
+	struct network_capture *c = get_capture(n);
+
+	if (c == NULL)
+		return;
+
+	trace_file_write(c->trace, incoming?TRACE_FROM_SERVER:TRACE_TO_SERVER,
+					 0, l);
+}
+
+/**
+ * Record a line sent by a client to a network, if traffic capturing
+ * is enabled.
+ */
+void trace_client_line(struct irc_network *n, struct irc_client *client,
+					   const struct irc_line *l, gboolean is_private)
+{
+	struct network_capture *c = get_capture(n);
+	guint id;
+
+	if (c == NULL)
+		return;
+
+	id = GPOINTER_TO_UINT(g_hash_table_lookup(c->client_ids, client));
+	if (id == 0 && client != NULL) {
+		id = ++c->next_client_id;
+		g_hash_table_insert(c->client_ids, client, GUINT_TO_POINTER(id));
+	}
+
+	trace_file_write(c->trace, is_private?TRACE_FROM_CLIENT_PRIVATE:TRACE_FROM_CLIENT,
+					 id, l);
+}
+
+/**
+ * Stop capturing traffic for a network.
+ */
+void trace_network_close(struct irc_network *n)
+{
+	if (captures != NULL)
+		g_hash_table_remove(captures, n);
+}
+
+static void trace_lose_client(struct irc_client *client, void *userdata)
+{
+	struct network_capture *c;
+
+	if (captures == NULL || client->network == NULL)
+		return;
+
+	c = g_hash_table_lookup(captures, client->network);
+	if (c != NULL)
+		g_hash_table_remove(c->client_ids, client);
+}
+
+/* Replay of traces through a virtual network */
+
+static gboolean replay_run(gpointer user_data);
+
+static void replay_schedule(struct irc_network *n)
+{
+	struct replay_context *rc = n->connection.data.virtual.private_data;
+	guint64 due, elapsed;
+
+	if (rc->speed <= 0) {
+		rc->source_id = g_idle_add(replay_run, n);
+		return;
+	}
+
+	due = rc->next.offset / rc->speed;
+	elapsed = trace_now() - rc->started;
+
+	rc->source_id = g_timeout_add(due > elapsed?(due - elapsed) / 1000:0,
+								  replay_run, n);
+}
+
+static gboolean replay_run(gpointer user_data)
+{
+	struct irc_network *n = user_data;
+	struct replay_context *rc = n->connection.data.virtual.private_data;
+	guint64 elapsed;
+	int i;
+
+	rc->source_id = 0;
+
+	for (i = 0; i < REPLAY_BATCH && rc->have_next; i++) {
+		elapsed = trace_now() - rc->started;
+
+		if (rc->speed > 0 && rc->next.offset / rc->speed > elapsed + 1000)
+			break;
+
+		switch (rc->next.type) {
+		case TRACE_FROM_SERVER:
+			virtual_network_recv_line(n, rc->next.line);
+			break;
+		case TRACE_FROM_CLIENT:
+		case TRACE_FROM_CLIENT_PRIVATE:
+			if (rc->next.line->argc > 0)
+				network_forward_line(n, NULL, rc->next.line,
+						rc->next.type == TRACE_FROM_CLIENT_PRIVATE);
+			break;
+		case TRACE_TO_SERVER:
+			/* Generated by ctrlproxy itself, so it will be sent
+			 * again as part of the replay */
+			break;
+		}
+
+		rc->lines++;
+		free_line(rc->next.line);
+		rc->next.line = NULL;
+		rc->have_next = trace_file_read(rc->trace, &rc->next);
+	}
+
+	if (!rc->have_next) {
+		network_log(LOG_INFO, n, "Replay finished: %" G_GUINT64_FORMAT
+					" lines in %.1f seconds", rc->lines,
+					(trace_now() - rc->started) / (double)G_USEC_PER_SEC);
+		return FALSE;
+	}
+
+	replay_schedule(n);
+	return FALSE;
+}
+
+static gboolean replay_init(struct irc_network *n)
+{
+	struct network_config *nc = n->private_data;
+	struct replay_context *rc;
+	GError *error = NULL;
+
+	if (nc->replay_trace == NULL) {
+		network_log(LOG_WARNING, n, "No trace set to replay (replay-trace)");
+		return FALSE;
+	}
+
+	rc = g_new0(struct replay_context, 1);
+	rc->trace = trace_file_open(nc->replay_trace, &error);
+	if (rc->trace == NULL) {
+		network_log(LOG_WARNING, n, "%s", error->message);
+		g_error_free(error);
+		g_free(rc);
+		return FALSE;
+	}
+
+	rc->speed = nc->replay_speed;
+	rc->started = trace_now();
+	n->connection.data.virtual.private_data = rc;
+
+	network_log(LOG_INFO, n, "Replaying %s at %s speed", nc->replay_trace,
+				rc->speed > 0?"recorded":"maximum");
+
+	rc->have_next = trace_file_read(rc->trace, &rc->next);
+	if (rc->have_next)
+		replay_schedule(n);
+
+	return TRUE;
+}
+
+static gboolean replay_to_server(struct irc_network *n, struct irc_client *c,
+								 const struct irc_line *l)
+{
+	/* The server replies come from the trace */
+	return TRUE;
+}
+
+static void replay_fini(struct irc_network *n)
+{
+	struct replay_context *rc = n->connection.data.virtual.private_data;
+
+	if (rc == NULL)
+		return;
+
+	if (rc->source_id != 0)
+		g_source_remove(rc->source_id);
+	free_line(rc->next.line);
+	trace_file_close(rc->trace);
+	g_free(rc);
+	n->connection.data.virtual.private_data = NULL;
+}
+
+static struct virtual_network_ops replay_network = {
+	.name = "replay",
+	.init = replay_init,
+	.to_server = replay_to_server,
+	.fini = replay_fini,
+};
+
+void init_trace(void)
+{
+	captures = g_hash_table_new_full(NULL, NULL, NULL,
+									 (GDestroyNotify)free_network_capture);
+	add_lose_client_hook("trace", trace_lose_client, NULL);
+	register_virtual_network(&replay_network);
+}
@@ -0,0 +1,40 @@
+#ifndef _CTRLPROXY_TRACE_H_
+#define _CTRLPROXY_TRACE_H_
+
+struct irc_line;
+struct irc_client;
+struct irc_network;
+struct trace_file;
+
+/* trace.c */
+enum trace_record_type {
+	TRACE_FROM_SERVER = 1,
+	TRACE_TO_SERVER = 2,
+	TRACE_FROM_CLIENT = 3,
+	TRACE_FROM_CLIENT_PRIVATE = 4,
+};
+
+#define TRACE_TYPE_HAS_CLIENT(t) ((t) == TRACE_FROM_CLIENT || (t) == TRACE_FROM_CLIENT_PRIVATE)
+
+struct trace_record {
+	enum trace_record_type type;
+	/** Client that sent the line, numbered from 1 within the trace. */
+	guint client;
+	/** Microseconds since the start of the trace. */
+	guint64 offset;
+	struct irc_line *line;
+};
+
+G_GNUC_WARN_UNUSED_RESULT struct trace_file *trace_file_create(const char *path);
+gboolean trace_file_write(struct trace_file *t, enum trace_record_type type, guint client, const struct irc_line *l);
+G_GNUC_WARN_UNUSED_RESULT struct trace_file *trace_file_open(const char *path, GError **error);
+G_GNUC_WARN_UNUSED_RESULT gboolean trace_file_read(struct trace_file *t, struct trace_record *r);
+guint64 trace_file_start_time(struct trace_file *t);
+void trace_file_close(struct trace_file *t);
+
+void trace_server_line(struct irc_network *n, const struct irc_line *l, gboolean incoming);
+void trace_client_line(struct irc_network *n, struct irc_client *c, const struct irc_line *l, gboolean is_private);
+void trace_network_close(struct irc_network *n);
+void init_trace(void);
+
+#endif
@@ -76,6 +76,18 @@ struct global *load_global(const char *config_dir, gboolean from_source)
 	global = init_global();
 	global->config = cfg;
 
+	if (cfg->transport_backend != NULL &&
+		!irc_transport_set_backend(cfg->transport_backend)) {
+		log_global(LOG_WARNING, "Transport backend `%s' not available, using `%s'",
+				   cfg->transport_backend, irc_transport_get_backend());
+	}
+
+	if (cfg->linestack_compression != NULL &&
+		!linestack_set_compression(cfg->linestack_compression)) {
+		log_global(LOG_WARNING, "Linestack compression `%s' not available, using `%s'",
+				   cfg->linestack_compression, linestack_get_compression());
+	}
+
 	load_networks(global, global->config);
 
 	nickserv_load(global);
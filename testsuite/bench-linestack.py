@@ -20,3 +20,9 @@ i = 0
 for x in ls.traverse(m1, m2):
     i += 1
 print "Read %d lines in %f" % (i, time.time()-t)
+
+t = time.time()
+i = 0
+for x in ls.traverse(m1, m2, raw=True):
+    i += 1
+print "Read %d raw lines in %f" % (i, time.time()-t)
@@ -0,0 +1,776 @@
+/*
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Micro benchmarks for the hot paths in libirc and the client code.
+ *
+ * Every benchmark works on a fixed data set so that runs can be compared
+ * between revisions. The results are written to stdout as JSON.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "ctrlproxy.h"
+#include "internals.h"
+
+/* No hup handler */
+void register_hup_handler(hup_handler_fn fn, void *userdata) {}
+
+#ifdef __GLIBC__
+/* Count allocations by interposing the glibc allocator. The benchmarks
+ * run in a single thread, so a plain counter is good enough. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+#define HAVE_ALLOC_COUNT 1
+
+static guint64 alloc_count = 0;
+
+void *malloc(size_t size)
+{
+	alloc_count++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __libc_realloc(ptr, size);
+}
+#else
+static guint64 alloc_count = 0;
+#endif
+
+#define BENCH_SAMPLE_LINE ":nick!user@host.example.com PRIVMSG #channel :Hello, world! How is everybody doing today?"
+#define BENCH_STATE_NICKS 2000
+#define BENCH_STATE_CHANNELS 100
+#define BENCH_CHANNEL_NICKS 50
+#define BENCH_LINESTACK_LINES 10000
+#define BENCH_FANOUT_CLIENTS 100
+
+/* Keeps the compiler from optimizing away results */
+static volatile int bench_sink;
+
+struct bench {
+	const char *name;
+	guint64 iterations;
+	void *(*setup) (guint64 iterations, const void *arg);
+	/* Returns the number of operations performed */
+	guint64 (*run) (void *data, guint64 iterations);
+	void (*teardown) (void *data);
+	const void *arg;
+};
+
+static void feed_state(struct irc_network_state *state, const char *fmt, ...)
+{
+	struct irc_line *l;
+	va_list ap;
+	char *raw;
+	gboolean ok;
+
+	va_start(ap, fmt);
+	raw = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	l = irc_parse_line(raw);
+	g_assert(l != NULL);
+	ok = state_handle_data(state, l);
+	g_assert(ok);
+	free_line(l);
+	g_free(raw);
+}
+
+static void remove_tree(const char *path)
+{
+	GDir *dir;
+	const char *name;
+
+	dir = g_dir_open(path, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name(dir)) != NULL) {
+			char *child = g_build_filename(path, name, NULL);
+			remove_tree(child);
+			g_free(child);
+		}
+		g_dir_close(dir);
+		rmdir(path);
+	} else {
+		unlink(path);
+	}
+}
+
+/* Parsing and serialization */
+
+static void *setup_line(guint64 iterations, const void *arg)
+{
+	return irc_parse_line(BENCH_SAMPLE_LINE);
+}
+
+static void teardown_line(void *data)
+{
+	free_line(data);
+}
+
+static guint64 run_parse_line(void *data, guint64 iterations)
+{
+	guint64 i;
+
+	for (i = 0; i < iterations; i++) {
+		struct irc_line *l = irc_parse_line(BENCH_SAMPLE_LINE);
+		bench_sink += l->argc;
+		free_line(l);
+	}
+
+	return iterations;
+}
+
+static guint64 run_line_string(void *data, guint64 iterations)
+{
+	guint64 i;
+
+	for (i = 0; i < iterations; i++) {
+		char *raw = irc_line_string(data);
+		bench_sink += raw[0];
+		g_free(raw);
+	}
+
+	return iterations;
+}
+
+/* State tracking with nicks joining, renaming and leaving */
+
+struct churn_data {
+	struct irc_network_state *state;
+	struct irc_line **lines;
+	guint64 count;
+};
+
+static void *setup_state_churn(guint64 iterations, const void *arg)
+{
+	struct churn_data *d = g_new0(struct churn_data, 1);
+	GString *names;
+	guint64 i;
+	int j;
+
+	d->state = network_state_init("bench", "user", "host.example.com");
+	feed_state(d->state, ":bench!user@host.example.com JOIN #churn");
+
+	names = g_string_new("bench");
+	for (j = 0; j < BENCH_STATE_NICKS; j++) {
+		g_string_append_printf(names, " %snick%d", (j % 10 == 0)?"@":"", j);
+		if (names->len > 400) {
+			feed_state(d->state, ":server 353 bench = #churn :%s", names->str);
+			g_string_truncate(names, 0);
+			g_string_append(names, "bench");
+		}
+	}
+	feed_state(d->state, ":server 353 bench = #churn :%s", names->str);
+	feed_state(d->state, ":server 366 bench #churn :End of /NAMES list.");
+	g_string_free(names, TRUE);
+
+	/* Parse up front so only state_handle_data() is measured */
+	d->count = iterations;
+	d->lines = g_new0(struct irc_line *, iterations);
+	for (i = 0; i < iterations; i++) {
+		guint64 n = i / 3;
+		char *raw;
+
+		switch (i % 3) {
+		case 0:
+			raw = g_strdup_printf(":churn%" G_GUINT64_FORMAT "!u@h JOIN #churn", n);
+			break;
+		case 1:
+			raw = g_strdup_printf(":churn%" G_GUINT64_FORMAT "!u@h NICK renamed%" G_GUINT64_FORMAT, n, n);
+			break;
+		default:
+			raw = g_strdup_printf(":renamed%" G_GUINT64_FORMAT "!u@h PART #churn :bye", n);
+			break;
+		}
+		d->lines[i] = irc_parse_line(raw);
+		g_free(raw);
+	}
+
+	return d;
+}
+
+static guint64 run_state_churn(void *data, guint64 iterations)
+{
+	struct churn_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < iterations && i < d->count; i++) {
+		bench_sink += state_handle_data(d->state, d->lines[i]);
+	}
+
+	return i;
+}
+
+static void teardown_state_churn(void *data)
+{
+	struct churn_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < d->count; i++) {
+		free_line(d->lines[i]);
+	}
+	g_free(d->lines);
+	free_network_state(d->state);
+	g_free(d);
+}
+
+/* Netsplit: many nicks on large shared channels quitting at once */
+
+#define BENCH_NETSPLIT_CHANNELS 10
+
+struct netsplit_data {
+	struct irc_network_state *state;
+	struct irc_line **lines;
+	guint64 count;
+};
+
+static void *setup_netsplit(guint64 iterations, const void *arg)
+{
+	struct netsplit_data *d = g_new0(struct netsplit_data, 1);
+	guint64 i;
+	int c;
+
+	d->state = network_state_init("bench", "user", "host.example.com");
+
+	/* Every nick is on most channels, so the channels have about
+	 * 0.7 * iterations members each */
+	for (c = 0; c < BENCH_NETSPLIT_CHANNELS; c++) {
+		GString *names = g_string_new("bench");
+
+		feed_state(d->state, ":bench!user@host.example.com JOIN #split%d", c);
+		for (i = 0; i < iterations; i++) {
+			if ((i + c) % 3 == 0)
+				continue;
+			g_string_append_printf(names, " split%" G_GUINT64_FORMAT, i);
+			if (names->len > 400) {
+				feed_state(d->state, ":server 353 bench = #split%d :%s", c, names->str);
+				g_string_truncate(names, 0);
+				g_string_append(names, "bench");
+			}
+		}
+		feed_state(d->state, ":server 353 bench = #split%d :%s", c, names->str);
+		feed_state(d->state, ":server 366 bench #split%d :End of /NAMES list.", c);
+		g_string_free(names, TRUE);
+	}
+
+	/* Nicks quit in the order they were seen, so finding them is cheap
+	 * and mostly removing them from the channels is measured */
+	d->count = iterations;
+	d->lines = g_new0(struct irc_line *, iterations);
+	for (i = 0; i < iterations; i++) {
+		char *raw = g_strdup_printf(":split%" G_GUINT64_FORMAT "!u@h QUIT :hub.example.com leaf.example.com", i);
+		d->lines[i] = irc_parse_line(raw);
+		g_free(raw);
+	}
+
+	return d;
+}
+
+static guint64 run_netsplit(void *data, guint64 iterations)
+{
+	struct netsplit_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < iterations && i < d->count; i++) {
+		bench_sink += state_handle_data(d->state, d->lines[i]);
+	}
+
+	return i;
+}
+
+static void teardown_netsplit(void *data)
+{
+	struct netsplit_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < d->count; i++) {
+		free_line(d->lines[i]);
+	}
+	g_free(d->lines);
+	free_network_state(d->state);
+	g_free(d);
+}
+
+/* Receiving the NAMES reply for a large channel */
+
+#define BENCH_NAMES_NICKS 5000
+
+struct names_data {
+	struct irc_network_state *state;
+	struct irc_line **lines;
+	guint64 count;
+};
+
+static void *setup_names(guint64 iterations, const void *arg)
+{
+	struct names_data *d = g_new0(struct names_data, 1);
+	GPtrArray *lines = g_ptr_array_new();
+	GString *names;
+	char *raw;
+	int j;
+
+	d->state = network_state_init("bench", "user", "host.example.com");
+	feed_state(d->state, ":bench!user@host.example.com JOIN #names");
+
+	names = g_string_new("bench");
+	for (j = 0; j < BENCH_NAMES_NICKS; j++) {
+		g_string_append_printf(names, " %snick%d", (j % 10 == 0)?"@":"", j);
+		if (names->len > 400) {
+			raw = g_strdup_printf(":server 353 bench = #names :%s", names->str);
+			g_ptr_array_add(lines, irc_parse_line(raw));
+			g_free(raw);
+			g_string_truncate(names, 0);
+			g_string_append(names, "bench");
+		}
+	}
+	raw = g_strdup_printf(":server 353 bench = #names :%s", names->str);
+	g_ptr_array_add(lines, irc_parse_line(raw));
+	g_free(raw);
+	g_ptr_array_add(lines, irc_parse_line(":server 366 bench #names :End of /NAMES list."));
+	g_string_free(names, TRUE);
+
+	d->count = lines->len;
+	d->lines = (struct irc_line **)g_ptr_array_free(lines, FALSE);
+
+	return d;
+}
+
+/* Each iteration is a full NAMES reply; the first one fills the channel,
+ * later ones resynchronise it */
+static guint64 run_names(void *data, guint64 iterations)
+{
+	struct names_data *d = data;
+	guint64 i, j;
+
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < d->count; j++)
+			bench_sink += state_handle_data(d->state, d->lines[j]);
+	}
+
+	return i;
+}
+
+static void teardown_names(void *data)
+{
+	struct names_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < d->count; i++) {
+		free_line(d->lines[i]);
+	}
+	g_free(d->lines);
+	free_network_state(d->state);
+	g_free(d);
+}
+
+/* Case-insensitive comparison */
+
+static void *setup_irccmp(guint64 iterations, const void *arg)
+{
+	struct irc_network_info *info = network_info_init();
+	info->casemapping = *(const enum casemapping *)arg;
+	return info;
+}
+
+static guint64 run_irccmp(void *data, guint64 iterations)
+{
+	guint64 i;
+
+	for (i = 0; i < iterations; i++) {
+		bench_sink += irccmp(data, "#Some[Channel]^Name", "#sOME{cHANNEL}~nAME");
+	}
+
+	return iterations;
+}
+
+static void teardown_irccmp(void *data)
+{
+	free_network_info(data);
+}
+
+static const enum casemapping casemap_rfc1459 = CASEMAP_RFC1459;
+static const enum casemapping casemap_ascii = CASEMAP_ASCII;
+static const enum casemapping casemap_strict_rfc1459 = CASEMAP_STRICT_RFC1459;
+
+/* Linestack */
+
+struct linestack_data {
+	char *dir;
+	struct irc_network_state *state;
+	struct linestack_context *ctx;
+	struct irc_line *line;
+};
+
+static void *setup_linestack(guint64 iterations, const void *arg)
+{
+	struct linestack_data *d = g_new0(struct linestack_data, 1);
+	gboolean ok;
+	int i;
+
+	d->dir = g_dir_make_tmp("ctrlproxy-bench-XXXXXX", NULL);
+	g_assert(d->dir != NULL);
+	d->state = network_state_init("bench", "user", "host.example.com");
+	feed_state(d->state, ":bench!user@host.example.com JOIN #channel");
+	d->ctx = create_linestack(d->dir, TRUE, d->state);
+	d->line = irc_parse_line(BENCH_SAMPLE_LINE);
+
+	if (arg != NULL) {
+		for (i = 0; i < BENCH_LINESTACK_LINES; i++) {
+			ok = linestack_insert_line(d->ctx, d->line, FROM_SERVER, d->state);
+			g_assert(ok);
+		}
+		linestack_flush(d->ctx);
+	}
+
+	return d;
+}
+
+static guint64 run_linestack_insert(void *data, guint64 iterations)
+{
+	struct linestack_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < iterations; i++) {
+		bench_sink += linestack_insert_line(d->ctx, d->line, FROM_SERVER, d->state);
+	}
+	linestack_flush(d->ctx);
+
+	return iterations;
+}
+
+static gboolean count_line(struct irc_line *l, time_t t, void *userdata)
+{
+	(*(guint64 *)userdata)++;
+	return TRUE;
+}
+
+static guint64 run_linestack_traverse(void *data, guint64 iterations)
+{
+	struct linestack_data *d = data;
+	guint64 i, ops = 0;
+
+	for (i = 0; i < iterations; i++) {
+		bench_sink += linestack_traverse(d->ctx, NULL, NULL, count_line, &ops);
+	}
+
+	return ops;
+}
+
+static void teardown_linestack(void *data)
+{
+	struct linestack_data *d = data;
+
+	free_linestack_context(d->ctx);
+	free_network_state(d->state);
+	free_line(d->line);
+	remove_tree(d->dir);
+	g_free(d->dir);
+	g_free(d);
+}
+
+/* Sending to clients */
+
+static struct irc_network_info bench_network_info = { .name = "bench" };
+static struct irc_network bench_network = {
+	.name = "bench",
+	.info = &bench_network_info,
+	.references = 1,
+};
+
+struct bench_client {
+	struct irc_client *client;
+	int peer;
+};
+
+static void bench_client_init(struct bench_client *bc)
+{
+	int sock[2];
+	GIOChannel *ch;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+
+	ch = g_io_channel_unix_new(sock[0]);
+	bc->client = client_init_iochannel(&bench_network, ch, "bench");
+	g_io_channel_unref(ch);
+	bc->client->state = network_state_init("bench", "user", "host.example.com");
+	bc->client->authenticated = TRUE;
+	bc->peer = sock[1];
+}
+
+/* Read whatever the client wrote until its send queue is empty, so the
+ * socket buffer never limits the benchmark. */
+static void bench_client_drain(struct bench_client *bc)
+{
+	char buf[65536];
+
+	for (;;) {
+		while (recv(bc->peer, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+
+		if (transport_get_queue_length(bc->client->transport) == 0)
+			break;
+
+		g_main_context_iteration(NULL, FALSE);
+	}
+}
+
+static void bench_client_free(struct bench_client *bc)
+{
+	client_disconnect(bc->client, "Benchmark finished");
+	close(bc->peer);
+}
+
+struct send_state_data {
+	struct bench_client client;
+	struct irc_network_state *state;
+};
+
+static void *setup_send_state(guint64 iterations, const void *arg)
+{
+	struct send_state_data *d = g_new0(struct send_state_data, 1);
+	int i, j;
+
+	d->state = network_state_init("bench", "user", "host.example.com");
+	for (i = 0; i < BENCH_STATE_CHANNELS; i++) {
+		GString *names = g_string_new("bench");
+
+		feed_state(d->state, ":bench!user@host.example.com JOIN #channel%d", i);
+		feed_state(d->state, ":server 332 bench #channel%d :Topic for channel %d", i, i);
+		for (j = 0; j < BENCH_CHANNEL_NICKS; j++) {
+			g_string_append_printf(names, " %snick%d", (j % 10 == 0)?"@":"", j);
+		}
+		feed_state(d->state, ":server 353 bench = #channel%d :%s", i, names->str);
+		feed_state(d->state, ":server 366 bench #channel%d :End of /NAMES list.", i);
+		g_string_free(names, TRUE);
+	}
+
+	bench_client_init(&d->client);
+
+	return d;
+}
+
+static guint64 run_send_state(void *data, guint64 iterations)
+{
+	struct send_state_data *d = data;
+	guint64 i;
+
+	for (i = 0; i < iterations; i++) {
+		bench_sink += client_send_state(d->client.client, d->state);
+		bench_client_drain(&d->client);
+	}
+
+	return iterations;
+}
+
+static void teardown_send_state(void *data)
+{
+	struct send_state_data *d = data;
+
+	bench_client_free(&d->client);
+	free_network_state(d->state);
+	g_free(d);
+}
+
+struct fanout_data {
+	struct bench_client clients[BENCH_FANOUT_CLIENTS];
+	GList *list;
+	struct irc_line *line;
+};
+
+static void *setup_fanout(guint64 iterations, const void *arg)
+{
+	struct fanout_data *d = g_new0(struct fanout_data, 1);
+	int i;
+
+	for (i = 0; i < BENCH_FANOUT_CLIENTS; i++) {
+		bench_client_init(&d->clients[i]);
+		d->list = g_list_append(d->list, d->clients[i].client);
+	}
+	d->line = irc_parse_line(BENCH_SAMPLE_LINE);
+
+	return d;
+}
+
+static guint64 run_fanout(void *data, guint64 iterations)
+{
+	struct fanout_data *d = data;
+	guint64 i;
+	int j;
+
+	for (i = 0; i < iterations; i++) {
+		clients_send(d->list, d->line, NULL);
+		for (j = 0; j < BENCH_FANOUT_CLIENTS; j++) {
+			bench_client_drain(&d->clients[j]);
+		}
+	}
+
+	return iterations;
+}
+
+static void teardown_fanout(void *data)
+{
+	struct fanout_data *d = data;
+	int i;
+
+	for (i = 0; i < BENCH_FANOUT_CLIENTS; i++) {
+		bench_client_free(&d->clients[i]);
+	}
+	g_list_free(d->list);
+	free_line(d->line);
+	g_free(d);
+}
+
+static const struct bench benchmarks[] = {
+	{ "irc_parse_line", 500000, setup_line, run_parse_line, teardown_line },
+	{ "irc_line_string", 500000, setup_line, run_line_string, teardown_line },
+	{ "state_handle_data_churn", 300000, setup_state_churn, run_state_churn, teardown_state_churn },
+	{ "state_handle_data_names_5000", 50, setup_names, run_names, teardown_names },
+	{ "state_handle_data_netsplit", 3000, setup_netsplit, run_netsplit, teardown_netsplit },
+	{ "irccmp_rfc1459", 2000000, setup_irccmp, run_irccmp, teardown_irccmp, &casemap_rfc1459 },
+	{ "irccmp_ascii", 2000000, setup_irccmp, run_irccmp, teardown_irccmp, &casemap_ascii },
+	{ "irccmp_strict_rfc1459", 2000000, setup_irccmp, run_irccmp, teardown_irccmp, &casemap_strict_rfc1459 },
+	{ "linestack_insert_line", 100000, setup_linestack, run_linestack_insert, teardown_linestack },
+	{ "linestack_traverse", 20, setup_linestack, run_linestack_traverse, teardown_linestack, "" },
+	{ "client_send_state_100_channels", 200, setup_send_state, run_send_state, teardown_send_state },
+	{ "clients_send_100_clients", 5000, setup_fanout, run_fanout, teardown_fanout },
+	{ NULL }
+};
+
+static guint64 now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (guint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run_benchmark(const struct bench *b, double scale, gboolean first)
+{
+	guint64 iterations, ops, start, elapsed, allocs;
+	void *data;
+
+	iterations = b->iterations * scale;
+	if (iterations == 0)
+		iterations = 1;
+
+	data = b->setup(iterations, b->arg);
+
+	allocs = alloc_count;
+	start = now_ns();
+	ops = b->run(data, iterations);
+	elapsed = now_ns() - start;
+	allocs = alloc_count - allocs;
+
+	b->teardown(data);
+
+	if (ops == 0)
+		ops = 1;
+	if (elapsed == 0)
+		elapsed = 1;
+
+	printf("%s\n    { \"name\": \"%s\", \"ops\": %" G_GUINT64_FORMAT
+		   ", \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"allocs_per_op\": ",
+		   first?"":",", b->name, ops, (double)elapsed / ops,
+		   ops * 1e9 / elapsed);
+#ifdef HAVE_ALLOC_COUNT
+	printf("%.2f }", (double)allocs / ops);
+#else
+	printf("null }");
+#endif
+	fflush(stdout);
+}
+
+static gboolean benchmark_selected(const struct bench *b, int argc, char **argv)
+{
+	int i;
+
+	if (argc < 2)
+		return TRUE;
+
+	for (i = 1; i < argc; i++) {
+		if (strstr(b->name, argv[i]) != NULL)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+extern enum log_level current_log_level;
+
+int main(int argc, char **argv)
+{
+	GOptionContext *pc;
+	double scale = 1.0;
+	gboolean list = FALSE;
+	gboolean first = TRUE;
+	int i;
+	GOptionEntry options[] = {
+		{"scale", 's', 0, G_OPTION_ARG_DOUBLE, &scale, "Multiply the number of iterations by this factor" },
+		{"list", 'l', 0, G_OPTION_ARG_NONE, &list, "List the available benchmarks" },
+		{ NULL }
+	};
+	GError *error = NULL;
+
+	pc = g_option_context_new("[BENCHMARK...]");
+	g_option_context_add_main_entries(pc, options, NULL);
+
+	if (!g_option_context_parse(pc, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	g_option_context_free(pc);
+
+	if (list) {
+		for (i = 0; benchmarks[i].name != NULL; i++) {
+			printf("%s\n", benchmarks[i].name);
+		}
+		return 0;
+	}
+
+	current_log_level = LOG_ERROR;
+
+	printf("{\n  \"benchmarks\": [");
+	for (i = 0; benchmarks[i].name != NULL; i++) {
+		if (!benchmark_selected(&benchmarks[i], argc, argv))
+			continue;
+		run_benchmark(&benchmarks[i], scale, first);
+		first = FALSE;
+	}
+	printf("\n  ]\n}\n");
+
+	return 0;
+}
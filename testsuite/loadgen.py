@@ -0,0 +1,493 @@
+#!/usr/bin/python3
+# End-to-end load generator for CtrlProxy
+# Copyright (C) 2009 Jelmer Vernooij <jelmer@jelmer.uk>
+#
+# Starts a scripted IRC server on localhost, points a freshly configured
+# ctrlproxy at it and attaches a number of clients. The server generates
+# channel traffic, nick churn and netsplits; every PRIVMSG carries the time
+# it was sent, so the clients can measure how long it took to get through
+# the proxy. The results are printed as JSON.
+
+import json
+import optparse
+import os
+import random
+import selectors
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+SERVER_NAME = "irc.loadtest.example"
+SPLIT_REASON = "hub.loadtest.example leaf.loadtest.example"
+MARKER = "lg"
+
+
+def now_us():
+    return int(time.monotonic() * 1000000)
+
+
+class Connection(object):
+    """Line-based, non-blocking connection."""
+
+    def __init__(self, sock):
+        self.sock = sock
+        self.sock.setblocking(False)
+        self.inbuf = b""
+        self.outbuf = bytearray()
+        self.closed = False
+
+    def send_line(self, line):
+        self.outbuf += line.encode("utf-8") + b"\r\n"
+
+    def flush(self):
+        while self.outbuf:
+            try:
+                n = self.sock.send(self.outbuf)
+            except (BlockingIOError, InterruptedError):
+                return
+            except OSError:
+                self.closed = True
+                return
+            del self.outbuf[:n]
+
+    def read_lines(self):
+        try:
+            data = self.sock.recv(65536)
+        except (BlockingIOError, InterruptedError):
+            return []
+        except OSError:
+            data = b""
+        if not data:
+            self.closed = True
+            return []
+        self.inbuf += data
+        lines = self.inbuf.split(b"\n")
+        self.inbuf = lines.pop()
+        return [l.rstrip(b"\r").decode("utf-8", "replace") for l in lines]
+
+
+def parse_line(line):
+    """Split a raw IRC line into (origin, command, args)."""
+    origin = None
+    if line.startswith(":"):
+        origin, line = line[1:].split(" ", 1)
+    if " :" in line:
+        line, trailing = line.split(" :", 1)
+        args = line.split() + [trailing]
+    else:
+        args = line.split()
+    if not args:
+        return origin, None, []
+    return origin, args[0].upper(), args[1:]
+
+
+class FakeServer(object):
+    """Scripted IRC server that a single ctrlproxy connects to."""
+
+    def __init__(self, opts, rng):
+        self.opts = opts
+        self.rng = rng
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind(("127.0.0.1", 0))
+        self.listener.listen(5)
+        self.listener.setblocking(False)
+        self.port = self.listener.getsockname()[1]
+        self.conn = None
+        self.nick = None
+        self.registered = False
+        self.channels = ["#load%d" % i for i in range(opts.channels)]
+        self.members = {}
+        for i, channel in enumerate(self.channels):
+            self.members[channel] = ["user%d_%d" % (i, j) for j in range(opts.members)]
+        self.churn = {}
+        self.split = []
+        self.seq = 0
+        self.sent_messages = 0
+        self.sent_lines = 0
+
+    def accept(self):
+        sock, addr = self.listener.accept()
+        if self.conn is not None:
+            self.conn.sock.close()
+        self.conn = Connection(sock)
+        self.nick = None
+        self.registered = False
+        return self.conn
+
+    def send(self, line):
+        self.conn.send_line(line)
+        self.sent_lines += 1
+
+    def handle_line(self, line):
+        origin, command, args = parse_line(line)
+        if command == "NICK" and args:
+            if self.registered:
+                self.send(":%s!user@loadtest NICK %s" % (self.nick, args[0]))
+            self.nick = args[0]
+        elif command == "USER":
+            self.register()
+        elif command == "PING":
+            self.send(":%s PONG %s :%s" % (SERVER_NAME, SERVER_NAME,
+                      args[0] if args else SERVER_NAME))
+
+    def register(self):
+        if self.registered or self.nick is None:
+            return
+        self.registered = True
+        n = self.nick
+        self.send(":%s 001 %s :Welcome to the load test network %s" % (SERVER_NAME, n, n))
+        self.send(":%s 002 %s :Your host is %s" % (SERVER_NAME, n, SERVER_NAME))
+        self.send(":%s 003 %s :This server was created just now" % (SERVER_NAME, n))
+        self.send(":%s 004 %s %s loadgen iosw biklmnopstv" % (SERVER_NAME, n, SERVER_NAME))
+        self.send(":%s 005 %s NETWORK=LoadTest CASEMAPPING=rfc1459 "
+                  "CHANTYPES=# PREFIX=(ov)@+ CHANMODES=beI,k,l,imnpst "
+                  ":are supported by this server" % (SERVER_NAME, n))
+        self.send(":%s 422 %s :MOTD File is missing" % (SERVER_NAME, n))
+        for channel in self.channels:
+            self.join_self(channel)
+
+    def join_self(self, channel):
+        n = self.nick
+        self.send(":%s!user@loadtest JOIN %s" % (n, channel))
+        self.send(":%s 332 %s %s :Load test channel %s" % (SERVER_NAME, n, channel, channel))
+        names = [n] + [("@" if i % 10 == 0 else "") + m
+                       for i, m in enumerate(self.members[channel])]
+        while names:
+            chunk, names = names[:40], names[40:]
+            self.send(":%s 353 %s = %s :%s" % (SERVER_NAME, n, channel, " ".join(chunk)))
+        self.send(":%s 366 %s %s :End of /NAMES list." % (SERVER_NAME, n, channel))
+
+    def message(self):
+        channel = self.rng.choice(self.channels)
+        if not self.members[channel]:
+            return
+        nick = self.rng.choice(self.members[channel])
+        self.seq += 1
+        padding = "x" * max(0, self.opts.message_size - 40)
+        self.send(":%s!user@host PRIVMSG %s :%s %d %d %s" % (
+                  nick, channel, MARKER, self.seq, now_us(), padding))
+        self.sent_messages += 1
+
+    def churn_event(self):
+        channel = self.rng.choice(self.channels)
+        state = self.churn.get(channel)
+        if state is None:
+            nick = "churn%d" % self.rng.randrange(1000000)
+            self.send(":%s!user@host JOIN %s" % (nick, channel))
+            self.churn[channel] = (nick, False)
+        elif not state[1]:
+            new = "renamed%d" % self.rng.randrange(1000000)
+            self.send(":%s!user@host NICK %s" % (state[0], new))
+            self.churn[channel] = (new, True)
+        else:
+            self.send(":%s!user@host PART %s :churn" % (state[0], channel))
+            del self.churn[channel]
+
+    def netsplit(self):
+        channel = self.rng.choice(self.channels)
+        members = self.members[channel]
+        count = min(self.opts.split_size, len(members))
+        victims = self.rng.sample(members, count)
+        for nick in victims:
+            self.send(":%s!user@host QUIT :%s" % (nick, SPLIT_REASON))
+            members.remove(nick)
+        self.split.append((time.monotonic() + self.opts.split_duration,
+                           channel, victims))
+
+    def rejoin(self, now):
+        while self.split and self.split[0][0] <= now:
+            when, channel, victims = self.split.pop(0)
+            for nick in victims:
+                self.send(":%s!user@host JOIN %s" % (nick, channel))
+                self.members[channel].append(nick)
+            self.send(":%s MODE %s +%s %s" % (SERVER_NAME, channel,
+                      "v" * len(victims[:4]), " ".join(victims[:4])))
+
+
+class Client(object):
+    """Client connected to ctrlproxy that records message latencies."""
+
+    def __init__(self, port, password, index):
+        sock = socket.create_connection(("127.0.0.1", port))
+        self.conn = Connection(sock)
+        self.index = index
+        self.joined = set()
+        self.welcomed = False
+        self.latencies = []
+        self.lines = 0
+        self.recording = False
+        self.conn.send_line("PASS %s" % password)
+        self.conn.send_line("NICK client%d" % index)
+        self.conn.send_line("USER client%d client%d localhost :Load test client" % (index, index))
+
+    def handle_line(self, line):
+        self.lines += 1
+        origin, command, args = parse_line(line)
+        if command == "PRIVMSG" and len(args) == 2 and args[1].startswith(MARKER + " "):
+            if self.recording:
+                fields = args[1].split(" ", 3)
+                self.latencies.append(now_us() - int(fields[2]))
+        elif command == "PING":
+            self.conn.send_line("PONG :%s" % (args[0] if args else ""))
+        elif command == "001":
+            self.welcomed = True
+        elif command == "JOIN" and args:
+            self.joined.add(args[0].lower())
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    k = int(round((len(values) - 1) * p / 100.0))
+    return values[k]
+
+
+def process_usage(pid):
+    """Return (cpu seconds, rss kB, peak rss kB) for a process, if known."""
+    try:
+        with open("/proc/%d/stat" % pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        cpu = (int(fields[11]) + int(fields[12])) / float(os.sysconf("SC_CLK_TCK"))
+        rss = hwm = None
+        with open("/proc/%d/status" % pid) as f:
+            for line in f:
+                if line.startswith("VmRSS:"):
+                    rss = int(line.split()[1])
+                elif line.startswith("VmHWM:"):
+                    hwm = int(line.split()[1])
+        return cpu, rss, hwm
+    except (IOError, OSError, IndexError, ValueError):
+        return None, None, None
+
+
+def write_config(config_dir, opts, server_port):
+    with open(os.path.join(config_dir, "config"), "w") as f:
+        f.write("[global]\n")
+        f.write("port = %d\n" % opts.port)
+        f.write("bind = 127.0.0.1\n")
+        f.write("password = %s\n" % opts.password)
+        f.write("default-network = loadtest\n")
+        f.write("autoconnect = loadtest\n")
+        f.write("replication = %s\n" % opts.replication)
+        f.write("autosave = false\n")
+        f.write("\n[loadtest]\n")
+        f.write("servers = 127.0.0.1:%d\n" % server_port)
+        f.write("nick = loadtest\n")
+        f.write("fullname = Load test\n")
+        f.write("username = loadtest\n")
+
+
+def free_port():
+    s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    s.bind(("127.0.0.1", 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def start_ctrlproxy(opts, config_dir):
+    ready_r, ready_w = os.pipe()
+    os.set_inheritable(ready_w, True)
+    args = [opts.ctrlproxy, "--config-dir", config_dir,
+            "--ready-fd", str(ready_w), "--debug-level", "0"]
+    proc = subprocess.Popen(args, pass_fds=[ready_w],
+                            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    os.close(ready_w)
+    data = os.read(ready_r, 1)
+    os.close(ready_r)
+    if data != b"1":
+        proc.kill()
+        raise RuntimeError("ctrlproxy exited before it started listening")
+    return proc
+
+
+def run(opts):
+    rng = random.Random(opts.seed)
+    server = FakeServer(opts, rng)
+    sel = selectors.DefaultSelector()
+    sel.register(server.listener, selectors.EVENT_READ, "listener")
+
+    config_dir = tempfile.mkdtemp(prefix="ctrlproxy-loadgen-")
+    if opts.port == 0:
+        opts.port = free_port()
+    write_config(config_dir, opts, server.port)
+    proc = start_ctrlproxy(opts, config_dir)
+
+    clients = []
+    try:
+        def poll(timeout):
+            for key, events in sel.select(timeout):
+                if key.data == "listener":
+                    conn = server.accept()
+                    sel.register(conn.sock, selectors.EVENT_READ, server)
+                    continue
+                obj = key.data
+                conn = obj.conn
+                for line in conn.read_lines():
+                    obj.handle_line(line)
+                if conn.closed:
+                    sel.unregister(conn.sock)
+                    conn.sock.close()
+            if server.conn is not None and not server.conn.closed:
+                server.conn.flush()
+            for c in clients:
+                if not c.conn.closed:
+                    c.conn.flush()
+
+        # Wait for ctrlproxy to register with the server
+        deadline = time.monotonic() + opts.timeout
+        while not server.registered:
+            if time.monotonic() > deadline:
+                raise RuntimeError("ctrlproxy did not connect to the server")
+            poll(0.1)
+
+        for i in range(opts.clients):
+            c = Client(opts.port, opts.password, i)
+            clients.append(c)
+            sel.register(c.conn.sock, selectors.EVENT_READ, c)
+
+        # Wait until every client has seen every channel
+        wanted = set(ch.lower() for ch in server.channels)
+        while not all(c.welcomed and wanted <= c.joined for c in clients):
+            if time.monotonic() > deadline:
+                raise RuntimeError("clients did not receive the channel state")
+            poll(0.1)
+
+        for c in clients:
+            c.recording = True
+        for c in clients:
+            c.lines = 0
+
+        cpu_start = process_usage(proc.pid)[0]
+        start = time.monotonic()
+        end = start + opts.duration
+        next_split = start + opts.split_interval if opts.split_interval else None
+        messages_due = churn_due = 0.0
+        last = start
+        sent_before = server.sent_lines
+
+        while True:
+            now = time.monotonic()
+            if now >= end:
+                break
+            elapsed = now - last
+            last = now
+            messages_due += elapsed * opts.rate
+            churn_due += elapsed * opts.churn_rate
+            while messages_due >= 1:
+                server.message()
+                messages_due -= 1
+            while churn_due >= 1:
+                server.churn_event()
+                churn_due -= 1
+            if next_split is not None and now >= next_split:
+                server.netsplit()
+                next_split += opts.split_interval
+            server.rejoin(now)
+            poll(0.001)
+
+        duration = time.monotonic() - start
+        cpu_end, rss, hwm = process_usage(proc.pid)
+
+        # Let the last lines through before stopping the clock
+        drain_end = time.monotonic() + opts.drain
+        while time.monotonic() < drain_end:
+            poll(0.05)
+
+        latencies = sorted(l for c in clients for l in c.latencies)
+        expected = server.sent_messages * len(clients)
+        received_lines = sum(c.lines for c in clients)
+        result = {
+            "config": {
+                "clients": opts.clients,
+                "channels": opts.channels,
+                "members": opts.members,
+                "rate": opts.rate,
+                "churn_rate": opts.churn_rate,
+                "split_interval": opts.split_interval,
+                "split_size": opts.split_size,
+                "duration": opts.duration,
+                "seed": opts.seed,
+            },
+            "server_messages": server.sent_messages,
+            "server_lines_per_sec": (server.sent_lines - sent_before) / duration,
+            "client_lines_per_sec": received_lines / duration,
+            "delivered_messages": len(latencies),
+            "lost_messages": expected - len(latencies),
+            "latency_us": {
+                "p50": percentile(latencies, 50),
+                "p90": percentile(latencies, 90),
+                "p99": percentile(latencies, 99),
+                "p999": percentile(latencies, 99.9),
+                "max": latencies[-1] if latencies else None,
+            },
+            "ctrlproxy": {
+                "cpu_percent": ((cpu_end - cpu_start) * 100 / duration
+                                if cpu_start is not None and cpu_end is not None else None),
+                "rss_kb": rss,
+                "peak_rss_kb": hwm,
+            },
+        }
+        json.dump(result, sys.stdout, indent=2)
+        sys.stdout.write("\n")
+    finally:
+        for c in clients:
+            c.conn.sock.close()
+        proc.terminate()
+        try:
+            proc.wait(5)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+            proc.wait()
+        shutil.rmtree(config_dir, ignore_errors=True)
+
+
+def main(argv):
+    parser = optparse.OptionParser(usage="%prog [OPTIONS]")
+    parser.add_option("--ctrlproxy", default="./ctrlproxy",
+                      help="ctrlproxy binary to test")
+    parser.add_option("--clients", type="int", default=10,
+                      help="number of clients to attach")
+    parser.add_option("--channels", type="int", default=50,
+                      help="number of channels the proxy is in")
+    parser.add_option("--members", type="int", default=100,
+                      help="number of other nicks in each channel")
+    parser.add_option("--rate", type="float", default=1000,
+                      help="channel messages per second")
+    parser.add_option("--message-size", type="int", default=80,
+                      help="approximate length of each message")
+    parser.add_option("--churn-rate", type="float", default=20,
+                      help="joins, nick changes and parts per second")
+    parser.add_option("--split-interval", type="float", default=10,
+                      help="seconds between netsplits (0 to disable)")
+    parser.add_option("--split-size", type="int", default=50,
+                      help="nicks lost in each netsplit")
+    parser.add_option("--split-duration", type="float", default=2,
+                      help="seconds before split nicks rejoin")
+    parser.add_option("--duration", type="float", default=30,
+                      help="seconds to generate traffic for")
+    parser.add_option("--drain", type="float", default=2,
+                      help="seconds to wait for lines still in flight")
+    parser.add_option("--replication", default="none",
+                      help="replication setting for ctrlproxy")
+    parser.add_option("--port", type="int", default=0,
+                      help="port for ctrlproxy to listen on (default: any free port)")
+    parser.add_option("--password", default="loadtest",
+                      help="password clients use to log in")
+    parser.add_option("--seed", type="int", default=42,
+                      help="random seed, for repeatable runs")
+    parser.add_option("--timeout", type="float", default=30,
+                      help="seconds to wait for the initial synchronization")
+    opts, args = parser.parse_args(argv)
+    if args:
+        parser.error("unexpected arguments: %s" % " ".join(args))
+    run(opts)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
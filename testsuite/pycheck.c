@@ -0,0 +1,151 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Runs the tests in python/tests. The ctrlproxy module only exists inside
+ * ctrlproxy, so the tests run in an embedded interpreter, with a
+ * ctrlproxy_test module to pass lines through the filters of a dummy
+ * network.
+ */
+
+#include <Python.h>
+#include "internals.h"
+#include "libirc/python/irc.h"
+
+extern void initirc(void);
+extern void initctrlproxy(void);
+
+static struct irc_network *test_network = NULL;
+
+static PyObject *py_test_network(PyObject *self)
+{
+	PyNetworkObject *ret;
+
+	ret = PyObject_New(PyNetworkObject, &PyNetworkType);
+	if (ret == NULL)
+		return NULL;
+	ret->network = irc_network_ref(test_network);
+
+	return (PyObject *)ret;
+}
+
+static PyObject *py_test_run_filter(gboolean log, PyObject *args)
+{
+	PyObject *py_line;
+	struct irc_line *l;
+	int dir;
+	gboolean ret;
+
+	if (!PyArg_ParseTuple(args, "Oi", &py_line, &dir))
+		return NULL;
+
+	l = PyObject_AsLine(py_line);
+	if (l == NULL)
+		return NULL;
+
+	if (log)
+		ret = run_log_filter(test_network, l, dir);
+	else
+		ret = run_server_filter(test_network, l, dir);
+	free_line(l);
+
+	return PyBool_FromLong(ret);
+}
+
+static PyObject *py_test_server_filter(PyObject *self, PyObject *args)
+{
+	return py_test_run_filter(FALSE, args);
+}
+
+static PyObject *py_test_log_filter(PyObject *self, PyObject *args)
+{
+	return py_test_run_filter(TRUE, args);
+}
+
+static PyObject *py_test_iterate(PyObject *self, PyObject *args)
+{
+	int may_block = 0;
+
+	if (!PyArg_ParseTuple(args, "|i", &may_block))
+		return NULL;
+
+	return PyBool_FromLong(g_main_context_iteration(NULL, may_block));
+}
+
+static PyMethodDef ctrlproxy_test_methods[] = {
+	{ "network", (PyCFunction)py_test_network, METH_NOARGS,
+		"network()\n"
+		"Network the lines are passed through" },
+	{ "server_filter", (PyCFunction)py_test_server_filter, METH_VARARGS,
+		"server_filter(line, direction) -> bool\n"
+		"Run the server filters; returns whether the line is kept" },
+	{ "log_filter", (PyCFunction)py_test_log_filter, METH_VARARGS,
+		"log_filter(line, direction) -> bool\n"
+		"Run the log filters; returns whether the line is kept" },
+	{ "iterate", (PyCFunction)py_test_iterate, METH_VARARGS,
+		"iterate(may_block=False) -> bool\n"
+		"Run one iteration of the main loop" },
+	{ NULL }
+};
+
+int main(int argc, char **argv)
+{
+	struct network_config nc = {
+		.name = "test"
+	};
+	const char *tests = (argc > 1)?argv[1]:"tests.test_filters";
+	PyObject *m, *result, *ok;
+	int ret;
+
+	Py_Initialize();
+	PySys_SetArgv(argc, argv);
+
+	initirc();
+	initctrlproxy();
+	if (Py_InitModule3("ctrlproxy_test", ctrlproxy_test_methods,
+					   "ctrlproxy test helpers") == NULL) {
+		PyErr_Print();
+		return 1;
+	}
+
+	test_network = load_network(NULL, &nc);
+
+	m = PyImport_AddModule("__main__");
+	if (PyModule_AddStringConstant(m, "tests", tests) < 0 ||
+		PyRun_SimpleString(
+			"import unittest\n"
+			"suite = unittest.defaultTestLoader.loadTestsFromName(tests)\n"
+			"result = unittest.TextTestRunner(verbosity=2).run(suite)\n") < 0)
+		return 1;
+
+	result = PyObject_GetAttrString(m, "result");
+	if (result == NULL) {
+		PyErr_Print();
+		return 1;
+	}
+	ok = PyObject_CallMethod(result, "wasSuccessful", NULL);
+	ret = (ok == Py_True)?0:1;
+	Py_XDECREF(ok);
+	Py_DECREF(result);
+
+	unload_network(test_network);
+	Py_Finalize();
+
+	return ret;
+}
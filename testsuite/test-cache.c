@@ -0,0 +1,334 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+#include "ctrlproxy.h"
+#include "torture.h"
+#include "internals.h"
+
+static void state_process(struct irc_network_state *ns, const char *data)
+{
+	struct irc_line *l;
+
+	l = irc_parse_line(data);
+	fail_unless(state_handle_data(ns, l));
+	free_line(l);
+}
+
+/* Returns what was sent to the client, or NULL if the query could not be
+ * answered from cache */
+static char *try_cache(struct irc_network *n, struct irc_network_state *ns,
+					   const char *query, const struct cache_settings *settings)
+{
+	GIOChannel *ch1, *ch2;
+	struct irc_client *c;
+	struct irc_line *l;
+	gboolean hit;
+	char *raw, *end;
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	c = client_init_iochannel(n, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	l = irc_parse_line(query);
+	hit = client_try_cache(c, ns, l, settings);
+	free_line(l);
+
+	client_disconnect(c, "done");
+	while (g_main_context_iteration(NULL, FALSE));
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+	g_io_channel_unref(ch2);
+
+	if (!hit) {
+		g_free(raw);
+		return NULL;
+	}
+
+	end = strstr(raw, "ERROR :done\r\n");
+	if (end != NULL)
+		*end = '\0';
+
+	return raw;
+}
+
+static struct irc_network_state *who_state(void)
+{
+	struct irc_network_state *ns;
+
+	ns = network_state_init("bla", "user", "host");
+	state_process(ns, ":bla!user@host JOIN #chan");
+	state_process(ns, ":foo!fu@fh JOIN #chan");
+	return ns;
+}
+
+static void who_refresh(struct irc_network_state *ns)
+{
+	state_process(ns, ":srv 352 bla #chan user host srv bla H :0 Bla");
+	state_process(ns, ":srv 352 bla #chan fu fh srv foo G :0 Foo");
+	state_process(ns, ":srv 315 bla #chan :End of /WHO list.");
+}
+
+START_TEST(test_who)
+{
+	struct cache_settings settings = { .max_who_age = 60, .max_whois_age = 0 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	fail_unless(try_cache(n, ns, "WHO #chan", &settings) == NULL);
+
+	who_refresh(ns);
+	raw = try_cache(n, ns, "WHO #chan", &settings);
+	fail_if(raw == NULL);
+	fail_unless(!strcmp(raw,
+		":test 352 * #chan user host srv bla H :0 Bla\r\n"
+		":test 352 * #chan fu fh srv foo G :0 Foo\r\n"
+		":test 315 * #chan :End of /WHO list.\r\n"), "got %s", raw);
+	g_free(raw);
+}
+END_TEST
+
+START_TEST(test_who_expired_refresh)
+{
+	struct cache_settings settings = { .max_who_age = 1, .max_whois_age = 0 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	who_refresh(ns);
+	raw = try_cache(n, ns, "WHO #chan", &settings);
+	fail_if(raw == NULL);
+	g_free(raw);
+
+	sleep(2);
+	fail_unless(try_cache(n, ns, "WHO #chan", &settings) == NULL);
+
+	/* A refresh that changes nothing makes the cache usable again */
+	who_refresh(ns);
+	raw = try_cache(n, ns, "WHO #chan", &settings);
+	fail_if(raw == NULL);
+	g_free(raw);
+
+	/* Also when nobody asked in between */
+	sleep(2);
+	who_refresh(ns);
+	raw = try_cache(n, ns, "WHO #chan", &settings);
+	fail_if(raw == NULL);
+	g_free(raw);
+}
+END_TEST
+
+START_TEST(test_userhost)
+{
+	struct cache_settings settings = { .max_who_age = 60, .max_whois_age = 0 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	/* Away status is only known from WHO replies */
+	fail_unless(try_cache(n, ns, "USERHOST foo", &settings) == NULL);
+
+	who_refresh(ns);
+	raw = try_cache(n, ns, "USERHOST foo bla", &settings);
+	fail_if(raw == NULL);
+	fail_unless(!strcmp(raw, ":test 302 * :foo=-fu@fh bla=+user@host\r\n"),
+				"got %s", raw);
+	g_free(raw);
+
+	fail_unless(try_cache(n, ns, "USERHOST foo unknown", &settings) == NULL);
+	fail_unless(try_cache(n, ns, "USERHOST", &settings) == NULL);
+
+	settings.max_who_age = 0;
+	fail_unless(try_cache(n, ns, "USERHOST foo", &settings) == NULL);
+}
+END_TEST
+
+static void whois_process(struct irc_network *n, const char *data,
+						  const struct cache_settings *settings)
+{
+	struct irc_line *l;
+
+	l = irc_parse_line(data);
+	cache_handle_response(n, l, settings);
+	free_line(l);
+}
+
+static void whois_foo(struct irc_network *n, const struct cache_settings *settings)
+{
+	whois_process(n, ":srv 311 bla foo fu fh * :Foo Bar", settings);
+	whois_process(n, ":srv 312 bla foo srv.example :Server", settings);
+	/* Not part of the WHOIS reply, but also about foo */
+	whois_process(n, ":srv 441 bla foo #chan :They aren't on that channel", settings);
+	whois_process(n, ":srv 317 bla foo 5 1000 :seconds idle, signon time", settings);
+	whois_process(n, ":srv 318 bla foo :End of /WHOIS list.", settings);
+}
+
+#define FOO_WHOIS ":srv 311 bla foo fu fh * :Foo Bar\r\n" \
+	":srv 312 bla foo srv.example :Server\r\n" \
+	":srv 318 bla foo :End of /WHOIS list.\r\n"
+
+START_TEST(test_whois)
+{
+	struct cache_settings settings = { .max_who_age = 0, .max_whois_age = 60 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	whois_process(n, ":srv 311 bla foo fu fh * :Foo Bar", &settings);
+	/* Incomplete */
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	whois_foo(n, &settings);
+	raw = try_cache(n, ns, "WHOIS foo", &settings);
+	fail_if(raw == NULL);
+	fail_unless(!strcmp(raw, FOO_WHOIS), "got %s", raw);
+	g_free(raw);
+
+	fail_unless(try_cache(n, ns, "WHOIS bar", &settings) == NULL);
+	fail_unless(try_cache(n, ns, "WHOIS srv foo", &settings) == NULL);
+
+	cache_forget_network(n);
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+}
+END_TEST
+
+START_TEST(test_whois_expire)
+{
+	struct cache_settings settings = { .max_who_age = 0, .max_whois_age = 1 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	whois_foo(n, &settings);
+	raw = try_cache(n, ns, "WHOIS foo", &settings);
+	fail_if(raw == NULL);
+	g_free(raw);
+
+	sleep(2);
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	cache_forget_network(n);
+}
+END_TEST
+
+static void cache_line(struct irc_network *n, const char *data)
+{
+	struct irc_line *l;
+
+	l = irc_parse_line(data);
+	cache_handle_line(n, l);
+	free_line(l);
+}
+
+START_TEST(test_whois_nick_quit)
+{
+	struct cache_settings settings = { .max_who_age = 0, .max_whois_age = 60 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	whois_foo(n, &settings);
+	cache_line(n, ":other!o@h NICK :bar");
+	raw = try_cache(n, ns, "WHOIS foo", &settings);
+	fail_if(raw == NULL);
+	g_free(raw);
+
+	cache_line(n, ":foo!fu@fh NICK :foo2");
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	/* Someone else taking the nick */
+	whois_foo(n, &settings);
+	cache_line(n, ":baz!b@h NICK :foo");
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	whois_foo(n, &settings);
+	cache_line(n, ":foo!fu@fh QUIT :Leaving");
+	fail_unless(try_cache(n, ns, "WHOIS foo", &settings) == NULL);
+
+	cache_forget_network(n);
+}
+END_TEST
+
+START_TEST(test_mode_lists)
+{
+	struct cache_settings settings = { .max_who_age = 0, .max_whois_age = 0 };
+	struct irc_network *n = dummy_network();
+	struct irc_network_state *ns = who_state();
+	char *raw;
+
+	fail_unless(try_cache(n, ns, "MODE #chan e", &settings) == NULL);
+
+	state_process(ns, ":srv 348 bla #chan *!*@one.example");
+	state_process(ns, ":srv 348 bla #chan *!*@two.example");
+	state_process(ns, ":srv 349 bla #chan :End of channel exception list");
+	raw = try_cache(n, ns, "MODE #chan e", &settings);
+	fail_if(raw == NULL);
+	fail_unless(strstr(raw, ":test 348 * #chan *!*@one.example\r\n") != NULL, "got %s", raw);
+	fail_unless(strstr(raw, ":test 348 * #chan *!*@two.example\r\n") != NULL, "got %s", raw);
+	fail_unless(g_str_has_suffix(raw, ":test 349 * #chan :End of channel exception list\r\n"), "got %s", raw);
+	g_free(raw);
+
+	/* The invite list hasn't been received */
+	fail_unless(try_cache(n, ns, "MODE #chan eI", &settings) == NULL);
+
+	state_process(ns, ":srv 346 bla #chan *!*@inv.example");
+	state_process(ns, ":srv 347 bla #chan :End of channel invite list");
+	raw = try_cache(n, ns, "MODE #chan I", &settings);
+	fail_if(raw == NULL);
+	fail_unless(!strcmp(raw, ":test 346 * #chan *!*@inv.example\r\n"
+						":test 347 * #chan :End of channel invite list\r\n"), "got %s", raw);
+	g_free(raw);
+
+	/* Changes are reflected in the answers */
+	state_process(ns, ":foo!fu@fh MODE #chan -e+I *!*@one.example *!*@inv2.example");
+	raw = try_cache(n, ns, "MODE #chan eI", &settings);
+	fail_if(raw == NULL);
+	fail_unless(strstr(raw, "one.example") == NULL, "got %s", raw);
+	fail_unless(strstr(raw, ":test 348 * #chan *!*@two.example\r\n") != NULL, "got %s", raw);
+	fail_unless(strstr(raw, ":test 346 * #chan *!*@inv2.example\r\n") != NULL, "got %s", raw);
+	g_free(raw);
+
+	/* Lists of a channel we left are gone */
+	state_process(ns, ":bla!user@host PART #chan");
+	fail_unless(try_cache(n, ns, "MODE #chan e", &settings) == NULL);
+}
+END_TEST
+
+Suite *cache_suite(void)
+{
+	Suite *s = suite_create("cache");
+	TCase *tc_core = tcase_create("core");
+	suite_add_tcase(s, tc_core);
+	tcase_set_timeout(tc_core, 10);
+	tcase_add_test(tc_core, test_who);
+	tcase_add_test(tc_core, test_who_expired_refresh);
+	tcase_add_test(tc_core, test_userhost);
+	tcase_add_test(tc_core, test_whois);
+	tcase_add_test(tc_core, test_whois_expire);
+	tcase_add_test(tc_core, test_whois_nick_quit);
+	tcase_add_test(tc_core, test_mode_lists);
+	return s;
+}
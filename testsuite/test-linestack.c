@@ -18,10 +18,12 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <check.h>
 #include "ctrlproxy.h"
 #include "torture.h"
 #include "internals.h"
+#include "worker.h"
 
 void stack_process(struct linestack_context *ctx, struct irc_network_state *ns, const char *line)
 {
@@ -92,10 +94,10 @@ static gboolean channel_state_equal(const struct irc_channel_state *channel1, co
 	null_equal(channel1, channel2);
 
 	for (i = 0; i < MAXMODES; i++) {
-		if (!str_equal(channel1->chanmode_option[i], channel2->chanmode_option[i]))
+		if (!str_equal(channel_mode_option(channel1, i), channel_mode_option(channel2, i)))
 			return FALSE;
 
-		if (!list_equal(channel1->chanmode_nicklist[i], channel2->chanmode_nicklist[i], (GEqualFunc)banlist_entry_equal))
+		if (!list_equal(channel_mode_nicklist(channel1, i), channel_mode_nicklist(channel2, i), (GEqualFunc)banlist_entry_equal))
 			return FALSE;
 	}
 
@@ -238,6 +240,419 @@ START_TEST(test_msg)
 }
 END_TEST
 
+START_TEST(test_msg_worker)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_worker *worker;
+	linestack_marker lm;
+	struct irc_client *cl;
+
+	GIOChannel *ch1, *ch2;
+	char *raw;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("msg_worker"), TRUE, ns1);
+	worker = irc_worker_new("linestack");
+	linestack_set_worker(ctx, worker);
+
+	lm = linestack_get_marker(ctx);
+
+	stack_process(ctx, ns1, ":bla!Gebruikersnaam@Computernaam JOIN #bla");
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi");
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	linestack_send(ctx, lm, NULL, cl, FALSE, FALSE, 0);
+	client_disconnect(cl, "foo");
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+
+	fail_unless(!strcmp(raw, ":bla!Gebruikersnaam@Computernaam JOIN #bla\r\n"
+						     ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi\r\n"
+							 "ERROR :foo\r\n"));
+
+	free_linestack_context(ctx);
+	irc_worker_free(worker);
+}
+END_TEST
+
+static void append_file(const char *dir, const char *name, const char *data)
+{
+	char *path = g_build_filename(dir, name, NULL);
+	FILE *f = fopen(path, "a");
+	g_assert(f != NULL);
+	fputs(data, f);
+	fclose(f);
+	g_free(path);
+}
+
+START_TEST(test_recover)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	linestack_marker lm;
+	struct irc_client *cl;
+	const char *dir = get_linestack_tempdir("recover");
+
+	GIOChannel *ch1, *ch2;
+	char *raw;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+
+	stack_process(ctx, ns1, ":bla!Gebruikersnaam@Computernaam JOIN #bla");
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi");
+	free_linestack_context(ctx);
+
+	/* Simulate a crash halfway through writing a line */
+	append_file(dir, "index", "torn");
+	append_file(dir, "lines", ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :to");
+
+	ctx = create_linestack(dir, FALSE, ns1);
+	fail_unless(ctx != NULL);
+
+	lm = linestack_get_marker(ctx);
+	fail_unless(*lm == 2);
+	linestack_free_marker(lm);
+
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :after");
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	linestack_send(ctx, NULL, NULL, cl, FALSE, FALSE, 0);
+	client_disconnect(cl, "foo");
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+
+	fail_unless(!strcmp(raw, ":bla!Gebruikersnaam@Computernaam JOIN #bla\r\n"
+						     ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi\r\n"
+						     ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :after\r\n"
+							 "ERROR :foo\r\n"));
+
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_state_worker)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_worker *worker;
+	const char *dir = get_linestack_tempdir("state_worker");
+	struct irc_line *l;
+	char *path;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	free_linestack_context(ctx);
+
+	/* Snapshots of a recovered linestack are synced on the worker */
+	ctx = create_linestack(dir, FALSE, ns1);
+	worker = irc_worker_new("linestack");
+	linestack_set_worker(ctx, worker);
+	for (i = 0; i < 1500; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+	linestack_flush(ctx);
+
+	path = g_build_filename(dir, "states", "1000", NULL);
+	fail_unless(g_file_test(path, G_FILE_TEST_EXISTS));
+	g_free(path);
+	path = g_build_filename(dir, "states", "1000.tmp", NULL);
+	fail_unless(!g_file_test(path, G_FILE_TEST_EXISTS));
+	g_free(path);
+
+	fail_unless(linestack_get_state(ctx, NULL) != NULL);
+
+	free_linestack_context(ctx);
+	irc_worker_free(worker);
+}
+END_TEST
+
+START_TEST(test_search)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	const char *dir = get_linestack_tempdir("search");
+	GArray *matches;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	fail_unless(linestack_search(ctx, "notes", 0, 10) == NULL);
+	linestack_enable_search(ctx);
+
+	stack_process(ctx, ns1, ":bla!Gebruikersnaam@Computernaam JOIN #bla");
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :Who has the release notes?");
+	stack_process(ctx, ns1, ":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :notes are in git");
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :thanks");
+
+	matches = linestack_search(ctx, "NOTES", 0, 10);
+	fail_unless(matches->len == 2);
+	fail_unless(g_array_index(matches, guint64, 0) == 2);
+	fail_unless(g_array_index(matches, guint64, 1) == 1);
+	g_array_free(matches, TRUE);
+
+	matches = linestack_search(ctx, "bloe notes", 0, 10);
+	fail_unless(matches->len == 1);
+	fail_unless(g_array_index(matches, guint64, 0) == 1);
+	g_array_free(matches, TRUE);
+
+	matches = linestack_search(ctx, "notes svn", 0, 10);
+	fail_unless(matches->len == 0);
+	g_array_free(matches, TRUE);
+
+	matches = linestack_search(ctx, "notes", time(NULL) + 3600, 10);
+	fail_unless(matches->len == 0);
+	g_array_free(matches, TRUE);
+
+	free_linestack_context(ctx);
+
+	/* The index is saved and extended when the linestack is reopened */
+	ctx = create_linestack(dir, FALSE, ns1);
+	stack_process(ctx, ns1, ":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :more notes");
+	linestack_enable_search(ctx);
+
+	matches = linestack_search(ctx, "notes", 0, 1);
+	fail_unless(matches->len == 1);
+	fail_unless(g_array_index(matches, guint64, 0) == 4);
+	g_array_free(matches, TRUE);
+
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_search_worker)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_worker *worker;
+	GArray *matches;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("search_worker"), TRUE, ns1);
+	worker = irc_worker_new("linestack");
+	linestack_set_worker(ctx, worker);
+
+	stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :release notes");
+	linestack_enable_search(ctx);
+	stack_process(ctx, ns1, ":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :more notes");
+
+	/* Lines from before and after search was enabled are indexed on
+	 * the worker */
+	linestack_flush(ctx);
+	matches = linestack_search(ctx, "notes", 0, 10);
+	fail_unless(matches->len == 2);
+	fail_unless(g_array_index(matches, guint64, 0) == 1);
+	fail_unless(g_array_index(matches, guint64, 1) == 0);
+	g_array_free(matches, TRUE);
+
+	free_linestack_context(ctx);
+	irc_worker_free(worker);
+}
+END_TEST
+
+START_TEST(test_stream)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_client *cl;
+	GIOChannel *ch1, *ch2;
+	char *raw, **lines;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("stream"), TRUE, ns1);
+
+	stack_process(ctx, ns1, ":bla!Gebruikersnaam@Computernaam JOIN #bla");
+	for (i = 0; i < 250; i++)
+		stack_process(ctx, ns1, ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi");
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	fail_unless(linestack_stream(ctx, "#bla", NULL, NULL, cl, TRUE, FALSE, 0));
+
+	/* Only the first chunk is sent right away */
+	while (g_main_context_iteration(NULL, FALSE));
+
+	client_disconnect(cl, "foo");
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+	lines = g_strsplit(raw, "\r\n", 0);
+	fail_unless(g_strv_length(lines) == 252, "got %d lines", g_strv_length(lines));
+	fail_unless(!strcmp(lines[0], ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :hihi"));
+	fail_unless(!strcmp(lines[250], "ERROR :foo"));
+	g_strfreev(lines);
+	g_free(raw);
+
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_stream_hold)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_client *cl;
+	struct irc_line *l;
+	GIOChannel *ch1, *ch2;
+	char *raw, **lines;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("stream_hold"), TRUE, ns1);
+
+	for (i = 0; i < 250; i++) {
+		char *msg = g_strdup_printf(":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :%d", i);
+		stack_process(ctx, ns1, msg);
+		g_free(msg);
+	}
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	fail_unless(linestack_stream(ctx, NULL, NULL, NULL, cl, FALSE, FALSE, 0));
+
+	/* A new line from the network arrives while the backlog is sent */
+	l = irc_parse_line(":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :live");
+	fail_unless(client_relay_line(cl, l, NULL));
+	free_line(l);
+
+	while (cl->holds > 0)
+		g_main_context_iteration(NULL, TRUE);
+
+	client_disconnect(cl, "foo");
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+	lines = g_strsplit(raw, "\r\n", 0);
+	fail_unless(g_strv_length(lines) == 253, "got %d lines", g_strv_length(lines));
+	for (i = 0; i < 250; i++) {
+		char *msg = g_strdup_printf(":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :%d", i);
+		fail_unless(!strcmp(lines[i], msg), "line %d is %s", i, lines[i]);
+		g_free(msg);
+	}
+	fail_unless(!strcmp(lines[250], ":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :live"));
+	fail_unless(!strcmp(lines[251], "ERROR :foo"));
+	g_strfreev(lines);
+	g_free(raw);
+
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_stream_reply)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_client *cl;
+	GIOChannel *ch1, *ch2;
+	char *raw, **lines;
+	int i, reply = -1;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("stream_reply"), TRUE, ns1);
+
+	for (i = 0; i < 250; i++) {
+		char *msg = g_strdup_printf(":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :%d", i);
+		stack_process(ctx, ns1, msg);
+		g_free(msg);
+	}
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	fail_unless(linestack_stream(ctx, NULL, NULL, NULL, cl, FALSE, FALSE, 0));
+
+	/* Replies to the client aren't held back */
+	fail_unless(client_send_args_ex(cl, "server", "PONG", "server", "bla", NULL));
+
+	while (cl->holds > 0)
+		g_main_context_iteration(NULL, TRUE);
+
+	client_disconnect(cl, "foo");
+
+	g_io_channel_read_to_end(ch2, &raw, NULL, NULL);
+	lines = g_strsplit(raw, "\r\n", 0);
+	fail_unless(g_strv_length(lines) == 253, "got %d lines", g_strv_length(lines));
+	for (i = 0; i < 251; i++) {
+		if (!strcmp(lines[i], ":server PONG server :bla"))
+			reply = i;
+	}
+	fail_unless(reply >= 0 && reply < 250, "reply at %d", reply);
+	fail_unless(!strcmp(lines[250], ":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :249"));
+	g_strfreev(lines);
+	g_free(raw);
+
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_stream_hold_overflow)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_client *cl;
+	struct irc_line *l;
+	GIOChannel *ch1, *ch2;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("stream_hold_overflow"), TRUE, ns1);
+
+	for (i = 0; i < 250; i++) {
+		char *msg = g_strdup_printf(":bloe!Gebruikersnaam@Computernaam PRIVMSG #bla :%d", i);
+		stack_process(ctx, ns1, msg);
+		g_free(msg);
+	}
+
+	g_io_channel_pair(&ch1, &ch2);
+	g_io_channel_set_flags(ch1, G_IO_FLAG_NONBLOCK, NULL);
+	g_io_channel_set_flags(ch2, G_IO_FLAG_NONBLOCK, NULL);
+	cl = client_init_iochannel(NULL, ch1, "test");
+	g_io_channel_unref(ch1);
+
+	fail_unless(linestack_stream(ctx, NULL, NULL, NULL, cl, FALSE, FALSE, 0));
+
+	l = irc_parse_line(":blie!Gebruikersnaam@Computernaam PRIVMSG #bla :live");
+	for (i = 0; i < CLIENT_MAX_HELD_LINES; i++)
+		fail_unless(client_relay_line(cl, l, NULL));
+	fail_unless(cl->connected);
+
+	/* A client that falls too far behind is disconnected */
+	fail_if(client_relay_line(cl, l, NULL));
+	fail_if(cl->connected);
+	fail_unless(g_queue_is_empty(&cl->held_lines));
+	free_line(l);
+
+	while (cl->holds > 0)
+		g_main_context_iteration(NULL, TRUE);
+
+	g_io_channel_unref(ch2);
+	free_linestack_context(ctx);
+}
+END_TEST
+
 START_TEST(test_join_part)
 {
 	struct irc_network_state *ns1;
@@ -444,6 +859,273 @@ START_TEST(bench_lots_of_lines)
 }
 END_TEST
 
+static GMutex worker_blocked;
+
+static void block_worker(gpointer data)
+{
+	g_mutex_lock(&worker_blocked);
+	g_mutex_unlock(&worker_blocked);
+}
+
+START_TEST(test_read_pending)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct irc_worker *worker;
+	struct irc_line *l;
+	linestack_marker lm;
+	GArray *entries;
+	guint64 from = 0;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(get_linestack_tempdir("read_pending"), TRUE, ns1);
+	worker = irc_worker_new("linestack");
+	linestack_set_worker(ctx, worker);
+
+	for (i = 0; i < 10; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+	linestack_flush(ctx);
+
+	/* Lines queued on a busy worker are read without waiting for it */
+	g_mutex_lock(&worker_blocked);
+	irc_worker_push(worker, block_worker, NULL, NULL);
+	for (i = 10; i < 20; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+
+	seen = 0;
+	fail_unless(linestack_traverse(ctx, NULL, NULL, line_track, NULL));
+	fail_unless(seen == 20, "saw %d lines", seen);
+
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	while (from < 20)
+		fail_unless(linestack_read_block(ctx, &from, 20, 0, 0, 100, entries,
+										 NULL));
+	fail_unless(entries->len == 20);
+	for (i = 0; i < 20; i++) {
+		struct linestack_entry *e = &g_array_index(entries,
+										struct linestack_entry, i);
+		char *msg = g_strdup_printf("PRIVMSG :%d", i);
+		fail_unless(e->index == i);
+		fail_unless(!strcmp(e->raw, msg), "line %d is %s", i, e->raw);
+		g_free(msg);
+		g_free(e->raw);
+	}
+	g_array_free(entries, TRUE);
+
+	lm = linestack_get_marker(ctx);
+	fail_unless(linestack_get_state(ctx, lm) != NULL);
+	linestack_free_marker(lm);
+
+	g_mutex_unlock(&worker_blocked);
+	free_linestack_context(ctx);
+	irc_worker_free(worker);
+}
+END_TEST
+
+START_TEST(test_read_block)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	const char *dir = get_linestack_tempdir("read_block");
+	struct irc_line *l;
+	GArray *entries;
+	guint64 from = 0;
+	char *path;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	for (i = 0; i < 1000; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+	free_linestack_context(ctx);
+
+	/* Make the line file look huge; reading the first few lines should
+	 * only read up to the line after them */
+	path = g_build_filename(dir, "lines", NULL);
+	fail_unless(truncate(path, G_GINT64_CONSTANT(1) << 32) == 0);
+	g_free(path);
+
+	ctx = linestack_open_readonly(dir, NULL);
+	fail_unless(ctx != NULL);
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	fail_unless(linestack_read_block(ctx, &from, 10, 0, 0, 100, entries, NULL));
+	fail_unless(from == 10);
+	fail_unless(entries->len == 10);
+	for (i = 0; i < entries->len; i++) {
+		struct linestack_entry *e = &g_array_index(entries, struct linestack_entry, i);
+		l = irc_parse_line(e->raw);
+		fail_unless(atoi(l->args[1]) == i);
+		free_line(l);
+		g_free(e->raw);
+	}
+	g_array_free(entries, TRUE);
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_check_reindex)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct linestack_check_result result;
+	const char *dir = get_linestack_tempdir("check_reindex");
+	guint64 lines, skipped;
+	struct irc_line *l;
+	char *path;
+	int i;
+
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	for (i = 0; i < 2500; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+	free_linestack_context(ctx);
+
+	ctx = linestack_open_readonly(dir, NULL);
+	fail_unless(ctx != NULL);
+	fail_unless(linestack_check(ctx, 2, &result, NULL, NULL, NULL));
+	fail_unless(result.lines == 2500);
+	fail_unless(result.bad_lines == 0);
+	fail_unless(result.bad_offsets == 0);
+	fail_unless(result.bad_states == 0);
+	fail_unless(result.trailing_bytes == 0);
+	free_linestack_context(ctx);
+
+	/* Lose the index */
+	path = g_build_filename(dir, "index", NULL);
+	fail_unless(g_file_set_contents(path, "", 0, NULL));
+	g_free(path);
+
+	fail_unless(linestack_reindex(dir, 2, &lines, &skipped, NULL));
+	fail_unless(lines == 2500);
+	fail_unless(skipped == 0);
+
+	ctx = linestack_open_readonly(dir, NULL);
+	fail_unless(linestack_check(ctx, 2, &result, NULL, NULL, NULL));
+	fail_unless(result.lines == 2500);
+	fail_unless(result.bad_lines + result.bad_offsets + result.bad_states == 0);
+	free_linestack_context(ctx);
+
+	ctx = create_linestack(dir, FALSE, ns1);
+	seen = 0;
+	fail_unless(linestack_traverse(ctx, NULL, NULL, line_track, NULL));
+	fail_unless(seen == 2500);
+	free_linestack_context(ctx);
+}
+END_TEST
+
+START_TEST(test_check_blocks)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	struct linestack_check_result result;
+	const char *dir = get_linestack_tempdir("check_blocks");
+	struct irc_line *l;
+	int i;
+
+	/* More records than are checked at a time, for every thread */
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	for (i = 0; i < 20000; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+	free_linestack_context(ctx);
+
+	ctx = linestack_open_readonly(dir, NULL);
+	fail_unless(ctx != NULL);
+	for (i = 1; i <= 3; i++) {
+		fail_unless(linestack_check(ctx, i, &result, NULL, NULL, NULL));
+		fail_unless(result.lines == 20000);
+		fail_unless(result.bad_lines == 0);
+		fail_unless(result.bad_offsets == 0);
+		fail_unless(result.bad_states == 0);
+		fail_unless(result.trailing_bytes == 0);
+	}
+	free_linestack_context(ctx);
+}
+END_TEST
+
+#ifdef HAVE_ZSTD
+START_TEST(test_compressed)
+{
+	struct irc_network_state *ns1;
+	struct linestack_context *ctx;
+	const char *dir = get_linestack_tempdir("compressed");
+	linestack_marker lm;
+	struct irc_line *l;
+	GArray *entries;
+	guint64 from = 9990;
+	char *path;
+	int i;
+
+	fail_unless(linestack_set_compression("zstd"));
+	ns1 = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+	ctx = create_linestack(dir, TRUE, ns1);
+	fail_unless(linestack_set_compression("none"));
+
+	/* Enough lines to fill several blocks */
+	for (i = 0; i < 10000; i++) {
+		l = irc_parse_linef("PRIVMSG :%d", i);
+		fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+		free_line(l);
+	}
+
+	seen = 0;
+	fail_unless(linestack_traverse(ctx, NULL, NULL, line_track, NULL));
+	fail_unless(seen == 10000);
+	free_linestack_context(ctx);
+
+	path = g_build_filename(dir, "lines.zst", NULL);
+	fail_unless(g_file_test(path, G_FILE_TEST_EXISTS));
+	g_free(path);
+
+	/* The linestack stays compressed when it is reopened */
+	ctx = create_linestack(dir, FALSE, ns1);
+	fail_unless(ctx != NULL);
+	lm = linestack_get_marker(ctx);
+	fail_unless(*lm == 10000);
+	linestack_free_marker(lm);
+
+	l = irc_parse_linef("PRIVMSG :%d", 10000);
+	fail_unless(linestack_insert_line(ctx, l, TO_SERVER, ns1));
+	free_line(l);
+
+	fail_unless(linestack_sync(ctx));
+	entries = g_array_new(FALSE, FALSE, sizeof(struct linestack_entry));
+	fail_unless(linestack_read_block(ctx, &from, 10001, 0, 0, 100, entries, NULL));
+	fail_unless(entries->len == 11);
+	for (i = 0; i < entries->len; i++) {
+		struct linestack_entry *e = &g_array_index(entries, struct linestack_entry, i);
+		l = irc_parse_line(e->raw);
+		fail_unless(atoi(l->args[1]) == 9990 + i);
+		free_line(l);
+		g_free(e->raw);
+	}
+	g_array_free(entries, TRUE);
+
+	seen = 0;
+	fail_unless(linestack_traverse(ctx, NULL, NULL, line_track, NULL));
+	fail_unless(seen == 10001);
+
+	free_linestack_context(ctx);
+}
+END_TEST
+#endif
+
 Suite *linestack_suite()
 {
 	Suite *s = suite_create("linestack");
@@ -452,6 +1134,22 @@ Suite *linestack_suite()
 	tcase_add_test(tc_core, test_empty);
 	tcase_add_test(tc_core, test_join);
 	tcase_add_test(tc_core, test_msg);
+	tcase_add_test(tc_core, test_msg_worker);
+	tcase_add_test(tc_core, test_read_pending);
+	tcase_add_test(tc_core, test_recover);
+	tcase_add_test(tc_core, test_state_worker);
+	tcase_add_test(tc_core, test_stream);
+	tcase_add_test(tc_core, test_stream_hold);
+	tcase_add_test(tc_core, test_stream_reply);
+	tcase_add_test(tc_core, test_stream_hold_overflow);
+	tcase_add_test(tc_core, test_search);
+	tcase_add_test(tc_core, test_search_worker);
+	tcase_add_test(tc_core, test_read_block);
+	tcase_add_test(tc_core, test_check_reindex);
+	tcase_add_test(tc_core, test_check_blocks);
+#ifdef HAVE_ZSTD
+	tcase_add_test(tc_core, test_compressed);
+#endif
 	tcase_add_test(tc_core, test_skip_msg);
 	tcase_add_test(tc_core, test_object_msg);
 	tcase_add_test(tc_core, test_object_open);
@@ -74,6 +74,25 @@ START_TEST(test_login)
 }
 END_TEST
 
+START_TEST(test_backoff_delay)
+{
+	guint i;
+
+	fail_unless(irc_network_backoff_delay(0, 900, 3) == 0);
+
+	for (i = 0; i < 20; i++) {
+		guint base = MIN(60 << MIN(i, 10), 900) * 1000;
+		guint delay = irc_network_backoff_delay(60, 900, i);
+		fail_unless(delay >= base && delay <= base + base / 4,
+					"delay %u out of range for attempt %u", delay, i);
+	}
+
+	/* A maximum below the base interval is ignored */
+	fail_unless(irc_network_backoff_delay(60, 10, 5) <= 75000);
+	fail_unless(irc_network_backoff_delay(60, 10, 5) >= 60000);
+}
+END_TEST
+
 Suite *network_suite()
 {
 	Suite *s = suite_create("network");
@@ -82,5 +101,6 @@ Suite *network_suite()
 	tcase_add_test(tc_core, test_create);
 	tcase_add_test(tc_core, test_uncreate);
 	tcase_add_test(tc_core, test_login);
+	tcase_add_test(tc_core, test_backoff_delay);
 	return s;
 }
@@ -82,6 +82,46 @@ START_TEST(test_topic)
 }
 END_TEST
 
+static void noop_userdata(void *data)
+{
+}
+
+START_TEST(test_coalesce)
+{
+	struct query_stack *stack = new_query_stack(noop_userdata, noop_userdata);
+	struct irc_line *l;
+	GList *requesters;
+	char *a = "a", *b = "b";
+
+	l = irc_parse_line("WHO #channel");
+	fail_unless(query_stack_record(stack, a, l));
+	fail_unless(query_stack_coalesce(stack, b, l));
+	fail_if(query_stack_coalesce(stack, a, l));
+	free_line(l);
+
+	l = irc_parse_line("MODE #channel +o nick");
+	fail_if(query_stack_coalesce(stack, b, l));
+	free_line(l);
+
+	l = irc_parse_line(":server 352 nick #channel user host server nick H :0 Name");
+	requesters = query_stack_match_responses(stack, l);
+	fail_unless(g_list_length(requesters) == 2);
+	fail_unless(requesters->data == a);
+	fail_unless(requesters->next->data == b);
+	g_list_free(requesters);
+	free_line(l);
+
+	l = irc_parse_line(":server 315 nick #channel :End of /WHO list.");
+	requesters = query_stack_match_responses(stack, l);
+	fail_unless(g_list_length(requesters) == 2);
+	g_list_free(requesters);
+	free_line(l);
+
+	fail_unless(stack->entries == NULL);
+	query_stack_free(stack);
+}
+END_TEST
+
 Suite *redirect_suite()
 {
 	Suite *s = suite_create("redirect");
@@ -93,5 +133,6 @@ Suite *redirect_suite()
 	tcase_add_test(tc_core, test_463);
 	tcase_add_test(tc_core, test_464);
 	tcase_add_test(tc_core, test_topic);
+	tcase_add_test(tc_core, test_coalesce);
 	return s;
 }
@@ -0,0 +1,81 @@
+/*
+    ircdtorture: an IRC RFC compliance tester
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <check.h>
+#include <ctrlproxy.h>
+#include "resolver.h"
+#include "torture.h"
+
+static void resolved_cb(struct addrinfo *res, int error, gpointer userdata)
+{
+	int *called = userdata;
+
+	fail_unless(error == 0);
+	fail_if(res == NULL);
+	freeaddrinfo(res);
+	(*called)++;
+}
+
+static void not_called_cb(struct addrinfo *res, int error, gpointer userdata)
+{
+	fail("callback called for cancelled lookup");
+}
+
+START_TEST(test_resolve_numeric)
+{
+	struct addrinfo hints;
+	int called = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	fail_if(irc_resolve_async("127.0.0.1", "6667", &hints, resolved_cb, &called) == NULL);
+	fail_unless(called == 0);
+	while (called == 0)
+		g_main_context_iteration(NULL, TRUE);
+	fail_unless(called == 1);
+}
+END_TEST
+
+START_TEST(test_resolve_cancel)
+{
+	struct irc_resolve_request *req;
+	int i;
+
+	req = irc_resolve_async("127.0.0.1", "6667", NULL, not_called_cb, NULL);
+	irc_resolve_cancel(req);
+	for (i = 0; i < 100; i++) {
+		g_usleep(1000);
+		g_main_context_iteration(NULL, FALSE);
+	}
+}
+END_TEST
+
+Suite *resolver_suite()
+{
+	Suite *s = suite_create("resolver");
+	TCase *tc_core = tcase_create("core");
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, test_resolve_numeric);
+	tcase_add_test(tc_core, test_resolve_cancel);
+	return s;
+}
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <check.h>
 #include "ctrlproxy.h"
+#include "slab.h"
 
 gboolean network_nick_set_nick(struct network_nick *, const char *);
 gboolean network_nick_set_hostmask(struct network_nick *, const char *);
@@ -107,6 +108,62 @@ START_TEST(state_join_other)
 END_TEST
 
 
+START_TEST(state_reply_cache_invalidate)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    struct irc_channel_state *cs;
+
+    state_process(ns, ":bla!user@host JOIN #examplechannel");
+    state_process(ns, ":foo!userx@host JOIN #examplechannel");
+
+    cs = ns->channels->data;
+    cs->names_cache = channel_reply_cache_new("server", "bla", ns->info);
+    fail_unless(channel_reply_cache_matches(cs->names_cache, "server", "bla", ns->info));
+    fail_if(channel_reply_cache_matches(cs->names_cache, "server", "other", ns->info));
+
+    state_process(ns, ":foo!userx@host NICK :foobar");
+    fail_unless(cs->names_cache == NULL);
+
+    cs->names_cache = channel_reply_cache_new("server", "bla", ns->info);
+    state_process(ns, ":bla!user@host MODE #examplechannel +o foobar");
+    fail_unless(cs->names_cache == NULL);
+
+    cs->who_cache = channel_reply_cache_new("server", "bla", ns->info);
+    state_process(ns, ":foobar!userx@host PART #examplechannel");
+    fail_unless(cs->who_cache == NULL);
+}
+END_TEST
+
+START_TEST(state_channel_modes)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    struct irc_channel_state *cs;
+
+    state_process(ns, ":bla!user@host JOIN #examplechannel");
+
+    cs = ns->channels->data;
+    fail_unless(cs->num_chanmodes == 0);
+
+    state_process(ns, ":bla!user@host MODE #examplechannel +kl secret 10");
+    fail_unless(cs->num_chanmodes == 2);
+    fail_unless(!strcmp(channel_mode_option(cs, 'k'), "secret"));
+    fail_unless(!strcmp(channel_mode_option(cs, 'l'), "10"));
+    fail_unless(channel_mode_option(cs, 'j') == NULL);
+
+    state_process(ns, ":bla!user@host MODE #examplechannel -k secret");
+    fail_unless(cs->num_chanmodes == 1);
+    fail_unless(channel_mode_option(cs, 'k') == NULL);
+    fail_unless(!strcmp(channel_mode_option(cs, 'l'), "10"));
+
+    state_process(ns, ":server 368 bla #examplechannel :End of Channel Ban List");
+    fail_unless(channel_mode_nicklist_present(cs, 'b'));
+    state_process(ns, ":bla!user@host MODE #examplechannel +b foo!*@*");
+    fail_unless(g_list_length(channel_mode_nicklist(cs, 'b')) == 1);
+    fail_unless(channel_mode_nicklist(cs, 'e') == NULL);
+    fail_unless(!channel_mode_nicklist_present(cs, 'e'));
+}
+END_TEST
+
 START_TEST(state_topic)
 {
     struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
@@ -126,6 +183,113 @@ START_TEST(state_topic)
 END_TEST
 
 
+START_TEST(state_quit_order)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    struct irc_channel_state *cs;
+    struct channel_nick *cn;
+
+    state_process(ns, ":bla!user@host JOIN #examplechannel");
+    state_process(ns, ":a!user@host JOIN #examplechannel");
+    state_process(ns, ":b!user@host JOIN #examplechannel");
+    state_process(ns, ":c!user@host JOIN #examplechannel");
+
+    cs = ns->channels->data;
+
+    state_process(ns, ":c!user@host QUIT :bye");
+    state_process(ns, ":d!user@host JOIN #examplechannel");
+    state_process(ns, ":b!user@host QUIT :bye");
+
+    fail_unless(g_list_length(cs->nicks) == 3);
+    cn = g_list_nth_data(cs->nicks, 1);
+    fail_unless(!strcmp(cn->global_nick->nick, "a"));
+    cn = g_list_nth_data(cs->nicks, 2);
+    fail_unless(!strcmp(cn->global_nick->nick, "d"));
+    fail_unless(cs->nicks_tail == g_list_last(cs->nicks));
+    fail_unless(find_network_nick(ns, "b") == NULL);
+    fail_unless(find_network_nick(ns, "c") == NULL);
+    fail_unless(ns->nicks_tail == g_list_last(ns->nicks));
+}
+END_TEST
+
+START_TEST(state_slab_cycle)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    gsize in_use, allocated, first_allocated;
+    char line[100];
+    int cycle, i;
+
+    for (cycle = 0; cycle < 5; cycle++) {
+        state_process(ns, ":bla!user@host JOIN #examplechannel");
+        for (i = 0; i < 2000; i++) {
+            g_snprintf(line, sizeof(line), ":nick%d!user@host JOIN #examplechannel", i);
+            state_process(ns, line);
+        }
+        irc_slab_stats(ns->channel_nick_slab, &in_use, &allocated);
+        fail_unless(in_use == 2001);
+        state_process(ns, ":bla!user@host PART #examplechannel");
+
+        irc_slab_stats(ns->network_nick_slab, &in_use, NULL);
+        fail_unless(in_use == 0);
+        irc_slab_stats(ns->channel_nick_slab, &in_use, &allocated);
+        fail_unless(in_use == 0);
+        if (cycle == 0)
+            first_allocated = allocated;
+        fail_unless(allocated == first_allocated);
+    }
+
+    free_network_state(ns);
+}
+END_TEST
+
+START_TEST(state_memory)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    gsize empty, joined;
+
+    empty = network_state_memory(ns);
+    fail_unless(empty > 0);
+    state_process(ns, ":bla!user@host JOIN #examplechannel");
+    state_process(ns, ":server 332 bla #examplechannel :Some topic");
+    state_process(ns, ":server 353 bla = #examplechannel :bla a b c");
+    joined = network_state_memory(ns);
+    fail_unless(joined > empty);
+    state_process(ns, ":bla!user@host PART #examplechannel");
+    fail_unless(network_state_memory(ns) < joined);
+
+    free_network_state(ns);
+}
+END_TEST
+
+START_TEST(state_names_resync)
+{
+    struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
+    struct irc_channel_state *cs;
+    struct channel_nick *a;
+
+    state_process(ns, ":bla!user@host JOIN #examplechannel");
+    state_process(ns, ":server 353 bla = #examplechannel :bla a b");
+    state_process(ns, ":server 366 bla #examplechannel :End of /NAMES list.");
+
+    cs = ns->channels->data;
+    fail_unless(g_list_length(cs->nicks) == 3);
+    a = find_channel_nick(cs, "a");
+    fail_if(a == NULL);
+
+    state_process(ns, ":server 353 bla = #examplechannel :@bla @A");
+    state_process(ns, ":server 353 bla = #examplechannel :+c");
+    fail_unless(find_channel_nick(cs, "b") != NULL);
+    state_process(ns, ":server 366 bla #examplechannel :End of /NAMES list.");
+
+    fail_unless(g_list_length(cs->nicks) == 3);
+    fail_unless(find_channel_nick(cs, "a") == a);
+    fail_unless(a->modes['o']);
+    fail_unless(find_channel_nick(cs, "b") == NULL);
+    fail_unless(find_network_nick(ns, "b") == NULL);
+    fail_unless(find_channel_nick(cs, "c")->modes['v']);
+}
+END_TEST
+
 START_TEST(state_part)
 {
     struct irc_network_state *ns = network_state_init("bla", "Gebruikersnaam", "Computernaam");
@@ -358,7 +522,12 @@ Suite *state_suite(void)
     tcase_add_test(tc_core, state_join_me);
     tcase_add_test(tc_core, state_join_other);
     tcase_add_test(tc_core, state_topic);
+    tcase_add_test(tc_core, state_channel_modes);
     tcase_add_test(tc_core, state_part);
+    tcase_add_test(tc_core, state_quit_order);
+    tcase_add_test(tc_core, state_slab_cycle);
+    tcase_add_test(tc_core, state_memory);
+    tcase_add_test(tc_core, state_names_resync);
     tcase_add_test(tc_core, state_cycle);
     tcase_add_test(tc_core, state_kick);
     tcase_add_test(tc_core, state_set_nick);
@@ -374,5 +543,6 @@ Suite *state_suite(void)
     tcase_add_test(tc_core, test_mode2string);
     tcase_add_test(tc_core, test_string2mode);
     tcase_add_test(tc_core, test_nicklist);
+    tcase_add_test(tc_core, state_reply_cache_invalidate);
     return s;
 }
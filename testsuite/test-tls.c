@@ -19,6 +19,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <check.h>
 #include "ctrlproxy.h"
 #include "torture.h"
@@ -41,6 +42,121 @@ START_TEST(test_tlscert)
 	fail_unless(g_file_test(certfile, G_FILE_TEST_EXISTS));
 }
 END_TEST
+
+START_TEST(test_session_cache_missing)
+{
+	char *path = torture_tempfile("tls_sessions_missing");
+	GError *error = NULL;
+
+	fail_unless(ssl_session_cache_load(path, &error));
+	fail_unless(error == NULL);
+}
+END_TEST
+
+START_TEST(test_session_cache_save)
+{
+	char *path = torture_tempfile("tls_sessions");
+	GError *error = NULL;
+
+	fail_unless(ssl_session_cache_save(path, &error));
+	fail_unless(g_file_test(path, G_FILE_TEST_EXISTS));
+	fail_unless(ssl_session_cache_load(path, &error));
+	fail_unless(error == NULL);
+}
+END_TEST
+
+static char *session_cache_file(const char *name, time_t stored, const char *data)
+{
+	char *path = torture_tempfile(name);
+	char *contents;
+
+	contents = g_strdup_printf("[irc.example.org:6697]\n"
+							   "stored=%ld\n"
+							   "data=%s\n"
+							   "[old.example.org:6697]\n"
+							   "stored=%ld\n"
+							   "data=b2xk\n",
+							   (long)stored, data, (long)(stored - 7*24*60*60));
+	fail_unless(g_file_set_contents(path, contents, -1, NULL));
+	g_free(contents);
+
+	return path;
+}
+
+START_TEST(test_session_cache_roundtrip)
+{
+	time_t now = time(NULL);
+	char *path = session_cache_file("tls_sessions_in", now, "c2Vzc2lvbg==");
+	char *saved = torture_tempfile("tls_sessions_out");
+	GError *error = NULL;
+	GKeyFile *kf;
+	guint resumed, full, cached;
+	struct stat st;
+	char *data;
+
+	fail_unless(ssl_session_cache_load(path, &error));
+	fail_unless(error == NULL);
+	ssl_session_cache_stats(&resumed, &full, &cached);
+	fail_unless(cached == 1, "cached %d sessions", cached);
+
+	fail_unless(ssl_session_cache_save(saved, &error));
+	fail_unless(stat(saved, &st) == 0);
+	fail_unless((st.st_mode & 0777) == 0600);
+
+	kf = g_key_file_new();
+	fail_unless(g_key_file_load_from_file(kf, saved, G_KEY_FILE_NONE, NULL));
+	fail_unless(g_key_file_get_int64(kf, "irc.example.org:6697", "stored", NULL) == now);
+	data = g_key_file_get_string(kf, "irc.example.org:6697", "data", NULL);
+	fail_unless(data != NULL && !strcmp(data, "c2Vzc2lvbg=="));
+	fail_if(g_key_file_has_group(kf, "old.example.org:6697"));
+	g_free(data);
+	g_key_file_free(kf);
+
+	fail_unless(ssl_session_cache_load(saved, &error));
+	ssl_session_cache_stats(&resumed, &full, &cached);
+	fail_unless(cached == 1, "cached %d sessions", cached);
+}
+END_TEST
+
+START_TEST(test_session_cache_truncated)
+{
+	char *path = session_cache_file("tls_sessions_truncated", time(NULL),
+									"c2Vzc2lvbg==");
+	GError *error = NULL;
+	guint resumed, full, cached;
+	char *contents;
+	gsize length;
+
+	/* Cut the file off in the middle of the first session */
+	fail_unless(g_file_get_contents(path, &contents, &length, NULL));
+	fail_unless(g_file_set_contents(path, contents, strstr(contents, "==") - contents - 1, NULL));
+	g_free(contents);
+
+	fail_if(ssl_session_cache_load(path, &error));
+	fail_unless(error != NULL);
+	g_error_free(error);
+	ssl_session_cache_stats(&resumed, &full, &cached);
+	fail_unless(cached == 0, "cached %d sessions", cached);
+}
+END_TEST
+
+START_TEST(test_session_cache_corrupt)
+{
+	char *path = session_cache_file("tls_sessions_corrupt", time(NULL),
+									"c2V*c3Npb24=");
+	GError *error = NULL;
+	guint resumed, full, cached;
+
+	fail_if(ssl_session_cache_load(path, &error));
+	fail_unless(error != NULL);
+	g_error_free(error);
+	ssl_session_cache_stats(&resumed, &full, &cached);
+	fail_unless(cached == 0, "cached %d sessions", cached);
+
+	fail_unless(g_file_set_contents(path, "[irc.example.org:6697\nstored=1\n", -1, NULL));
+	fail_if(ssl_session_cache_load(path, NULL));
+}
+END_TEST
 #endif
 
 Suite *tls_suite()
@@ -50,6 +166,11 @@ Suite *tls_suite()
 	suite_add_tcase(s, tc_core);
 #ifdef HAVE_GNUTLS
 	tcase_add_test(tc_core, test_tlscert);
+	tcase_add_test(tc_core, test_session_cache_missing);
+	tcase_add_test(tc_core, test_session_cache_save);
+	tcase_add_test(tc_core, test_session_cache_roundtrip);
+	tcase_add_test(tc_core, test_session_cache_truncated);
+	tcase_add_test(tc_core, test_session_cache_corrupt);
 #endif
 	return s;
 }
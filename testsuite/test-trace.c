@@ -0,0 +1,129 @@
+/*
+	ctrlproxy: A modular IRC proxy
+	(c) 2009 Jelmer Vernooĳ <jelmer@jelmer.uk>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software
+	Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <check.h>
+#include "ctrlproxy.h"
+#include "torture.h"
+#include "internals.h"
+#include "trace.h"
+
+static void write_trace_line(struct trace_file *t, enum trace_record_type type,
+							 guint client, const char *raw)
+{
+	struct irc_line *l = irc_parse_line(raw);
+	fail_unless(trace_file_write(t, type, client, l));
+	free_line(l);
+}
+
+static void check_trace_line(struct trace_file *t, enum trace_record_type type,
+							 guint client, const char *raw)
+{
+	struct trace_record r;
+	char *s;
+
+	fail_unless(trace_file_read(t, &r));
+	fail_unless(r.type == type);
+	fail_unless(r.client == client);
+	s = irc_line_string(r.line);
+	fail_unless(!strcmp(s, raw), "Expected %s, got %s", raw, s);
+	g_free(s);
+	free_line(r.line);
+}
+
+START_TEST(test_roundtrip)
+{
+	char *path = torture_tempfile("roundtrip.trace");
+	struct trace_file *t;
+	struct trace_record r;
+
+	t = trace_file_create(path);
+	fail_if(t == NULL);
+	write_trace_line(t, TRACE_FROM_SERVER, 0, ":server 001 nick :Welcome");
+	write_trace_line(t, TRACE_FROM_CLIENT, 1, "PRIVMSG #channel :hello");
+	write_trace_line(t, TRACE_TO_SERVER, 0, "PONG :server");
+	write_trace_line(t, TRACE_FROM_CLIENT_PRIVATE, 300, "MODE #channel");
+	trace_file_close(t);
+
+	t = trace_file_open(path, NULL);
+	fail_if(t == NULL);
+	fail_if(trace_file_start_time(t) == 0);
+	check_trace_line(t, TRACE_FROM_SERVER, 0, ":server 001 nick :Welcome");
+	check_trace_line(t, TRACE_FROM_CLIENT, 1, "PRIVMSG #channel :hello");
+	check_trace_line(t, TRACE_TO_SERVER, 0, "PONG :server");
+	check_trace_line(t, TRACE_FROM_CLIENT_PRIVATE, 300, "MODE #channel");
+	fail_if(trace_file_read(t, &r));
+	trace_file_close(t);
+	g_free(path);
+}
+END_TEST
+
+START_TEST(test_truncated)
+{
+	char *path = torture_tempfile("truncated.trace");
+	struct trace_file *t;
+	struct trace_record r;
+	char *contents;
+	gsize len;
+
+	t = trace_file_create(path);
+	fail_if(t == NULL);
+	write_trace_line(t, TRACE_FROM_SERVER, 0, ":server 001 nick :Welcome");
+	write_trace_line(t, TRACE_FROM_SERVER, 0, ":server 002 nick :Your host");
+	trace_file_close(t);
+
+	/* Cut the last record short */
+	fail_unless(g_file_get_contents(path, &contents, &len, NULL));
+	fail_unless(g_file_set_contents(path, contents, len - 5, NULL));
+	g_free(contents);
+
+	t = trace_file_open(path, NULL);
+	fail_if(t == NULL);
+	check_trace_line(t, TRACE_FROM_SERVER, 0, ":server 001 nick :Welcome");
+	fail_if(trace_file_read(t, &r));
+	trace_file_close(t);
+	g_free(path);
+}
+END_TEST
+
+START_TEST(test_not_a_trace)
+{
+	char *path = torture_tempfile("invalid.trace");
+	GError *error = NULL;
+
+	fail_unless(g_file_set_contents(path, "PRIVMSG #foo :bar\r\n", -1, NULL));
+	fail_unless(trace_file_open(path, &error) == NULL);
+	fail_if(error == NULL);
+	g_error_free(error);
+	g_free(path);
+}
+END_TEST
+
+Suite *trace_suite(void)
+{
+	Suite *s = suite_create("trace");
+	TCase *tc_core = tcase_create("core");
+	suite_add_tcase(s, tc_core);
+	tcase_add_test(tc_core, test_roundtrip);
+	tcase_add_test(tc_core, test_truncated);
+	tcase_add_test(tc_core, test_not_a_trace);
+	return s;
+}
@@ -60,12 +60,27 @@ START_TEST(test_send)
 }
 END_TEST
 
+static void setup_epoll(void)
+{
+	irc_transport_set_backend("epoll");
+}
+
+static void teardown_epoll(void)
+{
+	irc_transport_set_backend("iochannel");
+}
+
 Suite *transport_suite()
 {
 	Suite *s = suite_create("transport");
 	TCase *tc_iochannel = tcase_create("iochannel");
+	TCase *tc_epoll = tcase_create("epoll");
 	suite_add_tcase(s, tc_iochannel);
 	tcase_add_test(tc_iochannel, test_create);
 	tcase_add_test(tc_iochannel, test_send);
+	suite_add_tcase(s, tc_epoll);
+	tcase_add_checked_fixture(tc_epoll, setup_epoll, teardown_epoll);
+	tcase_add_test(tc_epoll, test_create);
+	tcase_add_test(tc_epoll, test_send);
 	return s;
 }
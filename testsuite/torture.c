@@ -56,6 +56,9 @@ Suite *nickserv_suite(void);
 Suite *url_suite(void);
 Suite *log_subst_suite(void);
 Suite *transport_suite(void);
+Suite *resolver_suite(void);
+Suite *trace_suite(void);
+Suite *cache_suite(void);
 gboolean init_log(const char *file);
 
 char *torture_tempfile(const char *path)
@@ -170,6 +173,9 @@ int main (int argc, char **argv)
 	srunner_add_suite(sr, url_suite());
 	srunner_add_suite(sr, log_subst_suite());
 	srunner_add_suite(sr, transport_suite());
+	srunner_add_suite(sr, resolver_suite());
+	srunner_add_suite(sr, trace_suite());
+	srunner_add_suite(sr, cache_suite());
 	if (no_fork)
 		srunner_set_fork_status(sr, CK_NOFORK);
 	srunner_run_all (sr, verbose?CK_VERBOSE:CK_NORMAL);